@@ -0,0 +1,223 @@
+/**************************************************************************
+* File:             plc4bits.h
+*
+* Description:      Packed transfer of BOOL addresses as byte ranges
+*
+* Notes:            A BOOL[n] address moved bit by bit costs one request
+*                   item and one plc4c_data list node per bit. Instead the
+*                   bytes spanning the bits are read as one USINT[k] item
+*                   and unpacked, eight flags per table lookup, so arrays
+*                   may start at any bit offset.
+*
+*                   Writes must not touch the neighbouring bits sharing the
+*                   first and last byte. The whole bytes in between go as
+*                   one USINT[k] item, the bits of a partial first or last
+*                   byte as single BOOL items, at most 14 of them.
+*
+*                   Flags are one byte 0 / 1 (C++ bool, MATLAB logical) and
+*                   hosts are little endian, as every MATLAB platform is.
+*
+* Revsions:         1.00 19/10/26 first release
+*
+* See also:         plc4sim.cpp, plc4mex.cpp, plc4image.h, plc4virtual.h
+*
+* SPDX-License-Identifier: Apache-2.0
+**************************************************************************/
+
+#ifndef PLC4BITS_H
+#define PLC4BITS_H
+
+#include <cctype>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <plc4c/plc4c.h>
+
+struct BitsRange {
+    std::string prefix;             // address up to the byte, eg. %DB1: or %M
+    uint32_t byte = 0;
+    uint32_t bit = 0;
+    uint32_t count = 1;
+};
+
+// A request item with the data bytes it carries, for PDU packing
+struct BitsItem {
+    std::string address;
+    plc4c_data *data;
+    uint32_t bytes;
+};
+
+// Function: bitsParse ====================================================
+// Abstract: Range of a BOOL or BIT address, eg. %DB1:2.3:BOOL[20] or
+// %I0.0:BOOL. False for any other type.
+static inline bool bitsParse(const char *address, BitsRange *range) {
+
+    const char *type = strrchr(address, ':');
+    const char *end;
+    char *stop;
+
+    if (!type || type == address)
+        return false;
+    type++;
+    if (!strncmp(type, "BOOL", 4))
+        end = type + 4;
+    else if (!strncmp(type, "BIT", 3))
+        end = type + 3;
+    else
+        return false;
+    range->count = 1;
+    if (*end == '[') {
+        range->count = (uint32_t) strtoul(end + 1, &stop, 10);
+        if ((*stop != ']') || (stop[1] != '\0') || (range->count == 0))
+            return false;
+    } else if (*end != '\0') {
+        return false;
+    }
+
+    // the position ends in <byte>.<bit> or <byte>
+    const char *pos = type - 1;
+    const char *first = pos;
+    while ((first > address) && (isdigit((unsigned char) first[-1]) ||
+            (first[-1] == '.')))
+        first--;
+    if ((first == pos) || (first == address))
+        return false;
+    range->prefix.assign(address, first - address);
+    range->byte = (uint32_t) strtoul(first, &stop, 10);
+    range->bit = *stop == '.' ? (uint32_t) strtoul(stop + 1, &stop, 10) : 0;
+    return (stop == pos) && (range->bit < 8);
+}
+
+// Function: bitsByteCount ================================================
+// Abstract: Bytes spanned by a range from its first byte
+static inline uint32_t bitsByteCount(const BitsRange *range) {
+    return (range->bit + range->count + 7) / 8;
+}
+
+// Function: bitsReadAddress ==============================================
+// Abstract: USINT[k] address of the bytes spanned by a range
+static inline std::string bitsReadAddress(const BitsRange *range) {
+    return range->prefix + std::to_string(range->byte) + ".0:USINT[" +
+        std::to_string(bitsByteCount(range)) + "]";
+}
+
+// Function: bitsTable ====================================================
+// Abstract: Eight flags of each byte value, in bit order
+static inline const uint64_t* bitsTable() {
+    static const struct BitsTable {
+        uint64_t flags[256];
+        BitsTable() {
+            for (int value = 0; value < 256; value++) {
+                uint8_t bits[8];
+                for (int bit = 0; bit < 8; bit++)
+                    bits[bit] = (value >> bit) & 1;
+                memcpy(&flags[value], bits, sizeof(bits));
+            }
+        }
+    } table;
+    return table.flags;
+}
+
+// Function: bitsPackByte =================================================
+// Abstract: Byte of eight flags, the multiply gathers bit 0 of each byte
+// into the top byte
+static inline uint8_t bitsPackByte(const bool *flags) {
+    uint64_t v;
+    memcpy(&v, flags, sizeof(v));
+    return (uint8_t) ((v * 0x0102040810204080ull) >> 56);
+}
+
+// Function: bitsUnpack ===================================================
+// Abstract: Unpack count flags starting bit bits into src
+static inline void bitsUnpack(const uint8_t *src, uint32_t bit,
+        uint32_t count, bool *dst) {
+
+    const uint64_t *table = bitsTable();
+    uint32_t idx = 0;
+
+    src += bit / 8;
+    bit %= 8;
+    if (bit) {
+        for (; (bit < 8) && (idx < count); bit++)
+            dst[idx++] = (*src >> bit) & 1;
+        src++;
+    }
+    for (; idx + 8 <= count; idx += 8)
+        memcpy(dst + idx, &table[*src++], 8);
+    for (bit = 0; idx < count; bit++)
+        dst[idx++] = (*src >> bit) & 1;
+}
+
+// Function: bitsPack =====================================================
+// Abstract: Pack count flags starting bit bits into dst, the other bits
+// of dst are kept
+static inline void bitsPack(const bool *src, uint32_t bit, uint32_t count,
+        uint8_t *dst) {
+
+    uint32_t idx = 0;
+
+    dst += bit / 8;
+    bit %= 8;
+    if (bit) {
+        for (; (bit < 8) && (idx < count); bit++, idx++)
+            *dst = (uint8_t) ((*dst & ~(1u << bit)) | (src[idx] ? 1u << bit : 0));
+        dst++;
+    }
+    for (; idx + 8 <= count; idx += 8)
+        *dst++ = bitsPackByte(src + idx);
+    for (bit = 0; idx < count; bit++, idx++)
+        *dst = (uint8_t) ((*dst & ~(1u << bit)) | (src[idx] ? 1u << bit : 0));
+}
+
+// Function: bitsBytesOf ==================================================
+// Abstract: Bytes of a USINT[k] read response, a list or a single value
+static inline void bitsBytesOf(plc4c_data *data, std::vector<uint8_t> &bytes) {
+
+    bytes.clear();
+    if (data->data_type != PLC4C_LIST) {
+        bytes.push_back(data->data.uchar_value);
+        return;
+    }
+    plc4c_list_element *item = plc4c_utils_list_tail(&data->data.list_value);
+    for (; item; item = item->next)
+        bytes.push_back(((plc4c_data*) item->value)->data.uchar_value);
+}
+
+// Function: bitsWriteItems ===============================================
+// Abstract: Write items of the flags of a range, whole bytes packed into
+// one USINT[k] item and the bits of partial bytes as BOOL items
+static inline void bitsWriteItems(const BitsRange *range, const bool *flags,
+        std::vector<BitsItem> &items) {
+
+    uint32_t byte = range->byte, bit = range->bit, idx = 0;
+
+    auto single = [&](uint32_t b) {
+        items.push_back({range->prefix + std::to_string(byte) + "." +
+            std::to_string(b) + ":BOOL",
+            plc4c_data_create_bool_data(flags[idx++]), 1});
+    };
+
+    if (bit) {
+        for (; (bit < 8) && (idx < range->count); bit++)
+            single(bit);
+        byte++;
+    }
+    uint32_t whole = (range->count - idx) / 8;
+    if (whole) {
+        std::vector<uint8_t> packed(whole);
+        bitsPack(flags + idx, 0, whole * 8, packed.data());
+        items.push_back({range->prefix + std::to_string(byte) + ".0:USINT[" +
+            std::to_string(whole) + "]", whole > 1 ?
+            plc4c_data_create_uint8_t_array(packed.data(), whole) :
+            plc4c_data_create_uint8_t_data(packed[0]), whole});
+        idx += whole * 8;
+        byte += whole;
+    }
+    for (bit = 0; idx < range->count; bit++)
+        single(bit);
+}
+
+#endif
@@ -0,0 +1,106 @@
+/**************************************************************************
+* File:             plc4broker.cpp
+*
+* Description:      Broker process owning PLC connections for the plc4mex
+*                   and plc4sim clients of a host
+*
+* Notes:            plc4broker <name> <connection string>
+*
+*                   Opens the connection (with its plc4mat options, eg.
+*                   io-timeout or pdu) and serves it as broker://<name>
+*                   until SIGINT or SIGTERM. SIGUSR1 prints the counters,
+*                   log messages of the link go to stderr.
+*                   Run one broker per PLC, each client then costs a socket
+*                   rather than a PLC connection.
+*
+* Revsions:         1.00 19/10/26 first release
+*
+* See also:         plc4broker.h, make_plc4broker.m
+*
+* SPDX-License-Identifier: Apache-2.0
+**************************************************************************/
+
+#include <cstdio>
+#include <csignal>
+#include <string>
+
+#include <pthread.h>
+
+#include "plc4broker.h"
+#include "plc4link.h"
+#include "plc4log.h"
+
+// Function: printCounters ================================================
+// Abstract: Print the progress of a broker and its link
+static void printCounters(BrokerServer *server) {
+    std::lock_guard<std::mutex> guard(server->link->lock);
+    printf("plc4broker %s: %s, %zu clients, %zu requests in %zu batches, "
+        "%zu PDUs, %zu shared reads, %zu failed\n", server->name.c_str(),
+        linkStateName(server->link->state), (size_t) server->clients,
+        (size_t) server->requests, (size_t) server->batches,
+        (size_t) server->pdus, (size_t) server->shared,
+        (size_t) server->failures);
+    fflush(stdout);
+}
+
+// Function: printLog =====================================================
+// Abstract: Print the queued log messages to stderr
+static void printLog() {
+    logDrain([](int level, int64_t stamp, const char *msg) {
+        (void) stamp;
+        fprintf(stderr, "plc4broker %s: %s\n", logLevelName(level), msg);
+    });
+}
+
+int main(int argc, char **argv) {
+
+    std::string err, key;
+    LinkOptionMap opts;
+    unsigned pdu = LINK_DEFAULT_PDU;
+    sigset_t signals;
+    struct timespec drain = {1, 0};
+    int sig = 0;
+
+    if (argc != 3) {
+        fprintf(stderr, "usage: plc4broker <name> <connection string>\n");
+        return 2;
+    }
+
+    // the threads started below inherit the mask, signals are taken here
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    linkSplitOptions(argv[2], key, opts);
+    PlcLink *link = linkOptionCount(opts, "pdu", LINK_MIN_PDU, &pdu, err) ?
+        LinkRegistry::instance().acquire(argv[2], err) : nullptr;
+    if (!link || (linkWaitReady(link, err) == LINK_FAILED)) {
+        printLog();
+        fprintf(stderr, "plc4broker: %s\n", err.c_str());
+        return 1;
+    }
+    BrokerServer *server = brokerServe(argv[1], link, pdu, err);
+    if (!server) {
+        fprintf(stderr, "plc4broker: %s\n", err.c_str());
+        return 1;
+    }
+    printf("plc4broker: serving <%s> as %s%s on %s\n", key.c_str(),
+        BROKER_SCHEME, argv[1], server->path.c_str());
+    fflush(stdout);
+
+    while (1) {
+        sig = sigtimedwait(&signals, NULL, &drain);
+        printLog();
+        if ((sig == SIGINT) || (sig == SIGTERM))
+            break;
+        if (sig == SIGUSR1)
+            printCounters(server);
+    }
+    printCounters(server);
+    brokerStop(server);
+    LinkRegistry::instance().release(link);
+    LinkRegistry::instance().shutdown();
+    return 0;
+}
@@ -0,0 +1,797 @@
+/**************************************************************************
+* File:             plc4broker.h
+*
+* Description:      Connection broker sharing one PLC link among the plc4mex
+*                   sessions and plc4sim blocks of many local processes
+*
+* Notes:            The broker process (plc4broker.cpp) owns the PLC link
+*                   and serves clients on the Unix domain socket
+*                   /tmp/plc4mat.<name>.sock, a connection string
+*                   broker://<name> attaches to it. A parallel worker,
+*                   session or block then costs a socket rather than one of
+*                   the few connections of the PLC.
+*
+*                   A request carries the write items then the read items of
+*                   one call or step: a type, a count and an address, and for
+*                   writes the values. The response carries the read values
+*                   in the type asked for. Values are host native both ways,
+*                   client and broker share the host.
+*
+*                   The broker takes the requests waiting when it wakes as
+*                   one batch: the write items of all of them go out packed
+*                   into as few PDUs as fit, then the read items, an address
+*                   asked for by several clients read once. Requests arriving
+*                   while a batch is on the wire form the next one, so the
+*                   batches grow with the load. Within a batch writes land
+*                   before reads, as for one client's write and read.
+*
+*                   While the link reconnects requests are answered stale at
+*                   once and clients serve held values. A client whose broker
+*                   went away gets stale answers and reconnects on its next
+*                   request.
+*
+* Revsions:         1.00 19/10/26 first release
+*
+* See also:         plc4broker.cpp, plc4link.h, plc4image.h, plc4mex.cpp,
+*                   plc4sim.cpp
+*
+* SPDX-License-Identifier: Apache-2.0
+**************************************************************************/
+
+#ifndef PLC4BROKER_H
+#define PLC4BROKER_H
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <plc4c/spi/types_private.h>
+
+#include "plc4bits.h"
+#include "plc4image.h"
+#include "plc4link.h"
+#include "plc4types.h"
+
+#define BROKER_MAGIC 0x52423450u    // "P4BR"
+#define BROKER_VERSION 1u
+#define BROKER_SCHEME "broker://"
+#define BROKER_MAX_ITEMS 1024
+#define BROKER_MAX_BYTES (1u << 20)
+#define BROKER_MAX_CLIENTS 256
+#define BROKER_POLL_MS 100
+
+enum BrokerStatus {
+    BROKER_OK,
+    BROKER_STALE,                   // link down or request failed, no values
+    BROKER_BAD                      // request refused, payload is the reason
+};
+
+struct BrokerHeader {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t status;                // of a response
+    uint16_t writes;                // items of a request
+    uint16_t reads;
+    uint32_t bytes;                 // payload following
+};
+
+// Request item, followed by its address and for a write its values
+struct BrokerItem {
+    uint8_t type;                   // PlcType
+    uint8_t length;                 // of the address
+    uint16_t reserved;
+    uint32_t count;
+};
+
+// Client connection as the broker sees it
+struct BrokerPeer {
+    int fd = -1;
+    std::vector<uint8_t> in;        // received, not yet taken as a request
+};
+
+// Request of a peer taken into a batch
+struct BrokerJob {
+    BrokerPeer *peer;
+    std::vector<ImageArea> writes;  // offset into data
+    std::vector<uint8_t> data;
+    std::vector<size_t> reads;      // areas of the batch
+    bool ok = true;
+    std::string error;              // refused if set
+};
+
+// Read areas of a batch, each distinct area once
+struct BrokerBatch {
+    std::vector<ImageArea> areas;   // offset into stage
+    std::vector<bool> good;
+    std::map<std::string, size_t> index;
+    std::vector<uint8_t> stage;
+};
+
+struct BrokerServer {
+    std::string name;
+    std::string path;
+    PlcLink *link = nullptr;
+    unsigned pdu = LINK_DEFAULT_PDU;
+    int listenFd = -1;
+    std::vector<std::unique_ptr<BrokerPeer>> peers;
+    std::thread thread;
+    std::atomic<bool> stop{false};
+    std::atomic<size_t> clients{0};
+    std::atomic<size_t> requests{0};
+    std::atomic<size_t> batches{0};
+    std::atomic<size_t> pdus{0};
+    std::atomic<size_t> shared{0};  // read items served by another's read
+    std::atomic<size_t> failures{0};
+};
+
+// Client side, one socket per plc4mex session or plc4sim block
+struct BrokerClient {
+    std::string name;
+    std::string path;
+    int fd = -1;
+    double timeout = LINK_DEFAULT_IO_TIMEOUT;
+    std::vector<uint8_t> msg;
+    size_t requests = 0;
+    size_t failures = 0;
+};
+
+// Function: brokerIsScheme ===============================================
+// Abstract: True if a connection string names a broker
+static inline bool brokerIsScheme(const char *connStr) {
+    return !strncmp(connStr, BROKER_SCHEME, strlen(BROKER_SCHEME));
+}
+
+// Function: brokerSocketPath =============================================
+// Abstract: Socket of a broker name, empty if the name is not made of
+// letters, digits, '_' and '-' or is too long
+static inline std::string brokerSocketPath(const std::string &name) {
+    std::string shm = imageShmName(name);
+    std::string path = "/tmp" + shm + ".sock";
+    if (shm.empty() || (path.size() >= sizeof(((sockaddr_un*) 0)->sun_path)))
+        return "";
+    return path;
+}
+
+// Function: brokerDial ===================================================
+// Abstract: Connected socket to a path, -1 if nobody listens on it
+static inline int brokerDial(const std::string &path) {
+
+    struct sockaddr_un addr;
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+    if (fd < 0)
+        return -1;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path.c_str());
+    if (connect(fd, (struct sockaddr*) &addr, sizeof(addr)) != 0) {
+        ::close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Function: brokerWait ===================================================
+// Abstract: Wait up to timeout seconds for a socket to be ready for events
+static inline bool brokerWait(int fd, short events, double timeout) {
+    struct pollfd p = {fd, events, 0};
+    int n;
+    do {
+        n = poll(&p, 1, (int) (timeout * 1000));
+    } while ((n < 0) && (errno == EINTR));
+    return n > 0;
+}
+
+// Function: brokerSend ===================================================
+// Abstract: Send all bytes, waiting up to timeout seconds whenever the
+// socket is full. False if the peer is gone or stuck.
+static inline bool brokerSend(int fd, const void *data, size_t n,
+        double timeout) {
+
+    const uint8_t *p = (const uint8_t*) data;
+
+    while (n > 0) {
+        ssize_t sent = send(fd, p, n, MSG_NOSIGNAL);
+        if (sent > 0) {
+            p += sent;
+            n -= (size_t) sent;
+        } else if ((sent < 0) && (errno == EINTR)) {
+            continue;
+        } else if ((sent < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK))) {
+            if (!brokerWait(fd, POLLOUT, timeout))
+                return false;
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Function: brokerRecv ===================================================
+// Abstract: Receive exactly n bytes within timeout seconds
+static inline bool brokerRecv(int fd, void *data, size_t n, double timeout) {
+
+    uint8_t *p = (uint8_t*) data;
+    LinkClock::time_point start = LinkClock::now();
+
+    while (n > 0) {
+        double left = timeout - linkSecondsSince(start);
+        if ((left <= 0) || !brokerWait(fd, POLLIN, left))
+            return false;
+        ssize_t got = recv(fd, p, n, 0);
+        if ((got < 0) && (errno == EINTR))
+            continue;
+        if (got <= 0)
+            return false;
+        p += got;
+        n -= (size_t) got;
+    }
+    return true;
+}
+
+// Function: brokerAreaKey ================================================
+// Abstract: Key of a read area, the same address in another type or count
+// is another area
+static inline std::string brokerAreaKey(const ImageArea *area) {
+    return std::string(area->address) + "#" + std::to_string(area->type) +
+        "#" + std::to_string(area->count);
+}
+
+// Function: brokerWire ===================================================
+// Abstract: Data bytes an area moves as on the wire, BOOL areas as the
+// bytes spanning their bits
+static inline uint32_t brokerWire(const ImageArea *area) {
+    BitsRange range;
+    if ((area->type == TYPE_BOOL) && bitsParse(area->address, &range))
+        return bitsByteCount(&range);
+    return area->bytes;
+}
+
+// Function: brokerParse ==================================================
+// Abstract: Take the first complete request of a peer into a job, reads
+// joining the areas of the batch. 0 if none is complete yet, 1 if taken
+// (job->error set if refused), -1 if the stream is not a broker's.
+static inline int brokerParse(BrokerPeer *peer, BrokerBatch *batch,
+        BrokerJob *job) {
+
+    BrokerHeader h;
+    uint32_t offset = 0;
+    size_t answer = 0;
+
+    if (peer->in.size() < sizeof(h))
+        return 0;
+    memcpy(&h, peer->in.data(), sizeof(h));
+    if ((h.magic != BROKER_MAGIC) || (h.version != BROKER_VERSION) ||
+            (h.bytes > BROKER_MAX_BYTES))
+        return -1;
+    if (peer->in.size() < sizeof(h) + h.bytes)
+        return 0;
+
+    const uint8_t *p = peer->in.data() + sizeof(h);
+    const uint8_t *end = p + h.bytes;
+    std::vector<ImageArea> reads;
+    job->peer = peer;
+    if ((size_t) h.writes + h.reads > BROKER_MAX_ITEMS)
+        job->error = "a broker request takes at most " +
+            std::to_string(BROKER_MAX_ITEMS) + " items";
+    for (size_t idx = 0; job->error.empty() && (idx < (size_t) h.writes + h.reads);
+            idx++) {
+        BrokerItem item;
+        ImageArea area;
+        if (end - p < (ptrdiff_t) sizeof(item)) {
+            job->error = "broker request is truncated";
+            break;
+        }
+        memcpy(&item, p, sizeof(item));
+        p += sizeof(item);
+        std::string address((const char*) p,
+            std::min((size_t) item.length, (size_t) (end - p)));
+        p += address.size();
+        if ((item.type > TYPE_DOUBLE) || (item.count == 0) ||
+                (item.count > BROKER_MAX_BYTES) || (address.size() != item.length) ||
+                !imageArea(address, (PlcType) item.type, item.count, &area)) {
+            job->error = "broker can not move <" + address + ">";
+            break;
+        }
+        if (idx >= h.writes) {
+            reads.push_back(area);
+            answer += area.bytes;
+            continue;
+        }
+        if ((size_t) (end - p) < area.bytes) {
+            job->error = "broker request is truncated";
+            break;
+        }
+        area.offset = offset;
+        offset += area.bytes;
+        job->data.insert(job->data.end(), p, p + area.bytes);
+        job->writes.push_back(area);
+        p += area.bytes;
+    }
+    if (job->error.empty() && (answer > BROKER_MAX_BYTES))
+        job->error = "broker request reads more than " +
+            std::to_string(BROKER_MAX_BYTES) + " bytes";
+    peer->in.erase(peer->in.begin(), peer->in.begin() + sizeof(h) + h.bytes);
+    if (!job->error.empty())
+        return 1;
+
+    for (auto &area : reads) {
+        auto found = batch->index.emplace(brokerAreaKey(&area),
+            batch->areas.size());
+        if (found.second) {
+            area.offset = (uint32_t) batch->stage.size();
+            batch->stage.resize(batch->stage.size() + ((area.bytes + 7) & ~7u));
+            batch->areas.push_back(area);
+        }
+        job->reads.push_back(found.first->second);
+    }
+    return 1;
+}
+
+// Function: brokerWriteRun ===============================================
+// Abstract: Send the write items first to last - 1 as one request, the
+// request owns their data once added. Call with the link lock held on a
+// connected link.
+static inline bool brokerWriteRun(PlcLink *link, std::vector<BitsItem> &items,
+        size_t first, size_t last) {
+
+    plc4c_write_request *request;
+    plc4c_write_request_execution *execution;
+    bool done = false;
+
+    if (plc4c_connection_create_write_request(link->connection, &request) != OK)
+        return false;
+    for (size_t idx = first; idx < last; idx++) {
+        plc4c_write_request_add_item(request, (char*) items[idx].address.c_str(),
+            items[idx].data);
+        items[idx].data = nullptr;
+    }
+    if (plc4c_write_request_execute(request, &execution) == OK) {
+        done = linkLoopUntil(link,
+            [&] { return plc4c_write_request_check_finished_successfully(execution); },
+            [&] { return plc4c_write_request_execution_check_completed_with_error(execution); },
+            "broker write");
+        if (done)
+            plc4c_write_destroy_write_response(
+                plc4c_write_request_execution_get_response(execution));
+        plc4c_write_request_execution_destroy(execution);
+    }
+    plc4c_write_request_destroy(request);
+    return done;
+}
+
+// Function: brokerReadRun ================================================
+// Abstract: Read the areas first to last - 1 of a batch into its stage.
+// Call with the link lock held on a connected link.
+static inline bool brokerReadRun(PlcLink *link, BrokerBatch *batch,
+        size_t first, size_t last) {
+
+    plc4c_read_request *request;
+    plc4c_read_request_execution *execution;
+    std::vector<std::string> fetch;
+    bool done = false;
+
+    if (plc4c_connection_create_read_request(link->connection, &request) != OK)
+        return false;
+    for (size_t idx = first; idx < last; idx++)
+        fetch.push_back(imageFetchAddress(&batch->areas[idx]));
+    for (size_t idx = first; idx < last; idx++)
+        plc4c_read_request_add_item(request, batch->areas[idx].address,
+            (char*) fetch[idx - first].c_str());
+    if (plc4c_read_request_execute(request, &execution) == OK) {
+        done = linkLoopUntil(link,
+            [&] { return plc4c_read_request_execution_check_finished_successfully(execution); },
+            [&] { return plc4c_read_request_execution_check_finished_with_error(execution); },
+            "broker read");
+        if (done) {
+            plc4c_read_response *response =
+                plc4c_read_request_execution_get_response(execution);
+            plc4c_list_element *item = plc4c_utils_list_tail(response->items);
+            for (size_t idx = first; item && (idx < last); idx++) {
+                const ImageArea *area = &batch->areas[idx];
+                imageStore(area, batch->stage.data() + area->offset,
+                    ((plc4c_response_value_item*) item->value)->value);
+                batch->good[idx] = true;
+                item = item->next;
+            }
+            plc4c_read_destroy_read_response(response);
+        }
+        plc4c_read_request_execution_destroy(execution);
+    }
+    plc4c_read_request_destroy(request);
+    return done;
+}
+
+// Function: brokerExecute ================================================
+// Abstract: Write the items of all jobs, then read the areas of the batch,
+// each packed into as few PDUs as fit. A job fails if any of its items did.
+static inline void brokerExecute(BrokerServer *server,
+        std::vector<BrokerJob> &jobs, BrokerBatch *batch) {
+
+    PlcLink *link = server->link;
+    std::vector<BitsItem> items;
+    std::vector<size_t> owners;
+    std::vector<uint32_t> bytes;
+
+    for (size_t job = 0; job < jobs.size(); job++) {
+        for (auto &area : jobs[job].writes) {
+            const uint8_t *values = jobs[job].data.data() + area.offset;
+            BitsRange range;
+            size_t first = items.size();
+            if ((area.type == TYPE_BOOL) && bitsParse(area.address, &range))
+                bitsWriteItems(&range, (const bool*) values, items);
+            else
+                items.push_back({area.address,
+                    typeDispatch<TypeEncode, plc4c_data*>((PlcType) area.type,
+                    (const void*) values, (size_t) area.count), area.bytes});
+            owners.resize(items.size(), job);
+            for (size_t idx = first; idx < items.size(); idx++)
+                bytes.push_back(items[idx].bytes);
+        }
+    }
+    batch->good.assign(batch->areas.size(), false);
+
+    {
+        std::lock_guard<std::mutex> guard(link->lock);
+        std::vector<size_t> runs = linkPack(bytes, true, server->pdu);
+        for (size_t run = 0; run < runs.size(); run++) {
+            size_t last = run + 1 < runs.size() ? runs[run + 1] : items.size();
+            if ((link->state == LINK_CONNECTED) &&
+                    brokerWriteRun(link, items, runs[run], last)) {
+                server->pdus++;
+                continue;
+            }
+            for (size_t idx = runs[run]; idx < last; idx++)
+                jobs[owners[idx]].ok = false;
+        }
+
+        bytes.clear();
+        for (auto &area : batch->areas)
+            bytes.push_back(brokerWire(&area));
+        runs = linkPack(bytes, false, server->pdu);
+        for (size_t run = 0; run < runs.size(); run++) {
+            size_t last = run + 1 < runs.size() ? runs[run + 1] :
+                batch->areas.size();
+            if ((link->state == LINK_CONNECTED) &&
+                    brokerReadRun(link, batch, runs[run], last))
+                server->pdus++;
+        }
+    }
+
+    // items of runs never sent still own their data
+    for (auto &item : items)
+        if (item.data)
+            plc4c_data_destroy(item.data);
+    for (auto &job : jobs)
+        for (size_t area : job.reads)
+            job.ok = job.ok && batch->good[area];
+}
+
+// Function: brokerReply ==================================================
+// Abstract: Answer a job, with the values of its reads if it succeeded
+static inline bool brokerReply(BrokerServer *server, const BrokerJob *job,
+        const BrokerBatch *batch) {
+
+    BrokerHeader h;
+    std::vector<uint8_t> msg(sizeof(h));
+
+    memset(&h, 0, sizeof(h));
+    h.magic = BROKER_MAGIC;
+    h.version = BROKER_VERSION;
+    if (!job->error.empty()) {
+        h.status = BROKER_BAD;
+        msg.insert(msg.end(), job->error.begin(), job->error.end());
+    } else if (!job->ok) {
+        h.status = BROKER_STALE;
+    } else {
+        h.status = BROKER_OK;
+        for (size_t area : job->reads) {
+            const uint8_t *p = batch->stage.data() + batch->areas[area].offset;
+            msg.insert(msg.end(), p, p + batch->areas[area].bytes);
+        }
+    }
+    h.bytes = (uint32_t) (msg.size() - sizeof(h));
+    memcpy(msg.data(), &h, sizeof(h));
+    return brokerSend(job->peer->fd, msg.data(), msg.size(),
+        server->link->opts.ioTimeout);
+}
+
+// Function: brokerReceive ================================================
+// Abstract: Append what a peer sent, false if it hung up or overflows
+static inline bool brokerReceive(BrokerPeer *peer) {
+
+    uint8_t chunk[65536];
+
+    while (1) {
+        ssize_t got = recv(peer->fd, chunk, sizeof(chunk), 0);
+        if (got > 0) {
+            peer->in.insert(peer->in.end(), chunk, chunk + got);
+            if (peer->in.size() > sizeof(BrokerHeader) + BROKER_MAX_BYTES)
+                return false;
+        } else if ((got < 0) && (errno == EINTR)) {
+            continue;
+        } else {
+            return (got < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK));
+        }
+    }
+}
+
+// Function: brokerAccept =================================================
+// Abstract: Take the waiting connections as peers, beyond the most peers
+// a connection is closed at once
+static inline void brokerAccept(BrokerServer *server) {
+
+    int fd;
+
+    while ((fd = accept4(server->listenFd, NULL, NULL,
+            SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        if (server->peers.size() >= BROKER_MAX_CLIENTS) {
+            ::close(fd);
+            continue;
+        }
+        std::unique_ptr<BrokerPeer> peer(new BrokerPeer);
+        peer->fd = fd;
+        server->peers.push_back(std::move(peer));
+        server->clients++;
+    }
+}
+
+// Function: brokerRun ====================================================
+// Abstract: Broker thread body, waits for requests and runs each round of
+// them as a batch. One request of a peer per batch keeps its order, the
+// rest of a pipelining peer waits for the next round.
+static inline void brokerRun(BrokerServer *server) {
+
+    std::vector<struct pollfd> fds;
+
+    while (!server->stop) {
+        bool pending = false;
+        fds.assign(1, {server->listenFd, POLLIN, 0});
+        for (auto &peer : server->peers) {
+            fds.push_back({peer->fd, POLLIN, 0});
+            pending |= peer->in.size() >= sizeof(BrokerHeader);
+        }
+        if ((poll(fds.data(), fds.size(), pending ? 0 : BROKER_POLL_MS) < 0) &&
+                (errno != EINTR))
+            break;
+
+        for (size_t idx = 0; idx < server->peers.size(); idx++) {
+            BrokerPeer *peer = server->peers[idx].get();
+            if ((fds[idx + 1].revents & (POLLIN | POLLHUP | POLLERR)) &&
+                    !brokerReceive(peer)) {
+                ::close(peer->fd);
+                peer->fd = -1;
+            }
+        }
+
+        std::vector<BrokerJob> jobs;
+        BrokerBatch batch;
+        for (auto &peer : server->peers) {
+            if (peer->fd < 0)
+                continue;
+            BrokerJob job;
+            int taken = brokerParse(peer.get(), &batch, &job);
+            if (taken < 0) {
+                ::close(peer->fd);
+                peer->fd = -1;
+            } else if (taken > 0) {
+                jobs.push_back(std::move(job));
+            }
+        }
+        if (!jobs.empty()) {
+            server->requests += jobs.size();
+            server->batches++;
+            size_t asked = 0;
+            for (auto &job : jobs)
+                asked += job.reads.size();
+            server->shared += asked - batch.areas.size();
+            brokerExecute(server, jobs, &batch);
+            for (auto &job : jobs) {
+                if (!job.ok || !job.error.empty())
+                    server->failures++;
+                if (!brokerReply(server, &job, &batch)) {
+                    ::close(job.peer->fd);
+                    job.peer->fd = -1;
+                }
+            }
+        }
+
+        server->peers.erase(std::remove_if(server->peers.begin(),
+            server->peers.end(), [](const std::unique_ptr<BrokerPeer> &peer) {
+            return peer->fd < 0; }), server->peers.end());
+        if (fds[0].revents & POLLIN)
+            brokerAccept(server);
+    }
+}
+
+// Function: brokerServe ==================================================
+// Abstract: Listen for clients of a broker name and serve them on the link
+// from a thread. A socket left by a broker that has exited is replaced,
+// one of a live broker is an error.
+static inline BrokerServer* brokerServe(const std::string &name, PlcLink *link,
+        unsigned pdu, std::string &err) {
+
+    std::string path = brokerSocketPath(name);
+    struct sockaddr_un addr;
+    int fd;
+
+    if (path.empty()) {
+        err = "broker name <" + name + "> must be letters, digits, _ or -";
+        return nullptr;
+    }
+    if ((fd = brokerDial(path)) >= 0) {
+        ::close(fd);
+        err = "broker <" + name + "> is already served";
+        return nullptr;
+    }
+    unlink(path.c_str());
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path.c_str());
+    if ((fd < 0) || (bind(fd, (struct sockaddr*) &addr, sizeof(addr)) != 0) ||
+            (listen(fd, BROKER_MAX_CLIENTS) != 0)) {
+        err = "cannot listen on <" + path + ">: " + strerror(errno);
+        if (fd >= 0)
+            ::close(fd);
+        return nullptr;
+    }
+
+    BrokerServer *server = new BrokerServer;
+    server->name = name;
+    server->path = path;
+    server->link = link;
+    server->pdu = pdu;
+    server->listenFd = fd;
+    server->thread = std::thread(brokerRun, server);
+    return server;
+}
+
+// Function: brokerStop ===================================================
+// Abstract: Stop serving, close every client and remove the socket
+static inline void brokerStop(BrokerServer *server) {
+    if (!server)
+        return;
+    server->stop = true;
+    if (server->thread.joinable())
+        server->thread.join();
+    for (auto &peer : server->peers)
+        ::close(peer->fd);
+    ::close(server->listenFd);
+    unlink(server->path.c_str());
+    delete server;
+}
+
+// Function: brokerConnect ================================================
+// Abstract: Client of a broker name, nullptr and err if it is not served
+static inline BrokerClient* brokerConnect(const std::string &name,
+        double timeout, std::string &err) {
+
+    std::string path = brokerSocketPath(name);
+    int fd;
+
+    if (path.empty() || ((fd = brokerDial(path)) < 0)) {
+        err = "broker <" + name + "> is not served";
+        return nullptr;
+    }
+    BrokerClient *client = new BrokerClient;
+    client->name = name;
+    client->path = path;
+    client->fd = fd;
+    client->timeout = timeout;
+    return client;
+}
+
+// Function: brokerAppend =================================================
+// Abstract: Append a request item for an area, with its values if given
+static inline void brokerAppend(std::vector<uint8_t> &msg,
+        const ImageArea *area, const uint8_t *values) {
+
+    BrokerItem item;
+    size_t length = strlen(area->address);
+
+    memset(&item, 0, sizeof(item));
+    item.type = (uint8_t) area->type;
+    item.length = (uint8_t) length;
+    item.count = area->count;
+    msg.insert(msg.end(), (const uint8_t*) &item, (const uint8_t*) (&item + 1));
+    msg.insert(msg.end(), area->address, area->address + length);
+    if (values)
+        msg.insert(msg.end(), values + area->offset,
+            values + area->offset + area->bytes);
+}
+
+// Function: brokerTransact ===============================================
+// Abstract: Write the write areas from writeData, then read the read areas
+// into readData, both at the offsets of the areas. BROKER_STALE (err says
+// why if the broker is gone) leaves readData alone, BROKER_BAD sets err.
+static inline BrokerStatus brokerTransact(BrokerClient *client,
+        const std::vector<ImageArea> &writes, const uint8_t *writeData,
+        const std::vector<ImageArea> &reads, uint8_t *readData,
+        std::string &err) {
+
+    BrokerHeader h;
+    std::vector<uint8_t> &msg = client->msg;
+    size_t expect = 0;
+
+    memset(&h, 0, sizeof(h));
+    h.magic = BROKER_MAGIC;
+    h.version = BROKER_VERSION;
+    h.writes = (uint16_t) writes.size();
+    h.reads = (uint16_t) reads.size();
+    msg.assign(sizeof(h), 0);
+    for (auto &area : writes)
+        brokerAppend(msg, &area, writeData);
+    for (auto &area : reads) {
+        brokerAppend(msg, &area, nullptr);
+        expect += area.bytes;
+    }
+    h.bytes = (uint32_t) (msg.size() - sizeof(h));
+    memcpy(msg.data(), &h, sizeof(h));
+    client->requests++;
+
+    if (client->fd < 0)
+        client->fd = brokerDial(client->path);
+    if ((client->fd < 0) ||
+            !brokerSend(client->fd, msg.data(), msg.size(), client->timeout) ||
+            !brokerRecv(client->fd, &h, sizeof(h), client->timeout) ||
+            (h.magic != BROKER_MAGIC) || (h.bytes > BROKER_MAX_BYTES)) {
+        if (client->fd >= 0)
+            ::close(client->fd);
+        client->fd = -1;
+        client->failures++;
+        err = "broker <" + client->name + "> is not answering";
+        return BROKER_STALE;
+    }
+    msg.resize(h.bytes);
+    if (!brokerRecv(client->fd, msg.data(), msg.size(), client->timeout)) {
+        ::close(client->fd);
+        client->fd = -1;
+        client->failures++;
+        err = "broker <" + client->name + "> is not answering";
+        return BROKER_STALE;
+    }
+
+    if ((h.status == BROKER_OK) && (msg.size() == expect)) {
+        size_t at = 0;
+        for (auto &area : reads) {
+            memcpy(readData + area.offset, msg.data() + at, area.bytes);
+            at += area.bytes;
+        }
+        return BROKER_OK;
+    }
+    client->failures++;
+    if (h.status == BROKER_BAD) {
+        err.assign(msg.begin(), msg.end());
+        return BROKER_BAD;
+    }
+    err = "broker <" + client->name + "> link is down";
+    return BROKER_STALE;
+}
+
+// Function: brokerClose ==================================================
+// Abstract: Close a client
+static inline void brokerClose(BrokerClient *client) {
+    if (!client)
+        return;
+    if (client->fd >= 0)
+        ::close(client->fd);
+    delete client;
+}
+
+#endif
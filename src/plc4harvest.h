@@ -0,0 +1,243 @@
+/**************************************************************************
+* File:             plc4harvest.h
+*
+* Description:      Harvesting of PLC side ring buffers, reading only the
+*                   slots written since the last harvest
+*
+* Notes:            A harvest address names a ring the PLC fills at its own
+*                   rate, eg. %DB5:0.0/1000:REAL. The position is that of a
+*                   DINT write index, /1000 the number of slots that follow
+*                   it (from byte 4) and the type that of a slot:
+*
+*                       DB5.DBD0        write index
+*                       DB5.DBD4..      ARRAY[0..999] OF REAL
+*
+*                   The PLC stores a sample in slot index mod slots, then
+*                   advances the index. The index may wrap at the number
+*                   of slots, or count every sample (wrapping at 2^32);
+*                   only a counting index lets a harvest that fell a whole
+*                   ring behind report the samples it lost.
+*
+*                   A harvest reads the index, then the new slots as at
+*                   most two contiguous runs (split at the end of the ring)
+*                   cut into items that fit the PDU and packed into as few
+*                   requests as possible. The first harvest only takes the
+*                   index as its starting point.
+*
+* Revsions:         1.00 19/10/26 first release
+*
+* See also:         plc4link.h, plc4mex.cpp, plc4sim.cpp
+*
+* SPDX-License-Identifier: Apache-2.0
+**************************************************************************/
+
+#ifndef PLC4HARVEST_H
+#define PLC4HARVEST_H
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <plc4c/spi/types_private.h>
+
+#include "plc4link.h"
+#include "plc4types.h"
+
+#define HARVEST_INDEX_BYTES 4
+
+struct HarvestSpec {
+    std::string prefix;             // address up to the byte, eg. %DB5:
+    uint32_t index = 0;             // byte of the write index
+    uint32_t slots = 0;
+    PlcType type = TYPE_UINT8;      // of a slot, host native
+    uint32_t size = 1;              // bytes per slot
+};
+
+// One item of a harvest, count values at offset bytes into the samples
+struct HarvestItem {
+    std::string address;
+    uint32_t count;
+    uint32_t offset;
+};
+
+struct Harvest {
+    HarvestSpec spec;
+    bool primed = false;
+    uint32_t last = 0;              // index at the last harvest
+    uint64_t harvests = 0;
+    uint64_t samples = 0;
+    uint64_t lost = 0;
+};
+
+// Function: harvestParse =================================================
+// Abstract: Spec of a harvest address, eg. %DB5:0.0/1000:REAL, false and
+// err if it is not one. A [count] after the type is ignored.
+static inline bool harvestParse(const std::string &address, HarvestSpec *spec,
+        std::string &err) {
+
+    size_t slash = address.find('/');
+    unsigned db, byte, bit = 0, slots;
+    uint32_t count;
+    char area, tail;
+
+    err = "<" + address + "> is not a harvest address, eg. %DB5:0.0/1000:REAL";
+    if (slash == std::string::npos)
+        return false;
+    std::string pos = address.substr(0, slash);
+    if ((sscanf(pos.c_str(), "%%DB%u:%u.%u%c", &db, &byte, &bit, &tail) == 3) ||
+            (sscanf(pos.c_str(), "%%DB%u:%u%c", &db, &byte, &tail) == 2))
+        spec->prefix = "%DB" + std::to_string(db) + ":";
+    else if (((sscanf(pos.c_str(), "%%%c%u.%u%c", &area, &byte, &bit, &tail) == 3) ||
+            (sscanf(pos.c_str(), "%%%c%u%c", &area, &byte, &tail) == 2)) &&
+            strchr("IQM", area))
+        spec->prefix = std::string("%") + area;
+    else
+        return false;
+    if ((bit != 0) || (sscanf(address.c_str() + slash + 1, "%u%c", &slots,
+            &tail) != 2) || (tail != ':') || (slots == 0))
+        return false;
+    if (!typeOfAddress(address, &spec->type, &spec->size, &count) ||
+            (spec->type == TYPE_BOOL)) {
+        err = "harvest slots of <" + address + "> need a numeric type";
+        return false;
+    }
+    spec->index = byte;
+    spec->slots = slots;
+    err.clear();
+    return true;
+}
+
+// Function: harvestIndexAddress ==========================================
+// Abstract: Address of the write index of a ring
+static inline std::string harvestIndexAddress(const HarvestSpec *spec) {
+    return spec->prefix + std::to_string(spec->index) + ".0:DINT";
+}
+
+// Function: harvestPlan ==================================================
+// Abstract: Items reading the slots written since the last harvest given
+// the write index now, each fitting a PDU. Counts the samples lost to a
+// counting index that moved more than a ring and returns the number of
+// new samples (at most a ring).
+static inline uint32_t harvestPlan(Harvest *h, uint32_t index, unsigned pdu,
+        std::vector<HarvestItem> &items) {
+
+    const HarvestSpec *spec = &h->spec;
+    uint32_t fresh;
+
+    items.clear();
+    if (!h->primed) {
+        h->primed = true;
+        h->last = index;
+        return 0;
+    }
+    if (index >= h->last)
+        fresh = index - h->last;
+    else if (h->last < spec->slots)
+        fresh = index + spec->slots - h->last;      // a wrapping index
+    else
+        fresh = 0;                                  // the PLC restarted
+    if (fresh > spec->slots) {
+        h->lost += fresh - spec->slots;
+        fresh = spec->slots;
+    }
+    h->last = index;
+
+    // a response item carries its data after the header of the job
+    uint32_t chunk = (pdu - LINK_S7_HEADER - LINK_S7_DATA) / spec->size;
+    uint32_t slot = (uint32_t) ((index + (uint64_t) spec->slots * 2 - fresh)
+        % spec->slots);
+    uint32_t done = 0;
+    std::string type = typeS7Name(spec->type);
+    while (done < fresh) {
+        uint32_t n = std::min(std::min(fresh - done, spec->slots - slot),
+            std::max(chunk, 1u));
+        uint32_t byte = spec->index + HARVEST_INDEX_BYTES + slot * spec->size;
+        items.push_back({spec->prefix + std::to_string(byte) + ".0:" + type +
+            "[" + std::to_string(n) + "]", n, done * spec->size});
+        done += n;
+        slot = (slot + n) % spec->slots;
+    }
+    h->harvests++;
+    h->samples += fresh;
+    return fresh;
+}
+
+// Function: harvestReadRun ===============================================
+// Abstract: Read items first to last - 1 of type into samples, host
+// native. Call with the link lock held on a connected link.
+static inline bool harvestReadRun(PlcLink *link, PlcType type,
+        const std::vector<HarvestItem> &items, size_t first, size_t last,
+        uint8_t *samples) {
+
+    plc4c_read_request *request;
+    plc4c_read_request_execution *execution;
+    bool done = false;
+
+    if (plc4c_connection_create_read_request(link->connection, &request) != OK)
+        return false;
+    for (size_t idx = first; idx < last; idx++)
+        plc4c_read_request_add_item(request, (char*) "Harvest",
+            (char*) items[idx].address.c_str());
+    if (plc4c_read_request_execute(request, &execution) == OK) {
+        done = linkLoopUntil(link,
+            [&] { return plc4c_read_request_execution_check_finished_successfully(execution); },
+            [&] { return plc4c_read_request_execution_check_finished_with_error(execution); },
+            "harvest read");
+        if (done) {
+            plc4c_read_response *response =
+                plc4c_read_request_execution_get_response(execution);
+            plc4c_list_element *item = plc4c_utils_list_tail(response->items);
+            for (size_t idx = first; idx < last; idx++, item = item->next) {
+                const HarvestItem *want = &items[idx];
+                size_t stored = item ? typeDispatch<TypeDecode, size_t>(
+                    type, ((plc4c_response_value_item*) item->value)->value,
+                    (void*) (samples + want->offset), (size_t) want->count) : 0;
+                done &= stored == want->count;
+                if (!item)
+                    break;
+            }
+            plc4c_read_destroy_read_response(response);
+        }
+        plc4c_read_request_execution_destroy(execution);
+    }
+    plc4c_read_request_destroy(request);
+    return done;
+}
+
+// Function: harvestRead ==================================================
+// Abstract: Append the samples written since the last harvest to samples,
+// oldest first and host native. Returns false if the link is down or a
+// read failed, the samples are then read again by the next harvest. Call
+// with the link lock held.
+static inline bool harvestRead(PlcLink *link, Harvest *h, unsigned pdu,
+        std::vector<uint8_t> &samples) {
+
+    std::vector<HarvestItem> items{{harvestIndexAddress(&h->spec), 1, 0}};
+    std::vector<uint32_t> bytes;
+    int32_t index;
+
+    if ((link->state != LINK_CONNECTED) ||
+            !harvestReadRun(link, TYPE_INT32, items, 0, 1, (uint8_t*) &index))
+        return false;
+    Harvest was = *h;
+    uint32_t fresh = harvestPlan(h, (uint32_t) index, pdu, items);
+    size_t at = samples.size();
+    samples.resize(at + (size_t) fresh * h->spec.size);
+    for (auto &item : items)
+        bytes.push_back(item.count * h->spec.size);
+    std::vector<size_t> runs = linkPack(bytes, false, pdu);
+    for (size_t run = 0; run < runs.size(); run++) {
+        size_t last = run + 1 < runs.size() ? runs[run + 1] : items.size();
+        if (!harvestReadRun(link, h->spec.type, items, runs[run], last,
+                samples.data() + at)) {
+            *h = was;
+            samples.resize(at);
+            return false;
+        }
+    }
+    return true;
+}
+
+#endif
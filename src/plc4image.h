@@ -0,0 +1,504 @@
+/**************************************************************************
+* File:             plc4image.h
+*
+* Description:      Process image of PLC tag areas in POSIX shared memory,
+*                   served by one poller and read by many local consumers
+*
+* Notes:            A poller owns one PLC link and reads its configured
+*                   areas every period into /dev/shm/plc4mat.<name>. Readers
+*                   in other MATLAB sessions or plc4sim blocks map the image
+*                   read only, so they cost no PLC connection and a read is
+*                   a memcpy.
+*
+*                   Snapshots are consistent across all areas through a
+*                   seqlock: the poller stages a complete read privately,
+*                   then bumps the sequence to odd, copies the stage in and
+*                   bumps it to even. A reader retries if the sequence was
+*                   odd or changed while it copied.
+*
+*                   Values are stored host native in the type of the area
+*                   address, eg. %DB2:0.0:REAL[4] is 4 floats. While the
+*                   poller's link reconnects the last good values stay in
+*                   the image and its state says so. BOOL areas are read
+*                   packed as the bytes spanning their bits (plc4bits.h).
+*
+* Revsions:         1.00 19/10/26 first release
+*
+* See also:         plc4link.h, plc4mex.cpp, plc4sim.cpp
+*
+* SPDX-License-Identifier: Apache-2.0
+**************************************************************************/
+
+#ifndef PLC4IMAGE_H
+#define PLC4IMAGE_H
+
+#include <atomic>
+#include <cctype>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <signal.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <plc4c/spi/types_private.h>
+
+#include "plc4bits.h"
+#include "plc4link.h"
+#include "plc4types.h"
+
+#define IMAGE_MAGIC 0x4d493450u     // "P4IM"
+#define IMAGE_VERSION 1u
+#define IMAGE_MAX_AREAS 256
+#define IMAGE_ADDRESS_LEN 64
+#define IMAGE_SCHEME "shm://"
+#define IMAGE_LIVE_CHECK 1.0        // s between checks of a quiet poller
+
+struct ImageArea {
+    char address[IMAGE_ADDRESS_LEN];
+    uint32_t type;
+    uint32_t count;
+    uint32_t offset;        // from the start of the data
+    uint32_t bytes;
+};
+
+struct ImageHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t nAreas;
+    uint32_t dataBytes;
+    double period;
+    int32_t pid;                    // of the poller
+    std::atomic<uint32_t> state;    // LinkState of the poller's link
+    std::atomic<uint64_t> seq;      // odd while the data is written
+    uint64_t updates;               // written under the seqlock
+    int64_t stamp;                  // CLOCK_REALTIME ns of the last update
+    ImageArea areas[IMAGE_MAX_AREAS];
+};
+
+// Poller side, one per served image
+struct ImagePoller {
+    std::string name;
+    ImageHeader *header = nullptr;
+    uint8_t *data = nullptr;
+    size_t size = 0;
+    PlcLink *link = nullptr;
+    std::vector<uint8_t> stage;
+    std::thread thread;
+    std::atomic<bool> stop{false};
+    std::atomic<size_t> polls{0};
+    std::atomic<size_t> failures{0};
+    std::atomic<size_t> overruns{0};
+};
+
+// Consumer side, read only mapping
+struct ImageReader {
+    std::string name;
+    const ImageHeader *header = nullptr;
+    const uint8_t *data = nullptr;
+    size_t size = 0;
+    uint64_t updates = 0;               // seen when the poller was last alive
+    LinkClock::time_point checked;      // last check of the poller
+    bool alive = false;
+};
+
+// Function: imageIsScheme ================================================
+// Abstract: True if a connection string names a shared memory image
+static inline bool imageIsScheme(const char *connStr) {
+    return !strncmp(connStr, IMAGE_SCHEME, strlen(IMAGE_SCHEME));
+}
+
+// Function: imageShmName =================================================
+// Abstract: POSIX shared memory object of an image name, empty if the name
+// is not made of letters, digits, '_' and '-'
+static inline std::string imageShmName(const std::string &name) {
+    if (name.empty() || (name.size() > 200))
+        return "";
+    for (char c : name)
+        if (!isalnum((unsigned char) c) && (c != '_') && (c != '-'))
+            return "";
+    return "/plc4mat." + name;
+}
+
+// Function: imagePosition ================================================
+// Abstract: Length of the position part of an address, up to its type, eg.
+// 10 for %DB2:996.0:REAL
+static inline size_t imagePosition(const char *address) {
+    const char *type = strrchr(address, ':');
+    return type ? (size_t) (type - address) : strlen(address);
+}
+
+// Function: imageArea ====================================================
+// Abstract: Area of count values of type at an address, with its size but
+// no offset. False if the address is too long.
+static inline bool imageArea(const std::string &address, PlcType type,
+        uint32_t count, ImageArea *area) {
+
+    uint32_t size;
+
+    if (address.size() >= IMAGE_ADDRESS_LEN)
+        return false;
+    typeS7Name(type, &size);
+    memset((void*) area, 0, sizeof(*area));
+    strcpy(area->address, address.c_str());
+    area->type = type;
+    area->count = count;
+    area->bytes = size * count;
+    return true;
+}
+
+// Function: imageFetchAddress ============================================
+// Abstract: Address an area is requested as, BOOL areas as the bytes
+// spanning their bits
+static inline std::string imageFetchAddress(const ImageArea *area) {
+    BitsRange range;
+    if ((area->type == TYPE_BOOL) && bitsParse(area->address, &range))
+        return bitsReadAddress(&range);
+    return area->address;
+}
+
+// Function: imageStore ===================================================
+// Abstract: Store a (possibly list) plc4c data item in an area's slot of
+// the stage, surplus values are ignored
+static inline void imageStore(const ImageArea *area, uint8_t *dst,
+        plc4c_data *data) {
+
+    BitsRange range;
+    if ((area->type == TYPE_BOOL) && bitsParse(area->address, &range)) {
+        std::vector<uint8_t> bytes;
+        bitsBytesOf(data, bytes);
+        if (bytes.size() >= bitsByteCount(&range))
+            bitsUnpack(bytes.data(), range.bit, area->count, (bool*) dst);
+        return;
+    }
+
+    typeDispatch<TypeDecode, size_t>((PlcType) area->type, data, (void*) dst,
+        (size_t) area->count);
+}
+
+// Function: imagePublish =================================================
+// Abstract: Copy the stage into the image as one seqlock write
+static inline void imagePublish(ImagePoller *poller) {
+
+    ImageHeader *h = poller->header;
+    struct timespec now;
+    uint64_t seq = h->seq.load(std::memory_order_relaxed);
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    h->seq.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    memcpy(poller->data, poller->stage.data(), h->dataBytes);
+    h->updates++;
+    h->stamp = (int64_t) now.tv_sec * 1000000000LL + now.tv_nsec;
+    h->seq.store(seq + 2, std::memory_order_release);
+}
+
+// Function: imagePoll ====================================================
+// Abstract: Read every area once into the stage and publish it. Returns
+// false if the link is down or the read failed.
+static inline bool imagePoll(ImagePoller *poller) {
+
+    PlcLink *link = poller->link;
+    ImageHeader *h = poller->header;
+    plc4c_read_request *request;
+    plc4c_read_request_execution *execution;
+    bool done = false;
+
+    std::lock_guard<std::mutex> guard(link->lock);
+    h->state.store(link->state, std::memory_order_relaxed);
+    if ((link->state != LINK_CONNECTED) ||
+            (plc4c_connection_create_read_request(link->connection,
+            &request) != OK))
+        return false;
+    for (uint32_t idx = 0; idx < h->nAreas; idx++) {
+        std::string address = imageFetchAddress(&h->areas[idx]);
+        plc4c_read_request_add_item(request, (char*) h->areas[idx].address,
+            (char*) address.c_str());
+    }
+    if (plc4c_read_request_execute(request, &execution) == OK) {
+        done = linkLoopUntil(link,
+            [&] { return plc4c_read_request_execution_check_finished_successfully(execution); },
+            [&] { return plc4c_read_request_execution_check_finished_with_error(execution); },
+            "image read");
+        if (done) {
+            plc4c_read_response *response =
+                plc4c_read_request_execution_get_response(execution);
+            plc4c_list_element *item = plc4c_utils_list_tail(response->items);
+            for (uint32_t idx = 0; item && (idx < h->nAreas); idx++) {
+                plc4c_response_value_item *value =
+                    (plc4c_response_value_item*) item->value;
+                imageStore(&h->areas[idx], poller->stage.data() +
+                    h->areas[idx].offset, value->value);
+                item = item->next;
+            }
+            plc4c_read_destroy_read_response(response);
+            imagePublish(poller);
+        }
+        plc4c_read_request_execution_destroy(execution);
+    }
+    plc4c_read_request_destroy(request);
+    h->state.store(link->state, std::memory_order_relaxed);
+    return done;
+}
+
+// Function: imagePidAlive ================================================
+// Abstract: False once a poller's process has exited. One of another user
+// cannot be signalled (EPERM) but runs.
+static inline bool imagePidAlive(pid_t pid) {
+    return (kill(pid, 0) == 0) || (errno != ESRCH);
+}
+
+// Function: imagePollerRun ===============================================
+// Abstract: Poller thread body, polls on absolute steady clock deadlines.
+// A poll finishing past the next deadline counts as an overrun and the
+// schedule restarts from now rather than running fast to catch up.
+static inline void imagePollerRun(ImagePoller *poller) {
+
+    auto period = std::chrono::duration_cast<LinkClock::duration>(
+        std::chrono::duration<double>(poller->header->period));
+    LinkClock::time_point deadline = LinkClock::now();
+
+    while (!poller->stop) {
+        if (imagePoll(poller))
+            poller->polls++;
+        else
+            poller->failures++;
+        {
+            // the pump thread changes the state under the link lock
+            std::lock_guard<std::mutex> guard(poller->link->lock);
+            if (poller->link->state == LINK_FAILED)
+                break;
+        }
+        deadline += period;
+        if (LinkClock::now() > deadline) {
+            poller->overruns++;
+            deadline = LinkClock::now();
+        }
+        std::this_thread::sleep_until(deadline);
+    }
+}
+
+// Function: imageServe ===================================================
+// Abstract: Create the image of the addresses and start polling them every
+// period on the link. An image left by a poller that has exited is
+// replaced, one of a live poller is an error.
+static inline ImagePoller* imageServe(const std::string &name,
+        const std::vector<std::string> &addresses, double period,
+        PlcLink *link, std::string &err) {
+
+    std::string shm = imageShmName(name);
+    uint32_t offset = 0, size, count;
+    PlcType type;
+    int fd;
+
+    if (shm.empty()) {
+        err = "image name <" + name + "> must be letters, digits, _ or -";
+        return nullptr;
+    }
+    if (addresses.empty() || (addresses.size() > IMAGE_MAX_AREAS)) {
+        err = "an image needs 1 to " + std::to_string(IMAGE_MAX_AREAS) + " areas";
+        return nullptr;
+    }
+    if (!(period > 0)) {
+        err = "image period must be positive";
+        return nullptr;
+    }
+
+    std::unique_ptr<ImagePoller> poller(new ImagePoller);
+    ImageHeader layout;
+    memset((void*) &layout, 0, sizeof(layout));
+    for (size_t idx = 0; idx < addresses.size(); idx++) {
+        ImageArea *area = &layout.areas[idx];
+        if (!typeOfAddress(addresses[idx], &type, &size, &count) ||
+                !imageArea(addresses[idx], type, count, area)) {
+            err = "image area <" + addresses[idx] + "> not supported";
+            return nullptr;
+        }
+        area->offset = offset;
+        offset += (area->bytes + 7) & ~7u;
+    }
+
+    // Refuse to take over the image of a live poller
+    if ((fd = shm_open(shm.c_str(), O_RDONLY, 0)) >= 0) {
+        ImageHeader old;
+        bool live = (pread(fd, &old, sizeof(old), 0) == sizeof(old)) &&
+            (old.magic == IMAGE_MAGIC) && (old.pid != getpid()) &&
+            imagePidAlive(old.pid);
+        ::close(fd);
+        if (live) {
+            err = "image <" + name + "> is served by process " +
+                std::to_string(old.pid);
+            return nullptr;
+        }
+        shm_unlink(shm.c_str());
+    }
+
+    poller->size = sizeof(ImageHeader) + offset;
+    fd = shm_open(shm.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+    if ((fd < 0) || (ftruncate(fd, poller->size) != 0)) {
+        if (fd >= 0)
+            ::close(fd);
+        err = "cannot create image <" + name + ">: " + strerror(errno);
+        return nullptr;
+    }
+    void *base = mmap(NULL, poller->size, PROT_READ | PROT_WRITE,
+        MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (base == MAP_FAILED) {
+        shm_unlink(shm.c_str());
+        err = "cannot map image <" + name + ">: " + strerror(errno);
+        return nullptr;
+    }
+
+    layout.magic = IMAGE_MAGIC;
+    layout.version = IMAGE_VERSION;
+    layout.nAreas = (uint32_t) addresses.size();
+    layout.dataBytes = offset;
+    layout.period = period;
+    layout.pid = getpid();
+    memcpy(base, (void*) &layout, sizeof(layout));
+
+    poller->name = name;
+    poller->header = (ImageHeader*) base;
+    poller->header->state.store(LINK_CONNECTING);
+    poller->header->seq.store(0);
+    poller->data = (uint8_t*) base + sizeof(ImageHeader);
+    poller->stage.assign(offset, 0);
+    poller->link = link;
+    poller->thread = std::thread(imagePollerRun, poller.get());
+    return poller.release();
+}
+
+// Function: imageStop ====================================================
+// Abstract: Stop a poller and remove its image, readers still attached
+// keep their mapping of the last values
+static inline void imageStop(ImagePoller *poller) {
+    if (!poller)
+        return;
+    poller->stop = true;
+    if (poller->thread.joinable())
+        poller->thread.join();
+    shm_unlink(imageShmName(poller->name).c_str());
+    munmap(poller->header, poller->size);
+    delete poller;
+}
+
+// Function: imageAttach ==================================================
+// Abstract: Map an image read only, nullptr and err if it does not exist
+static inline ImageReader* imageAttach(const std::string &name,
+        std::string &err) {
+
+    std::string shm = imageShmName(name);
+    struct stat st;
+    int fd;
+
+    if (shm.empty() || ((fd = shm_open(shm.c_str(), O_RDONLY, 0)) < 0)) {
+        err = "image <" + name + "> is not served";
+        return nullptr;
+    }
+    void *base = (fstat(fd, &st) == 0) &&
+        (st.st_size >= (off_t) sizeof(ImageHeader)) ?
+        mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+    ::close(fd);
+    if (base == MAP_FAILED) {
+        err = "cannot map image <" + name + ">";
+        return nullptr;
+    }
+    const ImageHeader *h = (const ImageHeader*) base;
+    if ((h->magic != IMAGE_MAGIC) || (h->version != IMAGE_VERSION) ||
+            (h->nAreas > IMAGE_MAX_AREAS) ||
+            (sizeof(ImageHeader) + h->dataBytes > (size_t) st.st_size)) {
+        munmap(base, st.st_size);
+        err = "<" + name + "> is not a plc4mat image";
+        return nullptr;
+    }
+
+    ImageReader *reader = new ImageReader;
+    reader->name = name;
+    reader->header = h;
+    reader->data = (const uint8_t*) base + sizeof(ImageHeader);
+    reader->size = st.st_size;
+    return reader;
+}
+
+// Function: imageDetach ==================================================
+// Abstract: Unmap an image
+static inline void imageDetach(ImageReader *reader) {
+    if (!reader)
+        return;
+    munmap((void*) reader->header, reader->size);
+    delete reader;
+}
+
+// Function: imageFind ====================================================
+// Abstract: Area of the image at the position of an address (the type is
+// not compared), -1 if the image has none
+static inline int imageFind(const ImageReader *reader, const char *address) {
+    size_t len = imagePosition(address);
+    for (uint32_t idx = 0; idx < reader->header->nAreas; idx++) {
+        const char *a = reader->header->areas[idx].address;
+        if ((imagePosition(a) == len) && !strncmp(a, address, len))
+            return (int) idx;
+    }
+    return -1;
+}
+
+// Function: imagePollerAlive =============================================
+// Abstract: Whether the poller of an image runs, given the update count of
+// a snapshot. New updates show it does without a system call, a quiet
+// poller's process is checked at most every IMAGE_LIVE_CHECK seconds.
+static inline bool imagePollerAlive(ImageReader *reader, uint64_t updates) {
+
+    LinkClock::time_point now = LinkClock::now();
+
+    if ((reader->checked != LinkClock::time_point()) &&
+            (updates != reader->updates)) {
+        reader->updates = updates;
+        reader->checked = now;
+        reader->alive = true;
+    } else if ((reader->checked == LinkClock::time_point()) ||
+            (now - reader->checked >= linkSeconds(IMAGE_LIVE_CHECK))) {
+        reader->updates = updates;
+        reader->checked = now;
+        reader->alive = imagePidAlive(reader->header->pid);
+    }
+    return reader->alive;
+}
+
+// Function: imageSnapshot ================================================
+// Abstract: Consistent copy out of the image. copy(data) is called with the
+// image data and may run more than once if the poller publishes meanwhile,
+// it must only copy. Returns the update count and stamp of the snapshot.
+template <typename F>
+static inline uint64_t imageSnapshot(const ImageReader *reader, F copy,
+        int64_t *stamp) {
+
+    const ImageHeader *h = reader->header;
+    uint64_t before, updates;
+    int spins = 0;
+
+    while (1) {
+        before = h->seq.load(std::memory_order_acquire);
+        if (!(before & 1)) {
+            copy(reader->data);
+            updates = h->updates;
+            *stamp = h->stamp;
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (h->seq.load(std::memory_order_relaxed) == before)
+                return updates;
+        }
+        if (++spins > 64)
+            sched_yield();
+    }
+}
+
+#endif
@@ -0,0 +1,654 @@
+/**************************************************************************
+* File:             plc4link.h
+*
+* Description:      Reference counted registry of PLC4c connections shared
+*                   by all users within one MEX binary
+*
+* Notes:            Links are keyed by the plc4c connection string. When
+*                   the last user releases a link it is kept open for the
+*                   idle timeout so a later simulation run or plc4mex
+*                   session can attach without a new handshake. Expired
+*                   links are reaped lazily on acquire / release and all
+*                   links are closed by shutdown (call at MEX unload).
+*
+*                   Connecting is asynchronous: each link owns a pump thread
+*                   that drives the plc4c event loop through the handshake,
+*                   users block in linkWaitReady only when they first
+*                   need the connection. The link lock must be held by
+*                   anyone calling into plc4c for that link.
+*
+*                   Links are supervised: an I/O error reported through
+*                   linkFault moves the link to reconnecting and the link
+*                   thread retries with exponential backoff. Users serve
+*                   held values meanwhile and rebuild any prepared requests
+*                   when the link generation changes.
+*
+*                   plc4mat options may be appended to the query part of
+*                   the connection string, they are stripped before the
+*                   string is passed to plc4c:
+*                       idle-timeout=<s>    keep alive after last release
+*                       connect-timeout=<s> fail a handshake taking longer
+*                       io-timeout=<s>      fail a request taking longer
+*                       reconnect=<0|1>     supervise the link (default on)
+*                       backoff-min=<s>     first reconnect delay
+*                       backoff-max=<s>     longest reconnect delay
+*
+*                   linkPack splits the items of a request into runs that
+*                   each fit one S7 PDU, for callers merging many items.
+*
+* Revsions:         1.00 19/10/26 first release
+*
+* See also:         plc4log.h, plc4mex.cpp, plc4sim.cpp
+*
+* SPDX-License-Identifier: Apache-2.0
+**************************************************************************/
+
+#ifndef PLC4LINK_H
+#define PLC4LINK_H
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <plc4c/driver_s7.h>
+#include <plc4c/plc4c.h>
+#include <plc4c/transport_tcp.h>
+
+#include "plc4log.h"
+
+#define LINK_DEFAULT_IDLE_TIMEOUT 30.0
+#define LINK_DEFAULT_CONNECT_TIMEOUT 10.0
+#define LINK_DEFAULT_IO_TIMEOUT 5.0
+#define LINK_DEFAULT_BACKOFF_MIN 0.1
+#define LINK_DEFAULT_BACKOFF_MAX 10.0
+#define LINK_DISCONNECT_TIMEOUT 1.0
+
+// S7 framing used to pack items into PDUs: header and parameter head of a
+// job, parameter item of a variable and data item header
+#define LINK_DEFAULT_PDU 240
+#define LINK_MIN_PDU 64
+#define LINK_S7_HEADER 14
+#define LINK_S7_ITEM 12
+#define LINK_S7_DATA 4
+
+typedef std::chrono::steady_clock LinkClock;
+typedef std::map<std::string, std::string> LinkOptionMap;
+
+// Query options consumed by plc4mat, anything else is passed on to plc4c
+static const char* const linkOptionNames[] = {
+    "idle-timeout", "connect-timeout", "io-timeout", "reconnect",
+    "backoff-min", "backoff-max", "diagnostics", "pace", "tagdb", "record",
+    "replay-check", "merge", "pdu", "subscribe",
+    "subscribe-max", "cache", "log", "split", nullptr
+};
+
+enum LinkState {
+    LINK_CONNECTING,
+    LINK_CONNECTED,
+    LINK_RECONNECTING,
+    LINK_FAILED
+};
+
+struct LinkOptions {
+    double idleTimeout = LINK_DEFAULT_IDLE_TIMEOUT;
+    double connectTimeout = LINK_DEFAULT_CONNECT_TIMEOUT;
+    double ioTimeout = LINK_DEFAULT_IO_TIMEOUT;
+    bool reconnect = true;
+    double backoffMin = LINK_DEFAULT_BACKOFF_MIN;
+    double backoffMax = LINK_DEFAULT_BACKOFF_MAX;
+};
+
+struct PlcLink {
+    std::string key;
+    plc4c_system *system = nullptr;
+    plc4c_connection *connection = nullptr;
+    int refs = 0;
+    LinkOptions opts;
+    LinkClock::time_point idleSince;
+    LinkState state = LINK_CONNECTING;
+    std::string error;
+    LinkClock::time_point connectStart;
+    unsigned generation = 0;        // bumped on every (re)connect
+    bool handshake = false;         // reconnect handshake in progress
+    double backoff = 0;
+    LinkClock::time_point retryAt;
+    std::mutex lock;
+    std::condition_variable changed;
+    std::thread pump;
+    bool stopping = false;
+};
+
+// Function: linkSecondsSince =============================================
+// Abstract: Elapsed seconds between a steady clock time point and now
+static inline double linkSecondsSince(LinkClock::time_point t) {
+    return std::chrono::duration<double>(LinkClock::now() - t).count();
+}
+
+// Function: linkSeconds ==================================================
+// Abstract: Convert seconds to a steady clock duration
+static inline LinkClock::duration linkSeconds(double seconds) {
+    return std::chrono::duration_cast<LinkClock::duration>(
+        std::chrono::duration<double>(seconds));
+}
+
+// Function: linkStateName ================================================
+// Abstract: Printable name of a link state for status output
+static inline const char* linkStateName(LinkState state) {
+    switch (state) {
+        case LINK_CONNECTING:
+            return "connecting";
+        case LINK_CONNECTED:
+            return "connected";
+        case LINK_RECONNECTING:
+            return "reconnecting";
+        default:
+            return "failed";
+    }
+}
+
+// Function: linkSplitOptions =============================================
+// Abstract: Split the connection string into the part passed to plc4c and
+// a map of the plc4mat options found in its query
+static inline void linkSplitOptions(const char *connStr, std::string &key,
+        LinkOptionMap &opts) {
+
+    const char *query = strchr(connStr, '?');
+    std::string kept;
+
+    opts.clear();
+    if (!query) {
+        key = connStr;
+        return;
+    }
+    key.assign(connStr, query - connStr);
+
+    std::string rest(query + 1);
+    size_t pos = 0;
+    while (pos <= rest.size()) {
+        size_t amp = rest.find('&', pos);
+        if (amp == std::string::npos)
+            amp = rest.size();
+        std::string item = rest.substr(pos, amp - pos);
+        pos = amp + 1;
+        if (item.empty())
+            continue;
+
+        size_t eq = item.find('=');
+        std::string name = item.substr(0, eq);
+        bool ours = false;
+        for (int idx = 0; linkOptionNames[idx]; idx++)
+            ours |= (name == linkOptionNames[idx]);
+        if (ours)
+            opts[name] = eq == std::string::npos ? "" : item.substr(eq + 1);
+        else
+            kept += (kept.empty() ? "" : "&") + item;
+    }
+    if (!kept.empty())
+        key += "?" + kept;
+}
+
+// Function: linkOptionSeconds ============================================
+// Abstract: Parse a non negative number of seconds if the option is given
+static inline bool linkOptionSeconds(const LinkOptionMap &opts,
+        const char *name, double *seconds, std::string &err) {
+
+    auto found = opts.find(name);
+    char *end;
+
+    if (found == opts.end())
+        return true;
+    *seconds = strtod(found->second.c_str(), &end);
+    if (found->second.empty() || (*end != '\0') || (*seconds < 0)) {
+        err = std::string("bad ") + name + " option <" + found->second + ">";
+        return false;
+    }
+    return true;
+}
+
+// Function: linkOptionFlag ===============================================
+// Abstract: Parse an on/off option if given, a bare name means on
+static inline bool linkOptionFlag(const LinkOptionMap &opts,
+        const char *name, bool *flag, std::string &err) {
+
+    auto found = opts.find(name);
+
+    if (found == opts.end())
+        return true;
+    const std::string &value = found->second;
+    if (value.empty() || (value == "1") || (value == "on") || (value == "true"))
+        *flag = true;
+    else if ((value == "0") || (value == "off") || (value == "false"))
+        *flag = false;
+    else {
+        err = std::string("bad ") + name + " option <" + value + ">";
+        return false;
+    }
+    return true;
+}
+
+// Function: linkOptionCount ==============================================
+// Abstract: Parse a whole number of at least min if the option is given
+static inline bool linkOptionCount(const LinkOptionMap &opts,
+        const char *name, unsigned min, unsigned *count, std::string &err) {
+
+    auto found = opts.find(name);
+    char *end;
+
+    if (found == opts.end())
+        return true;
+    unsigned long value = strtoul(found->second.c_str(), &end, 10);
+    if (found->second.empty() || (*end != '\0') || (value < min) ||
+            (value > 0xFFFF)) {
+        err = std::string("bad ") + name + " option <" + found->second + ">";
+        return false;
+    }
+    *count = (unsigned) value;
+    return true;
+}
+
+// Function: linkParseOptions =============================================
+// Abstract: Split the connection string into the part passed to plc4c and
+// the link options
+static inline bool linkParseOptions(const char *connStr, std::string &key,
+        LinkOptions *opts, std::string &err) {
+
+    LinkOptionMap map;
+
+    linkSplitOptions(connStr, key, map);
+    return linkOptionSeconds(map, "idle-timeout", &opts->idleTimeout, err)
+        && linkOptionSeconds(map, "connect-timeout", &opts->connectTimeout, err)
+        && linkOptionSeconds(map, "io-timeout", &opts->ioTimeout, err)
+        && linkOptionFlag(map, "reconnect", &opts->reconnect, err)
+        && linkOptionSeconds(map, "backoff-min", &opts->backoffMin, err)
+        && linkOptionSeconds(map, "backoff-max", &opts->backoffMax, err);
+}
+
+// Function: linkSchedule =================================================
+// Abstract: Back off exponentially before the next reconnect attempt. Call
+// with the lock held.
+static inline void linkSchedule(PlcLink *link) {
+    link->backoff = link->backoff <= 0 ? link->opts.backoffMin
+        : std::min(2 * link->backoff, link->opts.backoffMax);
+    link->retryAt = LinkClock::now() + linkSeconds(link->backoff);
+    link->handshake = false;
+    LOG(LOG_DEBUG, "link <%s> retrying in %.3g s", link->key.c_str(),
+        link->backoff);
+    link->state = LINK_RECONNECTING;
+}
+
+// Function: linkFault ====================================================
+// Abstract: Report an I/O failure on a connected link. A supervised link
+// is reconnected in the background, else it fails. Call with the lock held.
+static inline void linkFault(PlcLink *link, const std::string &reason) {
+    if (link->state != LINK_CONNECTED)
+        return;
+    link->error = reason;
+    LOG(LOG_WARN, "link <%s> lost, %s", link->key.c_str(), reason.c_str());
+    if (link->opts.reconnect) {
+        link->backoff = 0;
+        linkSchedule(link);
+    } else {
+        link->state = LINK_FAILED;
+    }
+    link->changed.notify_all();
+}
+
+// Function: linkRestart ==================================================
+// Abstract: Drop the broken plc4c connection and start a new handshake.
+// Call from the link thread with the lock held.
+static inline void linkRestart(PlcLink *link) {
+
+    if (link->connection) {
+        plc4c_system_remove_connection(link->system, link->connection);
+        plc4c_connection_destroy(link->connection);
+        link->connection = nullptr;
+    }
+    if (plc4c_system_connect(link->system, link->key.c_str(),
+            &link->connection) != OK) {
+        link->connection = nullptr;
+        linkSchedule(link);
+        return;
+    }
+    link->handshake = true;
+    link->connectStart = LinkClock::now();
+}
+
+// Function: linkPump =====================================================
+// Abstract: Link thread body, drives the plc4c event loop while the link is
+// (re)connecting and records the outcome of each handshake
+static inline void linkPump(PlcLink *link) {
+
+    std::unique_lock<std::mutex> lk(link->lock);
+
+    while (1) {
+        link->changed.wait(lk, [link] {
+            return link->stopping || (link->state == LINK_CONNECTING)
+                || (link->state == LINK_RECONNECTING); });
+        if (link->stopping)
+            break;
+
+        if ((link->state == LINK_RECONNECTING) && !link->handshake) {
+            if (LinkClock::now() < link->retryAt)
+                link->changed.wait_until(lk, link->retryAt,
+                    [link] { return link->stopping; });
+            else
+                linkRestart(link);
+            continue;
+        }
+
+        plc4c_system_loop(link->system);
+        if (plc4c_connection_get_connected(link->connection)) {
+            link->state = LINK_CONNECTED;
+            link->handshake = false;
+            link->backoff = 0;
+            link->generation++;
+            LOG(LOG_INFO, "link <%s> connected", link->key.c_str());
+        } else if (plc4c_connection_has_error(link->connection) ||
+                (linkSecondsSince(link->connectStart)
+                > link->opts.connectTimeout)) {
+            if (link->state == LINK_RECONNECTING) {
+                linkSchedule(link);
+            } else {
+                link->state = LINK_FAILED;
+                link->error = "connection to <" + link->key + "> " +
+                    (plc4c_connection_has_error(link->connection) ?
+                    "failed" : "timed out");
+                LOG(LOG_ERROR, "%s", link->error.c_str());
+            }
+        } else {
+            // give waiting users a chance to take the lock
+            lk.unlock();
+            std::this_thread::yield();
+            lk.lock();
+            continue;
+        }
+        link->changed.notify_all();
+    }
+}
+
+// Function: linkPack =====================================================
+// Abstract: Split items carrying the given data bytes into runs of a read
+// (write false) or write request that fit one PDU both ways. Returns the
+// first item of each run, an item too big for any PDU gets a run of its own.
+static inline std::vector<size_t> linkPack(const std::vector<uint32_t> &bytes,
+        bool write, unsigned pdu) {
+
+    std::vector<size_t> starts;
+    unsigned request = 0, response = 0;
+
+    for (size_t idx = 0; idx < bytes.size(); idx++) {
+        unsigned data = LINK_S7_DATA + bytes[idx] + (bytes[idx] & 1);
+        unsigned out = LINK_S7_ITEM + (write ? data : 0);
+        unsigned in = write ? 1 : data;     // a write answers a return code
+        if (starts.empty() || (request + out > pdu) || (response + in > pdu)) {
+            starts.push_back(idx);
+            request = response = LINK_S7_HEADER;
+        }
+        request += out;
+        response += in;
+    }
+    return starts;
+}
+
+// Function: linkWaitReady ================================================
+// Abstract: Block while the first handshake of a link is running and
+// return the link state. LINK_RECONNECTING means the caller should serve
+// held values, LINK_FAILED sets err. Do not hold the lock.
+static inline LinkState linkWaitReady(PlcLink *link, std::string &err) {
+
+    std::unique_lock<std::mutex> lk(link->lock);
+
+    link->changed.wait(lk, [link] {
+        return link->state != LINK_CONNECTING; });
+    if (link->state == LINK_FAILED)
+        err = link->error;
+    return link->state;
+}
+
+// Function: linkLoopUntil ================================================
+// Abstract: Drive the event loop of a connected link until done() is true.
+// A failed() execution, a lost connection or the I/O timeout is reported
+// to linkFault and returns false. Call with the lock held.
+template <typename D, typename F>
+static inline bool linkLoopUntil(PlcLink *link, D done, F failed,
+        const char *what) {
+
+    LinkClock::time_point start = LinkClock::now();
+    std::string reason;
+
+    while (1) {
+        if (plc4c_system_loop(link->system) != OK)
+            reason = "plc4c_system_loop failed";
+        else if (done())
+            return true;
+        else if (failed())
+            reason = std::string(what) + " execution failed";
+        else if (plc4c_connection_has_error(link->connection) ||
+                !plc4c_connection_get_connected(link->connection))
+            reason = "connection to <" + link->key + "> lost";
+        else if (linkSecondsSince(start) > link->opts.ioTimeout)
+            reason = std::string(what) + " timed out";
+        else
+            continue;
+        linkFault(link, reason);
+        return false;
+    }
+}
+
+class LinkRegistry {
+    public:
+        static LinkRegistry& instance() {
+            static LinkRegistry registry;
+            return registry;
+        }
+        PlcLink* acquire(const char *connStr, std::string &err);
+        bool prefetch(const char *connStr, std::string &err);
+        void release(PlcLink *link);
+        void reap();
+        void shutdown();
+        template <typename F> void forEach(F fcn) {
+            for (auto &entry : links)
+                fcn(*entry.second);
+        }
+    private:
+        LinkRegistry() {}
+        ~LinkRegistry() { shutdown(); }
+        static bool healthy(PlcLink *link);
+        static bool open(PlcLink *link, std::string &err);
+        static void close(PlcLink *link);
+        PlcLink* find(const char *connStr, std::string &err);
+        std::map<std::string, PlcLink*> links;
+};
+
+// Function: LinkRegistry::healthy ========================================
+// Abstract: A link can be reused if it is still (re)connecting or plc4c
+// still reports it connected
+inline bool LinkRegistry::healthy(PlcLink *link) {
+    std::lock_guard<std::mutex> guard(link->lock);
+    if ((link->state == LINK_CONNECTING) || (link->state == LINK_RECONNECTING))
+        return true;
+    return (link->state == LINK_CONNECTED)
+        && plc4c_connection_get_connected(link->connection)
+        && !plc4c_connection_has_error(link->connection);
+}
+
+// Function: LinkRegistry::open ===========================================
+// Abstract: Create the plc4c system for a link and start the handshake on
+// the link thread, does not wait for the connection
+inline bool LinkRegistry::open(PlcLink *link, std::string &err) {
+
+    plc4c_return_code result;
+
+    result = plc4c_system_create(&link->system);
+    if (result != OK) {
+        err = "plc4c_system_create failed";
+        return false;
+    }
+    plc4c_driver *s7_driver = plc4c_driver_s7_create();
+    result = plc4c_system_add_driver(link->system, s7_driver);
+    if (result == OK) {
+        plc4c_transport *tcp_transport = plc4c_transport_tcp_create();
+        result = plc4c_system_add_transport(link->system, tcp_transport);
+    }
+    if (result == OK)
+        result = plc4c_system_init(link->system);
+    if (result != OK) {
+        err = "plc4c system setup failed";
+        close(link);
+        return false;
+    }
+
+    result = plc4c_system_connect(link->system, link->key.c_str(),
+        &link->connection);
+    if (result != OK) {
+        err = "plc4c_system_connect failed for <" + link->key + ">";
+        close(link);
+        return false;
+    }
+
+    link->state = LINK_CONNECTING;
+    link->connectStart = LinkClock::now();
+    link->pump = std::thread(linkPump, link);
+    return true;
+}
+
+// Function: LinkRegistry::close ==========================================
+// Abstract: Disconnect (bounded wait) and free the plc4c system of a link
+inline void LinkRegistry::close(PlcLink *link) {
+
+    if (link->pump.joinable()) {
+        {
+            std::lock_guard<std::mutex> guard(link->lock);
+            link->stopping = true;
+        }
+        link->changed.notify_all();
+        link->pump.join();
+    }
+
+    if (link->connection) {
+        if (plc4c_connection_get_connected(link->connection)
+                && (plc4c_connection_disconnect(link->connection) == OK)) {
+            LinkClock::time_point start = LinkClock::now();
+            while (plc4c_connection_get_connected(link->connection)
+                    && !plc4c_connection_has_error(link->connection)
+                    && (linkSecondsSince(start) < LINK_DISCONNECT_TIMEOUT))
+                plc4c_system_loop(link->system);
+        }
+        plc4c_system_remove_connection(link->system, link->connection);
+        plc4c_connection_destroy(link->connection);
+        link->connection = nullptr;
+    }
+    if (link->system) {
+        plc4c_system_shutdown(link->system);
+        plc4c_system_destroy(link->system);
+        link->system = nullptr;
+    }
+}
+
+// Function: LinkRegistry::find ===========================================
+// Abstract: Return the registry entry for a connection string, opening a
+// new link (without waiting for it) if there is no usable one
+inline PlcLink* LinkRegistry::find(const char *connStr, std::string &err) {
+
+    LinkOptions opts;
+    std::string key;
+    PlcLink *link;
+
+    reap();
+    if (!linkParseOptions(connStr, key, &opts, err))
+        return nullptr;
+
+    auto found = links.find(key);
+    if (found != links.end()) {
+        link = found->second;
+        if ((link->refs > 0) || healthy(link)) {
+            link->opts = opts;
+            return link;
+        }
+        // stale or failed idle link, drop it and open a new one
+        close(link);
+        links.erase(found);
+        delete link;
+    }
+
+    link = new PlcLink;
+    link->key = key;
+    link->opts = opts;
+    if (!open(link, err)) {
+        delete link;
+        return nullptr;
+    }
+    link->idleSince = LinkClock::now();
+    links[key] = link;
+    return link;
+}
+
+// Function: LinkRegistry::acquire ========================================
+// Abstract: Return a link for the connection string, reusing an open one if
+// possible. The handshake may still be running, see linkWaitReady.
+// Returns nullptr and sets err on failure.
+inline PlcLink* LinkRegistry::acquire(const char *connStr, std::string &err) {
+
+    PlcLink *link = find(connStr, err);
+    if (link)
+        link->refs++;
+    return link;
+}
+
+// Function: LinkRegistry::prefetch =======================================
+// Abstract: Start connecting without taking a reference so a later acquire
+// finds the handshake under way. Unused it expires like an idle link.
+inline bool LinkRegistry::prefetch(const char *connStr, std::string &err) {
+    return find(connStr, err) != nullptr;
+}
+
+// Function: LinkRegistry::release ========================================
+// Abstract: Drop a reference, an unused link stays open until it expires
+inline void LinkRegistry::release(PlcLink *link) {
+    if ((link == nullptr) || (link->refs <= 0))
+        return;
+    if (--link->refs == 0)
+        link->idleSince = LinkClock::now();
+    reap();
+}
+
+// Function: LinkRegistry::reap ===========================================
+// Abstract: Close unused links that have been idle past their timeout
+inline void LinkRegistry::reap() {
+    for (auto it = links.begin(); it != links.end(); ) {
+        PlcLink *link = it->second;
+        bool expired = (link->refs == 0) &&
+            (linkSecondsSince(link->idleSince) >= link->opts.idleTimeout);
+        if (expired) {
+            // a prefetched link is kept until its handshake has finished
+            std::lock_guard<std::mutex> guard(link->lock);
+            expired = link->state != LINK_CONNECTING;
+        }
+        if (expired) {
+            close(link);
+            delete link;
+            it = links.erase(it);
+        } else {
+            it++;
+        }
+    }
+}
+
+// Function: LinkRegistry::shutdown =======================================
+// Abstract: Close every link regardless of references, used at unload
+inline void LinkRegistry::shutdown() {
+    for (auto &entry : links) {
+        close(entry.second);
+        delete entry.second;
+    }
+    links.clear();
+}
+
+#endif
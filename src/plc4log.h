@@ -0,0 +1,193 @@
+/**************************************************************************
+* File:             plc4log.h
+*
+* Description:      Levelled logging into a lock free ring drained off the
+*                   I/O path
+*
+* Notes:            LOG(level, fmt, ...) formats a message into a slot of a
+*                   bounded ring shared by all threads of the MEX binary.
+*                   Producers never block or allocate: a full ring drops the
+*                   message and counts it. The ring is drained on the MATLAB
+*                   thread (plc4mex calls, plc4sim callbacks), which is the
+*                   only place MATLAB output may be written from.
+*
+*                   Sites above PLC4_LOG_LEVEL (default LOG_INFO) compile to
+*                   nothing, build with -DPLC4_LOG_LEVEL=4 to keep the
+*                   debug and trace sites. Sites compiled in are filtered
+*                   at run time by logSetLevel (default LOG_INFO), a
+*                   filtered site costs one relaxed load.
+*
+* Revsions:         1.00 19/10/26 first release
+*
+* See also:         plc4link.h, plc4mex.cpp, plc4sim.cpp
+*
+* SPDX-License-Identifier: Apache-2.0
+**************************************************************************/
+
+#ifndef PLC4LOG_H
+#define PLC4LOG_H
+
+#include <atomic>
+#include <cstdarg>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+#include <time.h>
+
+#define LOG_ERROR 0
+#define LOG_WARN 1
+#define LOG_INFO 2
+#define LOG_DEBUG 3
+#define LOG_TRACE 4
+
+#ifndef PLC4_LOG_LEVEL
+#define PLC4_LOG_LEVEL LOG_INFO
+#endif
+
+#define LOG_SLOTS 1024              // power of two
+#define LOG_MSG_LEN 200
+
+#define LOG(level, ...)                                                     \
+    do {                                                                    \
+        if (((level) <= PLC4_LOG_LEVEL) && logEnabled(level))               \
+            logPush((level), __VA_ARGS__);                                  \
+    } while (0)
+
+struct LogSlot {
+    std::atomic<size_t> seq;        // turn of the slot, see logPush
+    int level;
+    int64_t stamp;                  // CLOCK_REALTIME ns
+    char msg[LOG_MSG_LEN];
+};
+
+struct LogRing {
+    LogSlot slots[LOG_SLOTS];
+    std::atomic<size_t> head{0};    // next slot to fill
+    std::atomic<size_t> tail{0};    // next slot to drain
+    std::atomic<int> level{LOG_INFO};
+    std::atomic<size_t> dropped{0};
+    LogRing() {
+        for (size_t idx = 0; idx < LOG_SLOTS; idx++)
+            slots[idx].seq.store(idx, std::memory_order_relaxed);
+    }
+};
+
+// Function: logRing ======================================================
+// Abstract: The ring of this MEX binary
+static inline LogRing& logRing() {
+    static LogRing ring;
+    return ring;
+}
+
+// Function: logLevelName =================================================
+// Abstract: Name of a level as printed
+static inline const char* logLevelName(int level) {
+    static const char *names[] = {"error", "warn", "info", "debug", "trace"};
+    return (level >= LOG_ERROR) && (level <= LOG_TRACE) ? names[level] : "?";
+}
+
+// Function: logLevelOf ===================================================
+// Abstract: Level of a name, false if it names none
+static inline bool logLevelOf(const std::string &name, int *level) {
+    for (int idx = LOG_ERROR; idx <= LOG_TRACE; idx++)
+        if (name == logLevelName(idx)) {
+            *level = idx;
+            return true;
+        }
+    return false;
+}
+
+// Function: logEnabled ===================================================
+// Abstract: True if messages of level are kept at run time
+static inline bool logEnabled(int level) {
+    return level <= logRing().level.load(std::memory_order_relaxed);
+}
+
+// Function: logSetLevel ==================================================
+// Abstract: Keep messages up to level from now on, returns the old level
+static inline int logSetLevel(int level) {
+    return logRing().level.exchange(level);
+}
+
+// Function: logPush ======================================================
+// Abstract: Format a message into the next free slot, dropped if the ring
+// is full. Safe from any thread.
+static inline void logPush(int level, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+static inline void logPush(int level, const char *fmt, ...) {
+
+    LogRing &ring = logRing();
+    size_t pos = ring.head.load(std::memory_order_relaxed);
+    struct timespec now;
+    LogSlot *slot;
+    va_list args;
+
+    // a slot is free to fill on turn pos when its seq is pos
+    while (1) {
+        slot = &ring.slots[pos & (LOG_SLOTS - 1)];
+        size_t seq = slot->seq.load(std::memory_order_acquire);
+        if (seq == pos) {
+            if (ring.head.compare_exchange_weak(pos, pos + 1,
+                    std::memory_order_relaxed))
+                break;
+        } else if (seq < pos) {
+            ring.dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        } else {
+            pos = ring.head.load(std::memory_order_relaxed);
+        }
+    }
+    clock_gettime(CLOCK_REALTIME, &now);
+    slot->level = level;
+    slot->stamp = (int64_t) now.tv_sec * 1000000000LL + now.tv_nsec;
+    va_start(args, fmt);
+    vsnprintf(slot->msg, LOG_MSG_LEN, fmt, args);
+    va_end(args);
+    slot->seq.store(pos + 1, std::memory_order_release);
+}
+
+// Function: logPending ===================================================
+// Abstract: True if messages wait to be drained
+static inline bool logPending() {
+    LogRing &ring = logRing();
+    return ring.tail.load(std::memory_order_relaxed) !=
+        ring.head.load(std::memory_order_relaxed);
+}
+
+// Function: logDrain =====================================================
+// Abstract: Hand the queued messages, oldest first, to emit(level, stamp,
+// msg) and free their slots. Returns the number drained.
+template <typename F>
+static inline size_t logDrain(F emit) {
+
+    LogRing &ring = logRing();
+    size_t pos = ring.tail.load(std::memory_order_relaxed), n = 0;
+    char msg[LOG_MSG_LEN];
+
+    // a slot is ready to drain on turn pos when its seq is pos + 1
+    while (1) {
+        LogSlot *slot = &ring.slots[pos & (LOG_SLOTS - 1)];
+        size_t seq = slot->seq.load(std::memory_order_acquire);
+        if (seq < pos + 1)
+            break;
+        if (seq > pos + 1) {
+            pos = ring.tail.load(std::memory_order_relaxed);
+            continue;
+        }
+        if (!ring.tail.compare_exchange_weak(pos, pos + 1,
+                std::memory_order_relaxed))
+            continue;
+        int level = slot->level;
+        int64_t stamp = slot->stamp;
+        memcpy(msg, slot->msg, LOG_MSG_LEN);
+        slot->seq.store(pos + LOG_SLOTS, std::memory_order_release);
+        emit(level, stamp, (const char*) msg);
+        pos++;
+        n++;
+    }
+    return n;
+}
+
+#endif
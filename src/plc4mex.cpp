@@ -19,12 +19,32 @@
 #include <iostream>
 #include <unistd.h>
 #include <cstddef>
+#include <ctime>
+#include <cerrno>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <algorithm>
+#include <cmath>
+#include <memory>
 
 #include <plc4c/driver_s7.h>
 #include <plc4c/plc4c.h>
 #include <plc4c/transport_tcp.h>
 #include <plc4c/spi/types_private.h>
 
+#include "plc4link.h"
+#include "plc4log.h"
+#include "plc4bits.h"
+#include "plc4broker.h"
+#include "plc4harvest.h"
+#include "plc4tags.h"
+#include "plc4image.h"
+#include "plc4record.h"
+#include "plc4replay.h"
+#include "plc4subscribe.h"
+#include "plc4virtual.h"
+
 #define ASSERT(chk, fs)                                                     \
     do {                                                                    \
         if ((chk) == false) {                                               \
@@ -41,6 +61,13 @@
         _e->feval(u"disp", 0, std::vector<Array>({_f.createScalar(fs)}));   \
     } while (0)
 
+#define WARNING(fs)                                                         \
+    do {                                                                    \
+        ArrayFactory _f;                                                    \
+        std::shared_ptr<matlab::engine::MATLABEngine> _e = getEngine();     \
+        _e->feval(u"warning", 0, std::vector<Array>({_f.createScalar(fs)}));\
+    } while (0)
+
 #define ERROR(fs)                                                           \
     do {                                                                    \
         ArrayFactory _f;                                                    \
@@ -51,30 +78,169 @@
 using namespace matlab::data;
 using matlab::mex::ArgumentList;
 
+// An address of a playback, written from count columns of the samples in
+// the type of the address
+struct PlaybackTag {
+    std::string address;
+    PlcType type;
+    uint32_t size;
+    uint32_t count;
+    size_t offset;                      // of its values in a row
+    bool bits;                          // a BOOL range, written packed
+    BitsRange range;
+};
+
+// Streamed write of a recorded profile, one row of N x M samples per period
+struct Playback {
+    std::vector<PlaybackTag> tags;
+    std::vector<uint8_t> samples;       // rows of the values of the tags
+    size_t rowBytes = 0;
+    size_t nRows = 0;
+    double period = 0;
+    bool skipLate = false;
+    PlcLink *link = nullptr;
+    std::thread thread;
+    std::atomic<bool> stop{false};
+    std::atomic<bool> running{false};
+    std::atomic<size_t> written{0};
+    std::atomic<size_t> skipped{0};
+    std::atomic<size_t> dropped{0};
+    std::atomic<size_t> overruns{0};
+    std::atomic<double> maxLateness{0};
+    std::mutex errorLock;
+    std::string error;
+    bool uncached = false;              // cache dropped after it ended
+};
+
+// Read or write queued by readAsync / writeAsync for the I/O thread, the
+// result fields are guarded by the AsyncIo lock
+struct AsyncJob {
+    bool write = false;
+    std::vector<ImageArea> areas;       // read: addresses and result layout
+    std::vector<uint8_t> data;          // read: values, host native
+    std::vector<BitsItem> items;        // write: items, owned until sent
+    bool finished = false;
+    bool ok = false;
+};
+
+// I/O thread running queued requests in order on the session's link
+struct AsyncIo {
+    PlcLink *link = nullptr;
+    std::thread thread;
+    std::mutex lock;
+    std::condition_variable changed;
+    std::deque<std::shared_ptr<AsyncJob>> queue;
+    bool stop = false;
+};
+
+// Value of an address read or written on the session, served to reads
+// within the time to live of the cache
+struct CacheEntry {
+    Array value;
+    LinkClock::time_point stamp;
+    VirtualItem span;                   // bytes covered, if known
+    bool spanned = false;
+};
+
+// Read cache of a connection, off while ttl is 0
+struct ReadCache {
+    double ttl = 0;
+    std::map<std::string, CacheEntry> entries;
+    size_t hits = 0;
+    size_t misses = 0;
+    size_t dropped = 0;                 // entries overlapping a write
+};
+
 class MexFunction : public matlab::mex::Function {
     public:
         void operator()(ArgumentList outputs, ArgumentList inputs);
         MexFunction() { mexLock(); }
-        ~MexFunction() {}
+        ~MexFunction() {
+            stopAsync();
+            stopPlayback();
+            imageStop(poller);
+            subStop(subscription);
+            for (auto &attached : images)
+                imageDetach(attached.second);
+            for (auto &opened : recordings)
+                recordRelease(opened.second);
+            replayClose(replay);
+            brokerClose(broker);
+            LinkRegistry::instance().shutdown(); 
+        }
     private:
         char connStr[254];
         bool connected = false;
         void connect(ArgumentList inputs);
         void release() { mexUnlock(); }
         void read(ArgumentList inputs, ArgumentList outputs);
-        void write(ArgumentList inputs);
+        void write(ArgumentList inputs, ArgumentList outputs);
+        void holdReadValues(StructArray &reads);
+        bool cacheLookup(StructArray &reads, const std::vector<std::string> &addrs);
+        void cacheStore(const std::string &address, Array value);
+        void cacheWrite(const std::string &address, Array value, bool done);
+        void cachePlayback();
+        void cacheOp(ArgumentList inputs, ArgumentList outputs);
+        void logOp(ArgumentList inputs, ArgumentList outputs);
+        void logFlush();
+        void readMatrix(ArgumentList inputs, ArgumentList outputs);
+        void readBlock(ArgumentList inputs, ArgumentList outputs);
+        bool fetchBlock(const BitsRange &range, std::vector<uint8_t> &block);
+        Array blockValues(const std::vector<uint8_t> &block, Array layout);
+        void harvest(ArgumentList inputs, ArgumentList outputs);
+        std::vector<std::string> addressList(ArgumentList inputs, size_t first);
+        template <typename F>
+        bool execRead(const std::vector<std::string> &names,
+            const std::vector<std::string> &addrs, F consume);
         void disconnect();
         void status();
+        void tagdb(ArgumentList inputs, ArgumentList outputs);
+        void image(ArgumentList inputs, ArgumentList outputs);
+        void record(ArgumentList inputs, ArgumentList outputs);
+        RecordReader* recording(const std::string &path, uint64_t rows);
+        void replayOp(ArgumentList inputs, ArgumentList outputs);
+        void subscribe(ArgumentList inputs);
+        void readAsync(ArgumentList inputs, ArgumentList outputs);
+        void writeAsync(ArgumentList inputs, ArgumentList outputs);
+        void collect(ArgumentList inputs, ArgumentList outputs, bool block);
+        double submit(std::shared_ptr<AsyncJob> job);
+        void stopAsync();
+        void fetch(ArgumentList outputs);
+        void replayRead(StructArray reads, ArgumentList outputs);
+        void virtualReads(StructArray reads, ArgumentList outputs);
+        void virtualWrites(StructArray writes, ArgumentList outputs);
+        void brokerReads(StructArray &reads, ArgumentList outputs);
+        void brokerWrites(StructArray writes, ArgumentList outputs);
+        std::string resolve(const std::string &addr);
+        void playback(ArgumentList inputs, ArgumentList outputs);
+        void stopPlayback();
         bool isValueType(ArrayType type);
         bool isWordType(ArrayType type);
         void checkWriteArgs(ArgumentList inputs);
         void checkReadArgs(ArgumentList inputs);
         StructArray formatReadArgs(ArgumentList inputs);
         StructArray formatWriteArgs(ArgumentList inputs);
-        plc4c_data* encodeWriteData(StructArray data, size_t idx);
+        plc4c_data* encodeWriteData(const std::string &address, Array value);
         Array decodeReadData(plc4c_data* responce_data);
-        plc4c_system* system = nullptr;
-        plc4c_connection* connection = nullptr;
+        PlcLink* link = nullptr;
+        TagDb* tags = nullptr;
+        std::map<std::string, Array> lastGood;
+        std::map<std::string, std::vector<Array>> lastMatrix;
+        std::map<std::string, std::vector<uint8_t>> lastBlock;
+        ReadCache cache;
+        std::map<std::string, Harvest> harvests;
+        std::unique_ptr<Playback> player;
+        ImagePoller* poller = nullptr;
+        Subscription* subscription = nullptr;
+        std::unique_ptr<AsyncIo> asyncIo;
+        std::map<uint64_t, std::shared_ptr<AsyncJob>> tickets;
+        std::map<uint64_t, Array> ticketReads;
+        uint64_t nextTicket = 1;
+        std::map<std::string, ImageReader*> images;
+        std::map<std::string, RecordReader*> recordings;
+        Replay* replay = nullptr;
+        VirtualPlc* virtualPlc = nullptr;
+        BrokerClient* broker = nullptr;
         plc4c_return_code result;
 };
 
@@ -82,63 +248,117 @@ class MexFunction : public matlab::mex::Function {
 void MexFunction::status()
 {
     std::cout << connected << std::endl;
+    if (virtualPlc) {
+        std::cout << "virtual PLC " << virtualPlc->name << std::endl;
+    } else if (broker) {
+        std::cout << "broker " << broker->name << " " << broker->requests
+            << " requests " << broker->failures << " failed" << std::endl;
+    } else if (replay) {
+        std::cout << "replay row " << replay->row + 1 << " of " 
+            << replay->rows << std::endl;
+    } else if (connected) {
+        std::lock_guard<std::mutex> guard(link->lock);
+        std::cout << linkStateName(link->state) << " " << link->error 
+            << std::endl;
+    }
+    if (cache.ttl > 0)
+        std::cout << "cache " << cache.entries.size() << " entries for "
+            << cache.ttl << " s, " << cache.hits << " hits " << cache.misses
+            << " misses" << std::endl;
+    if (subscription) {
+        std::lock_guard<std::mutex> guard(subscription->lock);
+        std::cout << "subscribed to " << subscription->items.size() 
+            << " addresses, " << subscription->polls << " polls " 
+            << subscription->notifications << " changes " 
+            << subscription->dropped << " dropped" << std::endl;
+        for (auto &item : subscription->items)
+            std::cout << "  " << item.area.address << " every " 
+                << item.interval << " s" << std::endl;
+    }
     std::cout << connStr << std::endl;
+    LinkRegistry::instance().forEach([](PlcLink &l) {
+        std::lock_guard<std::mutex> guard(l.lock);
+        std::cout << l.key << " " << linkStateName(l.state) << " refs "
+            << l.refs << std::endl;
+    });
 }
 
 void MexFunction::disconnect()
 {
     ASSERT(connected, "must be connected to disconnect");
+    stopAsync();
+    stopPlayback();
+    imageStop(poller);
+    poller = nullptr;
+    subStop(subscription);
+    subscription = nullptr;
+    replayClose(replay);
+    replay = nullptr;
+    virtualPlc = nullptr;
+    brokerClose(broker);
+    broker = nullptr;
+    cache = ReadCache();
+    harvests.clear();
 
-    result = plc4c_connection_disconnect(connection);
-    ASSERT(result == OK,"plc4c_connection_disconnect failed");
-
-    while (1) {
-        plc4c_system_loop(system);
-        if (!plc4c_connection_get_connected(connection))
-            break;
-        else if (plc4c_connection_has_error(connection))
-            ASSERT(false, "plc4c_connection_has_error");
-    }
+    // the link stays open in the registry until its idle timeout expires
+    LinkRegistry::instance().release(link);
+    link = nullptr;
     connected = false;
-    std::cout << "Disconencted!" << std::endl;
-
-    plc4c_system_remove_connection(system, connection);
-    plc4c_connection_destroy(connection);
-    plc4c_system_shutdown(system);
-    plc4c_system_destroy(system);
+    LOG(LOG_INFO, "disconnected");
 }
 
 void MexFunction::connect(ArgumentList inputs)
 {
-    DISP("Connecting");
     ASSERT(!connected, "must be disconnected to connected");
+    ASSERT(!poller, "stop serving the image before connecting again");
     if (inputs.size() == 2)
         strcpy(connStr, ((CharArray)inputs[1]).toAscii().c_str());
     else
         strcpy(connStr ,"s7:tcp://0.0.0.0:102");
     
-    result = plc4c_system_create(&system);
-    ASSERT(result == OK, "plc4c_system_create failed");
-    plc4c_driver *s7_driver = plc4c_driver_s7_create();
-    result = plc4c_system_add_driver(system, s7_driver);
-    ASSERT(result == OK, "plc4c_system_add_driver failed");
-    plc4c_transport *tcp_transport = plc4c_transport_tcp_create();
-    result = plc4c_system_add_transport(system, tcp_transport);
-    ASSERT(result == OK, "plc4c_system_add_transport failed");
-    result = plc4c_system_init(system);
-    ASSERT(result == OK, "plc4c_system_init failed");
-    result = plc4c_system_connect(system, connStr, &connection);
-    ASSERT(result == OK, "plc4c_system_connect failed");
+    // a tagdb option opens the tag database used to resolve symbols
+    std::string err, key;
+    LinkOptionMap opts;
+    linkSplitOptions(connStr, key, opts);
+    if (opts.count("tagdb")) {
+        tags = tagdbOpen(opts["tagdb"].c_str(), err);
+        ASSERT(tags != nullptr, err);
+    }
+    // a cache option serves repeated reads for that many seconds
+    cache = ReadCache();
+    ASSERT(linkOptionSeconds(opts, "cache", &cache.ttl, err), err);
 
-    while (1) {
-        plc4c_system_loop(system);
-        if (plc4c_connection_get_connected(connection))
-            break;
-        else if (plc4c_connection_has_error(connection))
-            return;
+    // a sim://<name> connection transfers to a virtual PLC in shared memory
+    if (virtualIsScheme(connStr)) {
+        virtualPlc = virtualAttach(key.substr(strlen(VIRTUAL_SCHEME)), err);
+        ASSERT(virtualPlc != nullptr, err);
+        connected = true;
+        return;
+    }
+
+    // a broker://<name> connection shares the link of a broker process
+    if (brokerIsScheme(connStr)) {
+        double timeout = LINK_DEFAULT_IO_TIMEOUT;
+        ASSERT(linkOptionSeconds(opts, "io-timeout", &timeout, err), err);
+        broker = brokerConnect(key.substr(strlen(BROKER_SCHEME)), timeout, err);
+        ASSERT(broker != nullptr, err);
+        connected = true;
+        return;
     }
-    DISP("connected");
+
+    // a replay://<file> connection serves reads from a recording
+    if (replayIsScheme(connStr)) {
+        replay = replayOpen(key.substr(strlen(REPLAY_SCHEME)), err);
+        ASSERT(replay != nullptr, err);
+        connected = true;
+        return;
+    }
+
+    // the handshake runs on the link thread, read & write wait for it
+    link = LinkRegistry::instance().acquire(connStr, err);
+    ASSERT(link != nullptr, err);
     connected = true;
+    LOG(LOG_INFO, "connecting to <%s>", key.c_str());
 }
 
 
@@ -210,13 +430,22 @@ StructArray MexFunction::formatWriteArgs(ArgumentList inputs)
         }
         case ArrayType::CHAR:
         case ArrayType::MATLAB_STRING: {
+            ASSERT(inputs.size() % 2 == 1, "addresses and values must pair");
             for (int i = 1 ; i < inputs.size(); i += 2) {
                 if (!isWordType(inputs[i].getType()))
                     ERROR("must be strings or chars");
                 if (!isValueType(inputs[i+1].getType()))
                     ERROR("must be value type array");
             }
-            break;
+            StructArray sa = factory.createStructArray({1,
+             (inputs.size() - (size_t)1) / 2}, {"name", "address", "value"});
+            for (idx = 1; idx < inputs.size(); idx += 2) {
+                CharArray addr = inputs[idx];
+                sa[idx / 2]["address"] = addr;
+                sa[idx / 2]["name"] = factory.createCharArray("HelloWorld");
+                sa[idx / 2]["value"] = inputs[idx + 1];
+            }
+            return sa;
         }
         default:
             ASSERT(1, "Input format/types incorrect");
@@ -275,8 +504,8 @@ StructArray MexFunction::formatReadArgs(ArgumentList inputs)
              {"name", "address", "value"});
             for (idx = 1; idx < inputs.size(); idx++) {
                 CharArray addr = inputs[idx];
-                sa[idx]["address"] = addr;
-                sa[idx]["name"] = factory.createCharArray("HelloWorld");
+                sa[idx - 1]["address"] = addr;
+                sa[idx - 1]["name"] = factory.createCharArray("HelloWorld");
             }
             return sa;
         }
@@ -285,378 +514,2142 @@ StructArray MexFunction::formatReadArgs(ArgumentList inputs)
     }
 }
 
-plc4c_data* MexFunction::encodeWriteData(StructArray data, size_t idx)
+// Function: mexTypeOf ===================================================
+// Abstract: PlcType of a numeric or logical MATLAB class, false for any
+// other class
+static bool mexTypeOf(ArrayType cls, PlcType *type)
 {
-    
-    Array addr = data[idx]["address"];
-    Array values = data[idx]["value"];
-    size_t nElem = values.getNumberOfElements();
-    size_t i;
-
-    switch (ArrayType::SINGLE) {
-        
-        case ArrayType::DOUBLE:{
-            if (nElem > 1) {
-                float vs[nElem];
-                for (i = 0 ; i < nElem ; i++)
-                    vs[i] = values[i];
-                return (plc4c_data_create_float_array(vs, nElem));
-            } else {
-                return (plc4c_data_create_float_data(values[0]));
-            }
-        }
-
-        case ArrayType::SINGLE:{
-            if (nElem > 1) {
-                float vs[nElem];
-                for (i = 0 ; i < nElem ; i++)
-                    vs[i] = values[i];
-                return (plc4c_data_create_float_array(vs, nElem));
-            } else {
-                return (plc4c_data_create_float_data(values[0]));
-            }
-        }
-
-        case ArrayType::INT8:{
-            if (nElem > 1) {
-                int8_t vs[nElem];
-                for (i = 0 ; i < nElem ; i++)
-                    vs[i] = values[i];
-                return (plc4c_data_create_int8_t_array(vs, nElem));
-            } else {
-                return (plc4c_data_create_int8_t_data(values[0]));
-            }
-        }
-
-        case ArrayType::UINT8:{
-            if (nElem > 1) {
-                uint8_t vs[nElem];
-                for (i = 0 ; i < nElem ; i++)
-                    vs[i] = values[i];
-                return (plc4c_data_create_uint8_t_array(vs, nElem));
-            } else {
-                return (plc4c_data_create_uint8_t_data(values[0]));
-            }
-        }
-
-        case ArrayType::INT16:{
-            if (nElem > 1) {
-                int16_t vs[nElem];
-                for (i = 0 ; i < nElem ; i++)
-                    vs[i] = values[i];
-                return (plc4c_data_create_int16_t_array(vs, nElem));
-            } else {
-                return (plc4c_data_create_int16_t_data(values[0]));
-            }
-        }
-        case ArrayType::UINT16:{
-            if (nElem > 1) {
-                uint16_t vs[nElem];
-                for (i = 0 ; i < nElem ; i++)
-                    vs[i] = values[i];
-                return (plc4c_data_create_uint16_t_array(vs, nElem));
-            } else {
-                return (plc4c_data_create_uint16_t_data(values[0]));
-            }
-        }
-        case ArrayType::INT32:{
-            if (nElem > 1) {
-                int32_t vs[nElem];
-                for (i = 0 ; i < nElem ; i++)
-                    vs[i] = values[i];
-                return (plc4c_data_create_int32_t_array(vs, nElem));
-            } else {
-                return (plc4c_data_create_int32_t_data(values[0]));
-            }
-        }
-        case ArrayType::UINT32:{
-            if (nElem > 1) {
-                uint32_t vs[nElem];
-                for (i = 0 ; i < nElem ; i++)
-                    vs[i] = values[i];
-                return (plc4c_data_create_uint32_t_array(vs, nElem));
-            } else {
-                return (plc4c_data_create_uint32_t_data(values[0]));
-            }
-        }
-        case ArrayType::INT64:{
-            if (nElem > 1) {
-                int64_t vs[nElem];
-                for (i = 0 ; i < nElem ; i++)
-                    vs[i] = values[i];
-                return (plc4c_data_create_int64_t_array(vs, nElem));
-            } else {
-                return (plc4c_data_create_int64_t_data(values[0]));
-            }
-        }
-        case ArrayType::UINT64:{
-            if (nElem > 1) {
-                uint64_t vs[nElem];
-                for (i = 0 ; i < nElem ; i++)
-                    vs[i] = values[i];
-                return (plc4c_data_create_uint64_t_array(vs, nElem));
-            } else {
-                return (plc4c_data_create_uint64_t_data(values[0]));
-            }
-        }
-        case ArrayType::LOGICAL:{
-            if (nElem > 1) {
-                bool vs[nElem];
-                for (i = 0 ; i < nElem ; i++)
-                    vs[i] = values[i];
-                return (plc4c_data_create_bool_data_array(vs, nElem));
-            } else {
-                return (plc4c_data_create_bool_data(values[0]));
-            }
-        }
-        default:
-            return nullptr;
+    switch (cls) {
+        case ArrayType::LOGICAL: *type = TYPE_BOOL; return true;
+        case ArrayType::INT8: *type = TYPE_INT8; return true;
+        case ArrayType::UINT8: *type = TYPE_UINT8; return true;
+        case ArrayType::INT16: *type = TYPE_INT16; return true;
+        case ArrayType::UINT16: *type = TYPE_UINT16; return true;
+        case ArrayType::INT32: *type = TYPE_INT32; return true;
+        case ArrayType::UINT32: *type = TYPE_UINT32; return true;
+        case ArrayType::INT64: *type = TYPE_INT64; return true;
+        case ArrayType::UINT64: *type = TYPE_UINT64; return true;
+        case ArrayType::SINGLE: *type = TYPE_FLOAT; return true;
+        case ArrayType::DOUBLE: *type = TYPE_DOUBLE; return true;
+        default: return false;
     }
 }
 
-
-Array MexFunction::decodeReadData(plc4c_data* responce)
+// Function: arrayCopy ====================================================
+// Abstract: Convert the elements of a MATLAB array of class S into dst
+template <typename S, typename T>
+static void arrayCopy(const TypedArray<S> &typed, T *dst)
 {
-    
-    
-    ArrayFactory factory;
-    size_t bytes;
-    
-    switch (responce->data_type) {
-        /*case PLC4C_BOOL: {
-            TypedArray<bool> b = factory.createArray(responce_data->size);
-            return (b);
-        }
-
-        case PLC4C_CHAR: {
-            return (nullptr);
-        }
-
-        case PLC4C_UCHAR: {
-            return (nullptr);
-        }
-
-        case PLC4C_SHORT: {
-            return (nullptr);
-        }
-
-        case PLC4C_USHORT: {
-            return (nullptr);
-        }
-
-        case PLC4C_INT: {
-            return (nullptr);
-        }
+    size_t idx = 0;
+    for (auto v : typed)
+        dst[idx++] = (T) v;
+}
 
-        case PLC4C_UINT: {
-            return (nullptr);
+// Kernel ArrayCopy =======================================================
+// Elements of a numeric or logical MATLAB array as T, false for any other
+// class. dst holds one T per element.
+template <typename T>
+struct ArrayCopy {
+    static bool run(Array value, void *dst) {
+        T *out = (T*) dst;
+        switch (value.getType()) {
+            case ArrayType::LOGICAL: arrayCopy<bool, T>(value, out); return true;
+            case ArrayType::INT8: arrayCopy<int8_t, T>(value, out); return true;
+            case ArrayType::UINT8: arrayCopy<uint8_t, T>(value, out); return true;
+            case ArrayType::INT16: arrayCopy<int16_t, T>(value, out); return true;
+            case ArrayType::UINT16: arrayCopy<uint16_t, T>(value, out); return true;
+            case ArrayType::INT32: arrayCopy<int32_t, T>(value, out); return true;
+            case ArrayType::UINT32: arrayCopy<uint32_t, T>(value, out); return true;
+            case ArrayType::INT64: arrayCopy<int64_t, T>(value, out); return true;
+            case ArrayType::UINT64: arrayCopy<uint64_t, T>(value, out); return true;
+            case ArrayType::SINGLE: arrayCopy<float, T>(value, out); return true;
+            case ArrayType::DOUBLE: arrayCopy<double, T>(value, out); return true;
+            default: return false;
         }
+    }
+};
 
-        case PLC4C_LINT: {
-            return (nullptr);
-        }
+// Kernel ArrayOf =========================================================
+// 1 x count MATLAB array of count host native values of T
+template <typename T>
+struct ArrayOf {
+    static Array run(ArrayFactory *factory, const void *src, size_t count) {
+        const T *values = (const T*) src;
+        return factory->createArray<T>({1, count}, values, values + count);
+    }
+};
 
-        case PLC4C_ULINT: {
-            return (nullptr);
-        }
-*/
-        case PLC4C_FLOAT: {
-            std::cout << responce->size;
-            TypedArray<float> a = factory.createArray<float>({1,1},
-                &(responce->data.float_value), ((&(responce->data.float_value))+8) );
-            return (a);
+// Kernel WireArrayOf =====================================================
+// 1 x count MATLAB array of count big endian values of T, as in S7 memory
+template <typename T>
+struct WireArrayOf {
+    static Array run(ArrayFactory *factory, const uint8_t *src, size_t count) {
+        buffer_ptr_t<T> buf = factory->createBuffer<T>(count);
+        TypeUnpack<T>::run(src, (void*) buf.get(), count);
+        return factory->createArrayFromBuffer<T>({1, count}, std::move(buf));
+    }
+};
 
-        }
-/*
-        case PLC4C_DOUBLE: {
-            return (nullptr);
-        }
+plc4c_data* MexFunction::encodeWriteData(const std::string &address,
+    Array value)
+{
+    // Encode a value in the type of its address, eg. INT or LREAL, values
+    // for addresses of no known type go in their MATLAB class
+    size_t nElem = value.getNumberOfElements();
+    uint32_t size, count;
+    PlcType type;
 
-        case PLC4C_STRING_POINTER: {
-            return (nullptr);
-        }
+    if (typeOfAddress(address, &type, &size, &count)) {
+        ASSERT(nElem == count, "<" + address + "> needs " +
+            std::to_string(count) + " values");
+    } else {
+        ASSERT(mexTypeOf(value.getType(), &type), 
+            "value for <" + address + "> must be numeric or logical");
+        typeS7Name(type, &size);
+    }
+    ASSERT(nElem > 0, "value for <" + address + "> is empty");
 
-        case PLC4C_CONSTANT_STRING: {
-            return (nullptr);
-        }
+    std::unique_ptr<uint8_t[]> buf(new uint8_t[size * nElem]);
+    bool copied = typeDispatch<ArrayCopy, bool>(type, value, (void*) buf.get());
+    ASSERT(copied, "value for <" + address + "> must be numeric or logical");
+    return typeDispatch<TypeEncode, plc4c_data*>(type, (const void*) buf.get(),
+        nElem);
+}
 
-        case PLC4C_VOID_POINTER: {
-            return (nullptr);
-        }
-        */
-        case PLC4C_LIST: {
-            plc4c_list_element* list_item;
-            plc4c_data* listdata;
-            size_t x = 0;
-            size_t nList;
-            plc4c_data_type type;
-            bool homogenous = true;
+// Function: flagsOf ======================================================
+// Abstract: Flags of a logical or numeric MATLAB array, false if it is
+// neither
+static bool flagsOf(Array value, std::vector<uint8_t> &flags)
+{
+    flags.resize(value.getNumberOfElements());
+    return ArrayCopy<bool>::run(value, flags.data());
+}
 
-            list_item = plc4c_utils_list_tail(&responce->data.list_value);
-            nList = plc4c_utils_list_size(&responce->data.list_value);
+// Function: typedArray ===================================================
+// Abstract: 1 x N MATLAB array of a read of an address of known type, at
+// most count values
+static Array typedArray(ArrayFactory &factory, PlcType type, uint32_t size,
+    uint32_t count, plc4c_data *data)
+{
+    std::unique_ptr<uint8_t[]> buf(new uint8_t[size * count]);
+    size_t n = typeDispatch<TypeDecode, size_t>(type, data, (void*) buf.get(),
+        (size_t) count);
+    return typeDispatch<ArrayOf, Array>(type, &factory, (const void*) buf.get(),
+        n);
+}
 
-            listdata = (plc4c_data*)(list_item->value);
-            type = listdata->data_type;
+// Function: flagsArray ===================================================
+// Abstract: 1 x count logical array of a packed BOOL read
+static Array flagsArray(ArrayFactory &factory, const BitsRange &range,
+    plc4c_data *data)
+{
+    std::vector<uint8_t> bytes;
+    bitsBytesOf(data, bytes);
+    bytes.resize(std::max<size_t>(bytes.size(), bitsByteCount(&range)), 0);
+    buffer_ptr_t<bool> flags = factory.createBuffer<bool>(range.count);
+    bitsUnpack(bytes.data(), range.bit, range.count, flags.get());
+    return factory.createArrayFromBuffer<bool>({1, range.count}, 
+        std::move(flags));
+}
 
-            do {
-                if (!list_item)
-                    break;
-                listdata = (plc4c_data*)(list_item->value);
-                if (type != listdata->data_type) {
-                    homogenous = false;
-                    break;
-                }
-                list_item = list_item->next;
-                x++;
-            } while (x < nList);
-
-            list_item = plc4c_utils_list_tail(&responce->data.list_value);
-            x = 0;
-            if (!homogenous) {
-                float nl[nList];
-                do {
-                    listdata = (plc4c_data*)(list_item->value);
-                    std::cout << "adding to nl " << listdata->data.float_value << std::endl;
-                    nl[x++] = listdata->data.float_value;
-                    list_item = list_item->next;
-                } while (x < nList);
-                TypedArray<float> a = factory.createArray<float>({1,nList}, &nl[0], &nl[nList]);
-                return (a);
-            } else {
-                TypedArray<float> ca  = factory.createArray<float>({1,nList});
-                float nl[nList];
-                do {
-                    listdata = (plc4c_data*)(list_item->value);
-                    std::cout << "adding to nl " << listdata->data.float_value << std::endl;
-                    nl[x] = listdata->data.float_value;
-                    list_item = list_item->next;
-                    //ca[0][x] = factory.createScalar<float>(nl[x]);
-                    ca[0][x] = nl[x];
-                    x++;
-                } while (x < nList);
-                return (ca);
-            }
-        }
-        
-/*
-        case PLC4C_STRUC: {
-            return (nullptr);
-        }
-*/
-        default:
-            return factory.createArray<bool>({1,1});
+// Function: plc4cTypeOf ==================================================
+// Abstract: PlcType of the values of a (possibly list) plc4c data item,
+// double for a list of mixed types. False if it holds anything but numbers.
+static bool plc4cTypeOf(plc4c_data *data, PlcType *type)
+{
+    if (data->data_type != PLC4C_LIST)
+        return typeOfData(data, type);
+    plc4c_list_element *item = plc4c_utils_list_tail(&data->data.list_value);
+    PlcType other;
+    if (!item || !typeOfData((plc4c_data*) item->value, type))
+        return false;
+    for (item = item->next; item; item = item->next) {
+        if (!typeOfData((plc4c_data*) item->value, &other))
+            return false;
+        if (other != *type)
+            *type = TYPE_DOUBLE;
     }
+    return true;
 }
 
+Array MexFunction::decodeReadData(plc4c_data* responce)
+{
+    // Read of an address of no known type as a 1 x N row of the type the
+    // driver returned, values that are not numbers read as empty
+    ArrayFactory factory;
+    uint32_t size;
+    PlcType type;
+
+    if (!plc4cTypeOf(responce, &type))
+        return factory.createArray<double>({0,0});
+    typeS7Name(type, &size);
+    uint32_t count = responce->data_type == PLC4C_LIST ?
+        (uint32_t) plc4c_utils_list_size(&responce->data.list_value) : 1;
+    return typedArray(factory, type, size, count, responce);
+}
 
-void MexFunction::write(ArgumentList inputs)
+void MexFunction::write(ArgumentList inputs, ArgumentList outputs)
 {
     // Locals
     plc4c_write_request *request;
     plc4c_write_request_execution *execution;
     plc4c_write_response *response;
     plc4c_data *data;
+    ArrayFactory factory;
+    std::string err;
     size_t idx;
+    bool done;
 
     // Parse the input arguments
     ASSERT(connected, "must be connected to write");
     StructArray writes = formatWriteArgs(inputs);
+    if (virtualPlc) {
+        virtualWrites(writes, outputs);
+        return;
+    }
+    if (broker) {
+        brokerWrites(writes, outputs);
+        return;
+    }
+    if (replay) {
+        // a replay has no PLC, writes are accepted and discarded
+        if (outputs.size() > 0)
+            outputs[0] = factory.createScalar<bool>(true);
+        return;
+    }
+    ASSERT(linkWaitReady(link, err) != LINK_FAILED, err);
+    std::lock_guard<std::mutex> guard(link->lock);
+    if (outputs.size() > 0)
+        outputs[0] = factory.createScalar<bool>(false);
+    if (link->state != LINK_CONNECTED) {
+        WARNING("write dropped, connection is " + 
+            std::string(linkStateName(link->state)));
+        return;
+    }
 
     // Setup the write request
-    result = plc4c_connection_create_write_request(connection, &request);
+    result = plc4c_connection_create_write_request(link->connection, &request);
     ASSERT(result == OK,"plc4c_connection_create_write_request failed");
     for (idx = 0; idx < writes.getNumberOfElements(); idx++) {
-        data = encodeWriteData(writes, idx);
-        ASSERT(data !=  nullptr, "encodeWriteData failed");
         CharArray addr = writes[idx]["address"];
+        std::string address = resolve(addr.toAscii());
+        BitsRange range;
+        if (bitsParse(address.c_str(), &range)) {
+            // BOOL ranges go as packed bytes and the bits of partial bytes
+            std::vector<uint8_t> flags;
+            std::vector<BitsItem> items;
+            ASSERT(flagsOf(writes[idx]["value"], flags), 
+                "value for <" + address + "> must be logical or numeric");
+            ASSERT(flags.size() == range.count, "<" + address + "> needs " +
+                std::to_string(range.count) + " values");
+            bitsWriteItems(&range, (const bool*) flags.data(), items);
+            for (auto &item : items) {
+                result = plc4c_write_request_add_item(request,
+                    (char*) item.address.c_str(), item.data);
+                ASSERT(result == OK,"plc4c_write_request_add_item failed");
+            }
+            continue;
+        }
+        data = encodeWriteData(address, writes[idx]["value"]);
         result = plc4c_write_request_add_item(request,
-            (char*) addr.toAscii().c_str(), data);
+            (char*) address.c_str(), data);
         ASSERT(result == OK,"plc4c_write_request_add_item failed");
     }
     result = plc4c_write_request_execute(request, &execution);
     ASSERT(result == OK,"plc4c_write_request_execute failed");
     
-    // Perform the write
-    while(1) {
-        result = plc4c_system_loop(system);
-        ASSERT(result == OK, "plc4c_system_loop failed");
-        if (plc4c_write_request_execution_check_completed_with_error(execution)) 
-            ERROR("write execution failed");
-        else if (plc4c_write_request_check_finished_successfully(execution)) 
-            break;
+    // Perform the write, a lost connection is reconnected in the background
+    done = linkLoopUntil(link,
+        [&] { return plc4c_write_request_check_finished_successfully(execution); },
+        [&] { return plc4c_write_request_execution_check_completed_with_error(execution); },
+        "write");
+    if (done) {
+        response = plc4c_write_request_execution_get_response(execution);
+        ASSERT(response != NULL, "plc4c_write_request_execution_get_response failed");
+        plc4c_write_destroy_write_response(response);
     }
-    response = plc4c_write_request_execution_get_response(execution);
-    ASSERT(response != NULL, "plc4c_write_request_execution_get_response failed");
 
     // Clean up
-    plc4c_write_destroy_write_response(response);
     plc4c_write_request_execution_destroy(execution);
     plc4c_write_request_destroy(request);
 
+    for (idx = 0; idx < writes.getNumberOfElements(); idx++) {
+        CharArray addr = writes[idx]["address"];
+        cacheWrite(resolve(addr.toAscii()), writes[idx]["value"], done);
+    }
+    if (!done) {
+        WARNING("write dropped, " + link->error);
+        ASSERT(link->state != LINK_FAILED, link->error);
+    }
+    if (outputs.size() > 0)
+        outputs[0] = factory.createScalar<bool>(done);
 }
 
-void MexFunction::read(ArgumentList inputs, ArgumentList outputs)
+void MexFunction::holdReadValues(StructArray &reads)
 {
-    // Locals
+    // Serve the last good value of each address while the link is down,
+    // addresses never read successfully get an empty value
+    ArrayFactory factory;
+    size_t idx;
+
+    for (idx = 0 ; idx < reads.getNumberOfElements() ; idx++) {
+        CharArray addr = reads[idx]["address"];
+        auto found = lastGood.find(resolve(addr.toAscii()));
+        if (found != lastGood.end())
+            reads[idx]["value"] = found->second;
+        else
+            reads[idx]["value"] = factory.createArray<double>({0,0});
+    }
+}
+
+bool MexFunction::cacheLookup(StructArray &reads,
+    const std::vector<std::string> &addrs)
+{
+    // Fill reads from the cache if every address was read or written within
+    // its time to live, the read then costs no request. A read needing
+    // any address from the PLC goes out whole and counts as a miss.
+    LinkClock::time_point now = LinkClock::now();
+    size_t idx;
+
+    if (!(cache.ttl > 0))
+        return false;
+    cachePlayback();
+    for (idx = 0; idx < addrs.size(); idx++) {
+        auto found = cache.entries.find(addrs[idx]);
+        if ((found == cache.entries.end()) ||
+                (now - found->second.stamp >= linkSeconds(cache.ttl))) {
+            cache.misses++;
+            return false;
+        }
+    }
+    for (idx = 0; idx < addrs.size(); idx++)
+        reads[idx]["value"] = cache.entries[addrs[idx]].value;
+    cache.hits++;
+    return true;
+}
+
+void MexFunction::cacheStore(const std::string &address, Array value)
+{
+    // Keep a value just read from the PLC
+    std::string err;
+
+    if (!(cache.ttl > 0))
+        return;
+    CacheEntry &entry = cache.entries[address];
+    entry.value = value;
+    entry.stamp = LinkClock::now();
+    entry.spanned = virtualParse(address, &entry.span, err);
+}
+
+void MexFunction::cacheWrite(const std::string &address, Array value,
+    bool done)
+{
+    // Keep the cache coherent with a write of value to address: entries
+    // overlapping it (all of them if its bytes are unknown) are dropped,
+    // then a written value of known type is kept as a read would return it
+    ArrayFactory factory;
+    VirtualItem span;
+    std::string err;
+
+    if (!(cache.ttl > 0))
+        return;
+    bool spanned = virtualParse(address, &span, err);
+    uint64_t end = span.type == TYPE_BOOL ?
+        span.byte + (span.bit + span.count + 7) / 8 :
+        span.byte + (uint64_t) span.size * span.count;
+    for (auto it = cache.entries.begin(); it != cache.entries.end(); ) {
+        const VirtualItem *other = &it->second.span;
+        uint64_t otherEnd = other->type == TYPE_BOOL ?
+            other->byte + (other->bit + other->count + 7) / 8 :
+            other->byte + (uint64_t) other->size * other->count;
+        bool overlaps = !spanned || !it->second.spanned ||
+            ((other->area == span.area) && (other->byte < end) &&
+            (span.byte < otherEnd));
+        if (overlaps) {
+            it = cache.entries.erase(it);
+            cache.dropped++;
+        } else {
+            ++it;
+        }
+    }
+    if (!done || !spanned || (value.getNumberOfElements() != span.count))
+        return;
+    std::unique_ptr<uint8_t[]> buf(new uint8_t[span.size * span.count]);
+    if (!typeDispatch<ArrayCopy, bool>(span.type, value, (void*) buf.get()))
+        return;
+    CacheEntry &entry = cache.entries[address];
+    entry.value = typeDispatch<ArrayOf, Array>(span.type, &factory,
+        (const void*) buf.get(), (size_t) span.count);
+    entry.stamp = LinkClock::now();
+    entry.span = span;
+    entry.spanned = true;
+}
+
+void MexFunction::cachePlayback()
+{
+    // Addresses written by a playback change behind the cache: their
+    // entries are dropped while it runs and once more after it ended
+    if (!player || player->uncached)
+        return;
+    bool ended = !player->running;
+    for (auto &tag : player->tags)
+        cacheWrite(tag.address, Array(), false);
+    player->uncached = ended;
+}
+
+void MexFunction::cacheOp(ArgumentList inputs, ArgumentList outputs)
+{
+    // st = plc4mex('cache')            statistics of the read cache
+    // plc4mex('cache', 'clear')        drop every entry
+    ArrayFactory factory;
+
+    if (inputs.size() > 1) {
+        ASSERT(isWordType(inputs[1].getType()) &&
+            (((CharArray) inputs[1]).toAscii() == "clear"),
+            "cache takes no argument or 'clear'");
+        cache.entries.clear();
+        return;
+    }
+    size_t reads = cache.hits + cache.misses;
+    StructArray st = factory.createStructArray({1, 1}, {"ttl", "entries",
+        "hits", "misses", "hitRate", "dropped"});
+    st[0]["ttl"] = factory.createScalar<double>(cache.ttl);
+    st[0]["entries"] = factory.createScalar<double>((double) cache.entries.size());
+    st[0]["hits"] = factory.createScalar<double>((double) cache.hits);
+    st[0]["misses"] = factory.createScalar<double>((double) cache.misses);
+    st[0]["hitRate"] = factory.createScalar<double>(reads ?
+        (double) cache.hits / reads : 0);
+    st[0]["dropped"] = factory.createScalar<double>((double) cache.dropped);
+    outputs[0] = st;
+}
+
+template <typename F>
+bool MexFunction::execRead(const std::vector<std::string> &names,
+    const std::vector<std::string> &addrs, F consume)
+{
+    // Run one read request on the connected link (lock held) and hand the
+    // response to consume. Returns false if the link faulted.
     plc4c_read_request *request;
     plc4c_read_request_execution *execution;
     plc4c_read_response *response;
+    size_t idx;
+    bool done;
+
+    result = plc4c_connection_create_read_request(link->connection, &request);
+    ASSERT(result == OK, "plc4c_connection_create_read_request failed");
+    for (idx = 0 ; idx < addrs.size() ; idx++) {
+        result = plc4c_read_request_add_item(request, 
+            (char*) names[idx].c_str(), (char*) addrs[idx].c_str());
+        ASSERT(result == OK, "plc4c_read_request_add_item failed");
+    }
+    result = plc4c_read_request_execute(request, &execution);
+    ASSERT(result == OK, "plc4c_read_request_execute failed");
+
+    // Perform the read, a lost connection is reconnected in the background
+    done = linkLoopUntil(link,
+        [&] { return plc4c_read_request_execution_check_finished_successfully(execution); },
+        [&] { return plc4c_read_request_execution_check_finished_with_error(execution); },
+        "read");
+    if (done) {
+        response = plc4c_read_request_execution_get_response(execution);
+        ASSERT(response != NULL, "plc4c_read_request_execution_get_response failed");
+        consume(response);
+        plc4c_read_destroy_read_response(response);
+    }
+
+    // Clean up
+    plc4c_read_request_execution_destroy(execution);
+    plc4c_read_request_destroy(request);
+
+    if (!done)
+        ASSERT(link->state != LINK_FAILED, link->error);
+    return done;
+}
+
+void MexFunction::read(ArgumentList inputs, ArgumentList outputs)
+{
+    // Locals
     plc4c_list_element *responce_list;
     plc4c_response_value_item *responce_value;
     ArrayFactory factory;
+    std::vector<std::string> names, addrs, fetch;
+    std::vector<BitsRange> ranges;
+    std::vector<bool> packed, typed;
+    std::vector<PlcType> types;
+    std::vector<uint32_t> sizes, counts;
+    std::string err;
     size_t idx;
+    bool done = false;
 
-    // Parse the input arguments
+    // Parse the input arguments, BOOL ranges are fetched as packed bytes
+    // and addresses of known type decoded in that type
     ASSERT(connected, "must be connected to read");
     StructArray reads = formatReadArgs(inputs);
-
-    // Setup the read request
-    result = plc4c_connection_create_read_request(connection, &request);
-    ASSERT(result == OK, "plc4c_connection_create_read_request failed");
+    ranges.resize(reads.getNumberOfElements());
+    types.resize(ranges.size());
+    sizes.resize(ranges.size());
+    counts.resize(ranges.size());
     for (idx = 0 ; idx < reads.getNumberOfElements() ; idx++) {
         CharArray addr = reads[idx]["address"];
         CharArray name = reads[idx]["name"];
-        result = plc4c_read_request_add_item(request, 
-            (char*) name.toAscii().c_str(), (char*) addr.toAscii().c_str());
+        addrs.push_back(resolve(addr.toAscii()));
+        names.push_back(name.toAscii());
+        packed.push_back(bitsParse(addrs[idx].c_str(), &ranges[idx]));
+        typed.push_back(typeOfAddress(addrs[idx], &types[idx], &sizes[idx],
+            &counts[idx]));
+        fetch.push_back(packed[idx] ? bitsReadAddress(&ranges[idx]) : addrs[idx]);
     }
-    result = plc4c_read_request_execute(request, &execution);
-    ASSERT(result == OK, "plc4c_read_request_execute failed");
-
-    // Perform the read
-    while (1) {
-        result = plc4c_system_loop(system);
-        ASSERT(result == OK,"plc4c_system_loop failed");
-        if (plc4c_read_request_execution_check_finished_successfully(execution))
-            break;
-        else if (plc4c_read_request_execution_check_finished_with_error(execution))
-            ERROR("read execution failed");
+    if (!virtualPlc && !replay && cacheLookup(reads, addrs)) {
+        outputs[0] = reads;
+        if (outputs.size() > 1)
+            outputs[1] = factory.createScalar<bool>(false);
+        return;
     }
-    response = plc4c_read_request_execution_get_response(execution);
-    ASSERT(response != NULL, "plc4c_read_request_execution_get_response failed");
-    
-    // Assign read results to outputs
-    responce_list = plc4c_utils_list_tail(response->items);
-    idx = 0;
-    while (responce_list != NULL) {
-        responce_value = (plc4c_response_value_item *) responce_list->value;
-        responce_list = responce_list->next;
-        reads[idx]["value"] = decodeReadData(responce_value->value);
-        DISP("decoded");
-        idx++;
+    if (virtualPlc) {
+        virtualReads(reads, outputs);
+        return;
+    }
+    if (broker) {
+        brokerReads(reads, outputs);
+        return;
+    }
+    if (replay) {
+        replayRead(reads, outputs);
+        return;
+    }
+    ASSERT(linkWaitReady(link, err) != LINK_FAILED, err);
+    std::lock_guard<std::mutex> guard(link->lock);
+
+    if (link->state == LINK_CONNECTED)
+        done = execRead(names, fetch, [&](plc4c_read_response *response) {
+            // Assign read results to outputs and keep them for outages
+            responce_list = plc4c_utils_list_tail(response->items);
+            idx = 0;
+            while (responce_list != NULL) {
+                responce_value = (plc4c_response_value_item *) responce_list->value;
+                responce_list = responce_list->next;
+                Array value = packed[idx] ? 
+                    flagsArray(factory, ranges[idx], responce_value->value) :
+                    typed[idx] ? typedArray(factory, types[idx], 
+                    sizes[idx], counts[idx], responce_value->value) :
+                    decodeReadData(responce_value->value);
+                lastGood[addrs[idx]] = value;
+                cacheStore(addrs[idx], value);
+                reads[idx]["value"] = value;
+                LOG(LOG_TRACE, "decoded <%s>", addrs[idx].c_str());
+                idx++;
+            }
+        });
+    if (!done) {
+        if (link->state == LINK_RECONNECTING)
+            WARNING("read values held, " + link->error);
+        holdReadValues(reads);
     }
     outputs[0] = reads;
+    if (outputs.size() > 1)
+        outputs[1] = factory.createScalar<bool>(!done);
+}
 
-    // Clean up
-    plc4c_read_destroy_read_response(response);
-    plc4c_read_request_execution_destroy(execution);
-    plc4c_read_request_destroy(request);
+std::vector<std::string> MexFunction::addressList(ArgumentList inputs, 
+    size_t first)
+{
+    // Addresses as one cell array or as separate char / string arguments
+    std::vector<std::string> addrs;
+    size_t idx;
+
+    ASSERT(inputs.size() > first, "addresses required");
+    if (inputs[first].getType() == ArrayType::CELL) {
+        for (idx = 0; idx < inputs[first].getNumberOfElements(); idx++) {
+            CharArray addr = inputs[first][idx];
+            addrs.push_back(resolve(addr.toAscii()));
+        }
+    } else {
+        for (idx = first; idx < inputs.size(); idx++) {
+            if (!isWordType(inputs[idx].getType()))
+                ERROR("must be strings or chars");
+            addrs.push_back(resolve(((CharArray) inputs[idx]).toAscii()));
+        }
+    }
+    return addrs;
+}
+
+std::string MexFunction::resolve(const std::string &addr)
+{
+    // Symbols are looked up in the tag database, % addresses pass through
+    std::string address, err;
+
+    ASSERT(tagdbResolve(tags, addr, address, err), err);
+    return address;
+}
+
+void MexFunction::tagdb(ArgumentList inputs, ArgumentList outputs)
+{
+    // plc4mex('tagdb', 'compile', table, index) builds the binary index,
+    // plc4mex('tagdb', 'open', index) selects it for symbolic addresses and
+    // plc4mex('tagdb', 'resolve', name) returns the address of a symbol
+    ArrayFactory factory;
+    std::string err;
+
+    ASSERT(inputs.size() >= 3, "tagdb needs a command and a file or name");
+    std::string cmd = ((CharArray) inputs[1]).toAscii();
+    std::string arg = ((CharArray) inputs[2]).toAscii();
+
+    if (cmd == "compile") {
+        ASSERT(inputs.size() == 4, "tagdb compile needs table and index files");
+        std::string index = ((CharArray) inputs[3]).toAscii();
+        ASSERT(tagdbCompile(arg.c_str(), index.c_str(), err), err);
+        // a session using the index resolves with the new one from now on
+        if (tags && (tags->path == index)) {
+            tags = tagdbOpen(index.c_str(), err);
+            ASSERT(tags != nullptr, err);
+        }
+    } else if (cmd == "open") {
+        TagDb *db = tagdbOpen(arg.c_str(), err);
+        ASSERT(db != nullptr, err);
+        tags = db;
+        if (outputs.size() > 0)
+            outputs[0] = factory.createScalar<double>(db->header->nTags);
+    } else if (cmd == "resolve") {
+        outputs[0] = factory.createCharArray(resolve(arg));
+    } else {
+        ERROR("tagdb command must be compile, open or resolve");
+    }
+}
+
+void MexFunction::image(ArgumentList inputs, ArgumentList outputs)
+{
+    // plc4mex('image', 'serve', name, addresses, period)
+    //   poll the addresses every period on this connection into the shared
+    //   memory image name, returns at once
+    // plc4mex('image', 'stop')
+    //   stop serving and remove the image
+    // plc4mex('image', 'status')
+    //   struct with the progress of the image served by this session
+    // [values, info] = plc4mex('image', 'read', name [, addresses])
+    //   cell of the values of all (or the given) areas of an image served by
+    //   any local process and a struct of its state, no PLC connection used
+    ArrayFactory factory;
+    std::string err;
+    size_t idx;
+
+    ASSERT(inputs.size() >= 2, "image requires a command");
+    std::string cmd = ((CharArray) inputs[1]).toAscii();
+
+    if (cmd == "serve") {
+        ASSERT(connected, "must be connected to serve an image");
+        ASSERT(link != nullptr, "an image needs a PLC connection");
+        ASSERT(!poller, "already serving an image, stop it first");
+        ASSERT(inputs.size() == 5, "image serve requires name, addresses and period");
+        ASSERT(inputs[4].getType() == ArrayType::DOUBLE, "image period must be a double");
+        std::string name = ((CharArray) inputs[2]).toAscii();
+        std::vector<std::string> addrs = addressList(inputs, 3);
+        double period = ((TypedArray<double>) inputs[4])[0];
+        ASSERT(linkWaitReady(link, err) != LINK_FAILED, err);
+        poller = imageServe(name, addrs, period, link, err);
+        ASSERT(poller != nullptr, err);
 
+    } else if (cmd == "stop") {
+        imageStop(poller);
+        poller = nullptr;
+
+    } else if (cmd == "status") {
+        StructArray st = factory.createStructArray({1,1}, {"serving", "name",
+            "areas", "polls", "failures", "overruns"});
+        st[0]["serving"] = factory.createScalar<bool>(poller != nullptr);
+        if (poller) {
+            st[0]["name"] = factory.createCharArray(poller->name);
+            st[0]["areas"] = factory.createScalar<double>(poller->header->nAreas);
+            st[0]["polls"] = factory.createScalar<double>(poller->polls);
+            st[0]["failures"] = factory.createScalar<double>(poller->failures);
+            st[0]["overruns"] = factory.createScalar<double>(poller->overruns);
+        }
+        outputs[0] = st;
+
+    } else if (cmd == "read") {
+        ASSERT((inputs.size() == 3) || (inputs.size() == 4), 
+            "image read requires a name and optional addresses");
+        std::string name = ((CharArray) inputs[2]).toAscii();
+        ImageReader *reader = images.count(name) ? images[name] : nullptr;
+        if (!reader) {
+            reader = imageAttach(name, err);
+            ASSERT(reader != nullptr, err);
+            images[name] = reader;
+        }
+        const ImageHeader *h = reader->header;
+
+        std::vector<int> areas;
+        if (inputs.size() == 4) {
+            for (auto &addr : addressList(inputs, 3)) {
+                int area = imageFind(reader, addr.c_str());
+                ASSERT(area >= 0, "image <" + name + "> has no area at <" + addr + ">");
+                areas.push_back(area);
+            }
+        } else {
+            for (idx = 0; idx < h->nAreas; idx++)
+                areas.push_back((int) idx);
+        }
+
+        std::vector<uint8_t> snap(h->dataBytes);
+        int64_t stamp;
+        uint64_t updates = imageSnapshot(reader, [&](const uint8_t *data) {
+            memcpy(snap.data(), data, snap.size());
+        }, &stamp);
+
+        CellArray values = factory.createCellArray({1, areas.size()});
+        for (idx = 0; idx < areas.size(); idx++) {
+            const ImageArea *a = &h->areas[areas[idx]];
+            const uint8_t *p = snap.data() + a->offset;
+            values[idx] = typeDispatch<ArrayOf, Array>((PlcType) a->type,
+                &factory, (const void*) p, (size_t) a->count);
+        }
+        outputs[0] = values;
+
+        if (outputs.size() > 1) {
+            struct timespec now;
+            clock_gettime(CLOCK_REALTIME, &now);
+            double age = updates ? (now.tv_sec - stamp / 1000000000LL) +
+                (now.tv_nsec - stamp % 1000000000LL) * 1e-9 : INFINITY;
+            bool live = imagePollerAlive(reader, updates);
+            StructArray info = factory.createStructArray({1,1}, {"updates",
+                "age", "state", "stale", "pid"});
+            info[0]["updates"] = factory.createScalar<double>((double) updates);
+            info[0]["age"] = factory.createScalar<double>(age);
+            info[0]["state"] = factory.createCharArray(live ? 
+                linkStateName((LinkState) h->state.load()) : "stopped");
+            info[0]["stale"] = factory.createScalar<bool>(!live || !updates ||
+                (h->state.load() != LINK_CONNECTED));
+            info[0]["pid"] = factory.createScalar<double>(h->pid);
+            outputs[1] = info;
+        }
+
+    } else {
+        ERROR("image command must be serve, stop, status or read");
+    }
+}
+
+// Function: recordArray ==================================================
+// Abstract: count x width MATLAB array of rows of a recorded column, the
+// rows are stored element after element so they are transposed
+template <typename T>
+static Array recordArray(ArrayFactory &factory, const RecordReader *r,
+    uint32_t col, uint64_t first, uint64_t count)
+{
+    uint32_t width = r->header->columns[col].width;
+    buffer_ptr_t<T> buf = factory.createBuffer<T>(count * width);
+    T *dst = buf.get();
+
+    recordSlice(r, col, first, count, [&](uint64_t done, const uint8_t *src,
+            uint64_t n) {
+        const T *rows = (const T*) src;
+        for (uint64_t row = 0; row < n; row++)
+            for (uint32_t el = 0; el < width; el++)
+                dst[done + row + el * count] = rows[row * width + el];
+    });
+    return factory.createArrayFromBuffer<T>({count, width}, std::move(buf));
+}
+
+// Function: recordColumnArray ============================================
+// Abstract: Rows of a recorded column as an array of the column's class,
+// false if the class is not known
+static bool recordColumnArray(ArrayFactory &factory, const RecordReader *r,
+    uint32_t col, uint64_t f, uint64_t n, Array &values)
+{
+    std::string type = r->header->columns[col].type;
+
+    if (type == "double") values = recordArray<double>(factory, r, col, f, n);
+    else if (type == "single") values = recordArray<float>(factory, r, col, f, n);
+    else if (type == "int8") values = recordArray<int8_t>(factory, r, col, f, n);
+    else if (type == "uint8") values = recordArray<uint8_t>(factory, r, col, f, n);
+    else if (type == "int16") values = recordArray<int16_t>(factory, r, col, f, n);
+    else if (type == "uint16") values = recordArray<uint16_t>(factory, r, col, f, n);
+    else if (type == "int32") values = recordArray<int32_t>(factory, r, col, f, n);
+    else if (type == "uint32") values = recordArray<uint32_t>(factory, r, col, f, n);
+    else if (type == "int64") values = recordArray<int64_t>(factory, r, col, f, n);
+    else if (type == "uint64") values = recordArray<uint64_t>(factory, r, col, f, n);
+    else if (type == "logical") values = recordArray<bool>(factory, r, col, f, n);
+    else return false;
+    return true;
+}
+
+RecordReader* MexFunction::recording(const std::string &path, uint64_t rows)
+{
+    // Mapped recording, remapped if a running recording has grown past rows
+    std::string err;
+    RecordReader *r = recordings.count(path) ? recordings[path] : nullptr;
+
+    if (r && (recordRows(r) < rows) &&
+            (r->header->rows.load() > recordRows(r))) {
+        recordRelease(r);
+        recordings.erase(path);
+        r = nullptr;
+    }
+    if (!r) {
+        r = recordOpen(path, err);
+        ASSERT(r != nullptr, err);
+        recordings[path] = r;
+    }
+    return r;
+}
+
+void MexFunction::record(ArgumentList inputs, ArgumentList outputs)
+{
+    // info = plc4mex('record', 'info', file)
+    //   rows and columns of a plc4sim recording
+    // values = plc4mex('record', 'read', file, column [, first [, count]])
+    //   rows first .. first + count - 1 (default all) of a column, by name or
+    //   number, as a count x width array of the column's class
+    // plc4mex('record', 'close', file)
+    //   unmap the file
+    ArrayFactory factory;
+    size_t idx;
+
+    ASSERT(inputs.size() >= 3, "record requires a command and a file");
+    std::string cmd = ((CharArray) inputs[1]).toAscii();
+    std::string path = ((CharArray) inputs[2]).toAscii();
+
+    if (cmd == "close") {
+        if (recordings.count(path)) {
+            recordRelease(recordings[path]);
+            recordings.erase(path);
+        }
+        return;
+    }
+
+    if (cmd == "info") {
+        RecordReader *r = recording(path, UINT64_MAX);
+        const RecordHeader *h = r->header;
+        StructArray cols = factory.createStructArray({h->nColumns, 1},
+            {"name", "address", "class", "width"});
+        for (idx = 0; idx < h->nColumns; idx++) {
+            cols[idx]["name"] = factory.createCharArray(h->columns[idx].name);
+            cols[idx]["address"] = factory.createCharArray(h->columns[idx].address);
+            cols[idx]["class"] = factory.createCharArray(h->columns[idx].type);
+            cols[idx]["width"] = factory.createScalar<double>(h->columns[idx].width);
+        }
+        StructArray info = factory.createStructArray({1,1}, {"rows", "columns"});
+        info[0]["rows"] = factory.createScalar<double>((double) recordRows(r));
+        info[0]["columns"] = cols;
+        outputs[0] = info;
+
+    } else if (cmd == "read") {
+        ASSERT((inputs.size() >= 4) && (inputs.size() <= 6),
+            "record read requires a file, a column and optional first and count");
+        double first = inputs.size() > 4 ? 
+            (double) ((TypedArray<double>) inputs[4])[0] : 1;
+        double count = inputs.size() > 5 ? 
+            (double) ((TypedArray<double>) inputs[5])[0] : -1;
+        ASSERT(first >= 1, "record first row must be 1 or more");
+        RecordReader *r = recording(path, count < 0 ? UINT64_MAX :
+            (uint64_t) (first - 1 + count));
+        uint64_t rows = recordRows(r);
+
+        int col;
+        if (isWordType(inputs[3].getType())) {
+            std::string name = ((CharArray) inputs[3]).toAscii();
+            col = recordColumnIndex(r, name.c_str());
+            ASSERT(col >= 0, "recording has no column <" + name + ">");
+        } else {
+            col = (int) ((TypedArray<double>) inputs[3])[0] - 1;
+            ASSERT((col >= 0) && (col < (int) r->header->nColumns), 
+                "record column number out of range");
+        }
+        if (count < 0)
+            count = first - 1 < rows ? rows - (first - 1) : 0;
+        ASSERT(first - 1 + count <= rows, "record rows out of range, the "
+            "recording has " + std::to_string(rows) + " rows");
+
+        Array values;
+        ASSERT(recordColumnArray(factory, r, col, (uint64_t) first - 1,
+            (uint64_t) count, values), "recorded column class <" + 
+            std::string(r->header->columns[col].type) + "> not supported");
+        outputs[0] = values;
+
+    } else {
+        ERROR("record command must be info, read or close");
+    }
+}
+
+void MexFunction::replayRead(StructArray reads, ArgumentList outputs)
+{
+    // Serve a read from the replayed row, then move to the next row. After
+    // the last row its values are held and stale is true.
+    ArrayFactory factory;
+    size_t idx;
+
+    for (idx = 0 ; idx < reads.getNumberOfElements() ; idx++) {
+        CharArray addr = reads[idx]["address"];
+        std::string address = resolve(addr.toAscii());
+        int col = replayColumn(replay, "read", address.c_str(), 0);
+        ASSERT(col >= 0, "recording has no column for <" + address + ">");
+        Array value;
+        ASSERT(recordColumnArray(factory, replay->rec, col, replay->row, 1,
+            value), "recorded column class not supported");
+        reads[idx]["value"] = value;
+    }
+    outputs[0] = reads;
+    if (outputs.size() > 1)
+        outputs[1] = factory.createScalar<bool>(replay->ended);
+    if (replay->row + 1 < replay->rows)
+        replay->row++;
+    else
+        replay->ended = true;
+}
+
+void MexFunction::replayOp(ArgumentList inputs, ArgumentList outputs)
+{
+    // plc4mex('replay', 'seek', row)
+    //   serve the given row (1 based) of the replayed recording next
+    // plc4mex('replay', 'status')
+    //   struct with the row served next, the number of rows and whether
+    //   the replay has passed its last row
+    ArrayFactory factory;
+
+    ASSERT(replay != nullptr, "not connected to a replay");
+    ASSERT(inputs.size() >= 2, "replay requires a command");
+    std::string cmd = ((CharArray) inputs[1]).toAscii();
+
+    if (cmd == "seek") {
+        ASSERT(inputs.size() == 3, "replay seek requires a row");
+        double row = ((TypedArray<double>) inputs[2])[0];
+        ASSERT((row >= 1) && (row <= replay->rows), "replay row out of range");
+        replay->row = (uint64_t) row - 1;
+        replay->ended = false;
+    } else if (cmd == "status") {
+        StructArray st = factory.createStructArray({1,1}, {"row", "rows",
+            "ended"});
+        st[0]["row"] = factory.createScalar<double>((double) replay->row + 1);
+        st[0]["rows"] = factory.createScalar<double>((double) replay->rows);
+        st[0]["ended"] = factory.createScalar<bool>(replay->ended);
+        outputs[0] = st;
+    } else {
+        ERROR("replay command must be seek or status");
+    }
+}
+
+void MexFunction::virtualWrites(StructArray writes, ArgumentList outputs)
+{
+    // Write each value to the virtual PLC in the type of its address, the
+    // number of elements must match the address
+    ArrayFactory factory;
+    std::string err;
+    size_t idx;
+
+    for (idx = 0; idx < writes.getNumberOfElements(); idx++) {
+        CharArray addr = writes[idx]["address"];
+        std::string address = resolve(addr.toAscii());
+        Array value = writes[idx]["value"];
+        VirtualItem item;
+
+        ASSERT(virtualParse(address, &item, err), err);
+        ASSERT(value.getNumberOfElements() == item.count, "<" + address + 
+            "> needs " + std::to_string(item.count) + " values");
+        std::vector<uint8_t> buf(item.size * item.count);
+        bool copied = typeDispatch<ArrayCopy, bool>(item.type, value,
+            (void*) buf.data());
+        ASSERT(copied, "value for <" + address + "> must be numeric or logical");
+        ASSERT(virtualWrite(virtualPlc, &item, buf.data()),
+            "virtual PLC has no room for <" + address + ">");
+    }
+    if (outputs.size() > 0)
+        outputs[0] = factory.createScalar<bool>(true);
+}
+
+void MexFunction::virtualReads(StructArray reads, ArgumentList outputs)
+{
+    // Read each address from the virtual PLC as a 1 x N row of its type
+    ArrayFactory factory;
+    std::string err;
+    size_t idx;
+
+    for (idx = 0; idx < reads.getNumberOfElements(); idx++) {
+        CharArray addr = reads[idx]["address"];
+        std::string address = resolve(addr.toAscii());
+        VirtualItem item;
+
+        ASSERT(virtualParse(address, &item, err), err);
+        std::vector<uint8_t> buf(item.size * item.count);
+        ASSERT(virtualRead(virtualPlc, &item, buf.data()),
+            "virtual PLC has no room for <" + address + ">");
+        reads[idx]["value"] = typeDispatch<ArrayOf, Array>(item.type, &factory,
+            (const void*) buf.data(), (size_t) item.count);
+    }
+    outputs[0] = reads;
+    if (outputs.size() > 1)
+        outputs[1] = factory.createScalar<bool>(false);
+}
+
+void MexFunction::brokerWrites(StructArray writes, ArgumentList outputs)
+{
+    // Send all values to the broker as one request, each converted to the
+    // type of its address. A write the broker could not make is dropped.
+    ArrayFactory factory;
+    std::vector<ImageArea> areas(writes.getNumberOfElements());
+    std::vector<uint8_t> data;
+    std::string err;
+    uint32_t size, count;
+    PlcType type;
+    size_t idx;
+
+    for (idx = 0; idx < areas.size(); idx++) {
+        CharArray addr = writes[idx]["address"];
+        std::string address = resolve(addr.toAscii());
+        Array value = writes[idx]["value"];
+        ASSERT(typeOfAddress(address, &type, &size, &count) &&
+            imageArea(address, type, count, &areas[idx]), "<" + address +
+            "> needs a known type to be written through a broker");
+        ASSERT(value.getNumberOfElements() == count, "<" + address + 
+            "> needs " + std::to_string(count) + " values");
+        areas[idx].offset = (uint32_t) data.size();
+        data.resize(data.size() + areas[idx].bytes);
+        bool copied = typeDispatch<ArrayCopy, bool>(type, value,
+            (void*) (data.data() + areas[idx].offset));
+        ASSERT(copied, "value for <" + address + "> must be numeric or logical");
+    }
+    BrokerStatus status = brokerTransact(broker, areas, data.data(), {},
+        nullptr, err);
+    ASSERT(status != BROKER_BAD, err);
+    for (idx = 0; idx < areas.size(); idx++)
+        cacheWrite(areas[idx].address, writes[idx]["value"], status == BROKER_OK);
+    if (status != BROKER_OK)
+        WARNING("write dropped, " + err);
+    if (outputs.size() > 0)
+        outputs[0] = factory.createScalar<bool>(status == BROKER_OK);
+}
+
+void MexFunction::brokerReads(StructArray &reads, ArgumentList outputs)
+{
+    // Read all addresses through the broker as one request, each as a 1 x N
+    // row of its type. Last good values are served while it is stale.
+    ArrayFactory factory;
+    std::vector<ImageArea> areas(reads.getNumberOfElements());
+    std::vector<uint8_t> data;
+    std::string err;
+    uint32_t size, count;
+    PlcType type;
+    size_t idx;
+
+    for (idx = 0; idx < areas.size(); idx++) {
+        CharArray addr = reads[idx]["address"];
+        std::string address = resolve(addr.toAscii());
+        ASSERT(typeOfAddress(address, &type, &size, &count) &&
+            imageArea(address, type, count, &areas[idx]), "<" + address +
+            "> needs a known type to be read through a broker");
+        areas[idx].offset = (uint32_t) data.size();
+        data.resize(data.size() + ((areas[idx].bytes + 7) & ~7u));
+    }
+    BrokerStatus status = brokerTransact(broker, {}, nullptr, areas,
+        data.data(), err);
+    ASSERT(status != BROKER_BAD, err);
+    if (status == BROKER_OK) {
+        for (idx = 0; idx < areas.size(); idx++) {
+            Array value = typeDispatch<ArrayOf, Array>((PlcType) areas[idx].type,
+                &factory, (const void*) (data.data() + areas[idx].offset),
+                (size_t) areas[idx].count);
+            lastGood[areas[idx].address] = value;
+            cacheStore(areas[idx].address, value);
+            reads[idx]["value"] = value;
+        }
+    } else {
+        holdReadValues(reads);
+    }
+    outputs[0] = reads;
+    if (outputs.size() > 1)
+        outputs[1] = factory.createScalar<bool>(status != BROKER_OK);
+}
+
+// Function: plc4cValueCount ==============================================
+// Abstract: Number of scalar values in a (possibly list) plc4c data item
+static size_t plc4cValueCount(plc4c_data *data)
+{
+    if (data->data_type == PLC4C_LIST)
+        return plc4c_utils_list_size(&data->data.list_value);
+    return 1;
+}
+
+// Function: plc4cValueAt =================================================
+// Abstract: Scalar value idx of a (possibly list) plc4c data item
+static plc4c_data* plc4cValueAt(plc4c_data *data, size_t idx)
+{
+    if (data->data_type == PLC4C_LIST)
+        return (plc4c_data*) plc4c_utils_list_get_value(
+            &data->data.list_value, idx);
+    return data;
+}
+
+// Kernel GroupOf ========================================================
+// 1 x N MATLAB array of T of the scalar plc4c data items of a typed group
+template <typename T>
+struct GroupOf {
+    static Array run(ArrayFactory *factory,
+            const std::vector<plc4c_data*> *items) {
+        buffer_ptr_t<T> buf = factory->createBuffer<T>(items->size());
+        T *dst = buf.get();
+        for (plc4c_data *item : *items)
+            *dst++ = typeValue<T>(item);
+        return factory->createArrayFromBuffer<T>({1, items->size()},
+            std::move(buf));
+    }
+};
+
+void MexFunction::readMatrix(ArgumentList inputs, ArgumentList outputs)
+{
+    // [values, index, stale] = plc4mex('readmatrix', addresses [, 'typed'])
+    //   values is one 1 x K double row of every element of every tag, 
+    //   index is M x 2 of [first column, count] per tag. With 'typed' 
+    //   values is a struct of one typed row per MATLAB class and index is
+    //   M x 3 of [group number, first column, count], groups in field order.
+    //   Held values are returned while reconnecting, stale is then true.
+    ArrayFactory factory;
+    std::string err;
+    bool typed = false;
+    bool done = false;
+    size_t idx, n;
+
+    ASSERT(connected, "must be connected to read");
+    ASSERT(link != nullptr, "readmatrix needs a PLC connection");
+    size_t last = inputs.size() - 1;
+    if ((last > 1) && isWordType(inputs[last].getType()) &&
+            (((CharArray) inputs[last]).toAscii() == "typed"))
+        typed = true;
+    std::vector<std::string> addrs = addressList(inputs, 1);
+    if (typed && (inputs[1].getType() != ArrayType::CELL))
+        addrs.pop_back();
+    std::string key = typed ? "typed" : "double";
+    for (auto &a : addrs)
+        key += ";" + a;
+
+    ASSERT(linkWaitReady(link, err) != LINK_FAILED, err);
+    std::lock_guard<std::mutex> guard(link->lock);
+
+    if (link->state == LINK_CONNECTED)
+        done = execRead(addrs, addrs, [&](plc4c_read_response *response) {
+            std::vector<plc4c_data*> tags;
+            plc4c_list_element *item = plc4c_utils_list_tail(response->items);
+            size_t total = 0;
+            while (item != NULL) {
+                plc4c_data *data = ((plc4c_response_value_item*) item->value)->value;
+                tags.push_back(data);
+                total += plc4cValueCount(data);
+                item = item->next;
+            }
+            ASSERT(tags.size() == addrs.size(), "read response incomplete");
+
+            if (!typed) {
+                // one allocation for every value, one for the index
+                buffer_ptr_t<double> vals = factory.createBuffer<double>(total);
+                buffer_ptr_t<double> index = factory.createBuffer<double>(2 * tags.size());
+                double *dst = vals.get();
+                for (idx = 0; idx < tags.size(); idx++) {
+                    n = plc4cValueCount(tags[idx]);
+                    index.get()[idx] = (dst - vals.get()) + 1;
+                    index.get()[idx + tags.size()] = n;
+                    dst += TypeDecode<double>::run(tags[idx], (void*) dst, n);
+                }
+                lastMatrix[key] = {
+                    factory.createArrayFromBuffer<double>({1, total}, std::move(vals)),
+                    factory.createArrayFromBuffer<double>({tags.size(), 2}, std::move(index))};
+                return;
+            }
+
+            // group the values by the type of their address, or of the
+            // values the driver returned for an address of no known type,
+            // one typed row per group named for its MATLAB class
+            std::vector<PlcType> groupTypes;
+            std::vector<std::string> groupNames;
+            std::vector<std::vector<plc4c_data*>> groups;
+            buffer_ptr_t<double> index = factory.createBuffer<double>(3 * tags.size());
+            for (idx = 0; idx < tags.size(); idx++) {
+                size_t count = plc4cValueCount(tags[idx]);
+                uint32_t size, typedCount;
+                PlcType type;
+                const char *name;
+                if (!typeOfAddress(addrs[idx], &type, &size, &typedCount) &&
+                        !(count && plc4cTypeOf(tags[idx], &type)))
+                    type = TYPE_DOUBLE;
+                typeS7Name(type, nullptr, &name);
+                size_t g = std::find(groupTypes.begin(), groupTypes.end(), 
+                    type) - groupTypes.begin();
+                if (g == groupTypes.size()) {
+                    groupTypes.push_back(type);
+                    groupNames.push_back(name);
+                    groups.emplace_back();
+                }
+                index.get()[idx] = g + 1;
+                index.get()[idx + tags.size()] = groups[g].size() + 1;
+                index.get()[idx + 2 * tags.size()] = count;
+                for (n = 0; n < count; n++)
+                    groups[g].push_back(plc4cValueAt(tags[idx], n));
+            }
+            StructArray st = factory.createStructArray({1,1}, groupNames);
+            for (size_t g = 0; g < groups.size(); g++)
+                st[0][groupNames[g]] = typeDispatch<GroupOf, Array>(
+                    groupTypes[g], &factory, &groups[g]);
+            lastMatrix[key] = {st,
+                factory.createArrayFromBuffer<double>({tags.size(), 3}, std::move(index))};
+        });
+
+    auto found = lastMatrix.find(key);
+    if (!done && (link->state == LINK_RECONNECTING))
+        WARNING("read values held, " + link->error);
+    ASSERT(found != lastMatrix.end(), "no values to hold, " + link->error);
+    outputs[0] = found->second[0];
+    if (outputs.size() > 1)
+        outputs[1] = found->second[1];
+    if (outputs.size() > 2)
+        outputs[2] = factory.createScalar<bool>(!done);
+}
+
+bool MexFunction::fetchBlock(const BitsRange &range, std::vector<uint8_t> &block)
+{
+    // Read the bytes of a range into block, split into USINT items that
+    // each fit a PDU and packed into as few requests as fit. Returns false
+    // if the connection is down or a read failed.
+    std::vector<std::string> names, addrs;
+    std::vector<uint32_t> bytes, starts;
+    std::vector<uint8_t> got;
+    LinkOptionMap opts;
+    std::string key, err;
+    unsigned pdu = LINK_DEFAULT_PDU;
+    BitsRange chunk = range;
+    uint32_t length = range.count / 8, at, n;
+    bool done = true;
+
+    if (virtualPlc) {
+        VirtualItem item;
+        ASSERT(virtualParse(bitsReadAddress(&range), &item, err), err);
+        ASSERT(virtualRead(virtualPlc, &item, block.data()),
+            "virtual PLC has no room for <" + bitsReadAddress(&range) + ">");
+        return true;
+    }
+    linkSplitOptions(connStr, key, opts);
+    ASSERT(linkOptionCount(opts, "pdu", LINK_MIN_PDU, &pdu, err), err);
+    for (at = 0; at < length; at += n) {
+        // a response item carries its data after the header of the job
+        n = std::min(length - at, (pdu - LINK_S7_HEADER - LINK_S7_DATA) & ~1u);
+        chunk.byte = range.byte + at;
+        chunk.count = n * 8;
+        names.push_back("Block" + std::to_string(names.size()));
+        addrs.push_back(bitsReadAddress(&chunk));
+        bytes.push_back(n);
+        starts.push_back(at);
+    }
+
+    if (broker) {
+        std::vector<ImageArea> areas(addrs.size());
+        for (size_t idx = 0; idx < addrs.size(); idx++) {
+            imageArea(addrs[idx], TYPE_UINT8, bytes[idx], &areas[idx]);
+            areas[idx].offset = starts[idx];
+        }
+        BrokerStatus status = brokerTransact(broker, {}, nullptr, areas,
+            block.data(), err);
+        ASSERT(status != BROKER_BAD, err);
+        return status == BROKER_OK;
+    }
+
+    ASSERT(linkWaitReady(link, err) != LINK_FAILED, err);
+    std::lock_guard<std::mutex> guard(link->lock);
+    std::vector<size_t> runs = linkPack(bytes, false, pdu);
+    for (size_t run = 0; done && (run < runs.size()); run++) {
+        size_t first = runs[run];
+        size_t last = run + 1 < runs.size() ? runs[run + 1] : addrs.size();
+        if (link->state != LINK_CONNECTED)
+            return false;
+        std::vector<std::string> runNames(names.begin() + first,
+            names.begin() + last);
+        std::vector<std::string> runAddrs(addrs.begin() + first,
+            addrs.begin() + last);
+        done = execRead(runNames, runAddrs, [&](plc4c_read_response *response) {
+            plc4c_list_element *item = plc4c_utils_list_tail(response->items);
+            for (size_t idx = first; idx < last; idx++, item = item->next) {
+                if (!item)
+                    break;
+                bitsBytesOf(((plc4c_response_value_item*) item->value)->value,
+                    got);
+                done &= got.size() >= bytes[idx];
+                memcpy(block.data() + starts[idx], got.data(),
+                    std::min<size_t>(got.size(), bytes[idx]));
+            }
+        }) && done;
+    }
+    return done;
+}
+
+Array MexFunction::blockValues(const std::vector<uint8_t> &block, Array layout)
+{
+    // Reinterpret the big endian bytes of a block: an S7 type name gives a
+    // row of that type over the whole block, a struct array with fields
+    // name, type, offset (byte.bit for BOOL) and optional count gives a
+    // struct of one typed row per name
+    ArrayFactory factory;
+    uint32_t size;
+    PlcType type;
+    size_t idx;
+
+    if (isWordType(layout.getType())) {
+        std::string name = ((CharArray) layout).toAscii();
+        ASSERT(typeOfName(name, &type, &size), "unknown type <" + name + ">");
+        if (type == TYPE_BOOL) {
+            buffer_ptr_t<bool> flags = factory.createBuffer<bool>(block.size() * 8);
+            bitsUnpack(block.data(), 0, (uint32_t) block.size() * 8, flags.get());
+            return factory.createArrayFromBuffer<bool>({1, block.size() * 8},
+                std::move(flags));
+        }
+        return typeDispatch<WireArrayOf, Array>(type, &factory, block.data(),
+            block.size() / size);
+    }
+
+    ASSERT(layout.getType() == ArrayType::STRUCT,
+        "a block layout is a type name or a struct array");
+    StructArray fields = layout;
+    std::vector<std::string> names;
+    for (idx = 0; idx < fields.getNumberOfElements(); idx++) {
+        CharArray name = fields[idx]["name"];
+        names.push_back(name.toAscii());
+    }
+    StructArray st = factory.createStructArray({1, 1}, names);
+    for (idx = 0; idx < fields.getNumberOfElements(); idx++) {
+        CharArray typeName = fields[idx]["type"];
+        TypedArray<double> offsets = fields[idx]["offset"];
+        double count = 1, offset = offsets[0];
+        auto known = fields.getFieldNames();
+        if (std::find(known.begin(), known.end(), "count") != known.end()) {
+            TypedArray<double> counts = fields[idx]["count"];
+            if (counts.getNumberOfElements() > 0)
+                count = counts[0];
+        }
+        ASSERT(typeOfName(typeName.toAscii(), &type, &size), "unknown type <" +
+            typeName.toAscii() + "> in block layout");
+        uint32_t byte = (uint32_t) offset;
+        uint32_t bit = (uint32_t) std::lround((offset - byte) * 10);
+        uint64_t end = type == TYPE_BOOL ? byte + (bit + (uint64_t) count + 7) / 8
+            : byte + (uint64_t) size * (uint64_t) count;
+        ASSERT((offset >= 0) && (count >= 1) && (bit < 8) &&
+            (end <= block.size()), "field <" + names[idx] +
+            "> does not fit the block");
+        if (type == TYPE_BOOL) {
+            buffer_ptr_t<bool> flags = factory.createBuffer<bool>((size_t) count);
+            bitsUnpack(block.data() + byte, bit, (uint32_t) count, flags.get());
+            st[0][names[idx]] = factory.createArrayFromBuffer<bool>(
+                {1, (size_t) count}, std::move(flags));
+        } else {
+            st[0][names[idx]] = typeDispatch<WireArrayOf, Array>(type,
+                &factory, block.data() + byte, (size_t) count);
+        }
+    }
+    return st;
+}
+
+void MexFunction::readBlock(ArgumentList inputs, ArgumentList outputs)
+{
+    // [data, stale] = plc4mex('readBlock', area, db, offset, length [, layout])
+    //   length bytes from offset of an area ('DB', 'I', 'Q' or 'M', db only
+    //   counts for DB) as a 1 x length uint8 row in as few requests as the
+    //   PDU allows, or reinterpreted by a layout (see blockValues). Held
+    //   bytes are returned while reconnecting, stale is then true.
+    ArrayFactory factory;
+    BitsRange range;
+    bool done = false;
+    size_t idx;
+
+    ASSERT(connected, "must be connected to read");
+    ASSERT(!replay, "readBlock needs a PLC, broker or virtual PLC connection");
+    ASSERT(((inputs.size() == 5) || (inputs.size() == 6)) &&
+        isWordType(inputs[1].getType()), "readBlock requires area, db, "
+        "offset, length and an optional layout");
+    for (idx = 2; idx < 5; idx++)
+        ASSERT((inputs[idx].getType() == ArrayType::DOUBLE) &&
+            (inputs[idx].getNumberOfElements() == 1) &&
+            ((double) ((TypedArray<double>) inputs[idx])[0] >= 0),
+            "db, offset and length must be non negative scalars");
+    std::string area = ((CharArray) inputs[1]).toAscii();
+    double db = ((TypedArray<double>) inputs[2])[0];
+    double offset = ((TypedArray<double>) inputs[3])[0];
+    double length = ((TypedArray<double>) inputs[4])[0];
+    ASSERT((length >= 1) && (length <= VIRTUAL_MAX_AREA) &&
+        (offset + length <= VIRTUAL_MAX_AREA), "block length out of range");
+    if (area == "DB")
+        range.prefix = "%DB" + std::to_string((unsigned) db) + ":";
+    else if ((area == "I") || (area == "Q") || (area == "M"))
+        range.prefix = "%" + area;
+    else
+        ERROR("block area must be DB, I, Q or M");
+    range.byte = (uint32_t) offset;
+    range.bit = 0;
+    range.count = (uint32_t) length * 8;
+
+    std::string key = bitsReadAddress(&range);
+    std::vector<uint8_t> block((size_t) length);
+    if (fetchBlock(range, block)) {
+        lastBlock[key].swap(block);
+        done = true;
+    }
+    auto found = lastBlock.find(key);
+    if (!done)
+        WARNING("read values held, block could not be read");
+    ASSERT(found != lastBlock.end(), "no values to hold for <" + key + ">");
+    if (inputs.size() == 6)
+        outputs[0] = blockValues(found->second, inputs[5]);
+    else
+        outputs[0] = factory.createArray<uint8_t>({1, found->second.size()},
+            found->second.data(), found->second.data() + found->second.size());
+    if (outputs.size() > 1)
+        outputs[1] = factory.createScalar<bool>(!done);
+}
+
+// Function: virtualHarvest ===============================================
+// Abstract: Append the samples written to a ring of a virtual PLC since
+// the last harvest to samples. False if the ring does not fit the PLC.
+static bool virtualHarvest(VirtualPlc *plc, Harvest *h,
+    std::vector<uint8_t> &samples)
+{
+    std::vector<HarvestItem> items;
+    VirtualItem item;
+    std::string err;
+    int32_t index;
+
+    virtualParse(harvestIndexAddress(&h->spec), &item, err);
+    if (!virtualRead(plc, &item, &index))
+        return false;
+    uint32_t fresh = harvestPlan(h, (uint32_t) index, VIRTUAL_MAX_AREA, items);
+    size_t at = samples.size();
+    samples.resize(at + (size_t) fresh * h->spec.size);
+    for (auto &want : items) {
+        virtualParse(want.address, &item, err);
+        if (!virtualRead(plc, &item, samples.data() + at + want.offset))
+            return false;
+    }
+    return true;
+}
+
+void MexFunction::harvest(ArgumentList inputs, ArgumentList outputs)
+{
+    // [samples, lost, stale] = plc4mex('harvest', address)
+    //   samples written to a PLC ring buffer since the last harvest of the
+    //   address (eg. %DB5:0.0/1000:REAL, see plc4harvest.h), oldest first
+    //   as a 1 x N row of the slot type. The first harvest returns none and
+    //   starts from the write index. lost counts the samples overwritten
+    //   before they could be read, stale is true if the ring could not be
+    //   read (its samples come with the next harvest).
+    ArrayFactory factory;
+    std::vector<uint8_t> samples;
+    LinkOptionMap opts;
+    std::string err, key;
+    unsigned pdu = LINK_DEFAULT_PDU;
+    bool done = true;
+
+    ASSERT(connected, "must be connected to harvest");
+    ASSERT(link || virtualPlc, "harvest needs a PLC or virtual PLC connection");
+    ASSERT((inputs.size() == 2) && isWordType(inputs[1].getType()),
+        "harvest requires an address");
+    std::string address = resolve(((CharArray) inputs[1]).toAscii());
+    auto found = harvests.find(address);
+    if (found == harvests.end()) {
+        Harvest h;
+        ASSERT(harvestParse(address, &h.spec, err), err);
+        found = harvests.emplace(address, h).first;
+    }
+    Harvest *h = &found->second;
+    uint64_t lost = h->lost;
+
+    if (virtualPlc) {
+        ASSERT(virtualHarvest(virtualPlc, h, samples),
+            "virtual PLC has no room for <" + address + ">");
+    } else {
+        linkSplitOptions(connStr, key, opts);
+        ASSERT(linkOptionCount(opts, "pdu", LINK_MIN_PDU, &pdu, err), err);
+        ASSERT(linkWaitReady(link, err) != LINK_FAILED, err);
+        std::lock_guard<std::mutex> guard(link->lock);
+        done = harvestRead(link, h, pdu, samples);
+        ASSERT(done || (link->state != LINK_FAILED), link->error);
+    }
+    outputs[0] = typeDispatch<ArrayOf, Array>(h->spec.type, &factory,
+        (const void*) samples.data(), samples.size() / h->spec.size);
+    if (outputs.size() > 1)
+        outputs[1] = factory.createScalar<double>((double) (h->lost - lost));
+    if (outputs.size() > 2)
+        outputs[2] = factory.createScalar<bool>(!done);
+}
+
+// Function: playbackCopy =================================================
+// Abstract: Convert the N x M samples once into rows of the values of the
+// tags, each column in the type of its address. The matrix is converted
+// whole once per type present. False if it is not numeric or logical.
+static bool playbackCopy(const Array &values, const std::vector<PlaybackTag> &tags,
+    size_t rowBytes, size_t nRows, std::vector<uint8_t> &raw)
+{
+    std::vector<uint8_t> typed;
+    std::vector<bool> copied(tags.size(), false);
+    size_t first, tag, column, row;
+
+    raw.resize(nRows * rowBytes);
+    for (first = 0; first < tags.size(); first++) {
+        if (copied[first])
+            continue;
+        PlcType type = tags[first].type;
+        uint32_t size = tags[first].size;
+        typed.resize(values.getNumberOfElements() * size);
+        if (!typeDispatch<ArrayCopy, bool>(type, values, (void*) typed.data()))
+            return false;
+        for (tag = 0, column = 0; tag < tags.size(); column += tags[tag++].count) {
+            if (tags[tag].type != type)
+                continue;
+            copied[tag] = true;
+            for (uint32_t elem = 0; elem < tags[tag].count; elem++)
+                for (row = 0; row < nRows; row++)
+                    memcpy(raw.data() + row * rowBytes + tags[tag].offset +
+                        elem * size, typed.data() + ((column + elem) * nRows +
+                        row) * size, size);
+        }
+    }
+    return true;
+}
+
+// Function: timespecAdd ==================================================
+// Abstract: Advance an absolute deadline by a number of nanoseconds
+static void timespecAdd(struct timespec *t, long long ns)
+{
+    ns += t->tv_nsec;
+    t->tv_sec += ns / 1000000000LL;
+    t->tv_nsec = ns % 1000000000LL;
+}
+
+// Function: timespecDiff =================================================
+// Abstract: Seconds from b to a
+static double timespecDiff(const struct timespec *a, const struct timespec *b)
+{
+    return (a->tv_sec - b->tv_sec) + (a->tv_nsec - b->tv_nsec) * 1e-9;
+}
+
+// Function: playbackRun ==================================================
+// Abstract: Playback thread body. Row k is written at start + k * period on
+// absolute CLOCK_MONOTONIC deadlines so timing error does not accumulate.
+// Only one write is in flight: a late write delays the next row (counted
+// as an overrun) or, with skipLate, rows whose slot has passed are skipped.
+static void playbackRun(Playback *pb)
+{
+    struct timespec deadline, now;
+    long long periodNs = (long long) (pb->period * 1e9);
+    std::vector<BitsItem> items;
+    size_t row;
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    for (row = 0; (row < pb->nRows) && !pb->stop; row++) {
+
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline,
+                NULL) == EINTR) ;
+
+        PlcLink *link = pb->link;
+        plc4c_write_request *request;
+        plc4c_write_request_execution *execution;
+        bool done = false;
+        {
+            std::lock_guard<std::mutex> guard(link->lock);
+            if ((link->state == LINK_CONNECTED) && 
+                    (plc4c_connection_create_write_request(link->connection,
+                    &request) == OK)) {
+                for (auto &tag : pb->tags) {
+                    const uint8_t *p = pb->samples.data() +
+                        row * pb->rowBytes + tag.offset;
+                    if (!tag.bits) {
+                        plc4c_write_request_add_item(request,
+                            (char*) tag.address.c_str(),
+                            typeDispatch<TypeEncode, plc4c_data*>(tag.type,
+                            (const void*) p, (size_t) tag.count));
+                        continue;
+                    }
+                    // BOOL ranges go as packed bytes and partial bytes' bits
+                    items.clear();
+                    bitsWriteItems(&tag.range, (const bool*) p, items);
+                    for (auto &item : items)
+                        plc4c_write_request_add_item(request,
+                            (char*) item.address.c_str(), item.data);
+                }
+                if (plc4c_write_request_execute(request, &execution) == OK) {
+                    done = linkLoopUntil(link,
+                        [&] { return plc4c_write_request_check_finished_successfully(execution); },
+                        [&] { return plc4c_write_request_execution_check_completed_with_error(execution); },
+                        "playback write");
+                    if (done)
+                        plc4c_write_destroy_write_response(
+                            plc4c_write_request_execution_get_response(execution));
+                    plc4c_write_request_execution_destroy(execution);
+                }
+                plc4c_write_request_destroy(request);
+            }
+            if (link->state == LINK_FAILED) {
+                std::lock_guard<std::mutex> errGuard(pb->errorLock);
+                pb->error = link->error;
+                break;
+            }
+        }
+        if (done)
+            pb->written++;
+        else
+            pb->dropped++;
+
+        // Next slot, account for a write that finished past it
+        timespecAdd(&deadline, periodNs);
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        double late = timespecDiff(&now, &deadline);
+        if (late > 0) {
+            pb->overruns++;
+            if (late > pb->maxLateness)
+                pb->maxLateness = late;
+            if (pb->skipLate) {
+                long long missed = (long long) (late * 1e9) / periodNs + 1;
+                missed = std::min<long long>(missed, pb->nRows - row - 1);
+                pb->skipped += missed;
+                row += missed;
+                timespecAdd(&deadline, missed * periodNs);
+            }
+        }
+    }
+    pb->running = false;
+}
+
+void MexFunction::stopPlayback()
+{
+    if (!player)
+        return;
+    player->stop = true;
+    if (player->thread.joinable())
+        player->thread.join();
+}
+
+void MexFunction::playback(ArgumentList inputs, ArgumentList outputs)
+{
+    // plc4mex('playback', addresses, samples, period [, 'skip'])
+    //   start writing row k of the N x M samples to the M addresses at
+    //   k * period seconds, returns at once
+    // plc4mex('playback', 'status')
+    //   struct with the progress and timing of the current playback
+    // plc4mex('playback', 'stop')
+    //   stop the current playback and wait for its thread
+    ArrayFactory factory;
+    size_t idx;
+
+    ASSERT(inputs.size() >= 2, "playback requires arguments");
+    if (isWordType(inputs[1].getType())) {
+        std::string cmd = ((CharArray) inputs[1]).toAscii();
+        if (cmd == "stop") {
+            stopPlayback();
+        } else if (cmd == "status") {
+            StructArray st = factory.createStructArray({1,1}, {"running",
+                "rows", "written", "skipped", "dropped", "overruns",
+                "maxLateness", "error"});
+            if (player) {
+                std::lock_guard<std::mutex> guard(player->errorLock);
+                st[0]["running"] = factory.createScalar<bool>(player->running);
+                st[0]["rows"] = factory.createScalar<double>(player->nRows);
+                st[0]["written"] = factory.createScalar<double>(player->written);
+                st[0]["skipped"] = factory.createScalar<double>(player->skipped);
+                st[0]["dropped"] = factory.createScalar<double>(player->dropped);
+                st[0]["overruns"] = factory.createScalar<double>(player->overruns);
+                st[0]["maxLateness"] = factory.createScalar<double>(player->maxLateness);
+                st[0]["error"] = factory.createCharArray(player->error);
+            } else {
+                st[0]["running"] = factory.createScalar<bool>(false);
+            }
+            outputs[0] = st;
+        } else {
+            ERROR("playback command must be 'status' or 'stop'");
+        }
+        return;
+    }
+
+    ASSERT(connected, "must be connected to playback");
+    ASSERT(link != nullptr, "playback needs a PLC connection");
+    ASSERT((inputs.size() == 4) || (inputs.size() == 5), 
+        "playback requires addresses, samples and period");
+    ASSERT(inputs[1].getType() == ArrayType::CELL, 
+        "playback addresses must be a cell array");
+    ASSERT(isValueType(inputs[2].getType()), 
+        "playback samples must be a numeric or logical matrix");
+    ASSERT(inputs[3].getType() == ArrayType::DOUBLE, 
+        "playback period must be a double");
+    ASSERT(!player || !player->running, "playback already running");
+    std::string err;
+    ASSERT(linkWaitReady(link, err) != LINK_FAILED, err);
+    stopPlayback();
+
+    std::unique_ptr<Playback> pb(new Playback);
+    ArrayDimensions dims = inputs[2].getDimensions();
+    ASSERT(dims.size() == 2, "playback samples must be N x M");
+    size_t columns = 0;
+    for (idx = 0; idx < inputs[1].getNumberOfElements(); idx++) {
+        // values go in the type of the address, or the matrix class if
+        // it has none, an address of k elements takes k columns
+        CharArray addr = inputs[1][idx];
+        PlaybackTag tag;
+        tag.address = resolve(addr.toAscii());
+        if (!typeOfAddress(tag.address, &tag.type, &tag.size, &tag.count)) {
+            ASSERT(mexTypeOf(inputs[2].getType(), &tag.type),
+                "playback samples type not supported");
+            typeS7Name(tag.type, &tag.size);
+            tag.count = 1;
+        }
+        tag.bits = bitsParse(tag.address.c_str(), &tag.range);
+        tag.offset = pb->rowBytes;
+        pb->rowBytes += (size_t) tag.size * tag.count;
+        columns += tag.count;
+        pb->tags.push_back(tag);
+    }
+    ASSERT(dims[1] == columns, "playback samples need one column per "
+        "address element, " + std::to_string(columns) + " columns");
+    pb->nRows = dims[0];
+    pb->period = (double) ((TypedArray<double>) inputs[3])[0];
+    ASSERT(pb->period > 0, "playback period must be positive");
+    if (inputs.size() == 5)
+        pb->skipLate = ((CharArray) inputs[4]).toAscii() == "skip";
+    pb->link = link;
+
+    ASSERT(playbackCopy(inputs[2], pb->tags, pb->rowBytes, pb->nRows,
+        pb->samples), "playback samples must be numeric or logical");
+
+    pb->running = true;
+    pb->thread = std::thread(playbackRun, pb.get());
+    player = std::move(pb);
+    cachePlayback();
+}
+
+void MexFunction::subscribe(ArgumentList inputs)
+{
+    // plc4mex('subscribe', {addresses} [, period])
+    //   poll the addresses every period (default 0.1 s) in the background
+    //   and queue each change of value for fetch, replaces any subscription.
+    //   A period [shortest longest] adapts the interval of each address to
+    //   how often it changes.
+    std::vector<SubItem> items;
+    LinkOptionMap opts;
+    std::string key, err;
+    unsigned pdu = LINK_DEFAULT_PDU;
+    double period = SUB_DEFAULT_PERIOD, periodMax;
+    uint32_t size, count;
+    PlcType type;
+
+    ASSERT(connected, "must be connected to subscribe");
+    ASSERT(link != nullptr, "a subscription needs a PLC connection");
+    ASSERT(((inputs.size() == 2) || (inputs.size() == 3)) && 
+        (inputs[1].getType() == ArrayType::CELL),
+        "subscribe requires a cell of addresses and an optional period");
+    periodMax = period;
+    if (inputs.size() == 3) {
+        ASSERT((inputs[2].getType() == ArrayType::DOUBLE) && 
+            (inputs[2].getNumberOfElements() >= 1) &&
+            (inputs[2].getNumberOfElements() <= 2),
+            "subscription period must be one or two doubles");
+        TypedArray<double> periods = inputs[2];
+        period = periodMax = periods[0];
+        if (periods.getNumberOfElements() == 2)
+            periodMax = periods[1];
+    }
+    linkSplitOptions(connStr, key, opts);
+    ASSERT(linkOptionCount(opts, "pdu", LINK_MIN_PDU, &pdu, err), err);
+
+    for (auto &address : addressList(inputs, 1)) {
+        ASSERT(typeOfAddress(address, &type, &size, &count),
+            "subscribed address <" + address + "> needs a known type");
+        items.push_back(SubItem());
+        ASSERT(subItem("Sub" + std::to_string(items.size()), address, type,
+            count, &items.back(), err), err);
+    }
+    subStop(subscription);
+    subscription = nullptr;
+    ASSERT(linkWaitReady(link, err) != LINK_FAILED, err);
+    subscription = subStart(items, period, periodMax, pdu, true, link, err);
+    ASSERT(subscription != nullptr, err);
+}
+
+void MexFunction::fetch(ArgumentList outputs)
+{
+    // [changes, dropped] = plc4mex('fetch')
+    //   struct array of the changes queued since the last fetch, oldest
+    //   first, with the address, value and time (posix seconds) of each,
+    //   and the number of changes dropped as the queue overflowed
+    ArrayFactory factory;
+    std::deque<SubEvent> events;
+    size_t idx;
+
+    ASSERT(subscription != nullptr, "must subscribe before fetching");
+    subFetch(subscription, events);
+    StructArray changes = factory.createStructArray({1, events.size()},
+        {"address", "value", "time"});
+    for (idx = 0; idx < events.size(); idx++) {
+        const SubItem *item = &subscription->items[events[idx].item];
+        changes[idx]["address"] = factory.createCharArray(item->area.address);
+        changes[idx]["value"] = typeDispatch<ArrayOf, Array>(
+            (PlcType) item->area.type, &factory, 
+            (const void*) events[idx].value.data(), (size_t) item->area.count);
+        changes[idx]["time"] = factory.createScalar<double>(
+            events[idx].stamp * 1e-9);
+    }
+    outputs[0] = changes;
+    if (outputs.size() > 1)
+        outputs[1] = factory.createScalar<double>(subscription->dropped);
+}
+
+// Function: asyncDiscard =================================================
+// Abstract: Free the data of write items that were never sent
+static void asyncDiscard(AsyncJob *job)
+{
+    for (auto &item : job->items)
+        if (item.data)
+            plc4c_data_destroy(item.data);
+    job->items.clear();
+}
+
+// Function: asyncWrite ===================================================
+// Abstract: Send the items of a write job. Call with the link lock held on
+// a connected link.
+static bool asyncWrite(PlcLink *link, AsyncJob *job)
+{
+    plc4c_write_request *request;
+    plc4c_write_request_execution *execution;
+    bool done = false;
+
+    if (plc4c_connection_create_write_request(link->connection, &request) != OK)
+        return false;
+    for (auto &item : job->items) {
+        // the request owns the data once added
+        plc4c_write_request_add_item(request, (char*) item.address.c_str(),
+            item.data);
+        item.data = nullptr;
+    }
+    if (plc4c_write_request_execute(request, &execution) == OK) {
+        done = linkLoopUntil(link,
+            [&] { return plc4c_write_request_check_finished_successfully(execution); },
+            [&] { return plc4c_write_request_execution_check_completed_with_error(execution); },
+            "write");
+        if (done)
+            plc4c_write_destroy_write_response(
+                plc4c_write_request_execution_get_response(execution));
+        plc4c_write_request_execution_destroy(execution);
+    }
+    plc4c_write_request_destroy(request);
+    return done;
+}
+
+// Function: asyncRead ====================================================
+// Abstract: Read the areas of a read job into its data. Call with the link
+// lock held on a connected link.
+static bool asyncRead(PlcLink *link, AsyncJob *job)
+{
+    plc4c_read_request *request;
+    plc4c_read_request_execution *execution;
+    std::vector<std::string> fetch;
+    bool done = false;
+
+    if (plc4c_connection_create_read_request(link->connection, &request) != OK)
+        return false;
+    for (auto &area : job->areas)
+        fetch.push_back(imageFetchAddress(&area));
+    for (size_t idx = 0; idx < fetch.size(); idx++)
+        plc4c_read_request_add_item(request, job->areas[idx].address,
+            (char*) fetch[idx].c_str());
+    if (plc4c_read_request_execute(request, &execution) == OK) {
+        done = linkLoopUntil(link,
+            [&] { return plc4c_read_request_execution_check_finished_successfully(execution); },
+            [&] { return plc4c_read_request_execution_check_finished_with_error(execution); },
+            "read");
+        if (done) {
+            plc4c_read_response *response =
+                plc4c_read_request_execution_get_response(execution);
+            plc4c_list_element *item = plc4c_utils_list_tail(response->items);
+            for (size_t idx = 0; item && (idx < job->areas.size()); idx++) {
+                const ImageArea *area = &job->areas[idx];
+                imageStore(area, job->data.data() + area->offset,
+                    ((plc4c_response_value_item*) item->value)->value);
+                item = item->next;
+            }
+            plc4c_read_destroy_read_response(response);
+        }
+        plc4c_read_request_execution_destroy(execution);
+    }
+    plc4c_read_request_destroy(request);
+    return done;
+}
+
+// Function: asyncRun =====================================================
+// Abstract: I/O thread body, runs the queued jobs in order. A job finding
+// the link down fails at once, jobs still queued at stop fail unsent.
+static void asyncRun(AsyncIo *io)
+{
+    std::unique_lock<std::mutex> lk(io->lock);
+
+    while (1) {
+        io->changed.wait(lk, [io] { return io->stop || !io->queue.empty(); });
+        if (io->stop)
+            break;
+        std::shared_ptr<AsyncJob> job = io->queue.front();
+        io->queue.pop_front();
+        lk.unlock();
+
+        bool ok = false;
+        {
+            std::lock_guard<std::mutex> guard(io->link->lock);
+            if (io->link->state == LINK_CONNECTED)
+                ok = job->write ? asyncWrite(io->link, job.get()) :
+                    asyncRead(io->link, job.get());
+        }
+        asyncDiscard(job.get());
+
+        lk.lock();
+        job->ok = ok;
+        job->finished = true;
+        io->changed.notify_all();
+    }
+    for (auto &job : io->queue) {
+        asyncDiscard(job.get());
+        job->finished = true;
+    }
+    io->queue.clear();
+    io->changed.notify_all();
+}
+
+double MexFunction::submit(std::shared_ptr<AsyncJob> job)
+{
+    // Queue a job on the I/O thread, started on first use, and return its
+    // ticket
+    std::string err;
+
+    ASSERT(linkWaitReady(link, err) != LINK_FAILED, err);
+    if (!asyncIo) {
+        asyncIo.reset(new AsyncIo);
+        asyncIo->link = link;
+        asyncIo->thread = std::thread(asyncRun, asyncIo.get());
+    }
+    {
+        std::lock_guard<std::mutex> guard(asyncIo->lock);
+        asyncIo->queue.push_back(job);
+    }
+    asyncIo->changed.notify_all();
+    tickets[nextTicket] = job;
+    return (double) nextTicket++;
+}
+
+void MexFunction::stopAsync()
+{
+    // Fail the queued jobs, wait for the one in flight and drop all tickets
+    if (asyncIo) {
+        {
+            std::lock_guard<std::mutex> guard(asyncIo->lock);
+            asyncIo->stop = true;
+        }
+        asyncIo->changed.notify_all();
+        if (asyncIo->thread.joinable())
+            asyncIo->thread.join();
+        asyncIo.reset();
+    }
+    tickets.clear();
+    ticketReads.clear();
+}
+
+void MexFunction::readAsync(ArgumentList inputs, ArgumentList outputs)
+{
+    // ticket = plc4mex('readAsync', addresses...)
+    //   queue a read of the addresses (arguments as for read) on the I/O
+    //   thread and return its ticket at once, collect it with poll or wait
+    std::shared_ptr<AsyncJob> job(new AsyncJob);
+    ArrayFactory factory;
+    uint32_t offset = 0, size, count;
+    PlcType type;
+    size_t idx;
+
+    ASSERT(connected, "must be connected to read");
+    ASSERT(link != nullptr, "asynchronous requests need a PLC connection");
+    StructArray reads = formatReadArgs(inputs);
+    job->areas.resize(reads.getNumberOfElements());
+    for (idx = 0 ; idx < reads.getNumberOfElements() ; idx++) {
+        CharArray addr = reads[idx]["address"];
+        std::string address = resolve(addr.toAscii());
+        ImageArea *area = &job->areas[idx];
+        ASSERT(typeOfAddress(address, &type, &size, &count) &&
+            imageArea(address, type, count, area), "<" + address +
+            "> needs a known type to be read asynchronously");
+        area->offset = offset;
+        offset += (area->bytes + 7) & ~7u;
+    }
+    job->data.assign(offset, 0);
+    double ticket = submit(job);
+    ticketReads.emplace((uint64_t) ticket, reads);
+    outputs[0] = factory.createScalar<double>(ticket);
+}
+
+void MexFunction::writeAsync(ArgumentList inputs, ArgumentList outputs)
+{
+    // ticket = plc4mex('writeAsync', addresses, values)
+    //   queue a write (arguments as for write) on the I/O thread and return
+    //   its ticket at once, collect it with poll or wait
+    std::shared_ptr<AsyncJob> job(new AsyncJob);
+    ArrayFactory factory;
+    std::vector<std::string> addrs;
+    std::vector<Array> values;
+    size_t idx;
+
+    ASSERT(connected, "must be connected to write");
+    ASSERT(link != nullptr, "asynchronous requests need a PLC connection");
+    StructArray writes = formatWriteArgs(inputs);
+    for (idx = 0; idx < writes.getNumberOfElements(); idx++) {
+        CharArray addr = writes[idx]["address"];
+        addrs.push_back(resolve(addr.toAscii()));
+        values.push_back(writes[idx]["value"]);
+        cacheWrite(addrs[idx], values[idx], false);
+    }
+
+    // values are checked before any plc4c data is made, so a bad value
+    // leaks nothing
+    for (idx = 0; idx < addrs.size(); idx++) {
+        BitsRange range;
+        PlcType type;
+        uint32_t size, typed;
+        uint32_t count = (uint32_t) values[idx].getNumberOfElements();
+        if (bitsParse(addrs[idx].c_str(), &range))
+            count = range.count;
+        else if (typeOfAddress(addrs[idx], &type, &size, &typed))
+            count = typed;
+        ASSERT(mexTypeOf(values[idx].getType(), &type) && (count > 0) &&
+            (values[idx].getNumberOfElements() == count), "<" + addrs[idx] +
+            "> needs " + std::to_string(count) + " logical or numeric values");
+    }
+    job->write = true;
+    for (idx = 0; idx < addrs.size(); idx++) {
+        BitsRange range;
+        std::vector<uint8_t> flags;
+        if (bitsParse(addrs[idx].c_str(), &range)) {
+            flagsOf(values[idx], flags);
+            bitsWriteItems(&range, (const bool*) flags.data(), job->items);
+            continue;
+        }
+        plc4c_data *data = encodeWriteData(addrs[idx], values[idx]);
+        job->items.push_back({addrs[idx], data,
+            (uint32_t) values[idx].getNumberOfElements()});
+    }
+    outputs[0] = factory.createScalar<double>(submit(job));
+}
+
+void MexFunction::collect(ArgumentList inputs, ArgumentList outputs,
+    bool block)
+{
+    // [done, result, stale] = plc4mex('poll', ticket)
+    // [done, result, stale] = plc4mex('wait', ticket [, timeout])
+    //   result of a readAsync (struct as read returns, last good values if
+    //   stale) or writeAsync (true if written) once done, wait blocks for
+    //   up to timeout seconds (default forever). A collected ticket is gone.
+    ArrayFactory factory;
+    double timeout = INFINITY;
+    bool finished;
+
+    ASSERT((inputs.size() >= 2) && (inputs[1].getType() == ArrayType::DOUBLE),
+        "a ticket is required");
+    uint64_t ticket = (uint64_t) ((TypedArray<double>) inputs[1])[0];
+    if (block && (inputs.size() > 2)) {
+        ASSERT(inputs[2].getType() == ArrayType::DOUBLE,
+            "timeout must be a double");
+        timeout = ((TypedArray<double>) inputs[2])[0];
+    }
+    auto found = tickets.find(ticket);
+    ASSERT(found != tickets.end(), "unknown ticket " + std::to_string(ticket));
+    std::shared_ptr<AsyncJob> job = found->second;
+
+    {
+        std::unique_lock<std::mutex> lk(asyncIo->lock);
+        auto ready = [&job] { return job->finished; };
+        if (!block) {
+            finished = job->finished;
+        } else if (std::isinf(timeout)) {
+            asyncIo->changed.wait(lk, ready);
+            finished = true;
+        } else {
+            finished = asyncIo->changed.wait_for(lk,
+                linkSeconds(std::max(timeout, 0.0)), ready);
+        }
+    }
+    outputs[0] = factory.createScalar<bool>(finished);
+    if (!finished) {
+        if (outputs.size() > 1)
+            outputs[1] = factory.createArray<double>({0,0});
+        if (outputs.size() > 2)
+            outputs[2] = factory.createScalar<bool>(true);
+        return;
+    }
+    tickets.erase(found);
+
+    Array result = factory.createScalar<bool>(job->ok);
+    auto reads = ticketReads.find(ticket);
+    if (reads != ticketReads.end()) {
+        // filled in place: the struct returned is the one values go into
+        StructArray values(std::move(reads->second));
+        ticketReads.erase(reads);
+        if (job->ok) {
+            for (size_t idx = 0; idx < job->areas.size(); idx++) {
+                const ImageArea *area = &job->areas[idx];
+                Array value = typeDispatch<ArrayOf, Array>((PlcType) area->type,
+                    &factory, (const void*) (job->data.data() + area->offset),
+                    (size_t) area->count);
+                lastGood[area->address] = value;
+                cacheStore(area->address, value);
+                values[idx]["value"] = value;
+            }
+        } else {
+            holdReadValues(values);
+        }
+        result = values;
+    }
+    if (outputs.size() > 1)
+        outputs[1] = result;
+    if (outputs.size() > 2)
+        outputs[2] = factory.createScalar<bool>(!job->ok);
+}
+
+void MexFunction::logFlush()
+{
+    // Print the queued log messages, the only place plc4mex writes to the
+    // MATLAB command window from unless asked
+    if (!logPending())
+        return;
+    logDrain([this](int level, int64_t stamp, const char *msg) {
+        (void) stamp;
+        DISP(std::string("plc4mex ") + logLevelName(level) + ": " + msg);
+    });
+}
+
+void MexFunction::logOp(ArgumentList inputs, ArgumentList outputs)
+{
+    // st = plc4mex('log' [, level])
+    //   set the run time level ('error', 'warn', 'info', 'debug', 'trace' 
+    //   or 0 to 4) and return the old level and the dropped message count.
+    //   Levels above the compile time level PLC4_LOG_LEVEL print nothing.
+    ArrayFactory factory;
+    int level = logRing().level.load();
+
+    if (inputs.size() > 1) {
+        if (isWordType(inputs[1].getType())) {
+            if (!logLevelOf(((CharArray) inputs[1]).toAscii(), &level))
+                level = -1;
+        } else {
+            ASSERT(inputs[1].getType() == ArrayType::DOUBLE,
+                "log level must be a name or a number");
+            level = (int) ((TypedArray<double>) inputs[1])[0];
+        }
+        ASSERT((level >= LOG_ERROR) && (level <= LOG_TRACE),
+            "log level must be error, warn, info, debug or trace");
+        level = logSetLevel(level);
+    }
+    StructArray st = factory.createStructArray({1, 1}, {"level", 
+        "compiled", "dropped"});
+    st[0]["level"] = factory.createCharArray(logLevelName(level));
+    st[0]["compiled"] = factory.createCharArray(logLevelName(PLC4_LOG_LEVEL));
+    st[0]["dropped"] = factory.createScalar<double>(
+        (double) logRing().dropped.load());
+    outputs[0] = st;
 }
 
 void MexFunction::operator()(ArgumentList outputs, ArgumentList inputs)
 {
         std::string mexOperation = ((CharArray)inputs[0]).toAscii();
         
+        // messages of background threads and the last call
+        logFlush();
         if (mexOperation == "init")
             return;
         else if  (mexOperation == "status")
@@ -669,8 +2662,44 @@ void MexFunction::operator()(ArgumentList outputs, ArgumentList inputs)
             disconnect();
         else if (mexOperation == "read")
             read(inputs, outputs);
+        else if (mexOperation == "readmatrix")
+            readMatrix(inputs, outputs);
+        else if (mexOperation == "readBlock")
+            readBlock(inputs, outputs);
+        else if (mexOperation == "harvest")
+            harvest(inputs, outputs);
+        else if (mexOperation == "cache")
+            cacheOp(inputs, outputs);
         else if (mexOperation == "write")
-            write(inputs);
+            write(inputs, outputs);
+        else if (mexOperation == "playback")
+            playback(inputs, outputs);
+        else if (mexOperation == "tagdb")
+            tagdb(inputs, outputs);
+        else if (mexOperation == "image")
+            image(inputs, outputs);
+        else if (mexOperation == "record")
+            record(inputs, outputs);
+        else if (mexOperation == "replay")
+            replayOp(inputs, outputs);
+        else if (mexOperation == "subscribe")
+            subscribe(inputs);
+        else if (mexOperation == "unsubscribe") {
+            subStop(subscription);
+            subscription = nullptr;
+        } else if (mexOperation == "fetch")
+            fetch(outputs);
+        else if (mexOperation == "readAsync")
+            readAsync(inputs, outputs);
+        else if (mexOperation == "writeAsync")
+            writeAsync(inputs, outputs);
+        else if (mexOperation == "poll")
+            collect(inputs, outputs, false);
+        else if (mexOperation == "wait")
+            collect(inputs, outputs, true);
+        else if (mexOperation == "log")
+            logOp(inputs, outputs);
         else 
             ERROR("mex operation not recognised");  
+        logFlush();
 }
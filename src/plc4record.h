@@ -0,0 +1,317 @@
+/**************************************************************************
+* File:             plc4record.h
+*
+* Description:      Append only, memory mapped columnar recording of the
+*                   I/O of every plc4sim step
+*
+* Notes:            The file is a page aligned header followed by chunks of
+*                   RECORD_CHUNK_ROWS rows. Inside a chunk each column is
+*                   contiguous, so a column slice is a few large copies.
+*
+*                   The writer maps only the header and the chunk being
+*                   filled, the file grows one chunk at a time, so memory
+*                   use is bounded whatever the length of the run. The row
+*                   count in the header is published after each row, a
+*                   reader can follow a recording that is still running.
+*
+*                   The reader maps the whole file read only and copies the
+*                   requested rows, pages are only read when touched.
+*
+*                   Column types are stored as MATLAB class names.
+*
+* Revsions:         1.00 19/10/26 first release
+*
+* See also:         plc4sim.cpp, plc4mex.cpp
+*
+* SPDX-License-Identifier: Apache-2.0
+**************************************************************************/
+
+#ifndef PLC4RECORD_H
+#define PLC4RECORD_H
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define RECORD_MAGIC 0x43523450u    // "P4RC"
+#define RECORD_VERSION 1u
+#define RECORD_MAX_COLUMNS 128
+#define RECORD_NAME_LEN 64
+#define RECORD_CHUNK_ROWS 4096
+#define RECORD_PAGE 4096
+
+struct RecordColumn {
+    char name[RECORD_NAME_LEN];
+    char address[RECORD_NAME_LEN];
+    char type[16];                  // MATLAB class of the elements
+    uint32_t elemSize;
+    uint32_t width;                 // elements per row
+    uint64_t offset;                // of the column within a chunk
+};
+
+struct RecordHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t nColumns;
+    uint32_t chunkRows;
+    uint64_t chunkBytes;            // page aligned
+    uint64_t dataOffset;            // of the first chunk
+    std::atomic<uint64_t> rows;
+    RecordColumn columns[RECORD_MAX_COLUMNS];
+};
+
+struct RecordWriter {
+    std::string path;
+    int fd = -1;
+    RecordHeader *header = nullptr;
+    uint8_t *chunk = nullptr;       // mapping of the chunk being filled
+    uint64_t chunkIndex = 0;
+    uint32_t row = 0;               // next row within the chunk
+};
+
+struct RecordReader {
+    std::string path;
+    const uint8_t *base = nullptr;
+    size_t size = 0;
+    const RecordHeader *header = nullptr;
+};
+
+// Function: recordPageAlign ==============================================
+// Abstract: Round up to a whole number of pages
+static inline uint64_t recordPageAlign(uint64_t bytes) {
+    return (bytes + RECORD_PAGE - 1) / RECORD_PAGE * RECORD_PAGE;
+}
+
+// Function: recordAddColumn ==============================================
+// Abstract: Describe a column before the recording is created, false if
+// there are too many columns
+static inline bool recordAddColumn(std::vector<RecordColumn> &columns,
+        const char *name, const char *address, const char *type,
+        uint32_t elemSize, uint32_t width) {
+
+    RecordColumn c;
+    if (columns.size() >= RECORD_MAX_COLUMNS)
+        return false;
+    memset(&c, 0, sizeof(c));
+    strncpy(c.name, name, RECORD_NAME_LEN - 1);
+    strncpy(c.address, address, RECORD_NAME_LEN - 1);
+    strncpy(c.type, type, sizeof(c.type) - 1);
+    c.elemSize = elemSize;
+    c.width = width;
+    columns.push_back(c);
+    return true;
+}
+
+// Function: recordMapChunk ===============================================
+// Abstract: Grow the file by one chunk and map it for writing
+static inline bool recordMapChunk(RecordWriter *w, std::string &err) {
+
+    uint64_t at = w->header->dataOffset + w->chunkIndex * w->header->chunkBytes;
+    if (ftruncate(w->fd, at + w->header->chunkBytes) != 0) {
+        err = "cannot extend recording <" + w->path + ">: " + strerror(errno);
+        return false;
+    }
+    void *p = mmap(NULL, w->header->chunkBytes, PROT_READ | PROT_WRITE,
+        MAP_SHARED, w->fd, at);
+    if (p == MAP_FAILED) {
+        err = "cannot map recording <" + w->path + ">: " + strerror(errno);
+        return false;
+    }
+    w->chunk = (uint8_t*) p;
+    w->row = 0;
+    return true;
+}
+
+// Function: recordClose ==================================================
+// Abstract: Unmap and close a recording, the rows written stay valid
+static inline void recordClose(RecordWriter *w) {
+    if (!w)
+        return;
+    if (w->chunk)
+        munmap(w->chunk, w->header->chunkBytes);
+    if (w->header)
+        munmap(w->header, w->header->dataOffset);
+    if (w->fd >= 0)
+        ::close(w->fd);
+    delete w;
+}
+
+// Function: recordCreate =================================================
+// Abstract: Create (or replace) a recording with the given columns
+static inline RecordWriter* recordCreate(const std::string &path,
+        std::vector<RecordColumn> columns, std::string &err) {
+
+    uint64_t offset = 0;
+    size_t idx;
+
+    for (idx = 0; idx < columns.size(); idx++) {
+        columns[idx].offset = offset;
+        offset += (uint64_t) RECORD_CHUNK_ROWS * columns[idx].elemSize *
+            columns[idx].width;
+    }
+
+    RecordWriter *w = new RecordWriter;
+    w->path = path;
+    uint64_t dataOffset = recordPageAlign(sizeof(RecordHeader));
+    if (((w->fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0) ||
+            (ftruncate(w->fd, dataOffset) != 0)) {
+        err = "cannot create recording <" + path + ">: " + strerror(errno);
+        recordClose(w);
+        return nullptr;
+    }
+    void *p = mmap(NULL, dataOffset, PROT_READ | PROT_WRITE, MAP_SHARED,
+        w->fd, 0);
+    if (p == MAP_FAILED) {
+        err = "cannot map recording <" + path + ">: " + strerror(errno);
+        recordClose(w);
+        return nullptr;
+    }
+
+    w->header = (RecordHeader*) p;
+    w->header->magic = RECORD_MAGIC;
+    w->header->version = RECORD_VERSION;
+    w->header->nColumns = (uint32_t) columns.size();
+    w->header->chunkRows = RECORD_CHUNK_ROWS;
+    w->header->chunkBytes = recordPageAlign(offset);
+    w->header->dataOffset = dataOffset;
+    w->header->rows.store(0);
+    memcpy(w->header->columns, columns.data(),
+        columns.size() * sizeof(RecordColumn));
+    if (!recordMapChunk(w, err)) {
+        recordClose(w);
+        return nullptr;
+    }
+    return w;
+}
+
+// Function: recordCell ===================================================
+// Abstract: Where column col of the row being written goes
+static inline uint8_t* recordCell(RecordWriter *w, uint32_t col) {
+    const RecordColumn *c = &w->header->columns[col];
+    return w->chunk + c->offset + (uint64_t) w->row * c->elemSize * c->width;
+}
+
+// Function: recordCommit =================================================
+// Abstract: Publish the row written with recordCell and move on, a full
+// chunk is unmapped and the next one mapped
+static inline bool recordCommit(RecordWriter *w, std::string &err) {
+    w->header->rows.fetch_add(1, std::memory_order_release);
+    if (++w->row < w->header->chunkRows)
+        return true;
+    munmap(w->chunk, w->header->chunkBytes);
+    w->chunk = nullptr;
+    w->chunkIndex++;
+    return recordMapChunk(w, err);
+}
+
+// Function: recordOpen ===================================================
+// Abstract: Map a recording read only, nullptr and err if it is invalid
+static inline RecordReader* recordOpen(const std::string &path,
+        std::string &err) {
+
+    struct stat st;
+    int fd = open(path.c_str(), O_RDONLY);
+
+    if ((fd < 0) || (fstat(fd, &st) != 0)) {
+        if (fd >= 0)
+            ::close(fd);
+        err = "cannot open recording <" + path + ">";
+        return nullptr;
+    }
+    void *p = st.st_size >= (off_t) sizeof(RecordHeader) ?
+        mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+    ::close(fd);
+    if (p == MAP_FAILED) {
+        err = "cannot map recording <" + path + ">";
+        return nullptr;
+    }
+    const RecordHeader *h = (const RecordHeader*) p;
+    if ((h->magic != RECORD_MAGIC) || (h->version != RECORD_VERSION) ||
+            (h->nColumns > RECORD_MAX_COLUMNS) || (h->chunkRows == 0)) {
+        munmap(p, st.st_size);
+        err = "<" + path + "> is not a plc4mat recording";
+        return nullptr;
+    }
+
+    RecordReader *r = new RecordReader;
+    r->path = path;
+    r->base = (const uint8_t*) p;
+    r->size = st.st_size;
+    r->header = h;
+    return r;
+}
+
+// Function: recordRelease ================================================
+// Abstract: Unmap a recording opened with recordOpen
+static inline void recordRelease(RecordReader *r) {
+    if (!r)
+        return;
+    munmap((void*) r->base, r->size);
+    delete r;
+}
+
+// Function: recordRows ===================================================
+// Abstract: Rows readable in the current mapping, a recording still being
+// written may have more and is reopened to see them
+static inline uint64_t recordRows(const RecordReader *r) {
+    const RecordHeader *h = r->header;
+    uint64_t rows = h->rows.load(std::memory_order_acquire);
+    uint64_t mapped = r->size > h->dataOffset ?
+        (r->size - h->dataOffset) / h->chunkBytes * h->chunkRows : 0;
+    return std::min(rows, mapped);
+}
+
+// Function: recordColumnIndex ============================================
+// Abstract: Column by name, -1 if there is none
+static inline int recordColumnIndex(const RecordReader *r, const char *name) {
+    for (uint32_t idx = 0; idx < r->header->nColumns; idx++)
+        if (!strcmp(r->header->columns[idx].name, name))
+            return (int) idx;
+    return -1;
+}
+
+// Function: recordRow ====================================================
+// Abstract: Start of a row of a column, the caller checks the row exists
+static inline const uint8_t* recordRow(const RecordReader *r, uint32_t col,
+        uint64_t row) {
+    const RecordHeader *h = r->header;
+    const RecordColumn *c = &h->columns[col];
+    return r->base + h->dataOffset + (row / h->chunkRows) * h->chunkBytes +
+        c->offset + (row % h->chunkRows) * c->elemSize * c->width;
+}
+
+// Function: recordSlice ==================================================
+// Abstract: Visit rows [first, first + count) of a column as runs that are
+// contiguous in the file, copy(done, src, n) gets n rows starting at row
+// first + done. The caller checks the rows are in range.
+template <typename F>
+static inline void recordSlice(const RecordReader *r, uint32_t col,
+        uint64_t first, uint64_t count, F copy) {
+
+    const RecordHeader *h = r->header;
+    const RecordColumn *c = &h->columns[col];
+    uint64_t rowBytes = (uint64_t) c->elemSize * c->width;
+    uint64_t row = first, done = 0;
+
+    while (done < count) {
+        uint64_t chunk = row / h->chunkRows;
+        uint64_t inChunk = row % h->chunkRows;
+        uint64_t n = std::min<uint64_t>(count - done, h->chunkRows - inChunk);
+        const uint8_t *src = r->base + h->dataOffset + chunk * h->chunkBytes +
+            c->offset + inChunk * rowBytes;
+        copy(done, src, n);
+        done += n;
+        row += n;
+    }
+}
+
+#endif
@@ -0,0 +1,147 @@
+/**************************************************************************
+* File:             plc4replay.h
+*
+* Description:      Offline replay of a plc4sim recording in place of a PLC
+*
+* Notes:            A connection string replay://<file> answers reads from
+*                   the read columns of a recording made with the record
+*                   option and checks or discards writes. There is no
+*                   network, so a replayed simulation runs at CPU speed.
+*
+*                   Ports and addresses find their column by address, then
+*                   by position (the type ignored), then by port number.
+*                   plc4sim follows the recorded time column, plc4mex steps
+*                   one row per read.
+*
+* Revsions:         1.00 19/10/26 first release
+*
+* See also:         plc4record.h, plc4sim.cpp, plc4mex.cpp
+*
+* SPDX-License-Identifier: Apache-2.0
+**************************************************************************/
+
+#ifndef PLC4REPLAY_H
+#define PLC4REPLAY_H
+
+#include <cstring>
+#include <string>
+
+#include "plc4record.h"
+
+#define REPLAY_SCHEME "replay://"
+#define REPLAY_TIME_TOL 1e-9
+
+struct Replay {
+    RecordReader *rec = nullptr;
+    uint64_t rows = 0;
+    uint64_t row = 0;               // row being served
+    int timeCol = -1;
+    bool ended = false;             // asked for a time or row past the end
+    bool check = false;             // compare writes with the recording
+    size_t mismatches = 0;
+};
+
+// Function: replayIsScheme ===============================================
+// Abstract: True if a connection string names a recording to replay
+static inline bool replayIsScheme(const char *connStr) {
+    return !strncmp(connStr, REPLAY_SCHEME, strlen(REPLAY_SCHEME));
+}
+
+// Function: replayOpen ===================================================
+// Abstract: Map a recording for replay, nullptr and err if it is invalid
+// or has no rows
+static inline Replay* replayOpen(const std::string &path, std::string &err) {
+
+    RecordReader *rec = recordOpen(path, err);
+    if (!rec)
+        return nullptr;
+    if (recordRows(rec) == 0) {
+        recordRelease(rec);
+        err = "recording <" + path + "> has no rows to replay";
+        return nullptr;
+    }
+    Replay *replay = new Replay;
+    replay->rec = rec;
+    replay->rows = recordRows(rec);
+    replay->timeCol = recordColumnIndex(rec, "time");
+    return replay;
+}
+
+// Function: replayClose ==================================================
+// Abstract: Unmap the recording
+static inline void replayClose(Replay *replay) {
+    if (!replay)
+        return;
+    recordRelease(replay->rec);
+    delete replay;
+}
+
+// Function: replayPositionLength =========================================
+// Abstract: Length of the position part of an address, up to its type
+static inline size_t replayPositionLength(const char *address) {
+    const char *first = strchr(address, ':');
+    const char *type = first ? strchr(first + 1, ':') : nullptr;
+    return type ? (size_t) (type - address) : strlen(address);
+}
+
+// Function: replayColumn =================================================
+// Abstract: Column of a read or write (side "read" or "write") at an
+// address or with a port number (1 based, 0 for none), -1 if not found
+static inline int replayColumn(const Replay *replay, const char *side,
+        const char *address, int port) {
+
+    const RecordHeader *h = replay->rec->header;
+    size_t sideLen = strlen(side);
+    size_t len = replayPositionLength(address);
+    uint32_t idx;
+
+    for (idx = 0; idx < h->nColumns; idx++)
+        if (!strncmp(h->columns[idx].name, side, sideLen) &&
+                !strcmp(h->columns[idx].address, address))
+            return (int) idx;
+    for (idx = 0; idx < h->nColumns; idx++)
+        if (!strncmp(h->columns[idx].name, side, sideLen) &&
+                (replayPositionLength(h->columns[idx].address) == len) &&
+                !strncmp(h->columns[idx].address, address, len))
+            return (int) idx;
+    if (port > 0)
+        return recordColumnIndex(replay->rec,
+            (side + std::to_string(port)).c_str());
+    return -1;
+}
+
+// Function: replayColumnBytes ============================================
+// Abstract: Bytes per row of a column
+static inline uint32_t replayColumnBytes(const Replay *replay, int col) {
+    const RecordColumn *c = &replay->rec->header->columns[col];
+    return c->elemSize * c->width;
+}
+
+// Function: replaySeek ===================================================
+// Abstract: Serve the last row recorded at or before time t. Past the
+// recorded time the last row is held and ended is set. Needs the time
+// column (timeCol >= 0).
+static inline void replaySeek(Replay *replay, double t) {
+
+    double at;
+
+    while (replay->row + 1 < replay->rows) {
+        memcpy(&at, recordRow(replay->rec, replay->timeCol, replay->row + 1),
+            sizeof(at));
+        if (at > t + REPLAY_TIME_TOL)
+            break;
+        replay->row++;
+    }
+    memcpy(&at, recordRow(replay->rec, replay->timeCol, replay->row),
+        sizeof(at));
+    replay->ended = (replay->row + 1 >= replay->rows) &&
+        (t > at + REPLAY_TIME_TOL);
+}
+
+// Function: replayCell ===================================================
+// Abstract: Recorded bytes of a column in the row being served
+static inline const uint8_t* replayCell(const Replay *replay, int col) {
+    return recordRow(replay->rec, (uint32_t) col, replay->row);
+}
+
+#endif
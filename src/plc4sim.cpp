@@ -19,6 +19,9 @@
 #include <iostream>
 #include <unistd.h>
 #include <cstddef>
+#include <ctime>
+#include <cerrno>
+#include <cmath>
 
 #include <plc4c/driver_s7.h>
 #include <plc4c/plc4c.h>
@@ -27,23 +30,30 @@
 
 #include "simstruc.h"
 
+#include "plc4link.h"
+#include "plc4log.h"
+#include "plc4bits.h"
+#include "plc4broker.h"
+#include "plc4harvest.h"
+#include "plc4types.h"
+#include "plc4tags.h"
+#include "plc4image.h"
+#include "plc4record.h"
+#include "plc4replay.h"
+#include "plc4subscribe.h"
+#include "plc4virtual.h"
+
 #define PARAM_PTR(PIDX) (ssGetSFcnParam(S, PIDX))
 #define PARAM_NUMEL(PIDX) (mxGetN(PARAM_PTR(PIDX))*mxGetM(PARAM_PTR(PIDX)))
 #define PARAM_STRLEN(PIDX) ((PARAM_NUMEL(PIDX) + 1) * sizeof(char))
 #define PARAM_VAL(PIDX) *mxGetPr(PARAM_PTR(PIDX))
 
-char _INFO_[128];
-char _ERROR_[128];
-
-
-#define SET_INFO(...) snprintf(_INFO_,128,__VA_ARGS__)
-#define SET_ERROR(...) snprintf(_ERROR_,128,__VA_ARGS__)
-#define GET_ERROR() (_ERROR_)
-#define GET_INFO() (_INFO_)
-#define INFO(...) do {SET_INFO(__VA_ARGS__); ssPrintf(_INFO_);} while(0)
-#define ERROR(...) do {SET_ERROR(__VA_ARGS__); ssSetErrorStatus(S,_ERROR_);return;} while(0)
-#define WARNING(...) do {SET_INFO(__VA_ARGS__); ssWarning(S,_INFO_);} while(0)
+#define ERROR(...) do {ssSetErrorStatus(S,simError(__VA_ARGS__));return;} while(0)
+#define WARNING(...) do {char _msg[LOG_MSG_LEN]; \
+    snprintf(_msg,LOG_MSG_LEN,__VA_ARGS__); ssWarning(S,_msg);} while(0)
 #define ASSERT(chk, ...) do { if ((chk) == false) { ERROR(__VA_ARGS__); } } while (0)
+#define ASSERT_FALSE(chk, ...) do { if ((chk) == false) { \
+    ssSetErrorStatus(S,simError(__VA_ARGS__)); return false;} } while (0)
 
 #define N_PARAMS 6
 #define P_TS 0
@@ -53,11 +63,46 @@ char _ERROR_[128];
 #define P_WRITES 4
 #define P_READS 5
 
-#define N_DWORK 4
-#define DW_SYSTEM 0
-#define DW_CONNECTION 1
-#define DW_WRITES 2
-#define DW_READS 3
+#define N_DWORK 18
+#define DW_LINK 0
+#define DW_WRITES 1
+#define DW_READS 2
+#define DW_REQUEST 3
+#define DW_GENERATION 4
+#define DW_STALE 5
+#define DW_PACE 6
+#define DW_IMAGE 7
+#define DW_AREAS 8
+#define DW_RECORD 9
+#define DW_REPLAY 10
+#define DW_COLUMNS 11
+#define DW_VIRTUAL 12
+#define DW_MERGE 13
+#define DW_SUBSCRIBE 14
+#define DW_BROKER 15
+#define DW_HARVEST 16
+#define DW_SPLIT 17
+
+#define REC_TIME 0
+#define REC_WALL 1
+#define REC_STALE 2
+#define REC_PORTS 3
+
+#define DIAG_STALE 0
+#define DIAG_RECONNECTS 1
+#define DIAG_OVERRUNS 2
+#define DIAG_WORST_LATE 3
+#define DIAG_SLACK 4
+#define DIAG_WIDTH 5
+
+#define PACE_ENABLED 0
+#define PACE_START_SEC 1
+#define PACE_START_NSEC 2
+#define PACE_OVERRUNS 3
+#define PACE_WORST_LATE 4
+#define PACE_SLACK 5
+#define PACE_FIRST_STEP 6
+#define PACE_WIDTH 7
 
 #ifndef SS_STDIO_AVAILABLE
     #define SS_STDIO_AVAILABLE
@@ -67,6 +112,7 @@ char _ERROR_[128];
 #ifdef MATLAB_MEX_FILE
     #define MDL_CHECK_PARAMETERS
     #define MDL_SET_INPUT_PORT_DIMENSION_INFO
+    #define MDL_SET_INPUT_PORT_FRAME_DATA
     #define MDL_SET_INPUT_PORT_DATA_TYPE
     #define MDL_SET_OUTPUT_PORT_DIMENSION_INFO
     #define MDL_SET_OUTPUT_PORT_DATA_TYPE
@@ -74,6 +120,7 @@ char _ERROR_[128];
     #define MDL_SET_DEFAULT_PORT_DIMENSION_INFO
     #define MDL_SET_WORK_WIDTHS
     #define MDL_START 
+    #define MDL_UPDATE
     #define MDL_RTW
 #endif
 
@@ -85,15 +132,43 @@ char _ERROR_[128];
 #define ssGetOutputPortBytes(S,i) ssGetDataTypeSize(S, \
     ssGetOutputPortDataType(S,i)) * ssGetOutputPortWidth(S,i)
 
-// Function: typeNameIsBuiltIn ============================================
-// Abstract: Check if the argument is a Simulink builtin type
-int parsePortString(const char* portStr, DimsInfo_T* dimsInfo, char * const typeStr) {
+// Function: simError =====================================================
+// Abstract: Format an error for ssSetErrorStatus, which keeps the pointer,
+// into storage of the calling thread
+static const char* simError(const char *fmt, ...)
+    __attribute__((format(printf, 1, 2)));
+static const char* simError(const char *fmt, ...) {
+    static thread_local char msg[LOG_MSG_LEN];
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(msg, LOG_MSG_LEN, fmt, args);
+    va_end(args);
+    return msg;
+}
 
-    char dimsStr[strlen(portStr)];
+// Function: logFlush =====================================================
+// Abstract: Print the queued log messages, call on the simulation thread
+static void logFlush() {
+    if (!logPending())
+        return;
+    logDrain([](int level, int64_t stamp, const char *msg) {
+        (void) stamp;
+        ssPrintf("plc4sim %s: %s\n", logLevelName(level), msg);
+    });
+}
+
+// Function: parsePortString ==============================================
+// Abstract: Type and dimensions of a port string, [frame,N,C] declares a
+// frame based port of N samples by C channels
+int parsePortString(const char* portStr, DimsInfo_T* dimsInfo, char * const typeStr,
+    Frame_T *frame, std::string &err) {
+
+    char dimsStr[strlen(portStr) + 1];
     char *curPos, *token;
     curPos = strcpy(dimsStr, portStr);
     int idx, actDim, totalDim = 1;
     dimsInfo->nextSigDims = NULL;
+    *frame = FRAME_NO;
 
     if (!curPos)
         return -1;
@@ -124,10 +199,29 @@ int parsePortString(const char* portStr, DimsInfo_T* dimsInfo, char * const type
 
     // Brackets specifed, get comma seperated tokens
     token = strtok_r(curPos, ",]", &curPos);
+    if (!token) {
+        err = "bad dimensions specification, not enough tokens";
+        return -1;
+    }
+
+    // A frame of N samples by C channels, [frame,N] or [frame,N,C]
+    if (strcmp(token, "frame") == 0) {
+        *frame = FRAME_YES;
+        dimsInfo->numDims = 2;
+        dimsInfo->dims[0] = (token = strtok_r(curPos, ",]", &curPos)) ? atoi(token) : 0;
+        dimsInfo->dims[1] = (token = strtok_r(curPos, ",]", &curPos)) ? atoi(token) : 1;
+        dimsInfo->width = dimsInfo->dims[0] * dimsInfo->dims[1];
+        if ((dimsInfo->dims[0] < 1) || (dimsInfo->dims[1] < 1) ||
+                ((curPos) && (strlen(curPos) > 0))) {
+            err = "bad frame dimensions, [frame,N] or [frame,N,C]";
+            return -1;
+        }
+        return 0;
+    }
     dimsInfo->numDims = atoi(token);
 
     if (dimsInfo->numDims > 8) {
-        SET_INFO("bad dimensions, no more than 8 dims allowed");
+        err = "bad dimensions, no more than 8 dims allowed";
         return -1;
     } 
 
@@ -136,7 +230,7 @@ int parsePortString(const char* portStr, DimsInfo_T* dimsInfo, char * const type
         dimsInfo->width = -1;
         dimsInfo->dims = NULL;
         if  ((curPos) && (strlen(curPos) > 0))  {
-            SET_INFO("bad dimensions if -1 numDims no more nums allowed");
+            err = "bad dimensions if -1 numDims no more nums allowed";
             return -1;
         }
         return 0;
@@ -154,43 +248,107 @@ int parsePortString(const char* portStr, DimsInfo_T* dimsInfo, char * const type
         }
         dimsInfo->width = totalDim;
     } else {
-        SET_INFO("bad dimensions specification, not enough tokens");
+        err = "bad dimensions specification, not enough tokens";
         return -1;
     }
     return 0;
 
 }
 
+// Function: resolvePortString ===========================================
+// Abstract: Expand a symbolic port string, eg. Motor.Speed[2,1,4], to the
+// %DB:pos:type[dims] form using the tag database. Array tags without dims
+// become a row vector. Port strings starting with % pass through.
+static bool resolvePortString(const TagDb *db, const char *portStr,
+        std::string &resolved, std::string &err) {
+
+    const char *dims = strchr(portStr, '[');
+    std::string symbol(portStr, dims ? dims - portStr : strlen(portStr));
+    const TagDbEntry *entry;
+
+    if (portStr[0] == '%') {
+        resolved = portStr;
+        return true;
+    }
+    if (!db) {
+        err = "port <" + symbol + "> is symbolic but no tagdb is given";
+        return false;
+    }
+    if (!(entry = tagdbLookup(db, symbol.c_str(), symbol.size()))) {
+        err = "unknown tag <" + symbol + ">";
+        return false;
+    }
+    resolved = db->strings + entry->address;
+    if (dims)
+        resolved += dims;
+    else if (entry->count > 1)
+        resolved += "[2,1," + std::to_string(entry->count) + "]";
+    return true;
+}
+
+// Function: portTagDb ====================================================
+// Abstract: Open the tag database named by the tagdb connection option,
+// nullptr without error if the option is not given
+static bool portTagDb(const LinkOptionMap &opts, TagDb **db,
+        std::string &err) {
+
+    auto found = opts.find("tagdb");
+    *db = nullptr;
+    if (found == opts.end())
+        return true;
+    return (*db = tagdbOpen(found->second.c_str(), err)) != nullptr;
+}
+
+// Function: simTypeOf ====================================================
+// Abstract: PlcType of a Simulink builtin type, false for busses and types
+// plc4mat does not move
+static bool simTypeOf(DTypeId id, PlcType *type) {
+    switch (id) {
+        case SS_BOOLEAN: *type = TYPE_BOOL; return true;
+        case SS_INT8: *type = TYPE_INT8; return true;
+        case SS_UINT8: *type = TYPE_UINT8; return true;
+        case SS_INT16: *type = TYPE_INT16; return true;
+        case SS_UINT16: *type = TYPE_UINT16; return true;
+        case SS_INT32: *type = TYPE_INT32; return true;
+        case SS_UINT32: *type = TYPE_UINT32; return true;
+        case SS_SINGLE: *type = TYPE_FLOAT; return true;
+        case SS_DOUBLE: *type = TYPE_DOUBLE; return true;
+        default: return false;
+    }
+}
+
 // Function: typeNameIsBuiltIn ============================================
-// Abstract: Check if the argument is a Simulink builtin type
+// Abstract: Check if the argument names a Simulink builtin type, by its
+// MATLAB class or S7 type name
 static int typeNameIsBuiltIn(char* typeName) {
+
+    PlcType type;
+    uint32_t size;
+    const char *matlab;
+    DTypeId id;
+
     if (!typeName)
         return INVALID_DTYPE_ID;
-    else if (!strcmp(typeName, "double") || !strcasecmp(typeName, "lreal"))
-        return SS_DOUBLE;
-    else if (!strcmp(typeName, "single") || !strcasecmp(typeName, "real"))
-        return SS_SINGLE;
-    else if (!strcmp(typeName, "uint8") || !strcasecmp(typeName, "byte") || !strcasecmp(typeName, "usint"))
-        return SS_UINT8;
-    else if (!strcmp(typeName, "int8") || !strcasecmp(typeName, "sint"))
-        return SS_INT8;
-    else if (!strcmp(typeName, "uint16") || !strcasecmp(typeName, "word")  || !strcasecmp(typeName, "uint"))
-        return SS_UINT16;
-    else if (!strcmp(typeName, "int16") || !strcasecmp(typeName, "int"))
-        return SS_INT16;
-    else if (!strcmp(typeName, "uint32") || !strcasecmp(typeName, "dword") || !strcasecmp(typeName, "udint"))
-        return SS_UINT32;
-    else if (!strcmp(typeName, "int32") || !strcasecmp(typeName, "dint"))
-        return SS_INT32;
-    else if (!strcmp(typeName, "boolean") || !strcasecmp(typeName, "bool"))
-        return SS_BOOLEAN;
-    else if (!strcasecmp(typeName, "inherit"))
+    if (!strcasecmp(typeName, "inherit"))
         return DYNAMICALLY_TYPED;
-    else
-        return INVALID_DTYPE_ID;
+    if (!strcmp(typeName, "boolean"))
+        return SS_BOOLEAN;
+    for (id = SS_DOUBLE ; id <= SS_BOOLEAN ; id++) {
+        if (!simTypeOf(id, &type))
+            continue;
+        typeS7Name(type, &size, &matlab);
+        if (!strcmp(typeName, matlab))
+            return id;
+    }
+    if (typeOfName(typeName, &type, &size))
+        for (id = SS_DOUBLE ; id <= SS_BOOLEAN ; id++) {
+            PlcType simType;
+            if (simTypeOf(id, &simType) && (simType == type))
+                return id;
+        }
+    return INVALID_DTYPE_ID;
 }
 
-
 // Function: mdlCheckParameters ===========================================
 // Abstract: Verify the mask paramters are valid, also called if run time 
 // parameters change during simulation.
@@ -216,6 +374,7 @@ static void mdlInitializeSizes(SimStruct *S) {
     size_t i;
     DimsInfo_T dimInfo;
     int dimArray[8];
+    Frame_T frame;
     char typeStr[64];
     char connStr[PARAM_STRLEN(P_CONNECTION)];
     char writeStr[PARAM_STRLEN(P_WRITES)];
@@ -238,6 +397,25 @@ static void mdlInitializeSizes(SimStruct *S) {
     mxGetString(PARAM_PTR(P_CONNECTION), connStr, PARAM_STRLEN(P_CONNECTION));
     mxGetString(PARAM_PTR(P_WRITES), writeStr, PARAM_STRLEN(P_WRITES));
     mxGetString(PARAM_PTR(P_READS), readStr, PARAM_STRLEN(P_READS));
+
+    // Port strings may name tags of the database given by the tagdb option
+    std::string linkKey, portAddr, err;
+    LinkOptionMap linkOpts;
+    TagDb *tags;
+
+    linkSplitOptions(connStr, linkKey, linkOpts);
+    if (!portTagDb(linkOpts, &tags, err))
+        ERROR("%s", err.c_str());
+
+    // A split phase block writes its inputs after the step computed them,
+    // they do not feed through to the outputs of the step
+    bool split = false;
+
+    if (!linkOptionFlag(linkOpts, "split", &split, err))
+        ERROR("%s", err.c_str());
+    if (split && (imageIsScheme(connStr) || replayIsScheme(connStr) ||
+            virtualIsScheme(connStr) || brokerIsScheme(connStr)))
+        ERROR("split needs a PLC connection");
     
     // INPUT PORTS DEFINITION ---------------------------------------------
     // NOTE: ssRegisterDataTypeFromNamedExpr doesn't work with bus selector
@@ -256,8 +434,11 @@ static void mdlInitializeSizes(SimStruct *S) {
         if (!(portStr = strtok_r(portStrPtr, ";", &portStrPtr)))
             ERROR("Not enough ip port strings!\n");
 
-        if (parsePortString(portStr, &dimInfo, typeStr))
-            ERROR("IP[%lu]: %s", i+1, GET_INFO());
+        if (!resolvePortString(tags, portStr, portAddr, err))
+            ERROR("IP[%lu]: %s", i+1, err.c_str());
+
+        if (parsePortString(portAddr.c_str(), &dimInfo, typeStr, &frame, err))
+            ERROR("IP[%lu]: %s", i+1, err.c_str());
         
         if ((typeId = typeNameIsBuiltIn(typeStr)) == INVALID_DTYPE_ID) {
             ssRegisterTypeFromNamedObject(S, typeStr, &typeId); 
@@ -265,15 +446,30 @@ static void mdlInitializeSizes(SimStruct *S) {
                 ERROR("Bad IP type name <%s> specified!\n",typeStr);
         }
         ssSetInputPortDataType(S, i, typeId);
-        ssSetInputPortDirectFeedThrough(S, i, 1);
+        ssSetInputPortDirectFeedThrough(S, i, split ? 0 : 1);
         ssSetInputPortRequiredContiguous(S, i, 1);
         ssSetInputPortDimensionInfo(S, i, &dimInfo);
+        if (frame == FRAME_YES)
+            ssSetInputPortFrameData(S, i, FRAME_YES);
         if (ssIsDataTypeABus(S,typeId))
             ssSetBusInputAsStruct(S, i, typeId);
     }
     
     // OUTPUT PORTS DEFINITION --------------------------------------------
-    ssSetNumOutputPorts(S, nOutput); 
+    // Outputs must keep their buffers between steps so held values survive
+    // a reconnect, an optional diagnostics port follows the read ports
+    bool diagnostics = false;
+
+    if (!linkOptionFlag(linkOpts, "diagnostics", &diagnostics, err))
+        ERROR("%s", err.c_str());
+    // the log level is of the whole binary, the last block to set it wins
+    if (linkOpts.count("log")) {
+        int level;
+        if (!logLevelOf(linkOpts["log"], &level))
+            ERROR("bad log option <%s>", linkOpts["log"].c_str());
+        logSetLevel(level);
+    }
+    ssSetNumOutputPorts(S, nOutput + (diagnostics ? 1 : 0)); 
 
     for (i = 0; i < nOutput; i++){
 
@@ -285,9 +481,12 @@ static void mdlInitializeSizes(SimStruct *S) {
         dimInfo.dims = dimArray;
         if (!(portStr = strtok_r(portStrPtr, ";", &portStrPtr)))
             ERROR("Not enough op port strings!\n");
+
+        if (!resolvePortString(tags, portStr, portAddr, err))
+            ERROR("OP[%lu]: %s", i+1, err.c_str());
         
-        if (parsePortString(portStr, &dimInfo, typeStr))
-            ERROR("OP[%lu]: %s", i+1, GET_INFO());
+        if (parsePortString(portAddr.c_str(), &dimInfo, typeStr, &frame, err))
+            ERROR("OP[%lu]: %s", i+1, err.c_str());
         
         if ((typeId = typeNameIsBuiltIn(&typeStr[0])) == INVALID_DTYPE_ID){
             ssRegisterTypeFromNamedObject(S, &typeStr[0], &typeId);
@@ -296,24 +495,26 @@ static void mdlInitializeSizes(SimStruct *S) {
         }
         ssSetOutputPortDataType(S, i, typeId);
         ssSetOutputPortDimensionInfo(S, i, &dimInfo);
+        ssSetOutputPortFrameData(S, i, frame);
+        ssSetOutputPortOptimOpts(S, i, SS_NOT_REUSABLE_AND_GLOBAL);
         if (ssIsDataTypeABus(S,typeId)) {
             ssSetBusOutputAsStruct(S, i, typeId);
             ssSetBusOutputObjectName(S, i, &typeStr[0]);
         }
     } 
 
+    if (diagnostics) {
+        ssSetOutputPortDataType(S, nOutput, SS_DOUBLE);
+        ssSetOutputPortWidth(S, nOutput, DIAG_WIDTH);
+    }
+
     // D-WORK VECTOR DEFINITION -------------------------------------------
     ssSetNumDWork(S, N_DWORK);
 
-    ssSetDWorkDataType(S, DW_SYSTEM, SS_POINTER);
-    ssSetDWorkWidth(S, DW_SYSTEM, 1);
-    ssSetDWorkComplexSignal(S, DW_SYSTEM, COMPLEX_NO);
-    ssSetDWorkName(S, DW_SYSTEM, "DW_SYSTEM");
-
-    ssSetDWorkDataType(S, DW_CONNECTION, SS_POINTER);
-    ssSetDWorkWidth(S, DW_CONNECTION, 1);
-    ssSetDWorkComplexSignal(S, DW_CONNECTION, COMPLEX_NO);
-    ssSetDWorkName(S, DW_CONNECTION, "DW_CONNECTION");
+    ssSetDWorkDataType(S, DW_LINK, SS_POINTER);
+    ssSetDWorkWidth(S, DW_LINK, 1);
+    ssSetDWorkComplexSignal(S, DW_LINK, COMPLEX_NO);
+    ssSetDWorkName(S, DW_LINK, "DW_LINK");
 
     ssSetDWorkDataType(S, DW_WRITES, SS_POINTER);
     ssSetDWorkWidth(S, DW_WRITES, MAX(nInput, 1));
@@ -325,13 +526,88 @@ static void mdlInitializeSizes(SimStruct *S) {
     ssSetDWorkComplexSignal(S, DW_READS, COMPLEX_NO);
     ssSetDWorkName(S, DW_READS, "DW_READS");
 
+    ssSetDWorkDataType(S, DW_REQUEST, SS_POINTER);
+    ssSetDWorkWidth(S, DW_REQUEST, 1);
+    ssSetDWorkComplexSignal(S, DW_REQUEST, COMPLEX_NO);
+    ssSetDWorkName(S, DW_REQUEST, "DW_REQUEST");
+
+    ssSetDWorkDataType(S, DW_GENERATION, SS_UINT32);
+    ssSetDWorkWidth(S, DW_GENERATION, 1);
+    ssSetDWorkComplexSignal(S, DW_GENERATION, COMPLEX_NO);
+    ssSetDWorkName(S, DW_GENERATION, "DW_GENERATION");
+
+    ssSetDWorkDataType(S, DW_STALE, SS_BOOLEAN);
+    ssSetDWorkWidth(S, DW_STALE, 1);
+    ssSetDWorkComplexSignal(S, DW_STALE, COMPLEX_NO);
+    ssSetDWorkName(S, DW_STALE, "DW_STALE");
+
+    ssSetDWorkDataType(S, DW_PACE, SS_DOUBLE);
+    ssSetDWorkWidth(S, DW_PACE, PACE_WIDTH);
+    ssSetDWorkComplexSignal(S, DW_PACE, COMPLEX_NO);
+    ssSetDWorkName(S, DW_PACE, "DW_PACE");
+
+    ssSetDWorkDataType(S, DW_IMAGE, SS_POINTER);
+    ssSetDWorkWidth(S, DW_IMAGE, 1);
+    ssSetDWorkComplexSignal(S, DW_IMAGE, COMPLEX_NO);
+    ssSetDWorkName(S, DW_IMAGE, "DW_IMAGE");
+
+    ssSetDWorkDataType(S, DW_AREAS, SS_INT32);
+    ssSetDWorkWidth(S, DW_AREAS, MAX(nOutput, 1));
+    ssSetDWorkComplexSignal(S, DW_AREAS, COMPLEX_NO);
+    ssSetDWorkName(S, DW_AREAS, "DW_AREAS");
+
+    ssSetDWorkDataType(S, DW_RECORD, SS_POINTER);
+    ssSetDWorkWidth(S, DW_RECORD, 1);
+    ssSetDWorkComplexSignal(S, DW_RECORD, COMPLEX_NO);
+    ssSetDWorkName(S, DW_RECORD, "DW_RECORD");
+
+    ssSetDWorkDataType(S, DW_REPLAY, SS_POINTER);
+    ssSetDWorkWidth(S, DW_REPLAY, 1);
+    ssSetDWorkComplexSignal(S, DW_REPLAY, COMPLEX_NO);
+    ssSetDWorkName(S, DW_REPLAY, "DW_REPLAY");
+
+    ssSetDWorkDataType(S, DW_COLUMNS, SS_INT32);
+    ssSetDWorkWidth(S, DW_COLUMNS, MAX(nInput + nOutput, 1));
+    ssSetDWorkComplexSignal(S, DW_COLUMNS, COMPLEX_NO);
+    ssSetDWorkName(S, DW_COLUMNS, "DW_COLUMNS");
+
+    ssSetDWorkDataType(S, DW_VIRTUAL, SS_POINTER);
+    ssSetDWorkWidth(S, DW_VIRTUAL, 1);
+    ssSetDWorkComplexSignal(S, DW_VIRTUAL, COMPLEX_NO);
+    ssSetDWorkName(S, DW_VIRTUAL, "DW_VIRTUAL");
+
+    ssSetDWorkDataType(S, DW_MERGE, SS_POINTER);
+    ssSetDWorkWidth(S, DW_MERGE, 1);
+    ssSetDWorkComplexSignal(S, DW_MERGE, COMPLEX_NO);
+    ssSetDWorkName(S, DW_MERGE, "DW_MERGE");
+
+    ssSetDWorkDataType(S, DW_SUBSCRIBE, SS_POINTER);
+    ssSetDWorkWidth(S, DW_SUBSCRIBE, 1);
+    ssSetDWorkComplexSignal(S, DW_SUBSCRIBE, COMPLEX_NO);
+    ssSetDWorkName(S, DW_SUBSCRIBE, "DW_SUBSCRIBE");
+
+    ssSetDWorkDataType(S, DW_BROKER, SS_POINTER);
+    ssSetDWorkWidth(S, DW_BROKER, 1);
+    ssSetDWorkComplexSignal(S, DW_BROKER, COMPLEX_NO);
+    ssSetDWorkName(S, DW_BROKER, "DW_BROKER");
+
+    ssSetDWorkDataType(S, DW_HARVEST, SS_POINTER);
+    ssSetDWorkWidth(S, DW_HARVEST, 1);
+    ssSetDWorkComplexSignal(S, DW_HARVEST, COMPLEX_NO);
+    ssSetDWorkName(S, DW_HARVEST, "DW_HARVEST");
+
+    ssSetDWorkDataType(S, DW_SPLIT, SS_POINTER);
+    ssSetDWorkWidth(S, DW_SPLIT, 1);
+    ssSetDWorkComplexSignal(S, DW_SPLIT, COMPLEX_NO);
+    ssSetDWorkName(S, DW_SPLIT, "DW_SPLIT");
+
     // OTHER SIMULINK DEFINITIONS -----------------------------------------
     ssSetNumSampleTimes(S, 1);
     ssSetModelReferenceNormalModeSupport(S,DEFAULT_SUPPORT_FOR_NORMAL_MODE);
     ssSetSimStateCompliance(S, USE_DEFAULT_SIM_STATE);
     ssSetOptions(S, SS_OPTION_WORKS_WITH_CODE_REUSE | SS_OPTION_USE_TLC_WITH_ACCELERATOR);
     
-    ssPrintf("SF Callback fired\n");
+    LOG(LOG_DEBUG, "%s sized", ssGetPath(S));
 }
 
 // Function: mdlSetInputPortWidth =========================================
@@ -342,6 +618,15 @@ static void mdlSetInputPortDimensionInfo(SimStruct *S, int_T port, const DimsInf
 }
 #endif
 
+// Function: mdlSetInputPortFrameData =====================================
+// Abstract: Accept the frame data of a signal, a port declared [frame,N]
+// only takes frames
+#ifdef MDL_SET_INPUT_PORT_FRAME_DATA
+static void mdlSetInputPortFrameData(SimStruct *S, int_T port, Frame_T frameData){
+    ssSetInputPortFrameData(S, port, frameData);
+}
+#endif
+
 // Function: mdlSetInputPortDataType ======================================
 // Abstract: ...
 #ifdef MDL_SET_INPUT_PORT_DATA_TYPE
@@ -412,6 +697,12 @@ void mdlSetDefaultPortDataTypes(SimStruct *S){
 }
 #endif
 
+// Function: linkShutdown =================================================
+// Abstract: Close the links kept open between runs when the MEX is cleared
+static void linkShutdown(void) {
+    LinkRegistry::instance().shutdown();
+}
+
 // Function: mdlSetWorkWidths =============================================
 // Abstract: 
 #ifdef MDL_SET_WORK_WIDTHS
@@ -419,6 +710,21 @@ void mdlSetWorkWidths(SimStruct *S) {
     //ssSetNumRunTimeParams(S, 1);
     //const char_T *rtpWrite = "JIMMY";
     //ssRegDlgParamAsRunTimeParam(S, 0, 0, rtpWrite, SS_DOUBLE);
+
+    // Start the handshake now so it overlaps the rest of model compilation,
+    // mdlStart attaches to the link and mdlOutputs waits for it
+    char connStr[PARAM_STRLEN(P_CONNECTION)];
+    std::string err;
+
+    if ((ssGetSimMode(S) != SS_SIMMODE_NORMAL) || ssRTWGenIsCodeGen(S))
+        return;
+    mxGetString(PARAM_PTR(P_CONNECTION), connStr, PARAM_STRLEN(P_CONNECTION));
+    if (imageIsScheme(connStr) || replayIsScheme(connStr) || 
+            virtualIsScheme(connStr) || brokerIsScheme(connStr))
+        return;
+    if (!LinkRegistry::instance().prefetch(connStr, err))
+        ERROR("%s", err.c_str());
+    mexAtExit(linkShutdown);
 }
 #endif
 
@@ -431,29 +737,12 @@ static void mdlInitializeSampleTimes(SimStruct *S) {
     ssSetModelReferenceSampleTimeDefaultInheritance(S);
 }
 
-char* getPlcTypeStringFromTypeId(DTypeId id) {
-    switch (id) {
-        case SS_DOUBLE:
-            return ((char*) "LREAL");
-        case SS_SINGLE:
-            return ((char*) "REAL");
-        case SS_UINT8:
-            return ((char*) "USINT");
-        case SS_INT8:
-            return ((char*) "SINT");
-        case SS_UINT16:
-            return ((char*) "UINT");
-        case SS_INT16:
-            return ((char*) "INT");
-        case SS_UINT32:
-            return ((char*) "ULINT");
-        case SS_INT32:
-            return ((char*) "LINT");
-        case SS_BOOLEAN:
-            return ((char*) "BIT");
-        default:
-            return ((char*) "USINT");
-    }
+// Function: getPlcTypeStringFromTypeId ===================================
+// Abstract: S7 type a port of a Simulink type moves as, other types and
+// busses as bytes
+const char* getPlcTypeStringFromTypeId(DTypeId id) {
+    PlcType type;
+    return simTypeOf(id, &type) ? typeS7Name(type) : typeS7Name(TYPE_UINT8);
 }
 
 void setPortStringWorkVector(char **vwp, DTypeId typeId, int width, char* pos) {
@@ -503,6 +792,349 @@ int findCharInstanceIdx(char *str, char find, int idx) {
     *pcl = '\0';
     return 0;
 }
+// Function: portClassName ================================================
+// Abstract: MATLAB class and element size a port is recorded as, busses
+// and other types are recorded as their bytes
+static const char* portClassName(SimStruct *S, DTypeId id, uint32_T *size) {
+
+    PlcType type;
+    const char *matlab;
+
+    if (ssIsDataTypeABus(S, id) || !simTypeOf(id, &type))
+        type = TYPE_UINT8;
+    typeS7Name(type, size, &matlab);
+    return matlab;
+}
+
+// Virtual PLC of a block and the items of its ports
+struct VirtualPorts {
+    VirtualPlc *plc;
+    std::vector<VirtualItem> writes;
+    std::vector<VirtualItem> reads;
+};
+
+// Function: virtualPortItem ==============================================
+// Abstract: Item of a port, at the position of its address and with the
+// element type and count of the port buffer, busses as bytes
+static bool virtualPortItem(SimStruct *S, DTypeId id, int bytes,
+        const char *address, VirtualItem *item, std::string &err) {
+
+    uint32_T size;
+
+    if (!virtualParse(address, item, err))
+        return false;
+    if (ssIsDataTypeABus(S, id) || !simTypeOf(id, &item->type))
+        item->type = TYPE_UINT8;
+    typeS7Name(item->type, &size);
+    item->size = size;
+    item->count = bytes / size;
+    return true;
+}
+
+// Broker client of a block with the areas of its ports, values staged at
+// their offsets
+struct BrokerPorts {
+    BrokerClient *client;
+    std::vector<ImageArea> writes;
+    std::vector<ImageArea> reads;
+    std::vector<uint8_t> out;
+    std::vector<uint8_t> in;
+};
+
+// Function: brokerPortAreas ==============================================
+// Abstract: Areas of the ports of a block in the type of each port, busses
+// as bytes, back to back in a stage
+static bool brokerPortAreas(SimStruct *S, bool input, char **addrs, int n,
+        std::vector<ImageArea> &areas, std::vector<uint8_t> &stage,
+        std::string &err) {
+
+    uint32_t offset = 0;
+    PlcType type;
+
+    areas.resize(n);
+    for (int idx = 0 ; idx < n ; idx++) {
+        DTypeId id = input ? ssGetInputPortDataType(S, idx) : 
+            ssGetOutputPortDataType(S, idx);
+        uint32_t count = input ? ssGetInputPortWidth(S, idx) :
+            ssGetOutputPortWidth(S, idx);
+        if (ssIsDataTypeABus(S, id) || !simTypeOf(id, &type)) {
+            type = TYPE_UINT8;
+            count = input ? ssGetInputPortBytes(S, idx) : 
+                ssGetOutputPortBytes(S, idx);
+        }
+        if (!imageArea(addrs[idx], type, count, &areas[idx])) {
+            err = std::string("address <") + addrs[idx] + "> is too long";
+            return false;
+        }
+        areas[idx].offset = offset;
+        offset += (areas[idx].bytes + 7) & ~7u;
+    }
+    stage.assign(offset, 0);
+    return true;
+}
+
+// A block of a merge group and the read values staged for it
+struct MergeMember {
+    SimStruct *S;
+    std::vector<uint8_t> stage;     // read ports back to back
+    bool ran;                       // outputs ran since the last write
+};
+
+// Blocks with the merge option on one link. The first of them to run in a
+// step reads the ports of all of them, the first to update writes them,
+// each in as few PDUs as the items fit.
+struct MergeGroup {
+    PlcLink *link;
+    unsigned pdu = LINK_DEFAULT_PDU;
+    std::vector<MergeMember> members;
+    std::vector<plc4c_read_request*> requests;  // one per PDU
+    std::vector<std::pair<size_t, int>> items;  // member, port of each item
+    unsigned generation = 0;
+    bool dirty = true;              // membership changed, rebuild requests
+    double readAt = -INFINITY;
+    double writeAt = -INFINITY;
+    bool readOk = false;
+};
+
+static std::map<PlcLink*, MergeGroup*> mergeGroups;
+
+// Subscription serving the read ports of a block and the changes of each
+// port already copied to its output
+struct SubPorts {
+    Subscription *sub;
+    std::vector<uint64_t> seen;
+};
+
+// Function: mergeDisarm ==================================================
+// Abstract: Drop the prepared read requests of a group. Call with the link
+// lock held.
+static void mergeDisarm(MergeGroup *group) {
+    for (auto request : group->requests)
+        plc4c_read_request_destroy(request);
+    group->requests.clear();
+    group->items.clear();
+    group->dirty = true;
+}
+
+// Function: mergeJoin ====================================================
+// Abstract: Add a block to the merge group of its link, the group takes
+// the smallest PDU its blocks ask for
+static MergeGroup* mergeJoin(SimStruct *S, PlcLink *link, unsigned pdu) {
+
+    MergeGroup *&group = mergeGroups[link];
+    if (!group) {
+        group = new MergeGroup;
+        group->link = link;
+        group->pdu = pdu;
+    }
+    std::lock_guard<std::mutex> guard(link->lock);
+    MergeMember member;
+    member.S = S;
+    member.ran = false;
+    group->members.push_back(member);
+    group->pdu = MIN(group->pdu, pdu);
+    mergeDisarm(group);
+    return group;
+}
+
+// Function: mergeLeave ===================================================
+// Abstract: Remove a block from its merge group, the last one frees it
+static void mergeLeave(SimStruct *S, MergeGroup *group) {
+
+    PlcLink *link = group->link;
+    {
+        std::lock_guard<std::mutex> guard(link->lock);
+        for (auto it = group->members.begin(); it != group->members.end(); it++)
+            if (it->S == S) {
+                group->members.erase(it);
+                break;
+            }
+        mergeDisarm(group);
+        if (!group->members.empty())
+            return;
+    }
+    mergeGroups.erase(link);
+    delete group;
+}
+
+// Function: subscribePorts ===============================================
+// Abstract: Subscribe to the read ports of a block, each delivered in the
+// type of its port, busses as bytes
+static SubPorts* subscribePorts(SimStruct *S, PlcLink *link, double period,
+        double periodMax, unsigned pdu, std::string &err) {
+
+    char **reads = (char**) ssGetDWork(S, DW_READS);
+    int nOut = (int) PARAM_VAL(P_N_OUT);
+    std::vector<SubItem> items(nOut);
+    DTypeId id;
+    PlcType type;
+    uint32_t count;
+    int idx;
+
+    for (idx = 0 ; idx < nOut ; idx++) {
+        id = ssGetOutputPortDataType(S, idx);
+        count = ssGetOutputPortWidth(S, idx);
+        if (ssIsDataTypeABus(S, id) || !simTypeOf(id, &type)) {
+            type = TYPE_UINT8;
+            count = ssGetOutputPortBytes(S, idx);
+        }
+        if (!subItem("Port" + std::to_string(idx), reads[idx], type, count,
+                &items[idx], err))
+            return nullptr;
+    }
+    Subscription *sub = subStart(items, period, periodMax, pdu, false, link,
+        err);
+    if (!sub)
+        return nullptr;
+    SubPorts *ports = new SubPorts;
+    ports->sub = sub;
+    ports->seen.assign(nOut, 0);
+    return ports;
+}
+
+// A read port harvesting a PLC ring buffer, its samples wait in fifo
+// until a frame of the port's width is complete
+struct HarvestPort {
+    int port;
+    Harvest harvest;
+    std::vector<uint8_t> fifo;      // host native, oldest first
+    uint64_t underruns = 0;
+};
+
+// Harvesting read ports of a block, the others are read as usual
+struct HarvestPorts {
+    unsigned pdu;
+    std::vector<bool> harvested;    // per read port
+    std::vector<HarvestPort> ports;
+};
+
+// Requests a split phase block issued in mdlUpdate, collected by the
+// mdlOutputs of the next step
+struct SplitIo {
+    unsigned generation = 0;        // of the link they were issued on
+    bool primed = false;            // a step has issued requests
+    plc4c_write_request *write = nullptr;
+    plc4c_write_request_execution *writing = nullptr;
+    plc4c_read_request_execution *reading = nullptr;
+    uint64_t steps = 0;
+    uint64_t late = 0;              // steps that waited for the responses
+};
+
+// Function: harvestPorts =================================================
+// Abstract: Harvesting ports of a block, those whose address names a ring
+// eg. %DB5:0.0/1000:single[1,500]. nullptr if there are none or on err.
+static HarvestPorts* harvestPorts(SimStruct *S, unsigned pdu, std::string &err) {
+
+    char **reads = (char**) ssGetDWork(S, DW_READS);
+    int nOut = (int) PARAM_VAL(P_N_OUT);
+    HarvestPorts *ports = nullptr;
+    HarvestSpec spec;
+    int idx;
+
+    err.clear();
+    for (idx = 0 ; idx < nOut ; idx++) {
+        if (!strchr(reads[idx], '/'))
+            continue;
+        if (!harvestParse(reads[idx], &spec, err) || 
+                (ssGetOutputPortDataType(S, idx) == SS_BOOLEAN) ||
+                ssIsDataTypeABus(S, ssGetOutputPortDataType(S, idx))) {
+            if (err.empty())
+                err = "harvest slots of <" + std::string(reads[idx]) + 
+                    "> need a numeric type";
+            delete ports;
+            return nullptr;
+        }
+        if (!ports) {
+            ports = new HarvestPorts;
+            ports->pdu = pdu;
+            ports->harvested.assign(nOut, false);
+        }
+        ports->harvested[idx] = true;
+        ports->ports.emplace_back();
+        ports->ports.back().port = idx;
+        ports->ports.back().harvest.spec = spec;
+    }
+    return ports;
+}
+
+// Function: harvestOutputs ===============================================
+// Abstract: Harvest the rings of a block into their fifos and emit the
+// oldest frame of each port, a port short of a frame holds its output.
+// A fifo keeps at most a ring and two frames, older samples are lost.
+// Returns false if the link faulted. Call with the link lock held.
+static bool harvestOutputs(SimStruct *S, PlcLink *link, HarvestPorts *ports) {
+
+    for (auto &port : ports->ports) {
+        Harvest *h = &port.harvest;
+        size_t frame = (size_t) ssGetOutputPortWidth(S, port.port) * h->spec.size;
+        size_t keep = ((size_t) h->spec.slots * h->spec.size) + 2 * frame;
+        uint64_t lost = h->lost;
+
+        if (!harvestRead(link, h, ports->pdu, port.fifo))
+            return false;
+        if (port.fifo.size() > keep) {
+            h->lost += (port.fifo.size() - keep) / h->spec.size;
+            port.fifo.erase(port.fifo.begin(), port.fifo.end() - keep);
+        }
+        if (h->lost != lost)
+            LOG(LOG_WARN, "%s read %d lost %lu samples", ssGetPath(S),
+                port.port + 1, (unsigned long) (h->lost - lost));
+        if (port.fifo.size() < frame) {
+            port.underruns++;
+            LOG(LOG_DEBUG, "%s read %d short of a frame", ssGetPath(S),
+                port.port + 1);
+            continue;
+        }
+        memcpy(ssGetOutputPortSignal(S, port.port), port.fifo.data(), frame);
+        port.fifo.erase(port.fifo.begin(), port.fifo.begin() + frame);
+    }
+    return true;
+}
+
+// Function: recordStart ==================================================
+// Abstract: Create the recording of the record option, columns are the
+// simulation and wall clock time, the stale flag, then every write and
+// read port
+static void recordStart(SimStruct *S, const LinkOptionMap &opts,
+        char **writes, char **reads) {
+
+    RecordWriter **rec = (RecordWriter**) ssGetDWork(S, DW_RECORD);
+    int nIn = ssGetNumInputPorts(S);
+    int nOut = (int) PARAM_VAL(P_N_OUT);
+    std::vector<RecordColumn> columns;
+    std::string err;
+    char name[16];
+    uint32_T size, bytes;
+    const char *type;
+    int idx;
+
+    *rec = nullptr;
+    auto found = opts.find("record");
+    if (found == opts.end())
+        return;
+    ASSERT(!found->second.empty(), "record option needs a file name");
+
+    recordAddColumn(columns, "time", "", "double", 8, 1);
+    recordAddColumn(columns, "wall", "", "int64", 8, 1);
+    recordAddColumn(columns, "stale", "", "logical", 1, 1);
+    for (idx = 0 ; idx < nIn ; idx++) {
+        type = portClassName(S, ssGetInputPortDataType(S, idx), &size);
+        bytes = ssGetInputPortBytes(S, idx);
+        sprintf(name, "write%d", idx + 1);
+        ASSERT(recordAddColumn(columns, name, writes[idx], type, size, 
+            bytes / size), "too many ports to record");
+    }
+    for (idx = 0 ; idx < nOut ; idx++) {
+        type = portClassName(S, ssGetOutputPortDataType(S, idx), &size);
+        bytes = ssGetOutputPortBytes(S, idx);
+        sprintf(name, "read%d", idx + 1);
+        ASSERT(recordAddColumn(columns, name, reads[idx], type, size, 
+            bytes / size), "too many ports to record");
+    }
+    *rec = recordCreate(found->second, columns, err);
+    ASSERT(*rec != nullptr, "%s", err.c_str());
+}
+
 // Function: mdlStart =====================================================
 // Abstract: Do one shot heavy lifting, such as opening files and sockets 
 // and setting work vectors for the mdlOutputs code.
@@ -515,13 +1147,12 @@ static void mdlStart(SimStruct *S) {
     char writeStr[PARAM_STRLEN(P_WRITES)];
 
     nIn = ssGetNumInputPorts(S);
-    nOut = ssGetNumOutputPorts(S);
+    nOut = (int) PARAM_VAL(P_N_OUT);
 
     char** writes = (char**) ssGetDWork(S,DW_WRITES);
     char** reads = (char**) ssGetDWork(S,DW_READS);
     
-    plc4c_system** system  = (plc4c_system**) ssGetDWork(S,DW_SYSTEM);
-    plc4c_connection** connection = (plc4c_connection**) ssGetDWork(S,DW_CONNECTION);
+    PlcLink** link = (PlcLink**) ssGetDWork(S,DW_LINK);
 
     size_t idx;
     DTypeId typeId;
@@ -530,23 +1161,39 @@ static void mdlStart(SimStruct *S) {
     mxGetString(PARAM_PTR(P_READS), readStr, PARAM_STRLEN(P_READS));
     mxGetString(PARAM_PTR(P_WRITES), writeStr, PARAM_STRLEN(P_WRITES));
 
+    // Symbols are resolved once here, the work vectors hold addresses
+    char connStr[PARAM_STRLEN(P_CONNECTION)];
+    std::string linkKey, portAddr, err;
+    LinkOptionMap linkOpts;
+    TagDb *tags;
+
+    mxGetString(PARAM_PTR(P_CONNECTION), connStr, PARAM_STRLEN(P_CONNECTION));
+    linkSplitOptions(connStr, linkKey, linkOpts);
+    ASSERT(portTagDb(linkOpts, &tags, err), "%s", err.c_str());
+
     for (idx = 0 ; idx < nIn ; idx++) {
         portToken = strtok_r(idx == 0 ? writeStr : portPtr, ";", &portPtr);
+        ASSERT(resolvePortString(tags, portToken, portAddr, err),
+            "%s", err.c_str());
+        portToken = &portAddr[0];
         
         if (findCharInstanceIdx(portToken, ':', 2))
             ERROR("failed to find port tokens");
 
         typeId = ssGetInputPortDataType(S,idx);
         if ssIsDataTypeABus(S,typeId)
-            width = ssGetOutputPortBytes(S, idx);
+            width = ssGetInputPortBytes(S, idx);
         else
-            width = ssGetOutputPortWidth(S, idx);
+            width = ssGetInputPortWidth(S, idx);
         setPortStringWorkVector(&writes[idx], typeId,  width, portToken);
-        INFO("Write %lu: %s\n",idx, writes[idx]);
+        LOG(LOG_DEBUG, "write %lu: %s", idx, writes[idx]);
     }
 
     for (idx = 0 ; idx < nOut ; idx++) {
         portToken = strtok_r(idx == 0 ? readStr : portPtr, ";", &portPtr);
+        ASSERT(resolvePortString(tags, portToken, portAddr, err),
+            "%s", err.c_str());
+        portToken = &portAddr[0];
         if (findCharInstanceIdx(portToken, ':', 2))
             ERROR("failed to find port tokens");
         typeId = ssGetOutputPortDataType(S,idx);
@@ -555,355 +1202,1012 @@ static void mdlStart(SimStruct *S) {
         else
             width = ssGetOutputPortWidth(S, idx);
         setPortStringWorkVector(&reads[idx], typeId,  width, portToken);
-        INFO("Read %lu: %s\n",idx, reads[idx]);
+        LOG(LOG_DEBUG, "read %lu: %s", idx, reads[idx]);
     }
     
-    // Connect 
-    char connStr[30];  
-
-    plc4c_return_code result;
+    // A shm:// connection reads a process image served by another process,
+    // each read port maps to the image area at its position
+    ImageReader **image = (ImageReader**) ssGetDWork(S,DW_IMAGE);
+    int32_T *areas = (int32_T*) ssGetDWork(S,DW_AREAS);
+
+    Replay **replay = (Replay**) ssGetDWork(S,DW_REPLAY);
+    int32_T *columns = (int32_T*) ssGetDWork(S,DW_COLUMNS);
+
+    *image = nullptr;
+    *replay = nullptr;
+    *link = nullptr;
+    *(VirtualPorts**) ssGetDWork(S,DW_VIRTUAL) = nullptr;
+    *(MergeGroup**) ssGetDWork(S,DW_MERGE) = nullptr;
+    *(SubPorts**) ssGetDWork(S,DW_SUBSCRIBE) = nullptr;
+    *(BrokerPorts**) ssGetDWork(S,DW_BROKER) = nullptr;
+    *(HarvestPorts**) ssGetDWork(S,DW_HARVEST) = nullptr;
+    *(SplitIo**) ssGetDWork(S,DW_SPLIT) = nullptr;
+    *(plc4c_read_request**) ssGetDWork(S,DW_REQUEST) = nullptr;
+    if (imageIsScheme(connStr)) {
+        ASSERT(nIn == 0, "a process image is read only, the block can not have inputs");
+        *image = imageAttach(linkKey.substr(strlen(IMAGE_SCHEME)), err);
+        ASSERT(*image != nullptr, "%s", err.c_str());
+        for (idx = 0 ; idx < (size_t) nOut ; idx++) {
+            areas[idx] = imageFind(*image, reads[idx]);
+            ASSERT(areas[idx] >= 0, "image has no area for read %lu <%s>",
+                idx + 1, reads[idx]);
+            ASSERT((*image)->header->areas[areas[idx]].bytes == 
+                (uint32_T) ssGetOutputPortBytes(S, idx), 
+                "image area <%s> does not match the size of read %lu",
+                (*image)->header->areas[areas[idx]].address, idx + 1);
+        }
+    } else if (virtualIsScheme(connStr)) {
+        // A sim://<name> connection transfers to a virtual PLC in shared
+        // memory
+        VirtualPorts *ports = new VirtualPorts;
+        VirtualItem item;
+        *(VirtualPorts**) ssGetDWork(S,DW_VIRTUAL) = ports;
+        ports->plc = virtualAttach(linkKey.substr(strlen(VIRTUAL_SCHEME)), err);
+        ASSERT(ports->plc != nullptr, "%s", err.c_str());
+        for (idx = 0 ; idx < (size_t) nIn ; idx++) {
+            ASSERT(virtualPortItem(S, ssGetInputPortDataType(S, idx),
+                ssGetInputPortBytes(S, idx), writes[idx], &item, err), 
+                "write %lu: %s", idx + 1, err.c_str());
+            ports->writes.push_back(item);
+        }
+        for (idx = 0 ; idx < (size_t) nOut ; idx++) {
+            ASSERT(virtualPortItem(S, ssGetOutputPortDataType(S, idx),
+                ssGetOutputPortBytes(S, idx), reads[idx], &item, err), 
+                "read %lu: %s", idx + 1, err.c_str());
+            ports->reads.push_back(item);
+        }
+    } else if (brokerIsScheme(connStr)) {
+        // A broker://<name> connection shares the link of a broker process,
+        // the ports of a step go as one request
+        double timeout = LINK_DEFAULT_IO_TIMEOUT;
+        ASSERT(linkOptionSeconds(linkOpts, "io-timeout", &timeout, err),
+            "%s", err.c_str());
+        BrokerPorts *ports = new BrokerPorts;
+        *(BrokerPorts**) ssGetDWork(S,DW_BROKER) = ports;
+        ports->client = brokerConnect(linkKey.substr(strlen(BROKER_SCHEME)),
+            timeout, err);
+        ASSERT(ports->client != nullptr, "%s", err.c_str());
+        ASSERT(brokerPortAreas(S, true, writes, nIn, ports->writes, ports->out,
+            err) && brokerPortAreas(S, false, reads, nOut, ports->reads,
+            ports->in, err), "%s", err.c_str());
+    } else if (replayIsScheme(connStr)) {
+        // A replay://<file> connection serves the reads of a recording,
+        // writes are discarded or compared with the recorded writes
+        *replay = replayOpen(linkKey.substr(strlen(REPLAY_SCHEME)), err);
+        ASSERT(*replay != nullptr, "%s", err.c_str());
+        ASSERT((*replay)->timeCol >= 0, "recording has no time column");
+        ASSERT(linkOptionFlag(linkOpts, "replay-check", &(*replay)->check, err),
+            "%s", err.c_str());
+        for (idx = 0 ; idx < (size_t) nOut ; idx++) {
+            columns[nIn + idx] = replayColumn(*replay, "read", reads[idx], idx + 1);
+            ASSERT(columns[nIn + idx] >= 0, "recording has no column for "
+                "read %lu <%s>", idx + 1, reads[idx]);
+            ASSERT(replayColumnBytes(*replay, columns[nIn + idx]) == 
+                (uint32_T) ssGetOutputPortBytes(S, idx), "recorded column for "
+                "read %lu <%s> has a different size", idx + 1, reads[idx]);
+        }
+        for (idx = 0 ; idx < (size_t) nIn ; idx++) {
+            columns[idx] = replayColumn(*replay, "write", writes[idx], idx + 1);
+            if ((columns[idx] >= 0) && (replayColumnBytes(*replay, 
+                    columns[idx]) != (uint32_T) ssGetInputPortBytes(S, idx)))
+                columns[idx] = -1;
+            if ((*replay)->check && (columns[idx] < 0))
+                WARNING("recording has no column to check write %lu <%s>",
+                    idx + 1, writes[idx]);
+        }
+    } else {
+        // Attach to the link, reusing an open one from a previous run or 
+        // the handshake started in mdlSetWorkWidths. A failure already 
+        // known fails here, one still in progress is waited for in the 
+        // first mdlOutputs
+        *link = LinkRegistry::instance().acquire(connStr, err);
+        ASSERT(*link != nullptr, "%s", err.c_str());
+        mexAtExit(linkShutdown);
+
+        // Blocks merging on the same link share their requests
+        bool merge = false;
+        unsigned pdu = LINK_DEFAULT_PDU;
+        ASSERT(linkOptionFlag(linkOpts, "merge", &merge, err) &&
+            linkOptionCount(linkOpts, "pdu", LINK_MIN_PDU, &pdu, err),
+            "%s", err.c_str());
+        if (merge)
+            *(MergeGroup**) ssGetDWork(S,DW_MERGE) = mergeJoin(S, *link, pdu);
+
+        // A subscribing block's read ports change only when the values do,
+        // with subscribe-max each port is polled as often as it changes
+        double period = 0, periodMax;
+        ASSERT(linkOptionSeconds(linkOpts, "subscribe", &period, err),
+            "%s", err.c_str());
+        periodMax = period;
+        ASSERT(linkOptionSeconds(linkOpts, "subscribe-max", &periodMax, err),
+            "%s", err.c_str());
+        if (linkOpts.count("subscribe") && (nOut > 0)) {
+            ASSERT(!merge, "merge and subscribe can not be combined");
+            SubPorts *ports = subscribePorts(S, *link, period, periodMax, pdu,
+                err);
+            ASSERT(ports != nullptr, "%s", err.c_str());
+            *(SubPorts**) ssGetDWork(S,DW_SUBSCRIBE) = ports;
+        }
 
-    strcpy(connStr ,"s7:tcp://0.0.0.0:102");
-    result = plc4c_system_create(system);
-    ASSERT(result == OK, "plc4c_system_create failed");
-    plc4c_driver *s7_driver = plc4c_driver_s7_create();
-    result = plc4c_system_add_driver(*system, s7_driver);
-    ASSERT(result == OK, "plc4c_system_add_driver failed");
-    plc4c_transport *tcp_transport = plc4c_transport_tcp_create();
-    result = plc4c_system_add_transport(*system, tcp_transport);
-    ASSERT(result == OK, "plc4c_system_add_transport failed");
-    result = plc4c_system_init(*system);
-    ASSERT(result == OK, "plc4c_system_init failed");
-    result = plc4c_system_connect(*system, connStr, connection);
-    ASSERT(result == OK, "plc4c_system_connect failed");
-    while (1) {
-        plc4c_system_loop(*system);
-        if (plc4c_connection_get_connected(*connection))
-            break;
-        else if (plc4c_connection_has_error(*connection))
-            return;
+        // Read ports naming a ring buffer harvest it, emitting frames
+        HarvestPorts *harvested = harvestPorts(S, pdu, err);
+        ASSERT(err.empty(), "%s", err.c_str());
+        *(HarvestPorts**) ssGetDWork(S,DW_HARVEST) = harvested;
+        ASSERT(!harvested || (!merge && !linkOpts.count("subscribe")),
+            "harvesting reads can not be merged or subscribed");
+
+        // A frame moves as one item, it must fit the data of a PDU. Harvests
+        // are split to fit
+        uint32_T frameMax = pdu - LINK_S7_HEADER - LINK_S7_DATA;
+        for (idx = 0 ; idx < (size_t) nIn ; idx++)
+            ASSERT((ssGetInputPortFrameData(S, idx) != FRAME_YES) ||
+                ((uint32_T) ssGetInputPortBytes(S, idx) <= frameMax),
+                "frame of write %lu is more than the %u bytes a PDU carries",
+                idx + 1, frameMax);
+        for (idx = 0 ; idx < (size_t) nOut ; idx++)
+            ASSERT((ssGetOutputPortFrameData(S, idx) != FRAME_YES) ||
+                (harvested && harvested->harvested[idx]) ||
+                ((uint32_T) ssGetOutputPortBytes(S, idx) <= frameMax),
+                "frame of read %lu is more than the %u bytes a PDU carries",
+                idx + 1, frameMax);
+
+        // A split phase block issues its I/O in mdlUpdate and collects it
+        // in the mdlOutputs of the next step
+        bool split = false;
+        ASSERT(linkOptionFlag(linkOpts, "split", &split, err), "%s",
+            err.c_str());
+        if (split) {
+            ASSERT(!merge && !linkOpts.count("subscribe") && !harvested,
+                "split can not be combined with merge, subscribe or harvesting");
+            *(SplitIo**) ssGetDWork(S,DW_SPLIT) = new SplitIo;
+        }
+    }
+    *(uint32_T*) ssGetDWork(S,DW_GENERATION) = 0;
+    *(bool*) ssGetDWork(S,DW_STALE) = false;
+
+    // Optional pacing to wall clock, anchored at the first step
+    bool pace = false;
+    double *paceWork = (double*) ssGetDWork(S,DW_PACE);
+
+    ASSERT(linkOptionFlag(linkOpts, "pace", &pace, err), "%s", err.c_str());
+    ASSERT(!pace || (ssGetSampleTime(S, 0) > 0), 
+        "pacing requires a discrete sample time");
+    for (idx = 0 ; idx < PACE_WIDTH ; idx++)
+        paceWork[idx] = 0;
+    paceWork[PACE_ENABLED] = pace;
+    paceWork[PACE_START_SEC] = -1;
+    recordStart(S, linkOpts, writes, reads);
+    if (*link) {
+        std::lock_guard<std::mutex> guard((*link)->lock);
+        ASSERT((*link)->state != LINK_FAILED, "%s", (*link)->error.c_str());
     }
-    INFO("connected");
 }
 #endif
 
-typedef union {
-    double *dbl;
-    float *flt;
-    uint8_t *ub;
-    int8_t *sb;
-    uint16_t *us;
-    int16_t *ss;
-    uint32_t *ui;
-    int32_t *si;
-    uint64_t *ul;
-    int64_t *sl;
-    bool *bit;
-    void *misc;
-} unionvalueptr;
-
-
-typedef union {
-    double dbl;
-    float flt;
-    uint8_t ub;
-    int8_t sb;
-    uint16_t us;
-    int16_t ss;
-    uint32_t ui;
-    int32_t si;
-    uint64_t ul;
-    int64_t sl;
-    bool bit;
-} unionvalue;
-
+// Function: encodeWriteData ==============================================
+// Abstract: plc4c data of an input port in its own type, busses as bytes
 plc4c_data* encodeWriteData(SimStruct *S, size_t port) {
     
     DTypeId dt = ssGetInputPortDataType(S, port);
-    int nElem = ssGetInputPortWidth(S, port);
-    unionvalue *sigPtrs = (unionvalue*) ssGetInputPortSignal(S, port);
+    PlcType type;
+
+    if (ssIsDataTypeABus(S, dt) || !simTypeOf(dt, &type))
+        return typeDispatch<TypeEncode, plc4c_data*>(TYPE_UINT8, 
+            (const void*) ssGetInputPortSignal(S, port), 
+            (size_t) ssGetInputPortBytes(S, port));
+    return typeDispatch<TypeEncode, plc4c_data*>(type, 
+        (const void*) ssGetInputPortSignal(S, port), 
+        (size_t) ssGetInputPortWidth(S, port));
+}
+
+// Function: decodeReadData ===============================================
+// Abstract: Store response item of a read port in a buffer of the port's
+// type, boolean ports unpack their packed bytes, busses are bytes
+void decodeReadData(SimStruct *S, size_t port, plc4c_read_response* responce,
+        size_t item, void *sigPtrs) {
     
-    switch (dt) {
-        case SS_DOUBLE:
-            if (nElem > 1) 
-                return (plc4c_data_create_double_array(&sigPtrs->dbl, nElem));
-            else 
-                return (plc4c_data_create_double_data(sigPtrs->dbl));
-        case SS_SINGLE:
-            if (nElem > 1) 
-                return (plc4c_data_create_float_array(&sigPtrs->flt, nElem));
-            else
-                return (plc4c_data_create_float_data(sigPtrs->flt));
-        case SS_INT8:
-            if (nElem > 1) 
-                return (plc4c_data_create_int8_t_array(&sigPtrs->sb, nElem));
-            else
-                return (plc4c_data_create_int8_t_data(sigPtrs->sb));
-        case SS_UINT8:
-            if (nElem > 1) 
-                return (plc4c_data_create_uint8_t_array(&sigPtrs->ub, nElem));
-            else
-                return (plc4c_data_create_uint8_t_data(sigPtrs->ub));
-        case SS_INT16:
-            if (nElem > 1) 
-                return (plc4c_data_create_int16_t_array(&sigPtrs->ss, nElem));
-            else
-                return (plc4c_data_create_int16_t_data(sigPtrs->ss));
-        case SS_UINT16:
-            if (nElem > 1) 
-                return (plc4c_data_create_uint16_t_array(&sigPtrs->us, nElem));
-            else
-                return (plc4c_data_create_uint16_t_data(sigPtrs->us));
-        case SS_INT32:
-            if (nElem > 1) 
-                return (plc4c_data_create_int32_t_array(&sigPtrs->si, nElem));
-            else
-                return (plc4c_data_create_int32_t_data(sigPtrs->si));
-        case SS_UINT32:
-            if (nElem > 1) 
-                return (plc4c_data_create_uint32_t_array(&sigPtrs->ui, nElem));
-            else
-                return (plc4c_data_create_uint32_t_data(sigPtrs->ui));
-        case SS_BOOLEAN:
-            if (nElem > 1) 
-                return (plc4c_data_create_bool_array(&sigPtrs->bit, nElem));
-            else
-                return (plc4c_data_create_bool_data(sigPtrs->bit));
-        default: 
-            nElem = ssGetInputPortBytes(S,port);
-            if (nElem > 1) 
-                return (plc4c_data_create_uint8_t_array(&sigPtrs->ub, nElem));
-            else
-                return (plc4c_data_create_uint8_t_data(sigPtrs->ub));
-               
-            // its a bus so proably getting complex 
+    DTypeId dtIdx = ssGetOutputPortDataType(S, port);
+    size_t nElem = ssGetOutputPortWidth(S, port);
+    plc4c_data *responceData;
+    PlcType type;
 
-        
+    responceData = (plc4c_data *) ((plc4c_response_value_item *) 
+        plc4c_utils_list_get_value(responce->items, item))->value;
+
+    if (dtIdx == SS_BOOLEAN) {
+        // read packed as the bytes spanning the bits
+        BitsRange range;
+        std::vector<uint8_t> bytes;
+        char **reads = (char**) ssGetDWork(S, DW_READS);
+        ASSERT(bitsParse(reads[port], &range), "invalid boolean address");
+        bitsBytesOf(responceData, bytes);
+        ASSERT(bytes.size() >= bitsByteCount(&range), "invalid data for outputs");
+        bitsUnpack(bytes.data(), range.bit, nElem, (bool*)sigPtrs);
+        return;
+    }
+    if (ssIsDataTypeABus(S, dtIdx) || !simTypeOf(dtIdx, &type)) {
+        type = TYPE_UINT8;
+        nElem = ssGetOutputPortBytes(S, port);
     }
+    size_t stored = typeDispatch<TypeDecode, size_t>(type, responceData, 
+        sigPtrs, nElem);
+    ASSERT(stored == nElem, "invalid data for outputs");
 }
 
-void decodeReadData(SimStruct *S, size_t port, plc4c_read_response* responce) {
-    
-    DTypeId dtIdx;
-    int nElem, idx;
-    void *sigPtrs;
-    plc4c_data *itemData, *responceData;
-
-    dtIdx = ssGetOutputPortDataType(S, port);
-    nElem = ssGetOutputPortWidth(S, port);
-    sigPtrs = ssGetOutputPortSignal(S, port);
-    responceData = (plc4c_data *) ((plc4c_response_value_item *) 
-        plc4c_utils_list_get_value(responce->items, port))->value;
-
-    switch (dtIdx) {
-        case SS_DOUBLE:
-            for (idx = 0 ; idx < nElem ; idx++) {
-                itemData = nElem > 1 ? (plc4c_data*) plc4c_utils_list_get_value(
-                    &responceData->data.list_value, idx) : responceData;
-                ASSERT(itemData != NULL, "invalid data for outputs");
-                ((double*)sigPtrs)[idx] = itemData->data.double_value;
-            }
-            break;
-        case SS_SINGLE:
-            for (idx = 0 ; idx < nElem ; idx++) {
-                itemData = nElem > 1 ? (plc4c_data*) plc4c_utils_list_get_value(
-                    &responceData->data.list_value, idx) : responceData;
-                ASSERT(itemData != NULL, "invalid data for outputs");
-                ((float*)sigPtrs)[idx] = itemData->data.float_value;
-            }
-            break;
-        case SS_INT8:
-            for (idx = 0 ; idx < nElem ; idx++) {
-                itemData = nElem > 1 ? (plc4c_data*) plc4c_utils_list_get_value(
-                    &responceData->data.list_value, idx) : responceData;
-                ASSERT(itemData != NULL, "invalid data for outputs");
-                ((int8_t*)sigPtrs)[idx] = itemData->data.char_value;
-            }
-            break;
-        case SS_UINT8:
-            for (idx = 0 ; idx < nElem ; idx++) {
-                itemData = nElem > 1 ? (plc4c_data*) plc4c_utils_list_get_value(
-                    &responceData->data.list_value, idx) : responceData;
-                ASSERT(itemData != NULL, "invalid data for outputs");
-                ((uint8_t*)sigPtrs)[idx] = itemData->data.uchar_value;
-            }
-            break;
-        case SS_INT16:
-            for (idx = 0 ; idx < nElem ; idx++) {
-                itemData = nElem > 1 ? (plc4c_data*) plc4c_utils_list_get_value(
-                    &responceData->data.list_value, idx) : responceData;
-                ASSERT(itemData != NULL, "invalid data for outputs");
-                ((int16_t*)sigPtrs)[idx] = itemData->data.short_value;
-            }
-            break;
-        case SS_UINT16:
-            for (idx = 0 ; idx < nElem ; idx++) {
-                itemData = nElem > 1 ? (plc4c_data*) plc4c_utils_list_get_value(
-                    &responceData->data.list_value, idx) : responceData;
-                ASSERT(itemData != NULL, "invalid data for outputs");
-                ((uint16_t*)sigPtrs)[idx] = itemData->data.ushort_value;
-            }
-            break;
-        case SS_INT32:
-            for (idx = 0 ; idx < nElem ; idx++) {
-                itemData = nElem > 1 ? (plc4c_data*) plc4c_utils_list_get_value(
-                    &responceData->data.list_value, idx) : responceData;
-                ASSERT(itemData != NULL, "invalid data for outputs");
-                ((int32_t*)sigPtrs)[idx] = itemData->data.int_value;
-            }
-            break;
-        case SS_UINT32:
-            for (idx = 0 ; idx < nElem ; idx++) {
-                itemData = nElem > 1 ? (plc4c_data*) plc4c_utils_list_get_value(
-                    &responceData->data.list_value, idx) : responceData;
-                ASSERT(itemData != NULL, "invalid data for outputs");
-                ((uint32_t*)sigPtrs)[idx] = itemData->data.uint_value;
-            }
-            break;
-        case SS_BOOLEAN:
-            for (idx = 0 ; idx < nElem ; idx++) {
-                itemData = nElem > 1 ? (plc4c_data*) plc4c_utils_list_get_value(
-                    &responceData->data.list_value, idx) : responceData;
-                ASSERT(itemData != NULL, "invalid data for outputs");
-                ((bool*)sigPtrs)[idx] = itemData->data.boolean_value;
-            }
-            break;
-        default: 
-            // its a bus encoded as a uint8_t array
-            nElem = ssGetOutputPortBytes(S,port);
-            for (idx = 0 ; idx <  nElem ; idx++) {
-                itemData = (plc4c_data*) plc4c_utils_list_get_value(
-                    &responceData->data.list_value, idx);
-                ASSERT(itemData != NULL, "invalid data for outputs");
-                ((uint8_t*)sigPtrs)[idx] = itemData->data.uchar_value;
-            }
-            break;
+// Function: portReadAddress =============================================
+// Abstract: Address a read port is requested as, boolean ports as the
+// bytes spanning their bits
+static std::string portReadAddress(SimStruct *S, int port) {
+
+    char **reads = (char**) ssGetDWork(S, DW_READS);
+    BitsRange range;
+
+    if ((ssGetOutputPortDataType(S, port) == SS_BOOLEAN) && 
+            bitsParse(reads[port], &range))
+        return bitsReadAddress(&range);
+    return reads[port];
+}
 
-           
-               
+// Function: portWriteItems ===============================================
+// Abstract: Write items of an input port, boolean ports as packed bytes
+// and the bits of partial bytes
+static void portWriteItems(SimStruct *S, int port, std::vector<BitsItem> &items) {
+
+    char **writes = (char**) ssGetDWork(S, DW_WRITES);
+    BitsRange range;
+
+    if ((ssGetInputPortDataType(S, port) == SS_BOOLEAN) &&
+            bitsParse(writes[port], &range)) {
+        bitsWriteItems(&range, (const bool*) ssGetInputPortSignal(S, port), 
+            items);
+        return;
     }
+    items.push_back({writes[port], encodeWriteData(S, port), 
+        (uint32_t) ssGetInputPortBytes(S, port)});
 }
-// Function: mdlOutputs ===================================================
-// Abstract: Use the inputs to write to the PLC and set the outputs once we
-// have read data from the PLC. Data must be also cast to relevant type.
-static void mdlOutputs(SimStruct *S, int_T tid) {
-    
-    int nIn, nOut, idx;
-    char **writes, **reads;
-    plc4c_data* data; 
+
+// Function: setStale =====================================================
+// Abstract: Flag whether the outputs hold the last good values, read ports
+// keep their buffers (not reusable) so nothing needs copying.
+static void setStale(SimStruct *S, const char *reason, bool stale) {
+
+    bool *wasStale = (bool*) ssGetDWork(S, DW_STALE);
+
+    if (stale && !*wasStale)
+        WARNING("holding outputs, %s", reason);
+    else if (!stale && *wasStale)
+        LOG(LOG_INFO, "%s connection restored, outputs live", ssGetPath(S));
+    *wasStale = stale;
+}
+
+// Function: setDiagnostics ===============================================
+// Abstract: Report link and pacing state on the diagnostics port, if the
+// block has one
+static void setDiagnostics(SimStruct *S, PlcLink *link) {
+
+    int nOut = (int) PARAM_VAL(P_N_OUT);
+    double *pace = (double*) ssGetDWork(S, DW_PACE);
+
+    if (ssGetNumOutputPorts(S) <= nOut)
+        return;
+    double *diag = (double*) ssGetOutputPortSignal(S, nOut);
+    diag[DIAG_STALE] = *(bool*) ssGetDWork(S, DW_STALE);
+    diag[DIAG_RECONNECTS] = link && (link->generation > 0) ? 
+        link->generation - 1 : 0;
+    diag[DIAG_OVERRUNS] = pace[PACE_OVERRUNS];
+    diag[DIAG_WORST_LATE] = pace[PACE_WORST_LATE];
+    diag[DIAG_SLACK] = pace[PACE_SLACK];
+}
+
+// Function: paceStep =====================================================
+// Abstract: Sleep until the wall clock deadline of the next sample hit. The
+// deadlines are absolute on CLOCK_MONOTONIC from the first step, counted
+// from the first hit whatever the start time, so sleep error does not
+// accumulate. Finishing past the deadline is an overrun,
+// more than a period late (eg. a paused simulation) re-anchors the clock.
+static void paceStep(SimStruct *S) {
+
+    double *pace = (double*) ssGetDWork(S, DW_PACE);
+    double ts = ssGetSampleTime(S, 0);
+    long long periodNs = (long long) (ts * 1e9);
+    long long hit = llround(ssGetT(S) / ts);
+    long long step, ns;
+    struct timespec now, deadline;
+
+    if (!pace[PACE_ENABLED])
+        return;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (pace[PACE_START_SEC] < 0) {
+        pace[PACE_START_SEC] = now.tv_sec;
+        pace[PACE_START_NSEC] = now.tv_nsec;
+        pace[PACE_FIRST_STEP] = (double) hit;
+    }
+    step = hit - (long long) pace[PACE_FIRST_STEP] + 1;
+
+    ns = (long long) pace[PACE_START_NSEC] + step * periodNs;
+    deadline.tv_sec = (time_t) pace[PACE_START_SEC] + ns / 1000000000LL;
+    deadline.tv_nsec = ns % 1000000000LL;
+
+    double late = (now.tv_sec - deadline.tv_sec) + 
+        (now.tv_nsec - deadline.tv_nsec) * 1e-9;
+    pace[PACE_SLACK] = -late;
+    if (late > 0) {
+        pace[PACE_OVERRUNS]++;
+        pace[PACE_WORST_LATE] = MAX(pace[PACE_WORST_LATE], late);
+        if (late > ts) {
+            ns = now.tv_sec * 1000000000LL + now.tv_nsec - step * periodNs;
+            pace[PACE_START_SEC] = ns / 1000000000LL;
+            pace[PACE_START_NSEC] = ns % 1000000000LL;
+        }
+        return;
+    }
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) 
+        == EINTR) ;
+}
+
+// Function: armReadRequest ===============================================
+// Abstract: Build the read request once per link generation, it is reused
+// every step and re-armed after a reconnect. Harvesting ports are read by
+// harvestOutputs instead. Call with the link lock held.
+static plc4c_read_request* armReadRequest(SimStruct *S, PlcLink *link) {
+
+    plc4c_read_request **request = (plc4c_read_request**) ssGetDWork(S, DW_REQUEST);
+    uint32_T *generation = (uint32_T*) ssGetDWork(S, DW_GENERATION);
+    HarvestPorts *harvested = *(HarvestPorts**) ssGetDWork(S, DW_HARVEST);
+    int nOut = (int) PARAM_VAL(P_N_OUT);
+    char namer[32];
+    int idx;
+
+    if (*request && (*generation == link->generation))
+        return *request;
+    if (*request)
+        plc4c_read_request_destroy(*request);
+    *request = nullptr;
+
+    if (plc4c_connection_create_read_request(link->connection, request) != OK)
+        return nullptr;
+    for (idx = 0 ; idx < nOut ; idx++) {
+        if (harvested && harvested->harvested[idx])
+            continue;
+        sprintf(namer, "Port%d",idx);
+        if (plc4c_read_request_add_item(*request, namer, 
+                (char*) portReadAddress(S, idx).c_str()) != OK) {
+            plc4c_read_request_destroy(*request);
+            *request = nullptr;
+            return nullptr;
+        }
+    }
+    *generation = link->generation;
+    return *request;
+}
+
+// Function: writeInputs ==================================================
+// Abstract: Write the inputs in one request. Returns false if the link
+// faulted. Call with the link lock held on a connected link.
+static bool writeInputs(SimStruct *S, PlcLink *link) {
+
+    int nIn, idx;
+    std::vector<BitsItem> items;
     plc4c_return_code result;
     plc4c_write_request* write_request;
     plc4c_write_request_execution* write_execution;
     plc4c_write_response *write_response;
-    plc4c_read_request* read_request;
-    plc4c_read_request_execution* read_execution;
-    plc4c_read_response *read_response;
-
-    int xk= 3;
-    plc4c_system* system  = *(plc4c_system**) ssGetDWork(S,DW_SYSTEM);
-    plc4c_connection* connection = *(plc4c_connection**) ssGetDWork(S,DW_CONNECTION);
+    bool done;
 
     nIn = ssGetNumInputPorts(S);
-    nOut = ssGetNumOutputPorts(S);
-    writes = (char**) ssGetDWork(S,DW_WRITES);
-    reads = (char**) ssGetDWork(S,DW_READS);
-
 
     // Inputs and write requests
-    result = plc4c_connection_create_write_request(connection, &write_request);
-    ASSERT(result == OK, "plc4c_connection_create_write_request failed");
-    for (idx = 0 ; idx < nIn ; idx++) {
-        data = encodeWriteData(S, idx);
-        result = plc4c_write_request_add_item(write_request, writes[idx] , data);
-        ASSERT(result == OK,"plc4c_write_request_add_item failed");
+    result = plc4c_connection_create_write_request(link->connection, &write_request);
+    ASSERT_FALSE(result == OK, "plc4c_connection_create_write_request failed");
+    for (idx = 0 ; idx < nIn ; idx++)
+        portWriteItems(S, idx, items);
+    for (auto &item : items) {
+        result = plc4c_write_request_add_item(write_request, 
+            (char*) item.address.c_str(), item.data);
+        ASSERT_FALSE(result == OK,"plc4c_write_request_add_item failed");
     }
 
     result = plc4c_write_request_execute(write_request, &write_execution);
-    ASSERT(result == OK, "plc4c_write_request_execute failed");
+    ASSERT_FALSE(result == OK, "plc4c_write_request_execute failed");
     
-    while (1) {
-        result = plc4c_system_loop(system);
-        ASSERT(result == OK,"plc4c_system_loop failed");
-        if (plc4c_write_request_check_finished_successfully(write_execution))
-            break;
-        else if (plc4c_write_request_execution_check_completed_with_error(write_execution))
-            ERROR("write execution failed");
-    } 
+    done = linkLoopUntil(link,
+        [&] { return plc4c_write_request_check_finished_successfully(write_execution); },
+        [&] { return plc4c_write_request_execution_check_completed_with_error(write_execution); },
+        "write");
+    if (done) {
+        write_response = plc4c_write_request_execution_get_response(write_execution);
+        ASSERT_FALSE(write_response != NULL, "plc4c_write_request_execution_get_response failed");
+        plc4c_write_destroy_write_response(write_response);
+    }
+    plc4c_write_request_execution_destroy(write_execution);
+    plc4c_write_request_destroy(write_request);
+    return done;
+}
+
+// Function: transact =====================================================
+// Abstract: Write the inputs and read the outputs in one step. Returns false
+// if the link faulted, the outputs are then left at their last values.
+// Call with the link lock held on a connected link.
+static bool transact(SimStruct *S, PlcLink *link) {
     
-    // Outputs and read requests
-    result = plc4c_connection_create_read_request(connection, &read_request);
-    ASSERT(result == OK, "plc4c_connection_create_read_request failed");
+    int nOut, idx, item;
+    plc4c_return_code result;
+    plc4c_read_request* read_request;
+    plc4c_read_request_execution* read_execution;
+    plc4c_read_response *read_response;
+    HarvestPorts *harvested;
+    bool done;
+
+    nOut = (int) PARAM_VAL(P_N_OUT);
+    harvested = *(HarvestPorts**) ssGetDWork(S, DW_HARVEST);
+
+    if (!writeInputs(S, link))
+        return false;
+    if (harvested && !harvestOutputs(S, link, harvested))
+        return false;
+    if (harvested && (harvested->ports.size() == (size_t) nOut))
+        return true;
     
-    char namer[32];
-    for (idx = 0 ; idx < nOut ; idx++) {
-        sprintf(namer, "Port%d",idx);
-        result = plc4c_read_request_add_item(read_request,namer , reads[idx]);
-        ASSERT(result == OK,"plc4c_read_request_add_item failed");
-    }
+    // Outputs and read requests, the request is prepared per connection
+    read_request = armReadRequest(S, link);
+    ASSERT_FALSE(read_request != NULL, "plc4c read request setup failed");
 
     result = plc4c_read_request_execute(read_request, &read_execution);
-    ASSERT(result == OK, "plc4c_read_request_execute failed");
-
-    while (1) {
-        result = plc4c_system_loop(system);
-        ASSERT(result == OK,"plc4c_system_loop failed");
-        if (plc4c_read_request_execution_check_finished_successfully(read_execution))
-            break;
-        else if (plc4c_read_request_execution_check_finished_with_error(read_execution))
-            ERROR("read execution failed");
-    } 
+    ASSERT_FALSE(result == OK, "plc4c_read_request_execute failed");
+
+    done = linkLoopUntil(link,
+        [&] { return plc4c_read_request_execution_check_finished_successfully(read_execution); },
+        [&] { return plc4c_read_request_execution_check_finished_with_error(read_execution); },
+        "read");
+    if (done) {
+        read_response = plc4c_read_request_execution_get_response(read_execution);
+        ASSERT_FALSE(read_response != NULL, "plc4c_read_request_execution_get_response failed");
+        for (idx = 0, item = 0 ; idx < nOut ; idx++) {
+            if (harvested && harvested->harvested[idx])
+                continue;
+            decodeReadData(S, idx, read_response, item++, 
+                ssGetOutputPortSignal(S, idx));
+        }
+        plc4c_read_destroy_read_response(read_response);
+    }
+    plc4c_read_request_execution_destroy(read_execution);
 
-    
-    // Perform the write / read
-    /*while (1) {
-        result = plc4c_system_loop(system);
-        ASSERT(result == OK,"plc4c_system_loop failed");
-        if ((plc4c_write_request_check_finished_successfully(write_execution)) &&
-            (plc4c_read_request_execution_check_finished_successfully(read_execution)))
-            break;
-        else if (plc4c_read_request_execution_check_finished_with_error(read_execution))
-            ERROR("read execution failed");
-        else if (plc4c_write_request_execution_check_completed_with_error(write_execution))
-            ERROR("write execution failed");
-    }*/
-
-    write_response = plc4c_write_request_execution_get_response(write_execution);
-    read_response = plc4c_read_request_execution_get_response(read_execution);
-    ASSERT(write_response != NULL, "plc4c_write_request_execution_get_response failed");
-    ASSERT(read_response != NULL, "plc4c_read_request_execution_get_response failed");
+    return done;
+}
 
-    
+// Function: splitDrop ====================================================
+// Abstract: Free the requests of a split phase block. Call with the link
+// lock held.
+static void splitDrop(SplitIo *split) {
+    if (split->writing)
+        plc4c_write_request_execution_destroy(split->writing);
+    if (split->write)
+        plc4c_write_request_destroy(split->write);
+    if (split->reading)
+        plc4c_read_request_execution_destroy(split->reading);
+    split->writing = nullptr;
+    split->write = nullptr;
+    split->reading = nullptr;
+}
+
+// Function: splitIssue ===================================================
+// Abstract: Send the write of the inputs and the read of the outputs of a
+// split phase block without waiting for them. Returns false on a setup
+// error. Call with the link lock held on a connected link.
+static bool splitIssue(SimStruct *S, PlcLink *link, SplitIo *split) {
+
+    int nIn = ssGetNumInputPorts(S), nOut = (int) PARAM_VAL(P_N_OUT), idx;
+    std::vector<BitsItem> items;
+    plc4c_read_request *read_request;
+
+    splitDrop(split);
+    split->primed = true;
+    split->generation = link->generation;
+    if (nIn > 0) {
+        ASSERT_FALSE(plc4c_connection_create_write_request(link->connection,
+            &split->write) == OK, "plc4c_connection_create_write_request failed");
+        for (idx = 0 ; idx < nIn ; idx++)
+            portWriteItems(S, idx, items);
+        for (auto &item : items)
+            ASSERT_FALSE(plc4c_write_request_add_item(split->write,
+                (char*) item.address.c_str(), item.data) == OK,
+                "plc4c_write_request_add_item failed");
+        ASSERT_FALSE(plc4c_write_request_execute(split->write,
+            &split->writing) == OK, "plc4c_write_request_execute failed");
+    }
+    if (nOut > 0) {
+        read_request = armReadRequest(S, link);
+        ASSERT_FALSE(read_request != NULL, "plc4c read request setup failed");
+        ASSERT_FALSE(plc4c_read_request_execute(read_request,
+            &split->reading) == OK, "plc4c_read_request_execute failed");
+    }
+
+    // put the requests on the wire, the responses are taken next step
+    plc4c_system_loop(link->system);
+    return true;
+}
+
+// Function: splitCollect =================================================
+// Abstract: Take the responses to the requests of the last step into the
+// outputs, waiting only if they are late. Returns false if they were lost
+// to a fault or a reconnect, the outputs then hold. Call with the link lock
+// held.
+static bool splitCollect(SimStruct *S, PlcLink *link, SplitIo *split) {
+
+    int nOut = (int) PARAM_VAL(P_N_OUT), idx;
+    plc4c_read_response *read_response;
+    bool done;
+
+    if (!split->writing && !split->reading)
+        return !split->primed;
+    if ((link->state != LINK_CONNECTED) ||
+            (split->generation != link->generation)) {
+        splitDrop(split);
+        return false;
+    }
+    auto finished = [&] {
+        return (!split->writing || 
+            plc4c_write_request_check_finished_successfully(split->writing)) &&
+            (!split->reading ||
+            plc4c_read_request_execution_check_finished_successfully(split->reading)); };
+    auto failed = [&] {
+        return (split->writing && 
+            plc4c_write_request_execution_check_completed_with_error(split->writing)) ||
+            (split->reading &&
+            plc4c_read_request_execution_check_finished_with_error(split->reading)); };
+
+    split->steps++;
+    if ((plc4c_system_loop(link->system) == OK) && !finished()) {
+        split->late++;
+        LOG(LOG_DEBUG, "%s waits for a late response", ssGetPath(S));
+    }
+    done = linkLoopUntil(link, finished, failed, "split");
+    if (done && split->reading) {
+        read_response = plc4c_read_request_execution_get_response(split->reading);
+        ASSERT_FALSE(read_response != NULL, "plc4c_read_request_execution_get_response failed");
+        for (idx = 0 ; idx < nOut ; idx++)
+            decodeReadData(S, idx, read_response, idx,
+                ssGetOutputPortSignal(S, idx));
+        plc4c_read_destroy_read_response(read_response);
+    }
+    if (done && split->writing) {
+        plc4c_write_response *write_response =
+            plc4c_write_request_execution_get_response(split->writing);
+        if (write_response)
+            plc4c_write_destroy_write_response(write_response);
+    }
+    splitDrop(split);
+    return done;
+}
+
+// Function: mergeArm =====================================================
+// Abstract: Build the read requests of a merge group, the read ports of
+// all its blocks packed into PDUs. Rebuilt when a block joins or leaves
+// and after a reconnect. Call with the link lock held.
+static bool mergeArm(MergeGroup *group) {
+
+    PlcLink *link = group->link;
+    std::vector<uint32_t> bytes;
+    size_t member, run, idx;
+    int port, nOut;
+
+    if (!group->dirty && (group->generation == link->generation))
+        return true;
+    mergeDisarm(group);
+    for (member = 0 ; member < group->members.size() ; member++) {
+        SimStruct *S = group->members[member].S;
+        nOut = (int) PARAM_VAL(P_N_OUT);
+        uint32_t stage = 0;
+        for (port = 0 ; port < nOut ; port++) {
+            BitsRange range;
+            char **reads = (char**) ssGetDWork(S, DW_READS);
+            group->items.push_back(std::make_pair(member, port));
+            bytes.push_back((ssGetOutputPortDataType(S, port) == SS_BOOLEAN) &&
+                bitsParse(reads[port], &range) ? bitsByteCount(&range) : 
+                ssGetOutputPortBytes(S, port));
+            stage += ssGetOutputPortBytes(S, port);
+        }
+        group->members[member].stage.assign(stage, 0);
+    }
+
+    std::vector<size_t> starts = linkPack(bytes, false, group->pdu);
+    for (run = 0 ; run < starts.size() ; run++) {
+        size_t end = run + 1 < starts.size() ? starts[run + 1] : bytes.size();
+        plc4c_read_request *request;
+        if (plc4c_connection_create_read_request(link->connection, &request) != OK) {
+            mergeDisarm(group);
+            return false;
+        }
+        group->requests.push_back(request);
+        for (idx = starts[run] ; idx < end ; idx++) {
+            std::string address = portReadAddress(
+                group->members[group->items[idx].first].S, 
+                group->items[idx].second);
+            if (plc4c_read_request_add_item(request, (char*) address.c_str(),
+                    (char*) address.c_str()) != OK) {
+                mergeDisarm(group);
+                return false;
+            }
+        }
+    }
+    group->generation = link->generation;
+    group->dirty = false;
+    return true;
+}
+
+// Function: mergeRead ====================================================
+// Abstract: Read the ports of every block in a merge group into their
+// stages, one request per PDU. Returns false if the link faulted. Call with
+// the link lock held on a connected link.
+static bool mergeRead(SimStruct *S, MergeGroup *group) {
+
+    PlcLink *link = group->link;
+    plc4c_read_request_execution *execution;
+    plc4c_read_response *response;
+    size_t run, first = 0, idx;
+    bool done;
+
+    ASSERT_FALSE(mergeArm(group), "plc4c merged read request setup failed");
+    for (run = 0 ; run < group->requests.size() ; run++) {
+        ASSERT_FALSE(plc4c_read_request_execute(group->requests[run], 
+            &execution) == OK, "plc4c_read_request_execute failed");
+        done = linkLoopUntil(link,
+            [&] { return plc4c_read_request_execution_check_finished_successfully(execution); },
+            [&] { return plc4c_read_request_execution_check_finished_with_error(execution); },
+            "merged read");
+        if (done) {
+            response = plc4c_read_request_execution_get_response(execution);
+            ASSERT_FALSE(response != NULL, "plc4c_read_request_execution_get_response failed");
+            size_t count = plc4c_utils_list_size(response->items);
+            for (idx = 0 ; idx < count ; idx++) {
+                MergeMember *member = &group->members[group->items[first + idx].first];
+                int port = group->items[first + idx].second;
+                size_t offset = 0;
+                for (int p = 0 ; p < port ; p++)
+                    offset += ssGetOutputPortBytes(member->S, p);
+                decodeReadData(member->S, port, response, idx, 
+                    member->stage.data() + offset);
+            }
+            first += count;
+            plc4c_read_destroy_read_response(response);
+        }
+        plc4c_read_request_execution_destroy(execution);
+        if (!done)
+            return false;
+    }
+    return true;
+}
+
+// Function: mergeWrite ===================================================
+// Abstract: Write the inputs of the blocks of a merge group that ran this
+// step, one request per PDU. Returns false if the link faulted. Call with
+// the link lock held on a connected link.
+static bool mergeWrite(SimStruct *S, MergeGroup *group) {
+
+    PlcLink *link = group->link;
+    std::vector<BitsItem> items;
+    std::vector<uint32_t> bytes;
+    plc4c_write_request *request;
+    plc4c_write_request_execution *execution;
+    plc4c_write_response *response;
+    size_t run, idx;
+    bool done = true;
+
+    for (auto &member : group->members) {
+        if (member.ran)
+            for (int port = 0 ; port < ssGetNumInputPorts(member.S) ; port++)
+                portWriteItems(member.S, port, items);
+        member.ran = false;
+    }
+    for (auto &item : items)
+        bytes.push_back(item.bytes);
+
+    std::vector<size_t> starts = linkPack(bytes, true, group->pdu);
+    for (run = 0 ; done && (run < starts.size()) ; run++) {
+        size_t end = run + 1 < starts.size() ? starts[run + 1] : bytes.size();
+        ASSERT_FALSE(plc4c_connection_create_write_request(link->connection, 
+            &request) == OK, "plc4c_connection_create_write_request failed");
+        for (idx = starts[run] ; idx < end ; idx++)
+            ASSERT_FALSE(plc4c_write_request_add_item(request, 
+                (char*) items[idx].address.c_str(), items[idx].data) == OK, 
+                "plc4c_write_request_add_item failed");
+        ASSERT_FALSE(plc4c_write_request_execute(request, &execution) == OK, 
+            "plc4c_write_request_execute failed");
+        done = linkLoopUntil(link,
+            [&] { return plc4c_write_request_check_finished_successfully(execution); },
+            [&] { return plc4c_write_request_execution_check_completed_with_error(execution); },
+            "merged write");
+        if (done) {
+            response = plc4c_write_request_execution_get_response(execution);
+            ASSERT_FALSE(response != NULL, "plc4c_write_request_execution_get_response failed");
+            plc4c_write_destroy_write_response(response);
+        }
+        plc4c_write_request_execution_destroy(execution);
+        plc4c_write_request_destroy(request);
+    }
+
+    // the items of runs not sent after a fault were never handed to plc4c
+    for (idx = run < starts.size() ? starts[run] : items.size() ; 
+            idx < items.size() ; idx++)
+        plc4c_data_destroy(items[idx].data);
+    return done;
+}
+
+// Function: mergeOutputs =================================================
+// Abstract: Set the outputs of a merging block, the first block of its
+// group to run at this time reads for all of them. Returns false if the
+// read failed. Call with the link lock held.
+static bool mergeOutputs(SimStruct *S, MergeGroup *group) {
+
+    int nOut = (int) PARAM_VAL(P_N_OUT);
+    size_t offset = 0;
+    int idx;
+
+    if (group->readAt != ssGetT(S)) {
+        group->readAt = ssGetT(S);
+        group->readOk = (group->link->state == LINK_CONNECTED) && 
+            mergeRead(S, group);
+    }
+    for (auto &member : group->members)
+        if (member.S == S) {
+            member.ran = true;
+            if (!group->readOk)
+                break;
+            for (idx = 0 ; idx < nOut ; idx++) {
+                memcpy(ssGetOutputPortSignal(S, idx), member.stage.data() + 
+                    offset, ssGetOutputPortBytes(S, idx));
+                offset += ssGetOutputPortBytes(S, idx);
+            }
+        }
+    return group->readOk;
+}
+
+// Function: subscribedOutputs ============================================
+// Abstract: Write the inputs and copy the read ports that changed since the
+// last step out of the block's subscription. Outputs are stale while the
+// link is down or a port has not been read yet. Call with the link lock
+// held.
+static bool subscribedOutputs(SimStruct *S, PlcLink *link, SubPorts *ports) {
+
+    int nOut = (int) PARAM_VAL(P_N_OUT);
+    bool done = link->state == LINK_CONNECTED;
+    int idx;
+
+    if (done && (ssGetNumInputPorts(S) > 0))
+        done = writeInputs(S, link);
     for (idx = 0 ; idx < nOut ; idx++) {
-        decodeReadData(S, idx, read_response);
+        subLatest(ports->sub, idx, ssGetOutputPortSignal(S, idx), 
+            &ports->seen[idx]);
+        done &= ports->seen[idx] > 0;
     }
+    return done;
+}
 
-    // Clean up
-    plc4c_write_destroy_write_response(write_response);
-    plc4c_write_request_execution_destroy(write_execution);
-    plc4c_write_request_destroy(write_request);
+// Function: recordStep ===================================================
+// Abstract: Append this step's port bytes to the recording, if any
+static void recordStep(SimStruct *S) {
 
-    plc4c_read_destroy_read_response(read_response);
-    plc4c_read_request_execution_destroy(read_execution);
-    plc4c_read_request_destroy(read_request);
+    RecordWriter *rec = *(RecordWriter**) ssGetDWork(S, DW_RECORD);
+    int nIn = ssGetNumInputPorts(S);
+    int nOut = (int) PARAM_VAL(P_N_OUT);
+    struct timespec now;
+    std::string err;
+    int idx;
+
+    if (!rec)
+        return;
+    double t = ssGetT(S);
+    clock_gettime(CLOCK_REALTIME, &now);
+    int64_t wall = (int64_t) now.tv_sec * 1000000000LL + now.tv_nsec;
+    memcpy(recordCell(rec, REC_TIME), &t, sizeof(t));
+    memcpy(recordCell(rec, REC_WALL), &wall, sizeof(wall));
+    *recordCell(rec, REC_STALE) = *(bool*) ssGetDWork(S, DW_STALE);
+    for (idx = 0 ; idx < nIn ; idx++)
+        memcpy(recordCell(rec, REC_PORTS + idx), ssGetInputPortSignal(S, idx),
+            ssGetInputPortBytes(S, idx));
+    for (idx = 0 ; idx < nOut ; idx++)
+        memcpy(recordCell(rec, REC_PORTS + nIn + idx), 
+            ssGetOutputPortSignal(S, idx), ssGetOutputPortBytes(S, idx));
+    ASSERT(recordCommit(rec, err), "%s", err.c_str());
+}
+
+// Function: imageOutputs =================================================
+// Abstract: Copy the read ports out of a process image as one consistent
+// snapshot. Outputs are stale while the image's poller is reconnecting,
+// has stopped or has not published yet.
+static void imageOutputs(SimStruct *S, ImageReader *image) {
+
+    int nOut = (int) PARAM_VAL(P_N_OUT);
+    const int32_T *areas = (const int32_T*) ssGetDWork(S, DW_AREAS);
+    const ImageHeader *h = image->header;
+    int64_t stamp;
+    int idx;
+
+    uint64_t updates = imageSnapshot(image, [&](const uint8_t *data) {
+        for (idx = 0 ; idx < nOut ; idx++)
+            memcpy(ssGetOutputPortSignal(S, idx), data + 
+                h->areas[areas[idx]].offset, h->areas[areas[idx]].bytes);
+    }, &stamp);
+
+    if (!imagePollerAlive(image, updates))
+        setStale(S, "image poller has stopped", true);
+    else if (!updates || (h->state.load() != LINK_CONNECTED))
+        setStale(S, "image poller is not connected", true);
+    else
+        setStale(S, "", false);
+}
+
+// Function: brokerOutputs ================================================
+// Abstract: Write the input ports and read the output ports through the
+// broker in one round trip. Outputs hold their values while it is stale.
+static void brokerOutputs(SimStruct *S, BrokerPorts *ports) {
+
+    std::string err;
+    size_t idx;
+
+    for (idx = 0 ; idx < ports->writes.size() ; idx++)
+        memcpy(ports->out.data() + ports->writes[idx].offset,
+            ssGetInputPortSignal(S, idx), ports->writes[idx].bytes);
+    BrokerStatus status = brokerTransact(ports->client, ports->writes,
+        ports->out.data(), ports->reads, ports->in.data(), err);
+    ASSERT(status != BROKER_BAD, "%s", err.c_str());
+    setStale(S, err.c_str(), status != BROKER_OK);
+    if (status != BROKER_OK)
+        return;
+    for (idx = 0 ; idx < ports->reads.size() ; idx++)
+        memcpy(ssGetOutputPortSignal(S, idx), ports->in.data() + 
+            ports->reads[idx].offset, ports->reads[idx].bytes);
 }
 
+// Function: replayOutputs ================================================
+// Abstract: Set the read ports from the recorded row at the current time
+// and, with replay-check, count the steps whose writes differ from the
+// recording. Past the end of the recording the outputs are held stale.
+static void replayOutputs(SimStruct *S, Replay *replay) {
+
+    int nIn = ssGetNumInputPorts(S);
+    int nOut = (int) PARAM_VAL(P_N_OUT);
+    const int32_T *columns = (const int32_T*) ssGetDWork(S, DW_COLUMNS);
+    bool differs = false;
+    int idx;
+
+    replaySeek(replay, ssGetT(S));
+    setStale(S, "replay is past the end of the recording", replay->ended);
+    if (replay->ended)
+        return;
+    for (idx = 0 ; idx < nOut ; idx++)
+        memcpy(ssGetOutputPortSignal(S, idx), replayCell(replay, 
+            columns[nIn + idx]), ssGetOutputPortBytes(S, idx));
+    if (!replay->check)
+        return;
+    for (idx = 0 ; idx < nIn ; idx++)
+        differs |= (columns[idx] >= 0) && memcmp(ssGetInputPortSignal(S, idx),
+            replayCell(replay, columns[idx]), ssGetInputPortBytes(S, idx));
+    if (differs && (replay->mismatches++ == 0))
+        WARNING("writes differ from the recording at t = %g", ssGetT(S));
+}
+
+// Function: mdlOutputs ===================================================
+// Abstract: Use the inputs to write to the PLC and set the outputs once we
+// have read data from the PLC. Data must be also cast to relevant type.
+// While the link reconnects the outputs hold their last good values.
+static void mdlOutputs(SimStruct *S, int_T tid) {
+
+    PlcLink* link = *(PlcLink**) ssGetDWork(S,DW_LINK);
+    ImageReader* image = *(ImageReader**) ssGetDWork(S,DW_IMAGE);
+    Replay* replay = *(Replay**) ssGetDWork(S,DW_REPLAY);
+    VirtualPorts* ports = *(VirtualPorts**) ssGetDWork(S,DW_VIRTUAL);
+    MergeGroup* group = *(MergeGroup**) ssGetDWork(S,DW_MERGE);
+    SubPorts* subscribed = *(SubPorts**) ssGetDWork(S,DW_SUBSCRIBE);
+    BrokerPorts* brokered = *(BrokerPorts**) ssGetDWork(S,DW_BROKER);
+    SplitIo* split = *(SplitIo**) ssGetDWork(S,DW_SPLIT);
+    std::string err;
+    bool done = false;
+    size_t idx;
+
+    // messages of the link threads and the last step
+    logFlush();
+    if (ports) {
+        for (idx = 0 ; idx < ports->writes.size() ; idx++)
+            ASSERT(virtualWrite(ports->plc, &ports->writes[idx], 
+                ssGetInputPortSignal(S, idx)), 
+                "virtual PLC has no room for write %lu", idx + 1);
+        for (idx = 0 ; idx < ports->reads.size() ; idx++)
+            ASSERT(virtualRead(ports->plc, &ports->reads[idx], 
+                ssGetOutputPortSignal(S, idx)), 
+                "virtual PLC has no room for read %lu", idx + 1);
+        recordStep(S);
+        paceStep(S);
+        setDiagnostics(S, nullptr);
+        return;
+    }
+    if (brokered) {
+        brokerOutputs(S, brokered);
+        if (ssGetErrorStatus(S))
+            return;
+        recordStep(S);
+        paceStep(S);
+        setDiagnostics(S, nullptr);
+        return;
+    }
+    if (replay) {
+        replayOutputs(S, replay);
+        recordStep(S);
+        paceStep(S);
+        setDiagnostics(S, nullptr);
+        return;
+    }
+    if (image) {
+        imageOutputs(S, image);
+        recordStep(S);
+        paceStep(S);
+        setDiagnostics(S, nullptr);
+        return;
+    }
+    ASSERT(linkWaitReady(link, err) != LINK_FAILED, "%s", err.c_str());
+    {
+        std::lock_guard<std::mutex> guard(link->lock);
+        if (group)
+            done = mergeOutputs(S, group);
+        else if (subscribed)
+            done = subscribedOutputs(S, link, subscribed);
+        else if (split)
+            done = splitCollect(S, link, split);
+        else if (link->state == LINK_CONNECTED)
+            done = transact(S, link);
+        if (ssGetErrorStatus(S))
+            return;
+        ASSERT(link->state != LINK_FAILED, "%s", link->error.c_str());
+        setStale(S, link->error.c_str(), !done);
+    }
+    recordStep(S);
+    paceStep(S);
+    setDiagnostics(S, link);
+}
+
+// Function: mdlUpdate ===================================================
+// Abstract: A merging block writes its inputs here, once every block has
+// computed its inputs for the step. The first block of a group to update
+// at this time writes for all of them. A split phase block sends its
+// write and the read of the next step's outputs.
+#ifdef MDL_UPDATE
+static void mdlUpdate(SimStruct *S, int_T tid) {
+
+    MergeGroup* group = *(MergeGroup**) ssGetDWork(S,DW_MERGE);
+    SplitIo* split = *(SplitIo**) ssGetDWork(S,DW_SPLIT);
+    PlcLink* link = *(PlcLink**) ssGetDWork(S,DW_LINK);
+
+    if (split) {
+        std::lock_guard<std::mutex> guard(link->lock);
+        if (link->state == LINK_CONNECTED)
+            splitIssue(S, link, split);
+        return;
+    }
+    if (!group)
+        return;
+    std::lock_guard<std::mutex> guard(group->link->lock);
+    if (group->writeAt == ssGetT(S))
+        return;
+    group->writeAt = ssGetT(S);
+    if (group->link->state == LINK_CONNECTED)
+        mergeWrite(S, group);
+}
+#endif
+
 // Function: mdlTerminate =================================================
 // Abstract: free allocated memory and work vectors, and close files
 static void mdlTerminate(SimStruct *S) {
 
     int nIn, nOut, idx;
     char **writes, **reads;
-    plc4c_system* system;  
-    plc4c_connection* connection; 
-    plc4c_return_code result;
+    PlcLink* link;
 
     nIn = ssGetNumInputPorts(S);
-    nOut = ssGetNumOutputPorts(S);
+    nOut = (int) PARAM_VAL(P_N_OUT);
 
-    writes = (char**) ssGetDWork(S,DW_READS);
-    reads = (char**) ssGetDWork(S,DW_WRITES);
-    system  = *((plc4c_system**) ssGetDWork(S,DW_SYSTEM));
-    connection = *((plc4c_connection**) ssGetDWork(S,DW_CONNECTION));
+    writes = (char**) ssGetDWork(S,DW_WRITES);
+    reads = (char**) ssGetDWork(S,DW_READS);
+    link = *((PlcLink**) ssGetDWork(S,DW_LINK));
 
     for (idx = 0 ; idx < nIn ; idx++) 
         free(writes[idx]);
@@ -911,28 +2215,69 @@ static void mdlTerminate(SimStruct *S) {
     for (idx = 0 ; idx < nOut ; idx++) 
         free(reads[idx]);
     
-    result = plc4c_connection_disconnect(connection);
-    ASSERT(result == OK,"plc4c_connection_disconnect failed");
-
-    unsigned long lidx;
-
-    while (1) {
-        plc4c_system_loop(system);
-        if (!plc4c_connection_get_connected(connection))
-            break;
-        else if (plc4c_connection_has_error(connection))
-            ASSERT(false, "plc4c_connection_has_error");
-        else if (lidx >1000)
-            break;
-        else
-            lidx++;
+    MergeGroup **group = (MergeGroup**) ssGetDWork(S,DW_MERGE);
+    if (*group)
+        mergeLeave(S, *group);
+    *group = nullptr;
+
+    SubPorts **subscribed = (SubPorts**) ssGetDWork(S,DW_SUBSCRIBE);
+    if (*subscribed) {
+        subStop((*subscribed)->sub);
+        delete *subscribed;
     }
-
-    plc4c_system_remove_connection(system, connection);
-    plc4c_connection_destroy(connection);
-    plc4c_system_shutdown(system);
-    plc4c_system_destroy(system);
-
+    *subscribed = nullptr;
+
+    SplitIo **split = (SplitIo**) ssGetDWork(S,DW_SPLIT);
+    if (link) {
+        plc4c_read_request **request = (plc4c_read_request**) ssGetDWork(S,DW_REQUEST);
+        std::lock_guard<std::mutex> guard(link->lock);
+        if (*split)
+            splitDrop(*split);
+        if (*request)
+            plc4c_read_request_destroy(*request);
+        *request = nullptr;
+    }
+    if (*split)
+        LOG(LOG_INFO, "%lu of %lu split phase steps waited for a late "
+            "response", (unsigned long) (*split)->late,
+            (unsigned long) (*split)->steps);
+    delete *split;
+    *split = nullptr;
+
+    // the link stays open in the registry until its idle timeout expires
+    LinkRegistry::instance().release(link);
+    imageDetach(*(ImageReader**) ssGetDWork(S,DW_IMAGE));
+    *(ImageReader**) ssGetDWork(S,DW_IMAGE) = nullptr;
+    recordClose(*(RecordWriter**) ssGetDWork(S,DW_RECORD));
+    *(RecordWriter**) ssGetDWork(S,DW_RECORD) = nullptr;
+
+    Replay **replay = (Replay**) ssGetDWork(S,DW_REPLAY);
+    if (*replay && (*replay)->check)
+        LOG(LOG_INFO, "%lu steps wrote values different from the recording",
+            (unsigned long) (*replay)->mismatches);
+    replayClose(*replay);
+    *replay = nullptr;
+    delete *(VirtualPorts**) ssGetDWork(S,DW_VIRTUAL);
+    *(VirtualPorts**) ssGetDWork(S,DW_VIRTUAL) = nullptr;
+
+    BrokerPorts **brokered = (BrokerPorts**) ssGetDWork(S,DW_BROKER);
+    if (*brokered) {
+        brokerClose((*brokered)->client);
+        delete *brokered;
+    }
+    *brokered = nullptr;
+
+    HarvestPorts **harvested = (HarvestPorts**) ssGetDWork(S,DW_HARVEST);
+    if (*harvested)
+        for (auto &port : (*harvested)->ports)
+            LOG(LOG_INFO, "read %d harvested %lu samples, lost %lu, %lu "
+                "steps short of a frame", port.port + 1,
+                (unsigned long) port.harvest.samples,
+                (unsigned long) port.harvest.lost,
+                (unsigned long) port.underruns);
+    delete *harvested;
+    *harvested = nullptr;
+    logFlush();
 }
 
 // Function: mdlRTW =======================================================
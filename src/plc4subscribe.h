@@ -0,0 +1,350 @@
+/**************************************************************************
+* File:             plc4subscribe.h
+*
+* Description:      Change driven subscriptions to PLC addresses, delivered
+*                   as a queue of changes or as latest values
+*
+* Notes:            A subscription owns a thread that reads its items on
+*                   the link every period, packed into as few requests as
+*                   the PDU allows (BOOL items as the bytes spanning their
+*                   bits). Only items whose value differs from the last
+*                   one are delivered: queued for plc4mex fetch, and
+*                   counted so plc4sim output ports copy a value only when
+*                   it changed. Unchanged tags cost no decode in MATLAB
+*                   and the model step never waits on the network.
+*
+*                   plc4c's subscription API carries the subscribe
+*                   handshake but hands no notifications to the caller and
+*                   its S7 driver reports no subscription support, so the
+*                   changes are detected here by polling.
+*
+*                   With a longest period above the period each item is
+*                   polled at its own interval: half the typical time
+*                   between its changes (a moving average), stretched while
+*                   it stays unchanged, and bounded by the two periods. The
+*                   longest period is the worst case staleness of an item.
+*
+*                   Item values are host native in the type the consumer
+*                   wants them in, eg. the type of a Simulink port. While
+*                   the link reconnects no changes are delivered and the
+*                   last values are kept. The queue holds at most
+*                   SUB_MAX_EVENTS changes, the oldest are dropped first.
+*
+* Revsions:         1.00 19/10/26 first release
+*
+* See also:         plc4image.h, plc4link.h, plc4mex.cpp, plc4sim.cpp
+*
+* SPDX-License-Identifier: Apache-2.0
+**************************************************************************/
+
+#ifndef PLC4SUBSCRIBE_H
+#define PLC4SUBSCRIBE_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <time.h>
+
+#include <plc4c/spi/types_private.h>
+
+#include "plc4bits.h"
+#include "plc4image.h"
+#include "plc4link.h"
+#include "plc4types.h"
+
+#define SUB_DEFAULT_PERIOD 0.1
+#define SUB_MAX_EVENTS 4096
+
+struct SubItem {
+    std::string name;
+    ImageArea area;                 // address, type and count delivered
+    std::string fetch;              // address requested
+    std::vector<uint8_t> value;     // last value, host native
+    uint64_t changes = 0;
+    uint32_t wire = 0;              // data bytes of the request item
+    double interval = 0;            // between polls
+    double gap = 0;                 // average time between changes
+    LinkClock::time_point changed;
+    LinkClock::time_point due;
+};
+
+struct SubEvent {
+    uint32_t item;
+    int64_t stamp;                  // CLOCK_REALTIME ns of the poll
+    std::vector<uint8_t> value;
+};
+
+struct Subscription {
+    PlcLink *link = nullptr;
+    double period = SUB_DEFAULT_PERIOD;
+    double periodMax = SUB_DEFAULT_PERIOD;
+    unsigned pdu = LINK_DEFAULT_PDU;
+    bool queue = false;             // keep events for subFetch
+    std::vector<SubItem> items;
+    std::vector<uint8_t> stage;
+    std::mutex lock;                // item values, changes and events
+    std::deque<SubEvent> events;
+    std::thread thread;
+    std::atomic<bool> stop{false};
+    std::atomic<size_t> polls{0};
+    std::atomic<size_t> failures{0};
+    std::atomic<size_t> notifications{0};
+    std::atomic<size_t> dropped{0};
+};
+
+// Function: subItem ======================================================
+// Abstract: Item delivering count values of type from an address, false
+// and err if the address does not fit
+static inline bool subItem(const std::string &name, const std::string &address,
+        PlcType type, uint32_t count, SubItem *item, std::string &err) {
+
+    if (!imageArea(address, type, count, &item->area)) {
+        err = "subscribed address <" + address + "> is too long";
+        return false;
+    }
+    item->name = name;
+    item->fetch = imageFetchAddress(&item->area);
+    item->value.assign(item->area.bytes, 0);
+    item->changes = 0;
+    return true;
+}
+
+// Function: subPollRun ===================================================
+// Abstract: Read the items due[first] to due[last - 1] into the stage.
+// Call with the link lock held on a connected link.
+static inline bool subPollRun(Subscription *sub, const std::vector<size_t> &due,
+        size_t first, size_t last) {
+
+    PlcLink *link = sub->link;
+    plc4c_read_request *request;
+    plc4c_read_request_execution *execution;
+    bool done = false;
+
+    if (plc4c_connection_create_read_request(link->connection, &request) != OK)
+        return false;
+    for (size_t idx = first; idx < last; idx++)
+        plc4c_read_request_add_item(request,
+            (char*) sub->items[due[idx]].name.c_str(),
+            (char*) sub->items[due[idx]].fetch.c_str());
+    if (plc4c_read_request_execute(request, &execution) == OK) {
+        done = linkLoopUntil(link,
+            [&] { return plc4c_read_request_execution_check_finished_successfully(execution); },
+            [&] { return plc4c_read_request_execution_check_finished_with_error(execution); },
+            "subscription read");
+        if (done) {
+            plc4c_read_response *response =
+                plc4c_read_request_execution_get_response(execution);
+            plc4c_list_element *item = plc4c_utils_list_tail(response->items);
+            for (size_t idx = first; item && (idx < last); idx++) {
+                plc4c_response_value_item *value =
+                    (plc4c_response_value_item*) item->value;
+                const ImageArea *area = &sub->items[due[idx]].area;
+                imageStore(area, sub->stage.data() + area->offset, value->value);
+                item = item->next;
+            }
+            plc4c_read_destroy_read_response(response);
+        }
+        plc4c_read_request_execution_destroy(execution);
+    }
+    plc4c_read_request_destroy(request);
+    return done;
+}
+
+// Function: subAdapt =====================================================
+// Abstract: Next poll interval of an item polled at t, half the average
+// time between its changes or the time since its last change if longer,
+// within the periods of the subscription
+static inline void subAdapt(Subscription *sub, SubItem *item, bool changed,
+        LinkClock::time_point t) {
+
+    double since = std::chrono::duration<double>(t - item->changed).count();
+
+    if (changed) {
+        if (item->changes > 1)
+            item->gap = item->gap > 0 ? 0.75 * item->gap + 0.25 * since : since;
+        item->changed = t;
+        since = 0;
+    }
+    double interval = std::max(item->gap, since) / 2;
+    item->interval = std::min(std::max(interval, sub->period), sub->periodMax);
+    item->due = t + linkSeconds(item->interval);
+}
+
+// Function: subPoll ======================================================
+// Abstract: Read the items that are due once and deliver the ones that
+// changed. Returns false if the link is down or a read failed.
+static inline bool subPoll(Subscription *sub) {
+
+    PlcLink *link = sub->link;
+    LinkClock::time_point t = LinkClock::now();
+    std::vector<size_t> due;
+    std::vector<uint32_t> bytes;
+    struct timespec now;
+
+    for (size_t idx = 0; idx < sub->items.size(); idx++)
+        if (sub->items[idx].due <= t) {
+            due.push_back(idx);
+            bytes.push_back(sub->items[idx].wire);
+        }
+    if (due.empty())
+        return true;
+    std::vector<size_t> runs = linkPack(bytes, false, sub->pdu);
+    {
+        std::lock_guard<std::mutex> guard(link->lock);
+        if (link->state != LINK_CONNECTED)
+            return false;
+        for (size_t run = 0; run < runs.size(); run++) {
+            size_t last = run + 1 < runs.size() ? runs[run + 1] : due.size();
+            if (!subPollRun(sub, due, runs[run], last))
+                return false;
+        }
+    }
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    int64_t stamp = (int64_t) now.tv_sec * 1000000000LL + now.tv_nsec;
+    std::lock_guard<std::mutex> guard(sub->lock);
+    for (size_t idx : due) {
+        SubItem *item = &sub->items[idx];
+        const uint8_t *polled = sub->stage.data() + item->area.offset;
+        bool changed = !item->changes || memcmp(polled, item->value.data(),
+            item->area.bytes);
+        if (changed) {
+            memcpy(item->value.data(), polled, item->area.bytes);
+            item->changes++;
+        }
+        subAdapt(sub, item, changed, t);
+        if (!changed)
+            continue;
+        sub->notifications++;
+        if (!sub->queue)
+            continue;
+        if (sub->events.size() >= SUB_MAX_EVENTS) {
+            sub->events.pop_front();
+            sub->dropped++;
+        }
+        sub->events.push_back({(uint32_t) idx, stamp, item->value});
+    }
+    return true;
+}
+
+// Function: subRun =======================================================
+// Abstract: Subscription thread body, polls the due items on absolute
+// steady clock deadlines of the shortest period and restarts the schedule
+// from now after an overrun
+static inline void subRun(Subscription *sub) {
+
+    LinkClock::duration period = linkSeconds(sub->period);
+    LinkClock::time_point deadline = LinkClock::now();
+
+    while (!sub->stop) {
+        if (subPoll(sub))
+            sub->polls++;
+        else
+            sub->failures++;
+        {
+            // the pump thread changes the state under the link lock
+            std::lock_guard<std::mutex> guard(sub->link->lock);
+            if (sub->link->state == LINK_FAILED)
+                break;
+        }
+        deadline += period;
+        if (LinkClock::now() > deadline)
+            deadline = LinkClock::now();
+        std::this_thread::sleep_until(deadline);
+    }
+}
+
+// Function: subStart =====================================================
+// Abstract: Start polling the items on the link, every period or adapted
+// between period and periodMax, queueing their changes if queue is set.
+// nullptr and err if they do not fit.
+static inline Subscription* subStart(std::vector<SubItem> &items,
+        double period, double periodMax, unsigned pdu, bool queue,
+        PlcLink *link, std::string &err) {
+
+    uint32_t offset = 0;
+
+    if (items.empty()) {
+        err = "a subscription needs at least one address";
+        return nullptr;
+    }
+    if (!(period > 0)) {
+        err = "subscription period must be positive";
+        return nullptr;
+    }
+    if (!(periodMax >= period)) {
+        err = "longest subscription period must not be below the period";
+        return nullptr;
+    }
+
+    std::unique_ptr<Subscription> sub(new Subscription);
+    sub->items.swap(items);
+    for (auto &item : sub->items) {
+        // requests are packed by the bytes on the wire
+        BitsRange range;
+        PlcType type;
+        uint32_t size, count, wire = item.area.bytes;
+        if (item.fetch != item.area.address)
+            wire = bitsParse(item.area.address, &range) ?
+                bitsByteCount(&range) : wire;
+        else if (typeOfAddress(item.fetch, &type, &size, &count))
+            wire = size * count;
+        item.area.offset = offset;
+        offset += (item.area.bytes + 7) & ~7u;
+        item.wire = wire;
+        item.interval = period;
+        item.due = item.changed = LinkClock::now();
+    }
+    sub->stage.assign(offset, 0);
+    sub->period = period;
+    sub->periodMax = periodMax;
+    sub->pdu = pdu;
+    sub->queue = queue;
+    sub->link = link;
+    sub->thread = std::thread(subRun, sub.get());
+    return sub.release();
+}
+
+// Function: subFetch =====================================================
+// Abstract: Take the queued changes, oldest first
+static inline void subFetch(Subscription *sub, std::deque<SubEvent> &events) {
+    std::lock_guard<std::mutex> guard(sub->lock);
+    events.clear();
+    events.swap(sub->events);
+}
+
+// Function: subLatest ====================================================
+// Abstract: Copy the value of an item to dst if it changed since seen,
+// and update seen. True if it was copied.
+static inline bool subLatest(Subscription *sub, size_t idx, void *dst,
+        uint64_t *seen) {
+
+    std::lock_guard<std::mutex> guard(sub->lock);
+    const SubItem *item = &sub->items[idx];
+    if (item->changes == *seen)
+        return false;
+    memcpy(dst, item->value.data(), item->area.bytes);
+    *seen = item->changes;
+    return true;
+}
+
+// Function: subStop ======================================================
+// Abstract: Stop a subscription's thread and free it
+static inline void subStop(Subscription *sub) {
+    if (!sub)
+        return;
+    sub->stop = true;
+    if (sub->thread.joinable())
+        sub->thread.join();
+    delete sub;
+}
+
+#endif
@@ -0,0 +1,490 @@
+/**************************************************************************
+* File:             plc4tags.h
+*
+* Description:      Symbolic tag database compiled to a memory mapped
+*                   binary index with hashed name lookup
+*
+* Notes:            tagdbCompile imports a PLC tag table exported as CSV
+*                   (columns Name, Address / Logical Address and optional
+*                   Data Type, ',' or ';' separated) or as TIA Openness XML
+*                   (SW.Tags.PlcTag elements) and writes the index file.
+*                   Addresses are normalised to the plc4c S7 form, eg.
+*                   %DB2.DBD996 Real -> %DB2:996.0:REAL.
+*
+*                   The index is opened with mmap and never parsed, a
+*                   lookup hashes the name (FNV-1a) and probes an open
+*                   addressing table, so resolution is O(1). Opened
+*                   databases are cached per path and remapped when the
+*                   file is replaced. An index is compiled to a temporary
+*                   file renamed over the old one, so a mapping in use
+*                   keeps the old contents and never sees a partial file.
+*
+*                   Index layout (little endian uint32 unless noted):
+*                       header  magic, version, nTags, nSlots,
+*                               entries offset, strings offset, size
+*                       slots   nSlots entry numbers + 1, 0 is empty
+*                       entries nTags of hash, name, address, count
+*                       strings NUL terminated names and addresses
+*
+* Revsions:         1.00 19/10/26 first release
+*
+* See also:         plc4mex.cpp, plc4sim.cpp
+*
+* SPDX-License-Identifier: Apache-2.0
+**************************************************************************/
+
+#ifndef PLC4TAGS_H
+#define PLC4TAGS_H
+
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define TAGDB_MAGIC 0x47543450u     // "P4TG"
+#define TAGDB_VERSION 1u
+
+struct TagDbHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t nTags;
+    uint32_t nSlots;
+    uint32_t entries;
+    uint32_t strings;
+    uint32_t size;
+};
+
+struct TagDbEntry {
+    uint32_t hash;
+    uint32_t name;          // offsets into the strings area
+    uint32_t address;
+    uint32_t count;         // array elements, 1 for a scalar
+};
+
+struct TagDb {
+    std::string path;
+    dev_t dev = 0;                  // identity of the file mapped
+    ino_t ino = 0;
+    time_t mtime = 0;
+    const uint8_t *base = nullptr;
+    size_t size = 0;
+    const TagDbHeader *header = nullptr;
+    const uint32_t *slots = nullptr;
+    const TagDbEntry *entries = nullptr;
+    const char *strings = nullptr;
+};
+
+// Function: tagdbHash ====================================================
+// Abstract: FNV-1a hash of a tag name
+static inline uint32_t tagdbHash(const char *name, size_t len) {
+    uint32_t hash = 2166136261u;
+    for (size_t idx = 0; idx < len; idx++) {
+        hash ^= (uint8_t) name[idx];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Function: tagdbTrim ====================================================
+// Abstract: Strip white space and surrounding quotes from a field
+static inline std::string tagdbTrim(const std::string &field) {
+    size_t a = 0, b = field.size();
+    while ((a < b) && isspace((unsigned char) field[a]))
+        a++;
+    while ((b > a) && isspace((unsigned char) field[b - 1]))
+        b--;
+    if ((b - a >= 2) && (field[a] == '"') && (field[b - 1] == '"')) {
+        a++;
+        b--;
+    }
+    return field.substr(a, b - a);
+}
+
+// Function: tagdbUpper ===================================================
+// Abstract: Upper case copy of a string
+static inline std::string tagdbUpper(std::string s) {
+    for (auto &c : s)
+        c = (char) toupper((unsigned char) c);
+    return s;
+}
+
+// Function: tagdbType ====================================================
+// Abstract: Convert a tag table data type to a plc4c type name and array
+// count, eg. "Array[0..9] of Real" -> REAL, 10. Empty if not supported.
+static inline std::string tagdbType(const std::string &dataType,
+        uint32_t *count) {
+
+    std::string type = tagdbTrim(dataType);
+    *count = 1;
+
+    if (tagdbUpper(type.substr(0, 6)) == "ARRAY[") {
+        long lo, hi;
+        size_t of = tagdbUpper(type).find(" OF ");
+        if ((of == std::string::npos) ||
+                (sscanf(type.c_str() + 6, "%ld..%ld", &lo, &hi) != 2) ||
+                (hi < lo))
+            return "";
+        *count = (uint32_t) (hi - lo + 1);
+        type = tagdbTrim(type.substr(of + 4));
+    }
+    type = tagdbUpper(type);
+    static const char* const known[] = {"BOOL", "BYTE", "WORD", "DWORD",
+        "LWORD", "SINT", "USINT", "INT", "UINT", "DINT", "UDINT", "LINT",
+        "ULINT", "REAL", "LREAL", "CHAR", "WCHAR", nullptr};
+    for (int idx = 0; known[idx]; idx++)
+        if (type == known[idx])
+            return type;
+    return "";
+}
+
+// Function: tagdbAddress =================================================
+// Abstract: Normalise an absolute address to the plc4c S7 form without the
+// type, eg. %DB2.DBX10.3 -> %DB2:10.3, %MW10 -> %M10.0, %DB2:4.0 kept.
+// Empty if the address is not understood.
+static inline std::string tagdbAddress(const std::string &address) {
+
+    std::string addr = tagdbUpper(tagdbTrim(address));
+    unsigned db, byte, bit = 0;
+    char area[3] = {0}, size;
+    char tail;
+
+    if (addr.empty() || (addr[0] != '%'))
+        addr = "%" + addr;
+
+    // already in plc4c form
+    if ((sscanf(addr.c_str(), "%%DB%u:%u.%u%c", &db, &byte, &bit, &tail) == 3) ||
+            (sscanf(addr.c_str(), "%%DB%u:%u%c", &db, &byte, &tail) == 2))
+        return "%DB" + std::to_string(db) + ":" + std::to_string(byte) +
+            "." + std::to_string(bit);
+
+    // data block, %DB2.DBX10.3 / %DB2.DBB4 / %DB2.DBW4 / %DB2.DBD4
+    if (sscanf(addr.c_str(), "%%DB%u.DB%c%u.%u%c", &db, &size, &byte, &bit, &tail) == 4 ||
+            sscanf(addr.c_str(), "%%DB%u.DB%c%u%c", &db, &size, &byte, &tail) == 3) {
+        if (!strchr("XBWD", size))
+            return "";
+        return "%DB" + std::to_string(db) + ":" + std::to_string(byte) +
+            "." + std::to_string(size == 'X' ? bit : 0);
+    }
+
+    // process image and memory, %I0.0 / %QW10 / %MD20 / %IB3
+    const char *p = addr.c_str() + 1;
+    if (!strchr("IQEAM", *p))
+        return "";
+    area[0] = *p == 'E' ? 'I' : (*p == 'A' ? 'Q' : *p);
+    p++;
+    if (*p && strchr("XBWD", *p))
+        p++;
+    if (sscanf(p, "%u.%u%c", &byte, &bit, &tail) == 2 ||
+            sscanf(p, "%u%c", &byte, &tail) == 1)
+        return "%" + std::string(area) + std::to_string(byte) + "." +
+            std::to_string(bit);
+    return "";
+}
+
+// Function: tagdbSplit ===================================================
+// Abstract: Split a CSV line honouring double quotes
+static inline std::vector<std::string> tagdbSplit(const std::string &line,
+        char sep) {
+    std::vector<std::string> fields(1);
+    bool quoted = false;
+    for (char c : line) {
+        if (c == '"')
+            quoted = !quoted;
+        if ((c == sep) && !quoted)
+            fields.emplace_back();
+        else
+            fields.back() += c;
+    }
+    return fields;
+}
+
+// Function: tagdbXmlValue ================================================
+// Abstract: Text of the first <tag>..</tag> element in a block of XML
+static inline std::string tagdbXmlValue(const std::string &xml,
+        const std::string &tag) {
+    size_t a = xml.find("<" + tag + ">");
+    if (a == std::string::npos)
+        return "";
+    a += tag.size() + 2;
+    size_t b = xml.find("</" + tag + ">", a);
+    return b == std::string::npos ? "" : xml.substr(a, b - a);
+}
+
+struct TagDbRecord {
+    std::string name;
+    std::string address;    // plc4c form with type, no array suffix
+    uint32_t count;
+};
+
+// Function: tagdbImport ==================================================
+// Abstract: Read the tags of a CSV or TIA XML tag table export
+static inline bool tagdbImport(const char *srcPath,
+        std::vector<TagDbRecord> &tags, std::string &err) {
+
+    std::ifstream in(srcPath);
+    std::stringstream buf;
+    std::vector<std::string> names, addrs, types;
+
+    if (!in) {
+        err = std::string("cannot open tag table <") + srcPath + ">";
+        return false;
+    }
+    buf << in.rdbuf();
+    std::string text = buf.str();
+
+    if (text.find("<SW.Tags.PlcTag") != std::string::npos) {
+        size_t pos = 0;
+        while ((pos = text.find("<SW.Tags.PlcTag", pos)) != std::string::npos) {
+            size_t end = text.find("</SW.Tags.PlcTag>", pos);
+            if (end == std::string::npos)
+                break;
+            std::string block = text.substr(pos, end - pos);
+            names.push_back(tagdbXmlValue(block, "Name"));
+            addrs.push_back(tagdbXmlValue(block, "LogicalAddress"));
+            types.push_back(tagdbXmlValue(block, "DataTypeName"));
+            pos = end;
+        }
+    } else {
+        std::istringstream lines(text);
+        std::string line;
+        int colName = -1, colAddr = -1, colType = -1;
+        char sep = ',';
+        if (!std::getline(lines, line)) {
+            err = "empty tag table";
+            return false;
+        }
+        if (std::count(line.begin(), line.end(), ';') >
+                std::count(line.begin(), line.end(), ','))
+            sep = ';';
+        std::vector<std::string> head = tagdbSplit(line, sep);
+        for (int idx = 0; idx < (int) head.size(); idx++) {
+            std::string h = tagdbUpper(tagdbTrim(head[idx]));
+            if (h == "NAME")
+                colName = idx;
+            else if ((h == "ADDRESS") || (h == "LOGICAL ADDRESS"))
+                colAddr = idx;
+            else if (h == "DATA TYPE")
+                colType = idx;
+        }
+        if ((colName < 0) || (colAddr < 0)) {
+            err = "tag table needs Name and Address columns";
+            return false;
+        }
+        while (std::getline(lines, line)) {
+            std::vector<std::string> f = tagdbSplit(line, sep);
+            if ((int) f.size() <= std::max(colName, colAddr))
+                continue;
+            names.push_back(tagdbTrim(f[colName]));
+            addrs.push_back(tagdbTrim(f[colAddr]));
+            types.push_back((colType >= 0) && (colType < (int) f.size()) ?
+                tagdbTrim(f[colType]) : "");
+        }
+    }
+
+    for (size_t idx = 0; idx < names.size(); idx++) {
+        TagDbRecord rec;
+        std::string addr = addrs[idx], type;
+        size_t colon = addr.rfind(':');
+        rec.name = names[idx];
+        if (rec.name.empty())
+            continue;
+        // an address may carry its own type, eg. %DB2:996.0:REAL
+        if ((colon != std::string::npos) && (colon > addr.find(':'))) {
+            type = addr.substr(colon + 1);
+            addr = addr.substr(0, colon);
+        } else {
+            type = types[idx];
+        }
+        std::string plcType = tagdbType(type, &rec.count);
+        std::string plcAddr = tagdbAddress(addr);
+        if (plcType.empty() || plcAddr.empty()) {
+            err = "tag <" + rec.name + "> has unsupported address <" +
+                addrs[idx] + "> or type <" + type + ">";
+            return false;
+        }
+        rec.address = plcAddr + ":" + plcType;
+        tags.push_back(rec);
+    }
+    return true;
+}
+
+// Function: tagdbCompile =================================================
+// Abstract: Import a tag table export and write the binary index, to a
+// temporary file renamed into place
+static inline bool tagdbCompile(const char *srcPath, const char *dstPath,
+        std::string &err) {
+
+    std::vector<TagDbRecord> tags;
+    std::vector<TagDbEntry> entries;
+    std::string strings;
+    uint32_t nSlots = 16;
+
+    if (!tagdbImport(srcPath, tags, err))
+        return false;
+    while (nSlots < 2 * tags.size())
+        nSlots *= 2;
+    std::vector<uint32_t> slots(nSlots, 0);
+
+    for (size_t idx = 0; idx < tags.size(); idx++) {
+        TagDbEntry e;
+        e.hash = tagdbHash(tags[idx].name.c_str(), tags[idx].name.size());
+        e.name = (uint32_t) strings.size();
+        strings += tags[idx].name + '\0';
+        e.address = (uint32_t) strings.size();
+        strings += tags[idx].address + '\0';
+        e.count = tags[idx].count;
+
+        uint32_t slot = e.hash & (nSlots - 1);
+        while (slots[slot]) {
+            const TagDbEntry &o = entries[slots[slot] - 1];
+            if ((o.hash == e.hash) &&
+                    !strcmp(strings.c_str() + o.name, tags[idx].name.c_str())) {
+                err = "duplicate tag <" + tags[idx].name + ">";
+                return false;
+            }
+            slot = (slot + 1) & (nSlots - 1);
+        }
+        entries.push_back(e);
+        slots[slot] = (uint32_t) entries.size();
+    }
+
+    TagDbHeader h;
+    h.magic = TAGDB_MAGIC;
+    h.version = TAGDB_VERSION;
+    h.nTags = (uint32_t) entries.size();
+    h.nSlots = nSlots;
+    h.entries = sizeof(h) + nSlots * sizeof(uint32_t);
+    h.strings = h.entries + h.nTags * sizeof(TagDbEntry);
+    h.size = h.strings + (uint32_t) strings.size();
+
+    std::string tmpPath = std::string(dstPath) + ".tmp" +
+        std::to_string((long) getpid());
+    std::ofstream out(tmpPath, std::ios::binary | std::ios::trunc);
+    out.write((const char*) &h, sizeof(h));
+    out.write((const char*) slots.data(), nSlots * sizeof(uint32_t));
+    out.write((const char*) entries.data(), entries.size() * sizeof(TagDbEntry));
+    out.write(strings.data(), strings.size());
+    out.close();
+    if (!out || (rename(tmpPath.c_str(), dstPath) != 0)) {
+        unlink(tmpPath.c_str());
+        err = std::string("cannot write tag index <") + dstPath + ">";
+        return false;
+    }
+    return true;
+}
+
+// Function: tagdbOpen ====================================================
+// Abstract: Map a compiled index read only, cached per path and mapped
+// again once the file was replaced. A replaced mapping stays valid for
+// those holding it. Returns nullptr and sets err if the file is missing
+// or not a valid index.
+static inline TagDb* tagdbOpen(const char *path, std::string &err) {
+
+    static std::map<std::string, TagDb*> cache;
+    struct stat st;
+    int fd;
+
+    auto found = cache.find(path);
+    if ((found != cache.end()) && (stat(path, &st) == 0) &&
+            (st.st_dev == found->second->dev) &&
+            (st.st_ino == found->second->ino) &&
+            (st.st_mtime == found->second->mtime) &&
+            ((size_t) st.st_size == found->second->size))
+        return found->second;
+
+    if (((fd = open(path, O_RDONLY)) < 0) || (fstat(fd, &st) != 0)) {
+        if (fd >= 0)
+            ::close(fd);
+        err = std::string("cannot open tag index <") + path + ">";
+        return nullptr;
+    }
+    void *base = st.st_size >= (off_t) sizeof(TagDbHeader) ?
+        mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+    ::close(fd);
+    if (base == MAP_FAILED) {
+        err = std::string("cannot map tag index <") + path + ">";
+        return nullptr;
+    }
+
+    const TagDbHeader *h = (const TagDbHeader*) base;
+    if ((h->magic != TAGDB_MAGIC) || (h->version != TAGDB_VERSION) ||
+            (h->size != (uint32_t) st.st_size) ||
+            (h->nSlots & (h->nSlots - 1)) || (h->nSlots == 0) ||
+            (h->entries != sizeof(TagDbHeader) + h->nSlots * sizeof(uint32_t)) ||
+            (h->strings != h->entries + h->nTags * sizeof(TagDbEntry)) ||
+            (h->strings > h->size)) {
+        munmap(base, st.st_size);
+        err = std::string("<") + path + "> is not a plc4mat tag index";
+        return nullptr;
+    }
+
+    TagDb *db = new TagDb;
+    db->path = path;
+    db->dev = st.st_dev;
+    db->ino = st.st_ino;
+    db->mtime = st.st_mtime;
+    db->base = (const uint8_t*) base;
+    db->size = st.st_size;
+    db->header = h;
+    db->slots = (const uint32_t*) (db->base + sizeof(TagDbHeader));
+    db->entries = (const TagDbEntry*) (db->base + h->entries);
+    db->strings = (const char*) (db->base + h->strings);
+    cache[path] = db;
+    return db;
+}
+
+// Function: tagdbLookup ==================================================
+// Abstract: Find a tag by name, nullptr if it is not in the database
+static inline const TagDbEntry* tagdbLookup(const TagDb *db,
+        const char *name, size_t len) {
+
+    uint32_t hash = tagdbHash(name, len);
+    uint32_t mask = db->header->nSlots - 1;
+    uint32_t slot = hash & mask;
+
+    while (db->slots[slot]) {
+        const TagDbEntry *e = &db->entries[db->slots[slot] - 1];
+        const char *n = db->strings + e->name;
+        if ((e->hash == hash) && !strncmp(n, name, len) && (n[len] == '\0'))
+            return e;
+        slot = (slot + 1) & mask;
+    }
+    return nullptr;
+}
+
+// Function: tagdbResolve =================================================
+// Abstract: Resolve a symbol to a plc4c address, arrays get the element
+// count suffix, eg. REAL[10]. Raw addresses (starting %) pass through.
+static inline bool tagdbResolve(const TagDb *db, const std::string &symbol,
+        std::string &address, std::string &err) {
+
+    if (!symbol.empty() && (symbol[0] == '%')) {
+        address = symbol;
+        return true;
+    }
+    const TagDbEntry *e = db ?
+        tagdbLookup(db, symbol.c_str(), symbol.size()) : nullptr;
+    if (!e) {
+        err = db ? "unknown tag <" + symbol + ">" :
+            "tag <" + symbol + "> used without a tag database";
+        return false;
+    }
+    address = db->strings + e->address;
+    if (e->count > 1)
+        address += "[" + std::to_string(e->count) + "]";
+    return true;
+}
+
+#endif
@@ -0,0 +1,266 @@
+/**************************************************************************
+* File:             plc4types.h
+*
+* Description:      Compile time traits of the element types plc4mat moves
+*                   and the encode / decode kernels generated from them
+*
+* Notes:            Each host type T has one TypeTraits<T> relating its
+*                   PlcType id, the S7 type it moves as, its wire size, its
+*                   MATLAB class and the plc4c data constructors and union
+*                   member. typeNames maps every S7 type name understood in
+*                   an address to a PlcType.
+*
+*                   Kernels are class templates over T with a static run,
+*                   typeDispatch picks the specialisation for a PlcType
+*                   once, so the element loops have no per element switch.
+*                   Simulink DTypeId and MATLAB ArrayType map to PlcType in
+*                   plc4sim.cpp and plc4mex.cpp, the only places they exist.
+*
+*                   PlcType values are stored in process images, append new
+*                   types at the end.
+*
+* Revsions:         1.00 19/10/26 first release
+*
+* See also:         plc4sim.cpp, plc4mex.cpp, plc4image.h, plc4virtual.h
+*
+* SPDX-License-Identifier: Apache-2.0
+**************************************************************************/
+
+#ifndef PLC4TYPES_H
+#define PLC4TYPES_H
+
+#include <cctype>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#include <plc4c/plc4c.h>
+#include <plc4c/spi/types_private.h>
+
+enum PlcType {
+    TYPE_BOOL,
+    TYPE_INT8,
+    TYPE_UINT8,
+    TYPE_INT16,
+    TYPE_UINT16,
+    TYPE_INT32,
+    TYPE_UINT32,
+    TYPE_INT64,
+    TYPE_UINT64,
+    TYPE_FLOAT,
+    TYPE_DOUBLE
+};
+
+template <typename T> struct TypeTraits;
+
+#define TYPE_TRAITS(T, ID, S7, CLASS, MEMBER, CREATE)                       \
+template <> struct TypeTraits<T> {                                          \
+    static constexpr PlcType id() { return ID; }                            \
+    static constexpr const char* s7() { return S7; }                        \
+    static constexpr const char* matlab() { return CLASS; }                 \
+    static constexpr uint32_t size() { return sizeof(T); }                  \
+    static T value(const plc4c_data *data) { return (T) data->data.MEMBER; }\
+    static plc4c_data* scalar(T v) {                                        \
+        return plc4c_data_create_##CREATE##_data(v); }                      \
+    static plc4c_data* array(T *v, int n) {                                 \
+        return plc4c_data_create_##CREATE##_array(v, n); }                  \
+};
+
+TYPE_TRAITS(bool, TYPE_BOOL, "BOOL", "logical", boolean_value, bool)
+TYPE_TRAITS(int8_t, TYPE_INT8, "SINT", "int8", char_value, int8_t)
+TYPE_TRAITS(uint8_t, TYPE_UINT8, "USINT", "uint8", uchar_value, uint8_t)
+TYPE_TRAITS(int16_t, TYPE_INT16, "INT", "int16", short_value, int16_t)
+TYPE_TRAITS(uint16_t, TYPE_UINT16, "UINT", "uint16", ushort_value, uint16_t)
+TYPE_TRAITS(int32_t, TYPE_INT32, "DINT", "int32", int_value, int32_t)
+TYPE_TRAITS(uint32_t, TYPE_UINT32, "UDINT", "uint32", uint_value, uint32_t)
+TYPE_TRAITS(int64_t, TYPE_INT64, "LINT", "int64", lint_value, int64_t)
+TYPE_TRAITS(uint64_t, TYPE_UINT64, "ULINT", "uint64", ulint_value, uint64_t)
+TYPE_TRAITS(float, TYPE_FLOAT, "REAL", "single", float_value, float)
+TYPE_TRAITS(double, TYPE_DOUBLE, "LREAL", "double", double_value, double)
+
+#undef TYPE_TRAITS
+
+// S7 type names of addresses and the host type they are held in
+struct TypeName {
+    const char *s7;
+    PlcType type;
+    uint32_t size;
+};
+
+static constexpr TypeName typeNames[] = {
+    {"BOOL", TYPE_BOOL, 1}, {"BIT", TYPE_BOOL, 1},
+    {"SINT", TYPE_INT8, 1}, {"USINT", TYPE_UINT8, 1},
+    {"BYTE", TYPE_UINT8, 1}, {"CHAR", TYPE_UINT8, 1},
+    {"INT", TYPE_INT16, 2}, {"UINT", TYPE_UINT16, 2},
+    {"WORD", TYPE_UINT16, 2}, {"DINT", TYPE_INT32, 4},
+    {"UDINT", TYPE_UINT32, 4}, {"DWORD", TYPE_UINT32, 4},
+    {"LINT", TYPE_INT64, 8}, {"ULINT", TYPE_UINT64, 8},
+    {"LWORD", TYPE_UINT64, 8}, {"REAL", TYPE_FLOAT, 4},
+    {"LREAL", TYPE_DOUBLE, 8}
+};
+
+// Function: typeOfName ===================================================
+// Abstract: Host type and size of an S7 type name, any case. False if it
+// is not a type plc4mat moves.
+static inline bool typeOfName(const std::string &name, PlcType *type,
+        uint32_t *size) {
+
+    std::string upper(name);
+    for (auto &c : upper)
+        c = (char) toupper((unsigned char) c);
+    for (const TypeName &t : typeNames)
+        if (upper == t.s7) {
+            *type = t.type;
+            *size = t.size;
+            return true;
+        }
+    return false;
+}
+
+// Function: typeOfAddress ===============================================
+// Abstract: Element type, size and count of an address, eg.
+// %DB2:0.0:REAL[4] -> TYPE_FLOAT, 4, 4. False if the type is unknown.
+static inline bool typeOfAddress(const std::string &address, PlcType *type,
+        uint32_t *size, uint32_t *count) {
+
+    size_t colon = address.rfind(':');
+    if (colon == std::string::npos)
+        return false;
+    std::string name = address.substr(colon + 1);
+    size_t bracket = name.find('[');
+    *count = 1;
+    if (bracket != std::string::npos) {
+        long n = atol(name.c_str() + bracket + 1);
+        if (n <= 0)
+            return false;
+        *count = (uint32_t) n;
+        name = name.substr(0, bracket);
+    }
+    return typeOfName(name, type, size);
+}
+
+// Function: typeValue ====================================================
+// Abstract: Convert a scalar plc4c data item of any numeric type to T, the
+// driver's choice of union member need not match T
+template <typename T>
+static inline T typeValue(const plc4c_data *data) {
+    switch (data->data_type) {
+        case PLC4C_BOOL: return (T) TypeTraits<bool>::value(data);
+        case PLC4C_CHAR: return (T) TypeTraits<int8_t>::value(data);
+        case PLC4C_UCHAR: return (T) TypeTraits<uint8_t>::value(data);
+        case PLC4C_SHORT: return (T) TypeTraits<int16_t>::value(data);
+        case PLC4C_USHORT: return (T) TypeTraits<uint16_t>::value(data);
+        case PLC4C_INT: return (T) TypeTraits<int32_t>::value(data);
+        case PLC4C_UINT: return (T) TypeTraits<uint32_t>::value(data);
+        case PLC4C_LINT: return (T) TypeTraits<int64_t>::value(data);
+        case PLC4C_ULINT: return (T) TypeTraits<uint64_t>::value(data);
+        case PLC4C_FLOAT: return (T) TypeTraits<float>::value(data);
+        case PLC4C_DOUBLE: return (T) TypeTraits<double>::value(data);
+        default: return (T) 0;
+    }
+}
+
+// Function: typeOfData ===================================================
+// Abstract: PlcType of the union member a scalar plc4c data item holds,
+// false if it holds no number
+static inline bool typeOfData(const plc4c_data *data, PlcType *type) {
+    switch (data->data_type) {
+        case PLC4C_BOOL: *type = TYPE_BOOL; return true;
+        case PLC4C_CHAR: *type = TYPE_INT8; return true;
+        case PLC4C_UCHAR: *type = TYPE_UINT8; return true;
+        case PLC4C_SHORT: *type = TYPE_INT16; return true;
+        case PLC4C_USHORT: *type = TYPE_UINT16; return true;
+        case PLC4C_INT: *type = TYPE_INT32; return true;
+        case PLC4C_UINT: *type = TYPE_UINT32; return true;
+        case PLC4C_LINT: *type = TYPE_INT64; return true;
+        case PLC4C_ULINT: *type = TYPE_UINT64; return true;
+        case PLC4C_FLOAT: *type = TYPE_FLOAT; return true;
+        case PLC4C_DOUBLE: *type = TYPE_DOUBLE; return true;
+        default: return false;
+    }
+}
+
+// Kernel TypeDecode ======================================================
+// Store up to n values of a (possibly list) plc4c data item as T, returns
+// the number stored
+template <typename T>
+struct TypeDecode {
+    static size_t run(plc4c_data *data, void *dst, size_t n) {
+        T *out = (T*) dst;
+        if (data->data_type != PLC4C_LIST) {
+            if (n > 0)
+                out[0] = typeValue<T>(data);
+            return n > 0;
+        }
+        size_t idx = 0;
+        plc4c_list_element *item = plc4c_utils_list_tail(&data->data.list_value);
+        for (; item && (idx < n); item = item->next)
+            out[idx++] = typeValue<T>((plc4c_data*) item->value);
+        return idx;
+    }
+};
+
+// Kernel TypeEncode ======================================================
+// plc4c data item of n values of T, a scalar for one value
+template <typename T>
+struct TypeEncode {
+    static plc4c_data* run(const void *src, size_t n) {
+        T *in = (T*) src;
+        return n == 1 ? TypeTraits<T>::scalar(in[0]) :
+            TypeTraits<T>::array(in, (int) n);
+    }
+};
+
+// Kernel TypeUnpack =====================================================
+// Store n values of T laid out big endian, as in S7 memory, host native
+template <typename T>
+struct TypeUnpack {
+    static void run(const uint8_t *src, void *dst, size_t n) {
+        uint8_t *out = (uint8_t*) dst;
+        for (size_t idx = 0; idx < n; idx++, src += sizeof(T))
+            for (size_t b = 0; b < sizeof(T); b++)
+                *out++ = src[sizeof(T) - 1 - b];
+    }
+};
+
+// Kernel TypeInfo ========================================================
+// Traits of a PlcType known only at run time
+template <typename T>
+struct TypeInfo {
+    static const char* run(uint32_t *size, const char **matlab) {
+        if (size)
+            *size = TypeTraits<T>::size();
+        if (matlab)
+            *matlab = TypeTraits<T>::matlab();
+        return TypeTraits<T>::s7();
+    }
+};
+
+// Function: typeDispatch =================================================
+// Abstract: Run kernel K specialised for the host type of a PlcType
+template <template <typename> class K, typename R, typename... A>
+static inline R typeDispatch(PlcType type, A... args) {
+    switch (type) {
+        case TYPE_BOOL: return K<bool>::run(args...);
+        case TYPE_INT8: return K<int8_t>::run(args...);
+        case TYPE_UINT8: return K<uint8_t>::run(args...);
+        case TYPE_INT16: return K<int16_t>::run(args...);
+        case TYPE_UINT16: return K<uint16_t>::run(args...);
+        case TYPE_INT32: return K<int32_t>::run(args...);
+        case TYPE_UINT32: return K<uint32_t>::run(args...);
+        case TYPE_INT64: return K<int64_t>::run(args...);
+        case TYPE_UINT64: return K<uint64_t>::run(args...);
+        case TYPE_FLOAT: return K<float>::run(args...);
+        default: return K<double>::run(args...);
+    }
+}
+
+// Function: typeS7Name ===================================================
+// Abstract: S7 type a PlcType moves as, with its size and MATLAB class
+static inline const char* typeS7Name(PlcType type, uint32_t *size = nullptr,
+        const char **matlab = nullptr) {
+    return typeDispatch<TypeInfo, const char*>(type, size, matlab);
+}
+
+#endif
@@ -0,0 +1,311 @@
+/**************************************************************************
+* File:             plc4virtual.h
+*
+* Description:      Simulated PLC memory in POSIX shared memory for
+*                   model-in-the-loop runs without sockets
+*
+* Notes:            A connection string sim://<name> attaches to a named
+*                   virtual PLC in /dev/shm/plc4mat.sim.<name>, created on
+*                   first use. It has the S7 areas (DB<n>, I, Q, M), each a
+*                   byte array zero until addresses touch it, and the read /
+*                   write item semantics of the S7 driver: byte and bit
+*                   offsets, big endian elements and arrays of N elements,
+*                   BOOL arrays packed one bit per element.
+*
+*                   plc4mex, plc4sim blocks and other MATLAB sessions naming
+*                   the same virtual PLC see each other's writes, a transfer
+*                   is a lock (a robust process shared mutex) and a copy.
+*                   Each area reserves VIRTUAL_MAX_AREA bytes of the mapping,
+*                   only the pages touched take memory. The memory lives
+*                   until the shared memory object is removed.
+*
+*                   Hosts are taken to be little endian, as every MATLAB
+*                   platform is.
+*
+* Revsions:         1.00 19/10/26 first release
+*
+* See also:         plc4image.h, plc4sim.cpp, plc4mex.cpp
+*
+* SPDX-License-Identifier: Apache-2.0
+**************************************************************************/
+
+#ifndef PLC4VIRTUAL_H
+#define PLC4VIRTUAL_H
+
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <string>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "plc4bits.h"
+#include "plc4image.h"
+
+#define VIRTUAL_SCHEME "sim://"
+#define VIRTUAL_MAX_AREA (1u << 24)
+#define VIRTUAL_MAX_AREAS 32
+#define VIRTUAL_MAGIC 0x4d533450u   // "P4SM"
+#define VIRTUAL_VERSION 1u
+#define VIRTUAL_AREA_LEN 16
+#define VIRTUAL_DATA_OFFSET 4096    // of the areas, past the header
+
+struct VirtualArea {
+    char name[VIRTUAL_AREA_LEN];    // DB<n>, I, Q or M
+    uint32_t bytes;                 // touched so far
+};
+
+struct VirtualHeader {
+    std::atomic<uint32_t> magic;    // set once the creator initialised it
+    uint32_t version;
+    pthread_mutex_t lock;           // process shared and robust
+    uint32_t nAreas;
+    VirtualArea areas[VIRTUAL_MAX_AREAS];
+};
+
+// A mapping of a virtual PLC, one per name and MEX binary
+struct VirtualPlc {
+    std::string name;
+    VirtualHeader *header = nullptr;
+    uint8_t *data = nullptr;
+    size_t size = 0;
+};
+
+// Scoped lock of a virtual PLC, recovers the mutex of a dead holder
+struct VirtualLock {
+    pthread_mutex_t *mutex;
+    explicit VirtualLock(VirtualPlc *plc) : mutex(&plc->header->lock) {
+        if (pthread_mutex_lock(mutex) == EOWNERDEAD)
+            pthread_mutex_consistent(mutex);
+    }
+    ~VirtualLock() { pthread_mutex_unlock(mutex); }
+};
+
+struct VirtualItem {
+    std::string area;               // DB<n>, I, Q or M
+    uint32_t byte = 0;
+    uint32_t bit = 0;
+    PlcType type = TYPE_UINT8;      // of the host buffer
+    uint32_t size = 1;              // bytes per element
+    uint32_t count = 1;
+};
+
+// Function: virtualIsScheme ==============================================
+// Abstract: True if a connection string names a virtual PLC
+static inline bool virtualIsScheme(const char *connStr) {
+    return !strncmp(connStr, VIRTUAL_SCHEME, strlen(VIRTUAL_SCHEME));
+}
+
+// Function: virtualMap ===================================================
+// Abstract: Map the shared memory of a virtual PLC, creating and zeroing
+// it if it does not exist. A process finding it new waits (up to a second)
+// for its creator to set it up. nullptr and err on failure.
+static inline VirtualPlc* virtualMap(const std::string &name, std::string &err) {
+
+    std::string shm = imageShmName(name);
+    size_t size = VIRTUAL_DATA_OFFSET + (size_t) VIRTUAL_MAX_AREAS * VIRTUAL_MAX_AREA;
+    bool created = false;
+    struct stat st;
+    int fd, tries;
+
+    static_assert(sizeof(VirtualHeader) <= VIRTUAL_DATA_OFFSET,
+        "virtual PLC header overlaps its data");
+    if (shm.empty()) {
+        err = "virtual PLC name <" + name + "> must be letters, digits, '_' or '-'";
+        return nullptr;
+    }
+    shm = "/plc4mat.sim." + name;
+    if ((fd = shm_open(shm.c_str(), O_RDWR | O_CREAT | O_EXCL, 0666)) >= 0) {
+        created = true;
+        if (ftruncate(fd, size) != 0) {
+            err = "can not size virtual PLC <" + name + ">: " + strerror(errno);
+            close(fd);
+            shm_unlink(shm.c_str());
+            return nullptr;
+        }
+    } else if ((errno != EEXIST) ||
+            ((fd = shm_open(shm.c_str(), O_RDWR, 0)) < 0)) {
+        err = "can not open virtual PLC <" + name + ">: " + strerror(errno);
+        return nullptr;
+    }
+
+    // the creator sizes the object before it sets the magic
+    struct timespec wait = {0, 1000000};
+    for (tries = 0; !created && (tries < 1000); tries++) {
+        if ((fstat(fd, &st) == 0) && ((size_t) st.st_size == size))
+            break;
+        nanosleep(&wait, NULL);
+    }
+    void *base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        err = "can not map virtual PLC <" + name + ">: " + strerror(errno);
+        if (created)
+            shm_unlink(shm.c_str());
+        return nullptr;
+    }
+    VirtualHeader *header = (VirtualHeader*) base;
+    if (created) {
+        pthread_mutexattr_t attr;
+        pthread_mutexattr_init(&attr);
+        pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+        pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+        pthread_mutex_init(&header->lock, &attr);
+        pthread_mutexattr_destroy(&attr);
+        header->version = VIRTUAL_VERSION;
+        header->nAreas = 0;
+        header->magic.store(VIRTUAL_MAGIC, std::memory_order_release);
+    }
+    for (tries = 0; tries < 1000; tries++) {
+        if (header->magic.load(std::memory_order_acquire) == VIRTUAL_MAGIC)
+            break;
+        nanosleep(&wait, NULL);
+    }
+    if ((header->magic.load(std::memory_order_acquire) != VIRTUAL_MAGIC) ||
+            (header->version != VIRTUAL_VERSION)) {
+        err = "virtual PLC <" + name + "> is not a plc4mat virtual PLC of "
+            "this version, remove /dev/shm" + shm;
+        munmap(base, size);
+        return nullptr;
+    }
+    VirtualPlc *plc = new VirtualPlc;
+    plc->name = name;
+    plc->header = header;
+    plc->data = (uint8_t*) base + VIRTUAL_DATA_OFFSET;
+    plc->size = size;
+    return plc;
+}
+
+// Function: virtualAttach ================================================
+// Abstract: Virtual PLC of a name, mapped once per MEX binary and created
+// empty on first use by any process. nullptr and err on failure.
+static inline VirtualPlc* virtualAttach(const std::string &name,
+        std::string &err) {
+    static std::mutex registryLock;
+    static std::map<std::string, VirtualPlc*> registry;
+
+    std::lock_guard<std::mutex> guard(registryLock);
+    VirtualPlc *&plc = registry[name];
+    if (!plc)
+        plc = virtualMap(name, err);
+    return plc;
+}
+
+// Function: virtualParse =================================================
+// Abstract: Item of an address, eg. %DB1:4.0:REAL[4], %DB1:2.3:BOOL or
+// %M10.0:INT. False and err if it is not understood.
+static inline bool virtualParse(const std::string &address, VirtualItem *item,
+        std::string &err) {
+
+    unsigned db, byte, bit = 0;
+    char area, tail;
+    size_t type = address.rfind(':');
+
+    err = "virtual PLC can not address <" + address + ">";
+    if ((type == std::string::npos) ||
+            !typeOfAddress(address, &item->type, &item->size, &item->count))
+        return false;
+    std::string pos = address.substr(0, type);
+
+    if ((sscanf(pos.c_str(), "%%DB%u:%u.%u%c", &db, &byte, &bit, &tail) == 3) ||
+            (sscanf(pos.c_str(), "%%DB%u:%u%c", &db, &byte, &tail) == 2))
+        item->area = "DB" + std::to_string(db);
+    else if ((sscanf(pos.c_str(), "%%%c%u.%u%c", &area, &byte, &bit, &tail) == 3) &&
+            strchr("IQM", area))
+        item->area = std::string(1, area);
+    else
+        return false;
+    if ((bit > 7) || (byte >= VIRTUAL_MAX_AREA))
+        return false;
+    item->byte = byte;
+    item->bit = bit;
+    err.clear();
+    return true;
+}
+
+// Function: virtualBytes =================================================
+// Abstract: Bytes of an area an item spans, the area added to the table
+// on first use. nullptr if the item ends past VIRTUAL_MAX_AREA or the
+// table is full. The PLC lock must be held.
+static inline uint8_t* virtualBytes(VirtualPlc *plc, const VirtualItem *item) {
+    VirtualHeader *header = plc->header;
+    uint64_t end = item->type == TYPE_BOOL ?
+        item->byte + (item->bit + item->count + 7) / 8 :
+        item->byte + (uint64_t) item->size * item->count;
+    uint32_t idx;
+
+    if (end > VIRTUAL_MAX_AREA)
+        return nullptr;
+    for (idx = 0; idx < header->nAreas; idx++)
+        if (item->area == header->areas[idx].name)
+            break;
+    if (idx == header->nAreas) {
+        if ((idx == VIRTUAL_MAX_AREAS) || (item->area.size() >= VIRTUAL_AREA_LEN))
+            return nullptr;
+        strcpy(header->areas[idx].name, item->area.c_str());
+        header->areas[idx].bytes = 0;
+        header->nAreas++;
+    }
+    if (header->areas[idx].bytes < end)
+        header->areas[idx].bytes = (uint32_t) end;
+    return plc->data + (size_t) idx * VIRTUAL_MAX_AREA + item->byte;
+}
+
+// Function: virtualRead ==================================================
+// Abstract: Copy an item out of the PLC into a host native buffer. False
+// if the PLC has no room for its area.
+static inline bool virtualRead(VirtualPlc *plc, const VirtualItem *item,
+        void *dst) {
+
+    VirtualLock guard(plc);
+    const uint8_t *src = virtualBytes(plc, item);
+    uint8_t *out = (uint8_t*) dst;
+
+    if (!src)
+        return false;
+    if (item->type == TYPE_BOOL) {
+        bitsUnpack(src, item->bit, item->count, (bool*) dst);
+        return true;
+    }
+    for (uint32_t idx = 0; idx < item->count; idx++) {
+        // S7 memory is big endian
+        for (uint32_t b = 0; b < item->size; b++)
+            out[idx * item->size + b] = src[idx * item->size + item->size - 1 - b];
+    }
+    return true;
+}
+
+// Function: virtualWrite =================================================
+// Abstract: Copy a host native buffer into an item of the PLC. False if
+// the PLC has no room for its area.
+static inline bool virtualWrite(VirtualPlc *plc, const VirtualItem *item,
+        const void *src) {
+
+    VirtualLock guard(plc);
+    uint8_t *dst = virtualBytes(plc, item);
+    const uint8_t *in = (const uint8_t*) src;
+
+    if (!dst)
+        return false;
+    if (item->type == TYPE_BOOL) {
+        bitsPack((const bool*) src, item->bit, item->count, dst);
+        return true;
+    }
+    for (uint32_t idx = 0; idx < item->count; idx++) {
+        for (uint32_t b = 0; b < item->size; b++)
+            dst[idx * item->size + item->size - 1 - b] = in[idx * item->size + b];
+    }
+    return true;
+}
+
+#endif
@@ -0,0 +1,77 @@
+classdef perf_plc4mex < matlab.perftest.TestCase
+% Performance tests of plc4mex read and write calls
+%
+% Each sample is one call on a shared memory virtual PLC (sim://perf), so the
+% time measured is the MATLAB and MEX side of a call without the network:
+% argument parsing, address resolution and value conversion. Run with
+% run_perf to compare against the stored baselines.
+%
+% See also: run_perf, perf_plc4sim
+
+    properties (TestParameter)
+        nTags = {1, 10, 100};
+        nElems = {1, 64};
+        format = {'struct', 'cell', 'namevalue'};
+    end
+
+    methods (TestClassSetup)
+        function connect(testCase)
+            plc4mex('connect', 'sim://perf');
+            testCase.addTeardown(@() plc4mex('disconnect'));
+        end
+    end
+
+    methods (Test)
+        function read(testCase, nTags, nElems, format)
+            args = readArgs(tagAddrs(nTags, nElems), format);
+            plc4mex('read', args{:});
+            while testCase.keepMeasuring
+                plc4mex('read', args{:});
+            end
+        end
+
+        function write(testCase, nTags, nElems, format)
+            addrs = tagAddrs(nTags, nElems);
+            values = repmat({single(1:nElems)}, 1, nTags);
+            args = writeArgs(addrs, values, format);
+            plc4mex('write', args{:});
+            while testCase.keepMeasuring
+                plc4mex('write', args{:});
+            end
+        end
+    end
+end
+
+%% tagAddrs
+function addrs = tagAddrs(nTags, nElems)
+    % REAL arrays laid end to end in one data block
+    addrs = cell(1, nTags);
+    for idx = 1:nTags
+        addrs{idx} = sprintf('%%DB10:%d.0:REAL[%d]', (idx - 1) * 4 * nElems, ...
+            nElems);
+    end
+end
+
+%% readArgs
+function args = readArgs(addrs, format)
+    switch format
+        case 'struct'
+            args = {struct('name', addrs, 'address', addrs, 'value', [])};
+        case 'cell'
+            args = {addrs};
+        case 'namevalue'
+            args = addrs;
+    end
+end
+
+%% writeArgs
+function args = writeArgs(addrs, values, format)
+    switch format
+        case 'struct'
+            args = {struct('name', addrs, 'address', addrs, 'value', values)};
+        case 'cell'
+            args = {addrs, values};
+        case 'namevalue'
+            args = reshape([addrs; values], 1, []);
+    end
+end
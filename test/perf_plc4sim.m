@@ -0,0 +1,46 @@
+classdef perf_plc4sim < matlab.perftest.TestCase
+% Performance test of plc4sim stepping plcTest.slx
+%
+% The plc4sim block of the model is pointed at a shared memory virtual PLC
+% (sim://perf) and the model is simulated for a fixed number of steps, so
+% the time measured is the Simulink and S-function side of a step. The
+% steps per second of the last run are logged.
+%
+% See also: run_perf, perf_plc4mex
+
+    properties (Constant)
+        model = 'plcTest';
+        block = 'plcTest/plc4sim1';
+        steps = 2000;
+    end
+
+    properties
+        ts
+    end
+
+    methods (TestClassSetup)
+        function openModel(testCase)
+            load_system(testCase.model);
+            testCase.addTeardown(@() close_system(testCase.model, 0));
+            connStr = get_param(testCase.block, 'connStr');
+            testCase.addTeardown(@() set_param(testCase.block, ...
+                'connStr', connStr));
+            set_param(testCase.block, 'connStr', 'sim://perf');
+            testCase.ts = str2double(get_param(testCase.block, 'ts'));
+        end
+    end
+
+    methods (Test)
+        function step(testCase)
+            stopTime = num2str(testCase.steps * testCase.ts);
+            sim(testCase.model, 'StopTime', stopTime);
+            while testCase.keepMeasuring
+                t = tic;
+                sim(testCase.model, 'StopTime', stopTime);
+                elapsed = toc(t);
+            end
+            testCase.log(1, sprintf('%.0f steps per second', ...
+                testCase.steps / elapsed));
+        end
+    end
+end
@@ -0,0 +1,57 @@
+function results = run_perf(recipe)
+% Run the plc4mex and plc4sim performance suite
+%
+%   results = run_perf            compare with the stored baselines
+%   results = run_perf('update')  store the results as the new baselines
+%
+% The median time of every test is compared with perf_baseline.csv and
+% the suite fails if one is more than tolerance slower. Baselines hold for
+% the machine they were stored on, store them again after an intended
+% change or on a new machine.
+%
+% See also: perf_plc4mex, perf_plc4sim
+
+if nargin == 0
+    recipe = 'check';
+end
+
+tolerance = 0.25;
+testDir = strrep(mfilename('fullpath'), mfilename, '');
+baselineFile = fullfile(testDir, 'perf_baseline.csv');
+
+suite = [matlab.unittest.TestSuite.fromClass(?perf_plc4mex), ...
+    matlab.unittest.TestSuite.fromClass(?perf_plc4sim)];
+experiment = matlab.perftest.TimeExperiment.limitingSamplingError( ...
+    'NumWarmups', 2, 'RelativeMarginOfError', 0.05);
+results = run(experiment, suite);
+
+summary = sampleSummary(results);
+summary.callsPerSecond = 1 ./ summary.Median;
+disp(summary(:, {'Name', 'Median', 'Max', 'callsPerSecond'}));
+
+switch recipe
+    case 'update'
+        writetable(summary(:, {'Name', 'Median'}), baselineFile);
+        fprintf('baselines stored in %s\n', baselineFile);
+    case 'check'
+        if ~isfile(baselineFile)
+            error('no baselines in %s, run run_perf(''update'') first', ...
+                baselineFile);
+        end
+        baseline = readtable(baselineFile, 'TextType', 'string');
+        summary.Name = string(summary.Name);
+        compared = innerjoin(summary, baseline, 'Keys', 'Name');
+        slower = compared.Median_summary > ...
+            (1 + tolerance) * compared.Median_baseline;
+        if any(slower)
+            disp(compared(slower, {'Name', 'Median_summary', 'Median_baseline'}));
+            error('%d of %d tests slower than their baseline', ...
+                nnz(slower), height(compared));
+        end
+        fprintf('%d tests within %.0f%% of their baseline\n', ...
+            height(compared), 100 * tolerance);
+    otherwise
+        warning('recipe not recognised')
+end
+
+end
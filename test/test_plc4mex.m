@@ -24,6 +24,14 @@ switch (scenario)
     case 'write'
         [write_req, ~] = formRequests();
         write(write_req);
+    case 'async'
+        build();
+        [write_req, read_req] = formRequests();
+        varargout{1} = asyncRead(write_req, read_req);
+    case 'cache'
+        build();
+        [write_req, read_req] = formRequests();
+        varargout{1} = cacheRead(write_req, read_req);
     otherwise 
         warning('switch case not reconginsed')
 end
@@ -71,4 +79,45 @@ end
 %% read
 function read_resp = read(read_req)
     read_resp = plc4mex('read', read_req);
-end
\ No newline at end of file
+end
+%% cacheRead
+function read_resp = cacheRead(write_req, read_req)
+    % A second read within the time to live is served from the cache and
+    % returns the values of the first
+    plc4mex('connect', 's7:tcp://0.0.0.0:102?cache=10');
+    cleanup = onCleanup(@() plc4mex('disconnect'));
+    plc4mex('cache', 'clear');
+    write(write_req);
+    first = read(read_req);
+    [read_resp, stale] = plc4mex('read', read_req);
+    st = plc4mex('cache');
+    assert(st.hits >= 1, 'second read was not served from the cache')
+    assert(~stale, 'cached read reported stale')
+    for idx = 1:numel(read_req)
+        assert(~isempty(read_resp(idx).value), ...
+            'cached read of %s returned no value', read_req(idx).address)
+        assert(isequal(read_resp(idx).value, first(idx).value), ...
+            'cached read of %s differs from the first', read_req(idx).address)
+    end
+    assert(isequal(read_resp(2).value, write_req(2).value), ...
+        'cached read of %s differs from the value written', ...
+        read_req(2).address)
+end
+
+%% asyncRead
+function read_resp = asyncRead(write_req, read_req)
+    % An asynchronous read returns the values a read does, or the last
+    % good values of a read before if it is stale
+    connect();
+    cleanup = onCleanup(@() plc4mex('disconnect'));
+    write(write_req);
+    first = read(read_req);
+    ticket = plc4mex('readAsync', read_req);
+    [done, read_resp, stale] = plc4mex('wait', ticket, 5);
+    assert(done, 'asynchronous read did not finish')
+    for idx = 1:numel(read_req)
+        assert(isequal(read_resp(idx).value, first(idx).value), ...
+            'asynchronous read of %s differs (stale %d)', ...
+            read_req(idx).address, stale)
+    end
+end
@@ -10,6 +10,7 @@ switch (scenario)
         connect();
         [write_req, read_req] = formRequests();
         write(write_req);
+        simulate();
         varargout{1} = read(read_req);
     case 'make'
         build();
@@ -24,6 +25,8 @@ switch (scenario)
     case 'write'
         [write_req, ~] = formRequests();
         write(write_req);
+    case 'sim'
+        simulate();
     otherwise 
         warning('switch case not reconginsed')
 end
@@ -54,21 +57,28 @@ end
 
 %% build
 function build()
-    plc4c_b('release'); 
-    make_plc4c; 
+    clear plc4sim;
+    make_plc4sim;
 end
 
 %% connect
+% plc4sim is an S-function, the PLC the model talks to is set up and
+% checked through plc4mex
 function connect()
-    plc4c_b('connect');
+    plc4mex('connect');
 end
 
 %% write
 function write(write_req)
-    plc4c_b('write', write_req);
+    plc4mex('write', write_req);
 end
 
 %% read
 function read_resp = read(read_req)
-    read_resp = plc4c_b('read', read_req);
+    read_resp = plc4mex('read', read_req);
+end
+
+%% simulate
+function simulate()
+    sim('plcTest');
 end
\ No newline at end of file
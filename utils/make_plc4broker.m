@@ -0,0 +1,85 @@
+function make_plc4broker(recipe)
+% psudo makefile, the broker is a plain executable built with g++
+
+if ~isunix
+   error('linux only')
+end
+
+[~,b] = system('locate libplc4c-driver-s7.a');
+if isempty(b)
+    error('plc4c s7 drive not found')
+end
+
+plc4cRoot = strrep(strtrim(b),'/drivers/s7/libplc4c-driver-s7.a','');
+
+
+name = 'plc4broker';
+srcDir = 'src';
+outDir = 'bin';
+plc4c_mex_root = fullfile(strrep(mfilename('fullpath'),mfilename,''),'..');
+
+default_goal = 'build';
+if nargin == 0 
+    recipe = default_goal;
+end
+
+%% Options, probably no need to change
+
+args.target = fullfile(plc4c_mex_root,outDir,name);
+args.srcs = {fullfile(plc4c_mex_root,srcDir,[name '.cpp'])};
+args.libs = {'-ldl', '-lpthread', '-lrt'};
+args.outdir = fullfile(plc4c_mex_root, outDir);
+args.output = name;
+
+args.objects = {
+    fullfile(plc4cRoot, 'spi', 'CMakeFiles', 'plc4c-spi.dir', 'src', 'write_buffer.c.o'),...
+    fullfile(plc4cRoot, 'spi', 'CMakeFiles', 'plc4c-spi.dir', 'src', 'subscribe.c.o'),...
+    fullfile(plc4cRoot, 'spi', 'CMakeFiles', 'plc4c-spi.dir', 'src', 'types.c.o'),...
+    fullfile(plc4cRoot, 'spi', 'CMakeFiles', 'plc4c-spi.dir', 'src', 'read.c.o'),...
+    fullfile(plc4cRoot, 'spi', 'CMakeFiles', 'plc4c-spi.dir', 'src', 'connection.c.o'),...
+    fullfile(plc4cRoot, 'spi', 'CMakeFiles', 'plc4c-spi.dir', 'src', 'write.c.o'),...
+    fullfile(plc4cRoot, 'spi', 'CMakeFiles', 'plc4c-spi.dir', 'src', 'system.c.o'),...
+    fullfile(plc4cRoot, 'spi', 'CMakeFiles', 'plc4c-spi.dir', 'src', 'read_buffer.c.o'),...
+    fullfile(plc4cRoot, 'spi', 'CMakeFiles', 'plc4c-spi.dir', 'src', 'data.c.o'),...
+    fullfile(plc4cRoot, 'spi', 'CMakeFiles', 'plc4c-spi.dir', 'src', 'utils', 'queue.c.o'),...
+    fullfile(plc4cRoot, 'spi', 'CMakeFiles', 'plc4c-spi.dir', 'src', 'utils', 'list.c.o'),...
+    fullfile(plc4cRoot, 'spi', 'CMakeFiles', 'plc4c-spi.dir', 'src', 'evaluation_helper.c.o'),...
+    }; 
+
+args.incs = {
+    ['-I' fullfile(plc4cRoot, 'api', 'include')], ...
+    ['-I' fullfile(plc4cRoot, 'drivers', 's7','include')],...
+    ['-I' fullfile(plc4cRoot, 'transports', 'tcp','include')],...
+    ['-I' fullfile(plc4cRoot, 'spi', 'include')] ...
+    };
+
+args.archives = {
+    fullfile(plc4cRoot, 'drivers', 's7', 'libplc4c-driver-s7.a'),...
+    fullfile(plc4cRoot, 'transports', 'tcp', 'libplc4c-transport-tcp.a')...
+    };
+    
+args.flags = { '-g', '-O2', '-std=c++11'};
+
+%% Recipes
+
+switch recipe
+    case 'build'
+        build(args);
+    case 'clean' 
+        clean(args);
+end
+
+end
+
+function build(args)
+    cmd = strjoin([{'g++'}, args.flags, args.incs, args.srcs, ...
+        {'-o', fullfile(args.outdir, args.output)}, args.objects, ...
+        args.archives, args.libs], ' ');
+    if system(cmd) ~= 0
+        error('plc4broker build failed')
+    end
+end
+
+function clean(args)
+    delete(args.target);
+end
@@ -28,7 +28,7 @@ args.root = projectRoot;
 args.srcName = srcName;
 args.srcDir = srcDir;
 args.outDir = outDir;
-args.libs = {'-ldl'};
+args.libs = {'-ldl', '-lpthread', '-lrt'};
 
 args.objects = {
     fullfile(plc4c_root, 'spi', 'CMakeFiles', 'plc4c-spi.dir', 'src', 'write_buffer.c.o'),...
@@ -27,7 +27,7 @@ end
 
 args.target = fullfile(plc4c_mex_root,srcDir,[name '.mexa64']);
 args.srcs = {fullfile(plc4c_mex_root,srcDir,[name '.cpp'])};
-args.libs = {'-ldl'};
+args.libs = {'-ldl', '-lpthread', '-lrt'};
 args.outdir = fullfile(plc4c_mex_root, outDir);
 args.output = name;
 
@@ -6,7 +6,8 @@ function mask_maker(blk)
 typeSelType = @(n) ['unidt({a=' num2str(n) '|||}{i=Inherit: auto}{b='...
     'double|single|int8|uint8|int16|uint16|int32|uint32|boolean}{u=bus})'];
 
-transportOpts = {'TCP','UDP','Serial','SocketCAN','Raw Socket','PCAP Replay'};
+transportOpts = {'TCP','UDP','Serial','SocketCAN','Raw Socket','PCAP Replay',...
+    'Broker'};
 
 protocolOpts = {'AB-ETH','ADS/AMS','BACnet/IP','CANopen','DeltaV','DF1',...
     'EtherNet/IP','Firmata','KNXnet/IP','Modbus','OPC UA','S7','Simulated'};
@@ -58,7 +58,22 @@ function formConnString(blk, hMask)
     protocol = get_param(blk,'protocol');
     ip = '0.0.0.0';
     port = '102';
-    connValue = [lower(protocol) ':' lower(transport) '://' ip ':' port];
+    if strcmp(transport, 'PCAP Replay')
+        % replay a plc4sim recording named in the first connection item
+        connValue = ['replay://' get_param(blk,'connItem1')];
+    elseif strcmp(transport, 'Broker')
+        % share the PLC connection of the broker named in the first item
+        connValue = ['broker://' get_param(blk,'connItem1')];
+    elseif strcmp(protocol, 'Simulated')
+        % in-process virtual PLC named in the first connection item
+        name = get_param(blk,'connItem1');
+        if isempty(name)
+            name = 'default';
+        end
+        connValue = ['sim://' name];
+    else
+        connValue = [lower(protocol) ':' lower(transport) '://' ip ':' port];
+    end
     connParam = getParameter(hMask,'connStr');
     setIfNeeded(blk, connParam, connValue, false);
     